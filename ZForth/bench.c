@@ -0,0 +1,1246 @@
+/* Benchmarks for the FORTH system.
+ * Every result is printed as a line of JSON (e.g. {"bench":"macro.fib","bits":32,"engine":"switch","mode":"plain",
+ * "metric":"ns_per_instr","value":3.141,"count":1234}) so that runs can be compared by scripts. The "plain" results
+ * use a default image, the "opt" ones turn on quickening, the peephole pass and tail calls, the "dense" ones also assemble dense
+ * code, the "jit" ones (only where forth_jit.h has a compiler) run the "opt" code with forth_jitrun and the "verify" ones
+ * run it with forth_verifyrun, and the "native" ones run the "opt" code with the host calls registered as leaf
+ * native functions. See the Makefile for building it in each configuration.
+ *
+ * Usage: bench [scale] (scale multiplies the time spent on each benchmark, 1 by default)
+ */
+#define _GNU_SOURCE
+#include "forth.h"
+#include "forth_image.h"
+#include "forth_wire.h"
+#include "forth_module.h"
+#include "forth_jit.h"
+#include "forth_verify.h"
+#include "forth_sched.h"
+#include "forth_async.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(FORTH_16BIT)
+#define BENCH_BITS	16
+#elif defined(FORTH_64BIT)
+#define BENCH_BITS	64
+#else
+#define BENCH_BITS	32
+#endif
+
+#if defined(FORTH_USE_THREADED) && defined(FORTH_TOSCACHE)
+#define BENCH_ENGINE	"threaded-tos"
+#elif defined(FORTH_USE_THREADED)
+#define BENCH_ENGINE	"threaded"
+#elif defined(FORTH_TOSCACHE)
+#define BENCH_ENGINE	"switch-tos"
+#else
+#define BENCH_ENGINE	"switch"
+#endif
+
+#ifdef FORTH_16BIT
+// Addresses in instructions only have 12 bits in 16-bit mode, so the index and code all have to fit below 2048.
+#define BENCH_SIZE		8192
+#define BENCH_INDEXSIZE		128
+#define BENCH_CODESIZE		768
+#define BENCH_FIB		15
+#define BENCH_FIBRESULT		610
+#define BENCH_SIEVE		1000
+#define BENCH_SIEVERESULT	168
+#define BENCH_STRINGS		200
+#define BENCH_ARITH		200
+#define BENCH_STATES		20
+#define BENCH_TASKS		50
+#define BENCH_BULK		200
+#define BENCH_DICTINDEX		200
+#define BENCH_DICTCODE		1000
+#define BENCH_DICTWORDS		180
+#define BENCH_ASMBYTES		1500
+#define BENCH_ALLOCSIZE		4096
+#define BENCH_ALLOCBLOCKS	64
+#define BENCH_ALLOCMAX		16
+#define BENCH_GCBUDGET		256
+#define BENCH_SCHEDFIB		12
+#define BENCH_SCHEDRESULT	144
+#else
+#define BENCH_SIZE		(1024 * 1024)
+#define BENCH_INDEXSIZE		128
+#define BENCH_CODESIZE		(256 * 1024)
+#define BENCH_FIB		24
+#define BENCH_FIBRESULT		46368
+#define BENCH_SIEVE		20000
+#define BENCH_SIEVERESULT	2262
+#define BENCH_STRINGS		2000
+#define BENCH_ARITH		20000
+#define BENCH_STATES		2000
+#define BENCH_TASKS		5000
+#define BENCH_BULK		20000
+#define BENCH_DICTINDEX		12000
+#define BENCH_DICTCODE		(64 * 1024)
+#define BENCH_DICTWORDS		10000
+#define BENCH_ASMBYTES		(512 * 1024)
+#define BENCH_ALLOCSIZE		(256 * 1024)
+#define BENCH_ALLOCBLOCKS	1024
+#define BENCH_ALLOCMAX		64
+#define BENCH_GCBUDGET		4096
+#define BENCH_SCHEDFIB		16
+#define BENCH_SCHEDRESULT	987
+#endif
+
+#define BENCH_SCHEDVMS	1024		// Scripts run by the scheduler benchmark, each in its own small image
+#define BENCH_IOCALLS	32		// I/O calls made by each script in the async benchmark
+#define BENCH_IOROUNDS	4		// Rounds of the event loop each I/O call takes to finish
+#define BENCH_SCHEDSLICE	1000		// Steps per time slice
+#define BENCH_STATEDEPTH	30		// Transitions per run of the state machine (each two return stack words without tail calls)
+
+#define BENCH_REPS	3		// Each result is the best of this many repetitions
+#define BENCH_MINTIME	0.02		// Minimum seconds per repetition (times the scale)
+#define BENCH_LOOPSTEPS	4000000L	// Instructions per repetition of a microbenchmark (times the scale)
+
+enum {
+	BENCH_PLAIN,
+	BENCH_OPT,
+	BENCH_DENSE,
+	BENCH_JIT,
+	BENCH_VERIFY,
+	BENCH_NATIVE,
+	BENCH_MODES
+};
+
+static const char* const bench_modenames[BENCH_MODES] = { "plain", "opt", "dense", "jit", "verify", "native" };
+
+static int bench_scale = 1;
+static int bench_mode = BENCH_PLAIN;
+static forth_jit_t* bench_jit = NULL; // For the image being benchmarked in jit mode
+static forth_verify_t* bench_verify = NULL; // And in verify mode
+static long bench_strfails = 0;
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench_report(const char* name, const char* metric, double value, long count) {
+	printf("{\"bench\":\"%s\",\"bits\":%d,\"engine\":\"%s\",\"mode\":\"%s\",\"metric\":\"%s\",\"value\":%.3f,\"count\":%ld}\n",
+		name, BENCH_BITS, BENCH_ENGINE, bench_modenames[bench_mode], metric, value, count);
+	fflush(stdout);
+}
+
+static void bench_fail(const char* name, const char* why) {
+	fprintf(stderr, "ERROR: Benchmark %s (%d-bit, %s, %s) failed: %s\n", name, BENCH_BITS, BENCH_ENGINE, bench_modenames[bench_mode], why);
+	exit(1);
+}
+
+/* The host words used by the benchmarks, since the VM has no stack or memory words of its own. */
+enum {
+	BENCH_SYS_NOP = 1,
+	BENCH_SYS_DUP,
+	BENCH_SYS_DROP,
+	BENCH_SYS_SWAP,
+	BENCH_SYS_OVER,
+	BENCH_SYS_ROT,
+	BENCH_SYS_LT,
+	BENCH_SYS_FETCH,
+	BENCH_SYS_STORE,
+	BENCH_SYS_STRCAT,
+	BENCH_SYS_YIELD,
+	BENCH_SYS_IO,
+	BENCH_SYS_COUNT
+};
+
+static const char* const bench_sysnames[BENCH_SYS_COUNT] = {
+	NULL, "nop.sys", "dup", "drop", "swap", "over", "rot", "lt", "fetch", "store", "strcat", "yield", "io"
+};
+
+static bool bench_callback(forth_t* forth, void* udata, int sysnum) {
+	forth_word_t a, b, c;
+	switch (sysnum) {
+	case BENCH_SYS_NOP:
+		break;
+	case BENCH_SYS_DUP: // a -- a a
+		a = forth_popdata(forth);
+		forth_pushdata(forth, a);
+		forth_pushdata(forth, a);
+		break;
+	case BENCH_SYS_DROP: // a --
+		forth_popdata(forth);
+		break;
+	case BENCH_SYS_SWAP: // a b -- b a
+		b = forth_popdata(forth);
+		a = forth_popdata(forth);
+		forth_pushdata(forth, b);
+		forth_pushdata(forth, a);
+		break;
+	case BENCH_SYS_OVER: // a b -- a b a
+		b = forth_popdata(forth);
+		a = forth_popdata(forth);
+		forth_pushdata(forth, a);
+		forth_pushdata(forth, b);
+		forth_pushdata(forth, a);
+		break;
+	case BENCH_SYS_ROT: // a b c -- b c a
+		c = forth_popdata(forth);
+		b = forth_popdata(forth);
+		a = forth_popdata(forth);
+		forth_pushdata(forth, b);
+		forth_pushdata(forth, c);
+		forth_pushdata(forth, a);
+		break;
+	case BENCH_SYS_LT: // a b -- a<b
+		b = forth_popdata(forth);
+		a = forth_popdata(forth);
+		forth_pushdata(forth, (a < b) ? -1 : 0);
+		break;
+	case BENCH_SYS_FETCH: // addr -- value
+		forth_pushdata(forth, forth_peek(forth, forth_popdata(forth)));
+		break;
+	case BENCH_SYS_STORE: // value addr --
+		a = forth_popdata(forth);
+		forth_poke(forth, a, forth_popdata(forth));
+		break;
+	case BENCH_SYS_STRCAT: { // str1 str2 -- str3 (allocated on the heap)
+		char buf1[128], buf2[64];
+		b = forth_peekstrl(forth, forth_popdata(forth), 64, buf2);
+		a = forth_peekstrl(forth, forth_popdata(forth), 64, buf1);
+		c = 0;
+		if (a >= 0 && b >= 0) {
+			memcpy(buf1 + a, buf2, b);
+			c = forth_allocstrl(forth, a + b, buf1);
+		}
+		if (c == 0) {
+			bench_strfails++;
+		}
+		forth_pushdata(forth, c);
+		break;
+	}
+	default:
+		fprintf(stderr, "ERROR: Callback called with sysnum %d\n", sysnum);
+		break;
+	}
+	return false;
+}
+
+/* The same host words as native functions, for native mode (the rest go to bench_callback). */
+static void bench_nativenop(forth_t* forth, void* udata, forth_word_t* args) {
+}
+
+static void bench_nativedup(forth_t* forth, void* udata, forth_word_t* args) {
+	args[1] = args[0];
+}
+
+static void bench_nativeswap(forth_t* forth, void* udata, forth_word_t* args) {
+	forth_word_t a = args[0];
+	args[0] = args[1];
+	args[1] = a;
+}
+
+static void bench_nativeover(forth_t* forth, void* udata, forth_word_t* args) {
+	args[2] = args[0];
+}
+
+static void bench_nativerot(forth_t* forth, void* udata, forth_word_t* args) {
+	forth_word_t a = args[0];
+	args[0] = args[1];
+	args[1] = args[2];
+	args[2] = a;
+}
+
+static void bench_nativelt(forth_t* forth, void* udata, forth_word_t* args) {
+	args[0] = (args[0] < args[1]) ? -1 : 0;
+}
+
+static void bench_nativefetch(forth_t* forth, void* udata, forth_word_t* args) {
+	args[0] = forth_peek(forth, args[0]);
+}
+
+static void bench_nativestore(forth_t* forth, void* udata, forth_word_t* args) {
+	forth_poke(forth, args[1], args[0]);
+}
+
+static forth_native_t bench_nativetable[BENCH_SYS_COUNT];
+static forth_natives_t bench_natives;
+
+static void bench_initnatives(void) {
+	forth_nativeinit(&bench_natives, bench_nativetable, BENCH_SYS_COUNT, &bench_callback, NULL);
+	forth_nativeleaf(&bench_natives, BENCH_SYS_NOP, 0, 0, &bench_nativenop, NULL);
+	forth_nativeleaf(&bench_natives, BENCH_SYS_DUP, 1, 2, &bench_nativedup, NULL);
+	forth_nativeleaf(&bench_natives, BENCH_SYS_DROP, 1, 0, &bench_nativenop, NULL);
+	forth_nativeleaf(&bench_natives, BENCH_SYS_SWAP, 2, 2, &bench_nativeswap, NULL);
+	forth_nativeleaf(&bench_natives, BENCH_SYS_OVER, 2, 3, &bench_nativeover, NULL);
+	forth_nativeleaf(&bench_natives, BENCH_SYS_ROT, 3, 3, &bench_nativerot, NULL);
+	forth_nativeleaf(&bench_natives, BENCH_SYS_LT, 2, 1, &bench_nativelt, NULL);
+	forth_nativeleaf(&bench_natives, BENCH_SYS_FETCH, 1, 1, &bench_nativefetch, NULL);
+	forth_nativeleaf(&bench_natives, BENCH_SYS_STORE, 2, 0, &bench_nativestore, NULL);
+}
+
+static forth_t* bench_open(const char* name, forth_word_t size, forth_word_t indexsize, forth_word_t codesize) {
+	forth_t* forth = malloc(size * sizeof(forth_word_t));
+	if (forth == NULL || forth_clear(forth, size, indexsize, codesize) != 0) {
+		bench_fail(name, "couldn't create the image");
+	}
+	int i;
+	for (i = 1; i < BENCH_SYS_COUNT; i++) {
+		forth_setlookupinstr(forth, bench_sysnames[i], forth_encode(forth, FORTH_OP_CALLSYS, i));
+	}
+	if (bench_mode != BENCH_PLAIN) {
+		if (forth_enablequicken(forth, codesize / 8) != 0) {
+			bench_fail(name, "couldn't enable quickening");
+		}
+		forth->header.asmflags |= FORTH_ASM_PEEPHOLE | FORTH_ASM_TAILCALL;
+	}
+	if (bench_mode == BENCH_DENSE) {
+		forth->header.asmflags |= FORTH_ASM_DENSE;
+	}
+	if (bench_mode == BENCH_JIT) {
+		bench_jit = forth_jitcreate(forth, 0, 0);
+		if (bench_jit == NULL) {
+			bench_fail(name, "couldn't create the JIT compiler");
+		}
+	}
+	if (bench_mode == BENCH_VERIFY) {
+		static const char* const pictures[BENCH_SYS_STRCAT + 1] = {
+			NULL, "--", "a -- a a", "a --", "a b -- b a", "a b -- a b a", "a b c -- b c a", "a b -- c", "a -- b", "a b --", "a b -- c"
+		};
+		bench_verify = forth_verifycreate(forth);
+		if (bench_verify == NULL) {
+			bench_fail(name, "couldn't create the verifier");
+		}
+		for (i = 1; i <= BENCH_SYS_STRCAT; i++) {
+			if (forth_verifysys(bench_verify, i, pictures[i]) != 0) {
+				bench_fail(name, "couldn't declare the host words");
+			}
+		}
+	}
+	return forth;
+}
+
+static void bench_close(forth_t* forth) {
+	if (bench_jit != NULL) {
+		forth_jitdestroy(bench_jit);
+		bench_jit = NULL;
+	}
+	if (bench_verify != NULL) {
+		forth_verifydestroy(bench_verify);
+		bench_verify = NULL;
+	}
+	free(forth);
+}
+
+/* Runs the image opened last, with the JIT compiler in jit mode, the verifier in verify mode and the native functions
+ * in native mode.
+ */
+static forth_word_t bench_run(forth_t* forth, long maxsteps, long* stepsout) {
+	if (bench_jit != NULL) {
+		return forth_jitrun(bench_jit, &bench_callback, NULL, maxsteps, stepsout);
+	}
+	if (bench_verify != NULL) {
+		return forth_verifyrun(bench_verify, &bench_callback, NULL, maxsteps, stepsout);
+	}
+	if (bench_mode == BENCH_NATIVE) {
+		return forth_run(forth, &forth_nativecallback, &bench_natives, maxsteps, stepsout);
+	}
+	return forth_run(forth, &bench_callback, NULL, maxsteps, stepsout);
+}
+
+/* Assembles src at the end of the code, returning the address it starts at. */
+static forth_word_t bench_code(forth_t* forth, const char* name, const char* src) {
+	forth_asmseal(forth);
+	forth_word_t start = forth->header.codenext;
+	forth_word_t len = (forth_word_t)strlen(src);
+	forth_word_t i = 0;
+	forth_word_t result = 0;
+	while ((result = forth_assemble(forth, src, i, len)) > 0) {
+		i += result;
+	}
+	if (result != 0) {
+		bench_fail(name, "couldn't assemble the source");
+	}
+	return start;
+}
+
+static void bench_define(forth_t* forth, const char* name, const char* src) {
+	forth_word_t addr = bench_code(forth, name, src);
+	if (forth_setlookupinstr(forth, name, forth_encode(forth, FORTH_OP_CALLADDR, addr)) != 0) {
+		bench_fail(name, "couldn't define the word");
+	}
+}
+
+/* Microbenchmarks run "[ body ] !" (so the body has to leave one non-zero value on the stack) for a fixed number of
+ * instructions, which never finishes by itself.
+ */
+static void bench_loop(forth_t* forth, const char* name, const char* body) {
+	char src[512];
+	snprintf(src, sizeof(src), "[ %s ] !", body);
+	forth->header.pc = bench_code(forth, name, src);
+	forth_word_t dsp = forth->header.dsp;
+	forth_word_t rsp = forth->header.rsp;
+	long steps = BENCH_LOOPSTEPS * bench_scale;
+	double best = 0;
+	int rep;
+	for (rep = 0; rep < BENCH_REPS; rep++) {
+		long done = 0;
+		double t = bench_now();
+		forth_word_t status = bench_run(forth, steps, &done);
+		t = bench_now() - t;
+		if (status != FORTH_RUN_BUDGET || done != steps) {
+			bench_fail(name, "the loop stopped");
+		}
+		// It can stop anywhere in the body, but the stacks shouldn't keep growing.
+		if (forth->header.dsp < dsp || forth->header.dsp > dsp + 16 || forth->header.rsp < rsp || forth->header.rsp > rsp + 70) {
+			bench_fail(name, "the loop isn't balanced");
+		}
+		if (rep == 0 || t < best) {
+			best = t;
+		}
+	}
+	forth->header.dsp = dsp;
+	forth->header.rsp = rsp;
+	bench_report(name, "ns_per_instr", best * 1e9 / steps, steps);
+}
+
+static void bench_micro(void) {
+	forth_t* forth = bench_open("micro", BENCH_SIZE, BENCH_INDEXSIZE, BENCH_CODESIZE);
+	bench_define(forth, "nop", ";");
+	char name[32], src[32];
+	int depth;
+	bench_define(forth, "d1", ";");
+	for (depth = 2; depth <= 64; depth++) {
+		snprintf(name, sizeof(name), "d%d", depth);
+		snprintf(src, sizeof(src), "d%d ;", depth - 1);
+		bench_define(forth, name, src);
+	}
+
+	bench_loop(forth, "micro.arith", "1 2 + 3 - 4 * 5 / 6 % 7 & 8 |");
+	bench_loop(forth, "micro.compare", "1 1 = 2 3 = | 4 4 = &");
+	bench_loop(forth, "micro.pushstr", "\"a\" \"bc\" + \"def\" + \"ghij\" +");
+	bench_loop(forth, "micro.pushblock", "[ ] [ ] + [ ] + [ ] +");
+	bench_loop(forth, "micro.cond", "0 [ ] ? 1 + 0 [ ] ? +");
+	bench_loop(forth, "micro.loop", "[ 0 ] ! [ 0 ] ! +");
+	bench_loop(forth, "micro.callsys", "nop.sys nop.sys nop.sys nop.sys 1");
+	bench_loop(forth, "micro.stackwords", "1 2 swap over rot lt drop drop 1");
+	bench_loop(forth, "micro.callindex", "nop nop nop nop 1");
+	for (depth = 1; depth <= 64; depth *= 4) {
+		snprintf(name, sizeof(name), "depth.%d", depth);
+		snprintf(src, sizeof(src), "d%d 1", depth);
+		bench_loop(forth, name, src);
+	}
+
+	bench_close(forth);
+}
+
+/* Macro workloads run the code at addr to the end of the code segment (so it should be the last thing assembled),
+ * which should leave the expected value on the stack. Words from zerostart to zerostart+zerolen are cleared and the
+ * heap is reset before every run.
+ */
+static void bench_macro(forth_t* forth, const char* name, forth_word_t addr, forth_word_t expect, forth_word_t zerostart, forth_word_t zerolen) {
+	forth_word_t heapnext = forth->header.heapnext;
+	double best = 0;
+	long instrs = 0;
+	long runs = 0;
+	int rep;
+	for (rep = 0; rep < BENCH_REPS; rep++) {
+		double t = 0;
+		long repinstrs = 0;
+		long represults = 0;
+		while (t < BENCH_MINTIME * bench_scale) {
+			forth->header.heapnext = heapnext;
+			forth_word_t i;
+			for (i = 0; i < zerolen; i++) {
+				forth_poke(forth, zerostart + i, 0);
+			}
+			forth->header.pc = addr;
+			double start = bench_now();
+			forth_word_t status;
+			do {
+				long done = 0;
+				status = bench_run(forth, 1000000, &done);
+				repinstrs += done;
+			} while (status == FORTH_RUN_BUDGET);
+			t += bench_now() - start;
+			if (status != -1 || forth->header.pc != forth->header.codenext) {
+				bench_fail(name, "didn't run to the end of the code");
+			}
+			if (forth_popdata(forth) != expect || bench_strfails != 0) {
+				bench_fail(name, "got the wrong result");
+			}
+			represults++;
+		}
+		if (rep == 0 || t / repinstrs < best / instrs) {
+			best = t;
+			instrs = repinstrs;
+			runs = represults;
+		}
+	}
+	forth->header.heapnext = heapnext;
+	bench_report(name, "ns_per_instr", best * 1e9 / instrs, instrs);
+	bench_report(name, "us_per_run", best * 1e6 / runs, runs);
+}
+
+/* What the "mix" word in bench_workloads computes (the values stay small enough not to overflow in 16 bits). */
+static forth_word_t bench_mix(forth_word_t x) {
+	x = ((x * 3 + 7) * 5 + 11) / 4;
+	x = (x - 13) * 3 / 2;
+	x = ((x & 1023) + 17) * 7 / 8;
+	return (x | 255) + 1;
+}
+
+/* What the "states" word in bench_workloads computes: the three states in turn (starting with the first) do
+ * something to acc, BENCH_STATEDEPTH transitions in a row, k times over.
+ */
+static forth_word_t bench_states(forth_word_t acc, int k) {
+	int i, n;
+	for (i = 0; i < k; i++) {
+		for (n = 0; n < BENCH_STATEDEPTH; n++) {
+			switch (n % 3) {
+			case 0: acc = acc + 1; break;
+			case 1: acc = (acc * 2) & 1023; break;
+			case 2: acc = acc - 3; break;
+			}
+		}
+	}
+	return acc;
+}
+
+static void bench_workloads(void) {
+	forth_t* forth = bench_open("macro", BENCH_SIZE, BENCH_INDEXSIZE, BENCH_CODESIZE);
+	char src[512];
+
+	bench_define(forth, "fib", "dup 2 lt [ drop ] ? drop dup 1 - fib swap 2 - fib + ;");
+
+	// The sieve keeps its variables and flags on the heap, after the stacks.
+	forth_word_t vars = forth->header.heapnext;
+	forth->header.heapnext += 3 + BENCH_SIEVE;
+	if ((forth_word_t)((vars + 3) << 4) >> 4 != vars + 3) {
+		bench_fail("macro.sieve", "the variables are too far up to use as literals");
+	}
+	snprintf(src, sizeof(src), "%d ;", (int)vars);
+	bench_define(forth, "v.i", src);
+	snprintf(src, sizeof(src), "%d ;", (int)vars + 1);
+	bench_define(forth, "v.j", src);
+	snprintf(src, sizeof(src), "%d ;", (int)vars + 2);
+	bench_define(forth, "v.count", src);
+	snprintf(src, sizeof(src), "%d ;", (int)vars + 3);
+	bench_define(forth, "v.flags", src);
+	snprintf(src, sizeof(src), "v.i fetch dup + v.j store v.j fetch %d lt [ drop [ 1 v.j fetch v.flags + store v.j fetch v.i fetch + dup v.j store %d lt ] ! drop ] ? drop ;", BENCH_SIEVE, BENCH_SIEVE);
+	bench_define(forth, "mark", src);
+	bench_define(forth, "step", "v.flags v.i fetch + fetch 0 = [ drop v.count fetch 1 + v.count store mark ] ? drop ;");
+	snprintf(src, sizeof(src), "0 v.count store 2 v.i store [ step v.i fetch 1 + dup v.i store %d lt ] ! drop v.count fetch ;", BENCH_SIEVE);
+	bench_define(forth, "sieve", src);
+
+	bench_define(forth, "strloop", "[ \"hello, \" \"world\" strcat drop swap 1 - dup rot swap ] ! drop ;");
+
+	// Arithmetic-heavy code, like a filter in a signal processing script ( acc n -- acc' ).
+	bench_define(forth, "mix", "3 * 7 + 5 * 11 + 4 / 13 - 3 * 2 / 1023 & 17 + 7 * 8 / 255 | 1 + ;");
+	bench_define(forth, "arith", "[ rot mix mix mix mix mix mix mix mix rot 1 - rot over ] ! drop drop ;");
+	forth_word_t arithresult = 1;
+	int i;
+	for (i = 0; i < BENCH_ARITH * 8; i++) {
+		arithresult = bench_mix(arithresult);
+	}
+
+	// A state machine, where each state ends by going to the next one ( acc n -- acc' 0 ).
+	bench_define(forth, "st.a", "swap 1 + swap 1 - dup [ drop st.b ] ? drop ;");
+	bench_define(forth, "st.b", "swap 2 * 1023 & swap 1 - dup [ drop st.c ] ? drop ;");
+	bench_define(forth, "st.c", "swap 3 - swap 1 - dup [ drop st.a ] ? drop ;");
+	snprintf(src, sizeof(src), "[ rot %d st.a drop rot 1 - rot over ] ! drop drop ;", BENCH_STATEDEPTH);
+	bench_define(forth, "states", src);
+
+	// Summing a buffer on the heap, a word at a time and with a bulk operation. It's after the sieve's flags, so its
+	// addresses are worked out from v.flags (they might not fit in literals in 16-bit builds).
+	forth_word_t bulkvars = forth->header.heapnext;
+	forth_word_t bulkoffset = bulkvars - (vars + 3);
+	forth->header.heapnext += 2 + BENCH_BULK;
+	if (forth_definebulkops(forth) != 0) {
+		bench_fail("macro.bulksum", "couldn't define the bulk operations");
+	}
+	forth_word_t bulkresult = 0;
+	for (i = 0; i < BENCH_BULK; i++) {
+		forth_poke(forth, bulkvars + 2 + i, i % 7);
+		bulkresult += i % 7;
+	}
+	snprintf(src, sizeof(src), "v.flags %d + ;", (int)bulkoffset);
+	bench_define(forth, "v.bi", src);
+	snprintf(src, sizeof(src), "v.flags %d + ;", (int)bulkoffset + 1);
+	bench_define(forth, "v.bsum", src);
+	snprintf(src, sizeof(src), "v.flags %d + ;", (int)bulkoffset + 2);
+	bench_define(forth, "v.buf", src);
+	snprintf(src, sizeof(src), "[ v.bsum fetch v.buf v.bi fetch + fetch + v.bsum store v.bi fetch 1 + dup v.bi store %d lt ] ! drop v.bsum fetch ;", BENCH_BULK);
+	bench_define(forth, "sumloop", src);
+	bench_report("macro.code", "words", forth->header.codenext - forth->header.codestart, 1);
+
+	snprintf(src, sizeof(src), "%d fib", BENCH_FIB);
+	bench_macro(forth, "macro.fib", bench_code(forth, "macro.fib", src), BENCH_FIBRESULT, 0, 0);
+	bench_macro(forth, "macro.sieve", bench_code(forth, "macro.sieve", "sieve"), BENCH_SIEVERESULT, vars, 3 + BENCH_SIEVE);
+	snprintf(src, sizeof(src), "%d strloop", BENCH_STRINGS);
+	bench_macro(forth, "macro.strings", bench_code(forth, "macro.strings", src), 0, 0, 0);
+	snprintf(src, sizeof(src), "1 %d arith", BENCH_ARITH);
+	bench_macro(forth, "macro.arith", bench_code(forth, "macro.arith", src), arithresult, 0, 0);
+	snprintf(src, sizeof(src), "0 %d states", BENCH_STATES);
+	bench_macro(forth, "macro.states", bench_code(forth, "macro.states", src), bench_states(0, BENCH_STATES), 0, 0);
+	bench_macro(forth, "macro.sumloop", bench_code(forth, "macro.sumloop", "sumloop"), bulkresult, bulkvars, 2);
+	snprintf(src, sizeof(src), "0 v.buf %d bulk.sum", BENCH_BULK);
+	bench_macro(forth, "macro.bulksum", bench_code(forth, "macro.bulksum", src), bulkresult, 0, 0);
+
+	bench_close(forth);
+}
+
+/* Four tasks taking turns in one image, each yielding n times before returning 2n, and the first task joining them
+ * all ( n -- 8n ). Their records and stacks come from the allocator.
+ */
+static void bench_tasks(void) {
+	forth_t* forth = bench_open("macro.tasks", BENCH_SIZE, BENCH_INDEXSIZE, BENCH_CODESIZE);
+	char src[64];
+	if (forth_enablealloc(forth, BENCH_ALLOCSIZE) != 0 || forth_enabletasks(forth, 16, 16) != 0 || forth_definetaskops(forth) != 0) {
+		bench_fail("macro.tasks", "couldn't enable tasks");
+	}
+	bench_define(forth, "yields", "[ task.yield swap 1 - dup rot swap ] ! drop ;");
+	bench_define(forth, "worker", "[ dup yields drop 2 * ] task.spawn ;");
+	bench_define(forth, "tasks", "dup worker swap dup worker swap dup worker swap worker task.join swap task.join + swap task.join + swap task.join + ;");
+	snprintf(src, sizeof(src), "%d tasks", BENCH_TASKS);
+	bench_macro(forth, "macro.tasks", bench_code(forth, "macro.tasks", src), 8 * BENCH_TASKS, 0, 0);
+	bench_close(forth);
+}
+
+/* Starting instances of a warm image (and running a script in them), either as copy-on-write forks of a template
+ * or by copying it.
+ */
+static void bench_fork(void) {
+	forth_t* forth = bench_open("image.fork", BENCH_SIZE, BENCH_INDEXSIZE, BENCH_CODESIZE);
+	char src[32];
+	bench_define(forth, "fib", "dup 2 lt [ drop ] ? drop dup 1 - fib swap 2 - fib + ;");
+	snprintf(src, sizeof(src), "%d fib", BENCH_SCHEDFIB);
+	forth->header.pc = bench_code(forth, "image.fork", src);
+	size_t bytes = (size_t)forth->header.fsize * sizeof(forth_word_t);
+	forth_template_t tmpl;
+	if (forth_maketemplate(&tmpl, forth) != 0) {
+		bench_fail("image.fork", "couldn't make a template");
+	}
+
+	double fork = 0, forkrun = 0, copy = 0;
+	long n = 0;
+	while (fork + forkrun + copy < 3 * BENCH_MINTIME * bench_scale) {
+		double t = bench_now();
+		forth_t* f = forth_forkimage(&tmpl);
+		if (f == NULL) {
+			bench_fail("image.fork", "couldn't fork the template");
+		}
+		forth_unmapimage(f);
+		fork += bench_now() - t;
+
+		// Forking and running a script, which has to copy the pages it changes
+		t = bench_now();
+		f = forth_forkimage(&tmpl);
+		while (f != NULL && forth_run(f, &bench_callback, NULL, 1000000, NULL) == FORTH_RUN_BUDGET) {
+		}
+		if (f == NULL || forth_popdata(f) != BENCH_SCHEDRESULT) {
+			bench_fail("image.forkrun", "the forked image didn't run properly");
+		}
+		forth_unmapimage(f);
+		forkrun += bench_now() - t;
+
+		// The same with a malloc'd copy
+		t = bench_now();
+		f = malloc(bytes);
+		if (f == NULL) {
+			bench_fail("image.copyrun", "out of memory");
+		}
+		memcpy(f, forth, bytes);
+		while (forth_run(f, &bench_callback, NULL, 1000000, NULL) == FORTH_RUN_BUDGET) {
+		}
+		if (forth_popdata(f) != BENCH_SCHEDRESULT) {
+			bench_fail("image.copyrun", "the copied image didn't run properly");
+		}
+		free(f);
+		copy += bench_now() - t;
+		n++;
+	}
+	bench_report("image.fork", "us_per_op", fork * 1e6 / n, n);
+	bench_report("image.forkrun", "us_per_op", forkrun * 1e6 / n, n);
+	bench_report("image.copyrun", "us_per_op", copy * 1e6 / n, n);
+
+	forth_closetemplate(&tmpl);
+	free(forth);
+}
+
+/* Moving a paused image through the wire format (to memory), and how much smaller that is than the whole image. */
+static void bench_wire(void) {
+	forth_t* forth = bench_open("image.wire", BENCH_SIZE, BENCH_INDEXSIZE, BENCH_CODESIZE);
+	char src[32];
+	bench_define(forth, "fib", "dup 2 lt [ drop ] ? drop dup 1 - fib swap 2 - fib + ;");
+	snprintf(src, sizeof(src), "%d fib", BENCH_SCHEDFIB);
+	forth->header.pc = bench_code(forth, "image.wire", src);
+	if (forth_run(forth, &bench_callback, NULL, 1000, NULL) != FORTH_RUN_BUDGET) { // Paused part way through
+		bench_fail("image.wire", "the script didn't pause");
+	}
+	size_t bytes = (size_t)forth->header.fsize * sizeof(forth_word_t);
+	forth_wiremem_t mem = { malloc(bytes), bytes, 0 };
+	forth_t* f = malloc(bytes);
+	if (mem.buf == NULL || f == NULL) {
+		bench_fail("image.wire", "out of memory");
+	}
+
+	double exp = 0, imp = 0;
+	long n = 0, len = 0;
+	while (exp + imp < 2 * BENCH_MINTIME * bench_scale) {
+		double t = bench_now();
+		mem.pos = 0;
+		len = forth_wireexport(forth, &forth_wirememwrite, &mem);
+		exp += bench_now() - t;
+		if (len < 0) {
+			bench_fail("image.wireexport", "couldn't export the image");
+		}
+
+		t = bench_now();
+		forth_wire_t w;
+		mem.size = mem.pos;
+		mem.pos = 0;
+		if (forth_wireopen(&w, &forth_wirememread, &mem) != forth->header.fsize || forth_wireimport(&w, f, forth->header.fsize) != 0) {
+			bench_fail("image.wireimport", "couldn't import the image");
+		}
+		imp += bench_now() - t;
+		mem.size = bytes;
+		n++;
+	}
+	while (forth_run(f, &bench_callback, NULL, 1000000, NULL) == FORTH_RUN_BUDGET) {
+	}
+	if (forth_popdata(f) != BENCH_SCHEDRESULT) {
+		bench_fail("image.wireimport", "the imported image didn't finish properly");
+	}
+	bench_report("image.wireexport", "us_per_op", exp * 1e6 / n, n);
+	bench_report("image.wireimport", "us_per_op", imp * 1e6 / n, n);
+	bench_report("image.wiresize", "percent_of_raw", len * 100.0 / bytes, len);
+
+	free(f);
+	free(mem.buf);
+	bench_close(forth);
+}
+
+/* Assembles src with the streaming assembler, fed in chunks of the given size. */
+static void bench_stream(forth_t* forth, const char* name, const char* src, size_t len, size_t chunk) {
+	forth_asmstream_t stream;
+	size_t i;
+	forth_asmbegin(&stream);
+	for (i = 0; i < len; i += chunk) {
+		if (forth_asmfeed(forth, &stream, src + i, (long)(len - i < chunk ? len - i : chunk)) != 0) {
+			bench_fail(name, "couldn't assemble the source");
+		}
+	}
+	if (forth_asmend(forth, &stream) != 0) {
+		bench_fail(name, "couldn't assemble the source");
+	}
+}
+
+/* Times assembling src (at the end of the code, over and over) and reports the MB/s. If chunk is non-zero it's fed to
+ * the streaming assembler in pieces of that size, otherwise it goes through forth_assemble. The code is dropped again
+ * afterwards, but any names it added to the index are kept.
+ */
+static void bench_asm(forth_t* forth, const char* name, const char* src, size_t chunk) {
+	forth_word_t codenext = forth->header.codenext;
+	size_t len = strlen(src);
+	double best = 0;
+	long bytes = 0;
+	int rep;
+	for (rep = 0; rep < BENCH_REPS; rep++) {
+		double t = 0;
+		long repbytes = 0;
+		while (t < BENCH_MINTIME * bench_scale) {
+			forth->header.codenext = codenext;
+			double start = bench_now();
+			if (chunk != 0) {
+				bench_stream(forth, name, src, len, chunk);
+			} else {
+				bench_code(forth, name, src);
+			}
+			t += bench_now() - start;
+			repbytes += (long)len;
+		}
+		if (rep == 0 || repbytes / t > bytes / best) {
+			best = t;
+			bytes = repbytes;
+		}
+	}
+	forth->header.codenext = codenext;
+	bench_report(name, "mb_per_s", bytes / best / 1e6, bytes);
+}
+
+/* Times loading the module assembled from src (at the end of the code, over and over), reporting the MB/s of the
+ * source it saves assembling.
+ */
+static void bench_modload(forth_t* forth, const char* name, const char* src) {
+	forth_word_t codenext = forth->header.codenext;
+	forth_modmark_t mark;
+	forth_modbegin(forth, &mark);
+	bench_code(forth, name, src);
+	forth_word_t size = forth_modwrite(forth, &mark, NULL, 0);
+	forth_word_t* mod = malloc((size > 0 ? size : 1) * sizeof(forth_word_t));
+	if (size <= 0 || mod == NULL || forth_modwrite(forth, &mark, mod, size) != size) {
+		bench_fail(name, "couldn't write the module");
+	}
+	size_t len = strlen(src);
+	double best = 0;
+	long bytes = 0;
+	int rep;
+	for (rep = 0; rep < BENCH_REPS; rep++) {
+		double t = 0;
+		long repbytes = 0;
+		while (t < BENCH_MINTIME * bench_scale) {
+			forth->header.codenext = codenext;
+			double start = bench_now();
+			if (forth_modload(forth, mod, size) != codenext) {
+				bench_fail(name, "couldn't load the module");
+			}
+			t += bench_now() - start;
+			repbytes += (long)len;
+		}
+		if (rep == 0 || repbytes / t > bytes / best) {
+			best = t;
+			bytes = repbytes;
+		}
+	}
+	forth->header.codenext = codenext;
+	bench_report(name, "mb_per_s", bytes / best / 1e6, bytes);
+	free(mod);
+}
+
+static void bench_assembler(void) {
+	static const char chunk[] =
+		"dup 2 lt [ drop ] ? drop dup 1 - fib swap 2 - fib + ;\n"
+		"1 2 + 3 * \"hello, world\" [ 0 ] ! v.count fetch 1 + v.count store\n";
+	char* src = malloc(BENCH_ASMBYTES + sizeof(chunk));
+	if (src == NULL) {
+		bench_fail("asm.source", "out of memory");
+	}
+	src[0] = 0;
+	size_t len = 0;
+	while (len < BENCH_ASMBYTES) {
+		memcpy(src + len, chunk, sizeof(chunk));
+		len += sizeof(chunk) - 1;
+	}
+
+	forth_t* forth = bench_open("asm.source", BENCH_SIZE, BENCH_INDEXSIZE, BENCH_CODESIZE);
+	bench_asm(forth, "asm.source", src, 0);
+	bench_asm(forth, "asm.stream", src, 4096);
+	bench_modload(forth, "asm.module", src);
+	free(forth);
+	free(src);
+}
+
+/* Dictionary lookups by name, then assembling and running code that calls every one of the words. */
+static void bench_dict(void) {
+	static char names[BENCH_DICTWORDS][16];
+	int i, rep;
+	for (i = 0; i < BENCH_DICTWORDS; i++) {
+		snprintf(names[i], sizeof(names[i]), "w%d", i);
+	}
+
+	forth_t* forth = NULL;
+	double best = 0;
+	for (rep = 0; rep < BENCH_REPS; rep++) {
+		free(forth);
+		forth = bench_open("dict.insert", BENCH_SIZE, BENCH_DICTINDEX, BENCH_DICTCODE);
+		double t = bench_now();
+		for (i = 0; i < BENCH_DICTWORDS; i++) {
+			if (forth_lookuptableaddr(forth, names[i]) == 0) {
+				bench_fail("dict.insert", "the index is full");
+			}
+		}
+		t = bench_now() - t;
+		if (rep == 0 || t < best) {
+			best = t;
+		}
+	}
+	bench_report("dict.insert", "ns_per_op", best * 1e9 / BENCH_DICTWORDS, BENCH_DICTWORDS);
+
+	long lookups = 0;
+	best = 0;
+	for (rep = 0; rep < BENCH_REPS; rep++) {
+		double t = 0;
+		long replookups = 0;
+		while (t < BENCH_MINTIME * bench_scale) {
+			double start = bench_now();
+			for (i = 0; i < BENCH_DICTWORDS; i++) {
+				if (forth_lookuptableaddr(forth, names[i]) == 0) {
+					bench_fail("dict.lookup", "lost a word");
+				}
+			}
+			t += bench_now() - start;
+			replookups += BENCH_DICTWORDS;
+		}
+		if (rep == 0 || t / replookups < best / lookups) {
+			best = t;
+			lookups = replookups;
+		}
+	}
+	bench_report("dict.lookup", "ns_per_op", best * 1e9 / lookups, lookups);
+
+	for (i = 0; i < BENCH_DICTWORDS; i++) {
+		bench_define(forth, names[i], "1 + ;");
+	}
+	char* src = malloc(BENCH_DICTWORDS * 16 + 4);
+	if (src == NULL) {
+		bench_fail("asm.dict", "out of memory");
+	}
+	size_t len = 0;
+	src[len++] = '0';
+	for (i = 0; i < BENCH_DICTWORDS; i++) {
+		len += snprintf(src + len, 16, " %s", names[i]);
+	}
+	bench_asm(forth, "asm.dict", src, 0);
+	bench_macro(forth, "macro.dict", bench_code(forth, "macro.dict", src), BENCH_DICTWORDS, 0, 0);
+
+	free(src);
+	free(forth);
+}
+
+typedef struct bench_schedvm bench_schedvm_t;
+struct bench_schedvm {
+	forth_sched_t* sched;
+	int id;
+	bool yielded;
+};
+
+/* Scheduled scripts can also "yield", which parks the VM once (waking it up straight away) and then carries on. */
+static bool bench_schedcallback(forth_t* forth, void* udata, int sysnum) {
+	bench_schedvm_t* vm = udata;
+	if (sysnum != BENCH_SYS_YIELD) {
+		return bench_callback(forth, NULL, sysnum);
+	}
+	vm->yielded = !vm->yielded;
+	if (vm->yielded) {
+		forth_schedwake(vm->sched, vm->id);
+	}
+	return vm->yielded;
+}
+
+/* The allocator, with a pool of live blocks of random sizes (up to BENCH_ALLOCMAX words) being freed and replaced, so
+ * the arena has to reach a steady state rather than run out.
+ */
+static void bench_alloc(void) {
+	static forth_word_t blocks[BENCH_ALLOCBLOCKS];
+	forth_t* forth = bench_open("heap.alloc", BENCH_SIZE, BENCH_INDEXSIZE, BENCH_CODESIZE);
+	if (forth_enablealloc(forth, BENCH_ALLOCSIZE) != 0) {
+		bench_fail("heap.alloc", "couldn't reserve the arena");
+	}
+	memset(blocks, 0, sizeof(blocks));
+	unsigned int seed = 1;
+	long ops = BENCH_LOOPSTEPS * bench_scale / 4;
+	double best = 0;
+	int rep;
+	for (rep = 0; rep < BENCH_REPS; rep++) {
+		double t = bench_now();
+		long i;
+		for (i = 0; i < ops; i++) {
+			seed = seed * 1103515245u + 12345u;
+			forth_word_t* block = &blocks[(seed >> 16) % BENCH_ALLOCBLOCKS];
+			if (*block != 0) {
+				forth_free(forth, *block);
+				*block = 0;
+			} else if ((*block = forth_alloc(forth, 1 + (seed >> 8) % BENCH_ALLOCMAX)) == 0) {
+				bench_fail("heap.alloc", "ran out of room");
+			}
+		}
+		t = bench_now() - t;
+		if (rep == 0 || t < best) {
+			best = t;
+		}
+	}
+	bench_report("heap.alloc", "ns_per_op", best * 1e9 / ops, ops);
+	bench_close(forth);
+}
+
+/* The collector, with the same sort of pool as heap.alloc but kept in a block whose address is on the data stack.
+ * Blocks are never freed, they're just replaced in the pool. A collection starts after every BENCH_ALLOCBLOCKS
+ * allocations and runs a slice (up to BENCH_GCBUDGET words) after every BENCH_ALLOCBLOCKS / 16. If the arena fills
+ * up anyway, the rest of the collection runs in one go, which shows up as the longest pause.
+ */
+static void bench_gc(void) {
+	forth_t* forth = bench_open("heap.gc", BENCH_SIZE, BENCH_INDEXSIZE, BENCH_CODESIZE);
+	forth_word_t pool;
+	if (forth_enablealloc(forth, BENCH_ALLOCSIZE) != 0 || (pool = forth_alloc(forth, BENCH_ALLOCBLOCKS)) == 0) {
+		bench_fail("heap.gc", "couldn't reserve the arena");
+	}
+	long i;
+	for (i = 0; i < BENCH_ALLOCBLOCKS; i++) {
+		forth_poke(forth, pool + i, 0);
+	}
+	forth_pushdata(forth, pool);
+	forth_gcstats_t stats = { 0 };
+	unsigned int seed = 1;
+	long ops = BENCH_LOOPSTEPS * bench_scale / 4;
+	double best = 0;
+	int rep;
+	for (rep = 0; rep < BENCH_REPS; rep++) {
+		double t = bench_now();
+		for (i = 0; i < ops; i++) {
+			seed = seed * 1103515245u + 12345u;
+			forth_word_t len = 1 + (seed >> 8) % BENCH_ALLOCMAX;
+			forth_word_t block = forth_alloc(forth, len);
+			if (block == 0 && (forth_gccollect(forth, &stats) != 0 || (block = forth_alloc(forth, len)) == 0)) {
+				bench_fail("heap.gc", "ran out of room");
+			}
+			forth_poke(forth, pool + (seed >> 16) % BENCH_ALLOCBLOCKS, block);
+			if (i % BENCH_ALLOCBLOCKS == 0) {
+				forth_gcstart(forth);
+			}
+			if (i % (BENCH_ALLOCBLOCKS / 16) == 0) {
+				forth_gcslice(forth, BENCH_GCBUDGET, &stats);
+			}
+		}
+		t = bench_now() - t;
+		if (rep == 0 || t < best) {
+			best = t;
+		}
+	}
+	bench_report("heap.gc", "ns_per_op", best * 1e9 / ops, ops);
+	bench_report("heap.gc", "us_mean_pause", stats.slices > 0 ? stats.totalpause / 1e3 / stats.slices : 0, stats.slices);
+	bench_report("heap.gc", "us_max_pause", stats.maxpause / 1e3, stats.slices);
+	bench_report("heap.gc", "kb_reclaimed_per_cycle", stats.cycles > 0 ? stats.reclaimed / 1024.0 / stats.cycles : 0, stats.cycles);
+	bench_close(forth);
+}
+
+/* Copying a string into the image and back out again from the host, as a character per word and packed (which is
+ * just a memcpy each way).
+ */
+static void bench_strcopy(forth_t* forth, const char* name, bool packed) {
+	static const char str[] = "The quick brown fox jumps over the lazy dog.";
+	forth_word_t len = (forth_word_t)strlen(str);
+	forth_word_t addr = forth->header.heapnext;
+	char buf[64];
+	long ops = BENCH_LOOPSTEPS * bench_scale / 4;
+	double best = 0;
+	int rep;
+	for (rep = 0; rep < BENCH_REPS; rep++) {
+		double t = bench_now();
+		long i;
+		for (i = 0; i < ops; i++) {
+			if ((packed ? forth_pokebytesl(forth, addr, len, str) : forth_pokestrl(forth, addr, len, str)) == 0
+				|| forth_peekstrl(forth, addr, sizeof(buf), buf) != len) {
+				bench_fail(name, "couldn't copy the string");
+			}
+		}
+		t = bench_now() - t;
+		if (rep == 0 || t < best) {
+			best = t;
+		}
+	}
+	bench_report(name, "ns_per_op", best * 1e9 / ops, ops);
+}
+
+static void bench_strings(void) {
+	forth_t* forth = bench_open("str", BENCH_SIZE, BENCH_INDEXSIZE, BENCH_CODESIZE);
+	bench_strcopy(forth, "str.copy.chars", false);
+	bench_strcopy(forth, "str.copy.packed", true);
+	bench_close(forth);
+}
+
+/* Lots of small scripts (a fib each, in their own images) run by the scheduler, with more and more workers. */
+static void bench_sched(void) {
+	static forth_t* images[BENCH_SCHEDVMS];
+	static bench_schedvm_t vms[BENCH_SCHEDVMS];
+	char name[32], src[32];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int workers, i, rep;
+	snprintf(src, sizeof(src), "%d fib yield", BENCH_SCHEDFIB);
+	for (workers = 1; workers <= cpus || workers == 1; workers *= 2) {
+		snprintf(name, sizeof(name), "sched.fib.%dw", workers);
+		double best = 0;
+		forth_schedstats_t stats = { 0 };
+		for (rep = 0; rep < BENCH_REPS; rep++) {
+			forth_sched_t* sched = forth_schedcreate(workers, BENCH_SCHEDVMS, BENCH_SCHEDSLICE);
+			if (sched == NULL) {
+				bench_fail(name, "couldn't create the scheduler");
+			}
+			for (i = 0; i < BENCH_SCHEDVMS; i++) {
+				images[i] = bench_open(name, 4096, 32, 512);
+				bench_define(images[i], "fib", "dup 2 lt [ drop ] ? drop dup 1 - fib swap 2 - fib + ;");
+				images[i]->header.pc = bench_code(images[i], name, src);
+				vms[i].sched = sched;
+				vms[i].yielded = false;
+				vms[i].id = forth_schedadd(sched, images[i], &bench_schedcallback, &vms[i]);
+			}
+			double t = bench_now();
+			if (forth_schedrun(sched) != 0) {
+				bench_fail(name, "couldn't start the workers");
+			}
+			t = bench_now() - t;
+			for (i = 0; i < BENCH_SCHEDVMS; i++) {
+				if (forth_schedstate(sched, vms[i].id) != FORTH_SCHED_DONE || images[i]->header.pc != images[i]->header.codenext || forth_popdata(images[i]) != BENCH_SCHEDRESULT) {
+					bench_fail(name, "a script didn't finish properly");
+				}
+				free(images[i]);
+			}
+			if (rep == 0 || t < best) {
+				best = t;
+				forth_schedgetstats(sched, -1, &stats);
+			}
+			forth_scheddestroy(sched);
+		}
+		bench_report(name, "scripts_per_s", BENCH_SCHEDVMS / best, BENCH_SCHEDVMS);
+		bench_report(name, "ns_per_instr", best * 1e9 / stats.steps, stats.steps);
+		bench_report(name, "max_wait_us", stats.maxwaitns / 1e3, stats.slices);
+	}
+}
+
+/* Scripts waiting on I/O, as an event loop would run them. Each "io" call starts an operation which finishes
+ * BENCH_IOROUNDS rounds of the loop later (a round runs everything that's ready, then finishes what's due, like
+ * an epoll_wait). With forth_async.h the VM parks until its call is completed; without it, it pauses and every
+ * round retries the callback of every VM until its operation has finished.
+ */
+typedef struct bench_iovm bench_iovm_t;
+struct bench_iovm {
+	forth_async_t* q;	// NULL when polling
+	int id;
+	long due;		// Round the pending operation finishes in, or -1
+	long round;		// When polling, the round it's being run in
+	long callbacks;
+};
+
+typedef struct bench_ioop bench_ioop_t;
+struct bench_ioop {
+	forth_asynctoken_t token;
+	long due;
+};
+
+static bench_ioop_t bench_ioops[BENCH_SCHEDVMS];
+static long bench_iohead, bench_iocount, bench_ioround;
+
+static bool bench_iocallback(forth_t* forth, void* udata, int sysnum) {
+	bench_iovm_t* vm = udata;
+	if (sysnum != BENCH_SYS_IO) {
+		return bench_callback(forth, NULL, sysnum);
+	}
+	vm->callbacks++;
+	if (vm->q != NULL) {
+		bench_ioop_t* op = &bench_ioops[(bench_iohead + bench_iocount++) % BENCH_SCHEDVMS];
+		op->token = forth_asyncpark(vm->q, vm->id);
+		op->due = bench_ioround + BENCH_IOROUNDS;
+		return true;
+	}
+	if (vm->due < 0) {
+		vm->due = vm->round + BENCH_IOROUNDS;
+	}
+	if (vm->round < vm->due) {
+		return true; // Try again next time
+	}
+	vm->due = -1;
+	forth_pushdata(forth, 1);
+	return false;
+}
+
+static void bench_async(void) {
+	static forth_t* images[BENCH_SCHEDVMS];
+	static bench_iovm_t vms[BENCH_SCHEDVMS];
+	static const forth_word_t one = 1;
+	const char* const names[2] = { "async.poll", "async.complete" };
+	char src[64];
+	snprintf(src, sizeof(src), "0 %d [ rot io + rot 1 - rot over ] ! drop drop", BENCH_IOCALLS);
+	int mode, i, rep;
+	for (mode = 0; mode < 2; mode++) {
+		double best = 0;
+		long callbacks = 0;
+		for (rep = 0; rep < BENCH_REPS; rep++) {
+			forth_async_t* q = (mode == 1) ? forth_asynccreate(BENCH_SCHEDVMS, BENCH_SCHEDSLICE) : NULL;
+			if (mode == 1 && q == NULL) {
+				bench_fail(names[mode], "couldn't create the queue");
+			}
+			for (i = 0; i < BENCH_SCHEDVMS; i++) {
+				images[i] = bench_open(names[mode], 4096, 32, 512);
+				images[i]->header.pc = bench_code(images[i], names[mode], src);
+				vms[i].q = q;
+				vms[i].due = -1;
+				vms[i].callbacks = 0;
+				vms[i].id = (q != NULL) ? forth_asyncadd(q, images[i], &bench_iocallback, &vms[i]) : i;
+			}
+			bench_iohead = bench_iocount = 0;
+			int live = BENCH_SCHEDVMS;
+			double t = bench_now();
+			for (bench_ioround = 0; live > 0; bench_ioround++) {
+				if (q != NULL) {
+					forth_asyncdrain(q, -1);
+					while (bench_iocount > 0 && bench_ioops[bench_iohead % BENCH_SCHEDVMS].due <= bench_ioround) {
+						if (forth_asynccomplete(q, bench_ioops[bench_iohead++ % BENCH_SCHEDVMS].token, &one, 1) != 0) {
+							bench_fail(names[mode], "couldn't complete a call");
+						}
+						bench_iocount--;
+					}
+					live = forth_asynclive(q);
+					continue;
+				}
+				for (i = 0, live = 0; i < BENCH_SCHEDVMS; i++) {
+					if (images[i]->header.pc != images[i]->header.codenext) {
+						vms[i].round = bench_ioround;
+						forth_word_t status = forth_run(images[i], &bench_iocallback, &vms[i], BENCH_SCHEDSLICE, NULL);
+						live += (status == FORTH_RUN_BUDGET || status == FORTH_RUN_PAUSED);
+					}
+				}
+			}
+			t = bench_now() - t;
+			long repcallbacks = 0;
+			for (i = 0; i < BENCH_SCHEDVMS; i++) {
+				if (images[i]->header.pc != images[i]->header.codenext || forth_popdata(images[i]) != BENCH_IOCALLS) {
+					bench_fail(names[mode], "a script didn't finish properly");
+				}
+				repcallbacks += vms[i].callbacks;
+				free(images[i]);
+			}
+			if (q != NULL) {
+				forth_asyncdestroy(q);
+			}
+			if (rep == 0 || t < best) {
+				best = t;
+				callbacks = repcallbacks;
+			}
+		}
+		long calls = (long)BENCH_SCHEDVMS * BENCH_IOCALLS;
+		bench_report(names[mode], "ns_per_call", best * 1e9 / calls, calls);
+		bench_report(names[mode], "callbacks_per_call", (double)callbacks / calls, calls);
+	}
+}
+
+int main(int argc, char** argv) {
+	if (argc > 1) {
+		bench_scale = atoi(argv[1]);
+	}
+	if (argc > 2 || bench_scale < 1) {
+		fprintf(stderr, "Usage: %s [scale]\n", argv[0]);
+		return -1;
+	}
+
+	bench_initnatives();
+	for (bench_mode = BENCH_PLAIN; bench_mode < BENCH_MODES; bench_mode++) {
+		if (bench_mode == BENCH_DENSE || bench_mode == BENCH_VERIFY || bench_mode == BENCH_NATIVE) {
+			// Only the benchmarks that run code (which is all the encoding or the verifier changes).
+			bench_micro();
+			bench_workloads();
+			bench_tasks();
+			continue;
+		}
+		if (bench_mode == BENCH_JIT) {
+#ifdef FORTH_JIT_NATIVE
+			// Only the benchmarks that run code on their own image.
+			bench_micro();
+			bench_workloads();
+			bench_tasks();
+#endif
+			continue;
+		}
+		bench_micro();
+		bench_workloads();
+		bench_tasks();
+		bench_assembler();
+		bench_dict();
+		bench_alloc();
+		bench_gc();
+		bench_strings();
+		bench_fork();
+		bench_wire();
+		bench_sched();
+		bench_async();
+	}
+
+	return 0;
+}
@@ -14,9 +14,10 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-// TODO: Replace calls to atoi etc. with portable code
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #ifdef FORTH_16BIT
 typedef int16_t forth_word_t;
@@ -62,6 +63,40 @@ struct forth_header {
 	forth_word_t dsend;
 	forth_word_t asstart;
 	forth_word_t asend;
+	/* Fields below were added after the original layout. Images made before them have a smaller hsize, so
+	 * check with FORTH_HEADER_HAS before relying on them.
+	 */
+	forth_word_t hashstart;
+	forth_word_t hashsize;
+	forth_word_t qstart;
+	forth_word_t qnext;
+	forth_word_t qend;
+	forth_word_t asmflags;
+	forth_word_t asmlast;
+	forth_word_t asmblock;
+	forth_word_t allocstart;
+	forth_word_t allocnext;
+	forth_word_t allocend;
+	forth_word_t gcphase;
+	forth_word_t gccursor;
+	forth_word_t gcblock;
+	forth_word_t gcoffset;
+	forth_word_t gcgrey;
+	forth_word_t gcrun;
+	forth_word_t waitseq;
+	forth_word_t waiting;
+	forth_word_t indexgen;	// Changed by forth_setlookupinstrl, so anything worked out from the index can tell it's stale
+	forth_word_t sharedstart;	// For an instance (see forth_clearinstance), the addresses its shared segment covers
+	forth_word_t sharedend;
+	forth_word_t sharedlink;	// And where the host's pointer to that segment is kept in the image, or 0 if it isn't one
+	forth_word_t task;	// The running task's record (see forth_enabletasks), or 0 if the image doesn't have tasks
+	forth_word_t taskmain;	// The record of the task that was running when they were enabled, which has no block to return from
+	forth_word_t taskrsize;	// How many words spawned tasks get for their return and data stacks
+	forth_word_t taskdsize;
+	forth_word_t fusedpushop;	// Pairs the peephole pass has fused into each kind of superinstruction (see forth_getpeepholestats)
+	forth_word_t fusedopop;
+	forth_word_t fusedblockloop;
+	forth_word_t tailcalls;	// And calls forth_asmtail has made into tail calls
 };
 
 union forth {
@@ -71,6 +106,48 @@ union forth {
 
 #define FORTH_INLINE static inline
 
+#define FORTH_HEADER_HAS(forth,field) ((forth)->header.hsize > (forth_word_t)(offsetof(forth_header_t, field) / sizeof(forth_word_t)))
+// Size of the header before any fields were added (i.e. up to asend)
+#define FORTH_HEADER_MINSIZE	24
+
+#define FORTH_MAGIC	((forth_word_t) 0x54175E1F) // Truncated in 16-bit mode
+#define FORTH_VERSION	1
+
+#define FORTH_OP_PUSHINT	0
+#define FORTH_OP_CALLADDR	1
+#define FORTH_OP_CALLSYS	2
+// A call that's followed by a return, made by the assembler (see forth_asmtail)
+#define FORTH_OP_TAILCALL	3
+#define FORTH_OP_PUSHSTR	4
+#define FORTH_OP_SIMPLE		5
+#define FORTH_OP_CONTROL	6
+#define FORTH_OP_CALLINDEX	7
+#define FORTH_OP_PUSHBLOCK	8
+#define FORTH_OP_LOOP		9
+// Superinstructions made by the peephole pass, see forth_peephole
+#define FORTH_OP_PUSHOP		10
+#define FORTH_OP_OPOP		11
+#define FORTH_OP_BLOCKLOOP	12
+// Bulk operations on the heap, see forth_bulk
+#define FORTH_OP_BULK		13
+// The allocator, see forth_defineheapops
+#define FORTH_OP_HEAP		14
+// Extended instructions, with one of the FORTH_EXT_* codes below in the low 4 bits of the argument
+#define FORTH_OP_EXT		15
+
+#define FORTH_EXT_PUSHBYTES	0 // Push a packed string (its length is the rest of the argument) and jump over it
+#define FORTH_EXT_DENSE		1 // Several simple ops and numbers in 4-bit slots (the rest of the argument), see forth_densecount
+#define FORTH_EXT_TAILINDEX	2 // A tail call by index (the rest of the argument is the address of the index entry)
+#define FORTH_EXT_TASK		3 // A task op (the rest of the argument), see forth_definetaskops
+
+/* The simple ops in the order of their 4-bit codes, as used by the superinstructions ('?' has to stay last). */
+#define FORTH_SIMPLEOPS		"+-*/%RL=AO&|?"
+#define FORTH_SIMPLEOPCOUNT	13
+
+FORTH_INLINE forth_word_t forth_encode(forth_t* forth, forth_word_t opcode, forth_word_t arg) {
+	return (arg << 4) | opcode;
+}
+
 FORTH_INLINE forth_word_t forth_pushdata(forth_t* forth, forth_word_t value) {
 	if (forth->header.dsp >= forth->header.dsstart && forth->header.dsp < forth->header.dsend) {
 		forth->data.words[forth->header.dsp++] = value;
@@ -119,16 +196,49 @@ FORTH_INLINE forth_word_t forth_popasm(forth_t* forth) {
 	return -1;
 }
 
+/* Gives the return, data and assembler stacks new regions of rsize, dsize and asize words (in that order) from
+ * heapnext, so they don't overlap each other or anything else. They all have to be empty. If their old regions are
+ * the last thing before heapnext (as forth_clear leaves them) they're reused. Returns 0 on success.
+ */
+FORTH_INLINE forth_word_t forth_setstacks(forth_t* forth, forth_word_t rsize, forth_word_t dsize, forth_word_t asize) {
+	forth_header_t* h = &forth->header;
+	if (rsize < 1 || dsize < 1 || asize < 1 || h->rsp != h->rsstart || h->dsp != h->dsstart || h->asp != h->asstart) {
+		return -1;
+	}
+	if (FORTH_HEADER_HAS(forth, taskdsize) && h->task != 0) { // The stacks belong to a task now
+		return -1;
+	}
+	forth_word_t next = h->heapnext;
+	if (h->rsend == h->dsstart && h->dsend == h->asstart && h->asend == next && h->rsstart >= h->heapstart && h->rsstart < next) {
+		next = h->rsstart;
+	}
+	if (rsize > h->heapend - next || dsize > h->heapend - next - rsize || asize > h->heapend - next - rsize - dsize) {
+		return -1;
+	}
+	h->rsstart = h->rsp = next;
+	h->rsend = h->dsstart = h->dsp = next + rsize;
+	h->dsend = h->asstart = h->asp = h->dsstart + dsize;
+	h->asend = h->heapnext = h->asstart + asize;
+	return 0;
+}
+
 FORTH_INLINE forth_word_t forth_clear(forth_t* forth, forth_word_t size, forth_word_t indexsize, forth_word_t codesize) {
-	if (forth == NULL || size < 1024 + (indexsize * 2) + codesize) {
+	forth_word_t hashsize = 0;
+#ifndef FORTH_NOHASHINDEX
+	// The hash index gets a power of two number of buckets, at least twice the number of index entries.
+	while (indexsize > 0 && hashsize < indexsize * 2) {
+		hashsize = (hashsize == 0) ? 1 : (hashsize << 1);
+	}
+#endif
+	if (forth == NULL || size < 1024 + (indexsize * 2) + hashsize + codesize) {
 		return -1;
 	}
 	forth_word_t i;
 	for (i = 0; i < size; i++) {
 		/*forth->data.words*/((forth_word_t*) (void*) forth)[i] = 0;
 	}
-	forth->header.fmagic = 0x54175E1F;
-	forth->header.fversion = 1;
+	forth->header.fmagic = FORTH_MAGIC;
+	forth->header.fversion = FORTH_VERSION;
 	forth->header.fsize = size;
 	forth->header.hsize = sizeof(forth_header_t) / sizeof(forth_word_t);
 	forth->header.resvd = 0;
@@ -137,8 +247,11 @@ FORTH_INLINE forth_word_t forth_clear(forth_t* forth, forth_word_t size, forth_w
 	forth->header.indexstart = forth->header.hsize;
 	forth->header.indexnext = forth->header.indexstart;
 	forth->header.indexend = forth->header.indexstart + (indexsize * 2);
+
+	forth->header.hashstart = forth->header.indexend;
+	forth->header.hashsize = hashsize;
 	
-	forth->header.codestart = forth->header.indexend;
+	forth->header.codestart = forth->header.hashstart + hashsize;
 	forth->header.codenext = forth->header.codestart;
 	forth->header.codeend = forth->header.codestart + codesize;
 
@@ -146,40 +259,316 @@ FORTH_INLINE forth_word_t forth_clear(forth_t* forth, forth_word_t size, forth_w
 	forth->header.heapnext = forth->header.heapstart;
 	forth->header.heapend = forth->header.fsize;
 
-	forth->header.dsstart = forth->header.heapstart;
-	forth->header.dsend = forth->header.heapend;
-	forth->header.rsstart = forth->header.heapstart;
-	forth->header.rsend = forth->header.heapend;
-	forth->header.asstart = forth->header.heapstart;
-	forth->header.asend = forth->header.heapend;
+	// 100 words for each stack to start with.
+	forth->header.rsp = forth->header.rsstart = forth->header.rsend = forth->header.heapnext;
+	forth->header.dsp = forth->header.dsstart = forth->header.dsend = forth->header.heapnext;
+	forth->header.asp = forth->header.asstart = forth->header.asend = forth->header.heapnext;
+	return forth_setstacks(forth, 100, 100, 100);
+}
+
+/* Instances share the index and code of a master image (which could be in ROM or a shared mapping) instead of
+ * having their own copy, and only hold their header, heap and stacks. The master has to be made with
+ * forth_clearshared, which leaves its first instancesize words unused so that they can be each instance's own
+ * addresses, and then set up as usual (assembling code, defining words and so on). An instance's index, hash index
+ * and code are read from the master's words between its indexstart and heapnext (so names and anything else
+ * allocated in its heap are shared too), and can't be changed: an instance has no room to add to the index or
+ * code and doesn't quicken. The master mustn't change while it has instances.
+ */
+
+// Words after the header that hold the pointer to an instance's shared segment.
+#define FORTH_SHARED_LINKWORDS	((forth_word_t)((sizeof(const forth_word_t*) + sizeof(forth_word_t) - 1) / sizeof(forth_word_t)))
+
+FORTH_INLINE bool forth_isinstance(forth_t* forth) {
+	return FORTH_HEADER_HAS(forth, sharedlink) && forth->header.sharedlink != 0;
+}
+
+/* Points an instance at its shared segment, a copy of the master's words from sharedstart up to sharedend (e.g. the
+ * master itself, or a copy in flash), after forth_clearinstance or after loading an instance that was saved.
+ */
+FORTH_INLINE forth_word_t forth_sharedlink(forth_t* forth, const forth_word_t* segment) {
+	if (!forth_isinstance(forth) || segment == NULL) {
+		return -1;
+	}
+	memcpy(forth->data.words + forth->header.sharedlink, &segment, sizeof(segment));
+	return 0;
+}
+
+/* The shared segment an instance was pointed at, or NULL if it hasn't been since it was loaded (forth_checkimage
+ * clears the pointer a saved instance was written with, since it was only good in the process that saved it).
+ */
+FORTH_INLINE const forth_word_t* forth_sharedsegment(forth_t* forth) {
+	const forth_word_t* segment;
+	memcpy(&segment, forth->data.words + forth->header.sharedlink, sizeof(segment));
+	return segment;
+}
+
+/* Like forth_clear, but for a master image whose first instancesize words are left for instances to use. */
+FORTH_INLINE forth_word_t forth_clearshared(forth_t* forth, forth_word_t size, forth_word_t instancesize, forth_word_t indexsize, forth_word_t codesize) {
+	if (forth_clear(forth, size, indexsize, codesize) != 0) {
+		return -1;
+	}
+	forth_header_t* h = &forth->header;
+	forth_word_t shift = instancesize - h->indexstart;
+	if (shift < 0 || shift > h->heapend - h->heapnext) {
+		return -1;
+	}
+	forth_word_t* fields[] = { &h->indexstart, &h->indexnext, &h->indexend, &h->hashstart, &h->codestart, &h->codenext, &h->codeend,
+		&h->heapstart, &h->heapnext, &h->rsp, &h->rsstart, &h->rsend, &h->dsp, &h->dsstart, &h->dsend, &h->asp, &h->asstart, &h->asend };
+	size_t i;
+	for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		*fields[i] += shift;
+	}
+	return 0;
+}
+
+/* Clears size words (no more than the instancesize the master was made with) as an instance of master, with stacks
+ * like forth_clear's in its own heap. Returns 0 on success.
+ */
+FORTH_INLINE forth_word_t forth_clearinstance(forth_t* forth, forth_word_t size, forth_t* master) {
+	forth_word_t hsize = sizeof(forth_header_t) / sizeof(forth_word_t);
+	if (forth == NULL || master == NULL || forth_isinstance(master) || master->header.hsize != hsize
+		|| size > master->header.indexstart || size < hsize + FORTH_SHARED_LINKWORDS + 300) {
+		return -1;
+	}
+	forth_word_t i;
+	for (i = 0; i < size; i++) {
+		((forth_word_t*) (void*) forth)[i] = 0;
+	}
+	forth_header_t* h = &forth->header;
+	const forth_header_t* m = &master->header;
+	h->fmagic = FORTH_MAGIC;
+	h->fversion = FORTH_VERSION;
+	h->fsize = size;
+	h->hsize = hsize;
+	h->pc = -1;
+	h->indexstart = m->indexstart;
+	h->indexnext = h->indexend = m->indexnext;
+	h->hashstart = m->hashstart;
+	h->hashsize = m->hashsize;
+	h->codestart = m->codestart;
+	h->codenext = h->codeend = m->codenext;
+	h->asmflags = m->asmflags;
+	h->asmlast = -1;
+	h->indexgen = m->indexgen;
+	h->sharedstart = m->indexstart;
+	h->sharedend = m->heapnext;
+	h->sharedlink = hsize;
+	h->heapstart = h->heapnext = hsize + FORTH_SHARED_LINKWORDS;
+	h->heapend = size;
+	h->rsp = h->rsstart = h->rsend = h->heapnext;
+	h->dsp = h->dsstart = h->dsend = h->heapnext;
+	h->asp = h->asstart = h->asend = h->heapnext;
+	forth_sharedlink(forth, master->data.words + m->indexstart);
+	return forth_setstacks(forth, 100, 100, 100);
+}
+
+/* The words to read an image's index and code from (for an instance, its shared segment, addressed the same way).
+ * Only addresses below forth_codelimit can be read through it.
+ */
+FORTH_INLINE const forth_word_t* forth_codewords(forth_t* forth) {
+	if (!forth_isinstance(forth)) {
+		return forth->data.words;
+	}
+	return forth_sharedsegment(forth) - forth->header.sharedstart;
+}
+
+FORTH_INLINE forth_word_t forth_codelimit(forth_t* forth) {
+	return forth_isinstance(forth) ? forth->header.sharedend : forth->header.fsize;
+}
+
+/* Returns where to read the word at addr from, whether it's an instance's own or in its shared segment, and sets
+ * *avail to how many words can be read from there. Returns NULL if there isn't a word at addr.
+ */
+FORTH_INLINE const forth_word_t* forth_readable(forth_t* forth, forth_word_t addr, forth_word_t* avail) {
+	if (addr >= 0 && addr < forth->header.fsize) {
+		*avail = forth->header.fsize - addr;
+		return forth->data.words + addr;
+	}
+	if (forth_isinstance(forth) && addr >= forth->header.sharedstart && addr < forth->header.sharedend) {
+		*avail = forth->header.sharedend - addr;
+		return forth_codewords(forth) + addr;
+	}
+	return NULL;
+}
 
-	forth->header.rsp = forth->header.heapnext;
-	forth->header.heapnext += 100;
-	forth->header.dsp = forth->header.heapnext;
-	forth->header.heapnext += 100;
-	forth->header.asp = forth->header.heapnext;
-	forth->header.heapnext += 100;
+/* Checks that an image of size words has a header this version can run, with its sections in order and inside the
+ * image, without changing it (e.g. before saving it). Returns 0 if so.
+ */
+FORTH_INLINE forth_word_t forth_checkheader(forth_t* forth, forth_word_t size) {
+	if (forth == NULL || size < FORTH_HEADER_MINSIZE) {
+		return -1;
+	}
+	forth_header_t* h = &forth->header;
+	if (h->fmagic != FORTH_MAGIC || h->fversion != FORTH_VERSION || h->fsize != size || h->hsize < FORTH_HEADER_MINSIZE || h->hsize > size) {
+		return -1;
+	}
+	if (forth_isinstance(forth)) {
+		// Its own words are the header, the link and the heap, and everything else is in the shared segment.
+		if (h->sharedlink < h->hsize || h->heapstart < h->sharedlink + FORTH_SHARED_LINKWORDS || h->heapnext < h->heapstart
+			|| h->heapend < h->heapnext || h->fsize < h->heapend || h->sharedstart < h->fsize || h->indexstart < h->sharedstart
+			|| h->indexnext < h->indexstart || h->indexend < h->indexnext || h->codestart < h->indexend
+			|| h->codenext < h->codestart || h->codeend < h->codenext || h->sharedend < h->codeend || h->qend != 0) {
+			return -1;
+		}
+	} else if (h->indexstart < h->hsize || h->indexnext < h->indexstart || h->indexend < h->indexnext || h->codestart < h->indexend
+		|| h->codenext < h->codestart || h->codeend < h->codenext || h->heapstart < h->codeend
+		|| h->heapnext < h->heapstart || h->heapend < h->heapnext || h->fsize < h->heapend) {
+		return -1;
+	}
+	if (FORTH_HEADER_HAS(forth, hashsize) && h->hashsize != 0 && (h->hashstart < h->indexend || h->hashstart + h->hashsize > h->codestart)) {
+		return -1;
+	}
+	// The stacks and the quicken log are written through without checking against the image, so they have to be in the heap.
+	if (h->rsstart < h->heapstart || h->rsp < h->rsstart || h->rsend < h->rsp || h->heapend < h->rsend
+		|| h->dsstart < h->heapstart || h->dsp < h->dsstart || h->dsend < h->dsp || h->heapend < h->dsend
+		|| h->asstart < h->heapstart || h->asp < h->asstart || h->asend < h->asp || h->heapend < h->asend) {
+		return -1;
+	}
+	if (FORTH_HEADER_HAS(forth, qend) && (h->qstart != 0 || h->qnext != 0 || h->qend != 0)) {
+		if (h->qstart < h->heapstart || h->qnext < h->qstart || h->qend < h->qnext || h->heapend < h->qend || (h->qnext - h->qstart) % 2 != 0) {
+			return -1;
+		}
+		// Each entry is a site in the code and the index entry's instruction it was quickened from (see forth_quicken).
+		forth_word_t i;
+		for (i = h->qstart; i < h->qnext; i += 2) {
+			forth_word_t site = forth->data.words[i], instraddr = forth->data.words[i + 1];
+			if (site < h->codestart || site >= h->codenext || instraddr <= h->indexstart || instraddr >= h->indexnext
+				|| (instraddr - h->indexstart) % 2 != 1) {
+				return -1;
+			}
+		}
+	}
+	if (FORTH_HEADER_HAS(forth, gcrun) && h->allocend != 0 && (h->allocstart < h->heapstart || h->allocnext < h->allocstart
+		|| h->allocend < h->allocnext || h->allocend > h->heapnext || (h->gcphase & 7) > 5 || h->gcgrey < 0)) {
+		return -1;
+	}
+	if (FORTH_HEADER_HAS(forth, waiting) && (h->waitseq < 0 || (h->waiting != 0 && h->waiting != 1))) {
+		return -1;
+	}
+	if (FORTH_HEADER_HAS(forth, taskdsize) && h->task != 0 && (!FORTH_HEADER_HAS(forth, gcrun) || h->task <= h->allocstart
+		|| h->task >= h->allocnext || h->taskmain <= h->allocstart || h->taskmain >= h->allocnext || h->taskrsize < 1 || h->taskdsize < 1)) {
+		return -1;
+	}
+	return 0;
+}
 
+/* Checks an image of size words that's been loaded (e.g. from a file or the wire) like forth_checkheader, and clears
+ * the link to the shared segment if it's an instance, so that it can't run until it's given one with
+ * forth_sharedlink. Returns 0 if it's good.
+ */
+FORTH_INLINE forth_word_t forth_checkimage(forth_t* forth, forth_word_t size) {
+	if (forth_checkheader(forth, size) != 0) {
+		return -1;
+	}
+	if (forth_isinstance(forth)) {
+		memset(forth->data.words + forth->header.sharedlink, 0, (size_t)FORTH_SHARED_LINKWORDS * sizeof(forth_word_t));
+	}
 	return 0;
 }
 
 FORTH_INLINE forth_word_t forth_peek(forth_t* forth, forth_word_t addr) {
 	if (addr < 0 || addr >= forth->header.fsize) {
-		return -1;
+		forth_word_t avail;
+		const forth_word_t* p = forth_readable(forth, addr, &avail);
+		return (p != NULL) ? *p : -1;
 	}
 	return forth->data.words[addr];
 }
 
+// The collector's write barrier, see below.
+FORTH_INLINE void forth_gcwrite(forth_t* forth, forth_word_t addr);
+
 FORTH_INLINE forth_word_t forth_poke(forth_t* forth, forth_word_t addr, forth_word_t val) {
 	if (addr < 0 || addr >= forth->header.fsize) {
 		return -1;
 	}
+	forth_gcwrite(forth, addr);
 	forth->data.words[addr] = val;
 	return 0;
 }
 
+/* Packed strings hold sizeof(forth_word_t) bytes to a word (in the image's byte order, with the last word padded
+ * with zeros) instead of a character per word, after a header that's also the instruction pushing them:
+ * forth_encode(forth, FORTH_OP_EXT, (len << 4) | FORTH_EXT_PUSHBYTES). The host copies them in and out with
+ * memcpy. Everything that reads strings (forth_peekstrl, the index and so on) takes both kinds.
+ */
+#define FORTH_PACKED_TAG	((FORTH_EXT_PUSHBYTES << 4) | FORTH_OP_EXT)
+#define FORTH_PACKED_MAXLEN	((forth_word_t)(((uintmax_t)1 << (sizeof(forth_word_t) * 8 - 9)) - 1))
+
+// How many words the bytes of a packed string of len bytes take (after its header).
+FORTH_INLINE forth_word_t forth_packedsize(forth_word_t len) {
+	return (len + (forth_word_t)sizeof(forth_word_t) - 1) / (forth_word_t)sizeof(forth_word_t);
+}
+
+FORTH_INLINE bool forth_ispacked(forth_word_t header) {
+	return (header & 0xFF) == FORTH_PACKED_TAG;
+}
+
+/* Returns the length of the string at addr (of either kind) and sets *packed, or returns -1 if there isn't a whole
+ * string there.
+ */
+FORTH_INLINE forth_word_t forth_strheader(forth_t* forth, forth_word_t addr, bool* packed) {
+	forth_word_t avail;
+	const forth_word_t* p = forth_readable(forth, addr, &avail);
+	if (p == NULL) {
+		return -1;
+	}
+	forth_word_t h = *p;
+	forth_word_t len, size;
+	if ((h & 0xF) == FORTH_OP_PUSHSTR) {
+		len = size = h >> 4;
+		*packed = false;
+	} else if (forth_ispacked(h)) {
+		len = h >> 8;
+		size = forth_packedsize(len);
+		*packed = true;
+	} else {
+		return -1;
+	}
+	return (len < 0 || size > avail - 1) ? -1 : len;
+}
+
+/* Copies the packed string at startaddr into strout (with a zero after it), returning its length, or -1 if there
+ * isn't one or it wouldn't fit in lenout bytes.
+ */
+FORTH_INLINE forth_word_t forth_peekbytesl(forth_t* forth, forth_word_t startaddr, forth_word_t lenout, char* strout) {
+	bool packed;
+	forth_word_t len = forth_strheader(forth, startaddr, &packed);
+	if (len < 0 || !packed || len + 1 > lenout) {
+		return -1;
+	}
+	forth_word_t avail;
+	memcpy(strout, forth_readable(forth, startaddr, &avail) + 1, (size_t)len);
+	strout[len] = 0;
+	return len;
+}
+
+/* Writes a packed string at startaddr, returning the address after it, or 0 if it doesn't fit in the image (or is
+ * longer than FORTH_PACKED_MAXLEN).
+ */
+FORTH_INLINE forth_word_t forth_pokebytesl(forth_t* forth, forth_word_t startaddr, forth_word_t len, const char* str) {
+	forth_word_t size = forth_packedsize(len);
+	if (startaddr < 0 || len < 0 || len > FORTH_PACKED_MAXLEN || size >= forth->header.fsize - startaddr) {
+		return 0;
+	}
+	forth_word_t i;
+	for (i = 0; i <= size; i++) {
+		forth_gcwrite(forth, startaddr + i);
+	}
+	forth_word_t* words = forth->data.words + startaddr;
+	words[0] = forth_encode(forth, FORTH_OP_EXT, (len << 4) | FORTH_EXT_PUSHBYTES);
+	if (size > 0) {
+		words[size] = 0;
+	}
+	memcpy(words + 1, str, (size_t)len);
+	return startaddr + 1 + size;
+}
+
 FORTH_INLINE forth_word_t forth_peekstrl(forth_t* forth, forth_word_t startaddr, forth_word_t lenout, char* strout) {
 	forth_word_t h = forth_peek(forth, startaddr);
+	if (forth_ispacked(h)) {
+		return forth_peekbytesl(forth, startaddr, lenout, strout);
+	}
 	//fprintf(stderr, "Peeking string with code %x\n", h);
 	if ((h & 0xF) != 4 || (h >> 4) + 1 > lenout) {
 		return -1;
@@ -217,223 +606,1850 @@ FORTH_INLINE forth_word_t forth_pokestr(forth_t* forth, forth_word_t startaddr,
 	return forth_pokestrl(forth, startaddr, forth_strlen(forth, str), str);
 }
 
-FORTH_INLINE forth_word_t forth_allocstrl(forth_t* forth, forth_word_t len, const char* str) {
-	if (forth->header.heapnext + len + 1 > forth->header.heapend) {
-		return 0;
+FORTH_INLINE forth_word_t forth_pokebytes(forth_t* forth, forth_word_t startaddr, const char* str) {
+	return forth_pokebytesl(forth, startaddr, forth_strlen(forth, str), str);
+}
+
+/* The allocator keeps an arena reserved from the heap, with a free list for each size class. A block of class c is
+ * 2 << c words: a header word ((c << 4) | FORTH_ALLOC_USED or FORTH_ALLOC_FREE, plus the collector's mark bits) and
+ * then the caller's words (the first of which links it into its free list when it's free). The arena starts with the
+ * list heads, the collector's grey stack and a bitmap with a bit set for each word where a block starts, and blocks
+ * follow them back to back up to allocnext, where new ones are taken from. Everything is a word address inside the
+ * image, so images with an allocator can still be saved, mapped and forked.
+ */
+#ifdef FORTH_16BIT
+#define FORTH_ALLOC_CLASSES	14
+#else
+#define FORTH_ALLOC_CLASSES	24
+#endif
+#define FORTH_ALLOC_USED	1
+#define FORTH_ALLOC_FREE	2
+#define FORTH_ALLOC_MARKED	4 // Reachable, found by the collector
+#define FORTH_ALLOC_SCANNED	8 // Reachable and its words have been looked at
+#define FORTH_ALLOC_BITS	((forth_word_t)(sizeof(forth_word_t) * 8))
+
+/* Collector phases, in gcphase (see forth_gcslice). The ones from FORTH_GC_ROOTS on are marking. */
+#define FORTH_GC_IDLE		0
+#define FORTH_GC_SWEEP		1
+#define FORTH_GC_ROOTS		2
+#define FORTH_GC_INDEX		3
+#define FORTH_GC_MARK		4
+#define FORTH_GC_RESCAN		5
+#define FORTH_GC_PHASEMASK	7
+#define FORTH_GC_OVERFLOW	8 // Some grey blocks didn't fit on the grey stack, so the arena has to be rescanned
+
+FORTH_INLINE bool forth_hasalloc(forth_t* forth) {
+	return FORTH_HEADER_HAS(forth, gcrun) && forth->header.allocend != 0;
+}
+
+// The grey stack and the bitmap both get a word for every FORTH_ALLOC_BITS words of the arena.
+FORTH_INLINE forth_word_t forth_allocmapsize(forth_word_t size) {
+	return (size + FORTH_ALLOC_BITS - 1) / FORTH_ALLOC_BITS;
+}
+
+FORTH_INLINE forth_word_t forth_allocmap(forth_t* forth) {
+	return forth->header.allocstart + FORTH_ALLOC_CLASSES + forth_allocmapsize(forth->header.allocend - forth->header.allocstart);
+}
+
+// Where the first block goes, after the bitmap.
+FORTH_INLINE forth_word_t forth_allocbase(forth_t* forth) {
+	return forth_allocmap(forth) + forth_allocmapsize(forth->header.allocend - forth->header.allocstart);
+}
+
+FORTH_INLINE bool forth_allocisblock(forth_t* forth, forth_word_t block) {
+	size_t i = (size_t)(block - forth->header.allocstart);
+	return (forth->data.words[forth_allocmap(forth) + i / FORTH_ALLOC_BITS] >> (i % FORTH_ALLOC_BITS)) & 1;
+}
+
+FORTH_INLINE void forth_allocsetblock(forth_t* forth, forth_word_t block, bool isblock) {
+	size_t i = (size_t)(block - forth->header.allocstart);
+	forth_word_t* w = forth->data.words + forth_allocmap(forth) + i / FORTH_ALLOC_BITS;
+	forth_word_t bit = (forth_word_t)((uintmax_t)1 << (i % FORTH_ALLOC_BITS));
+	*w = isblock ? (*w | bit) : (*w & ~bit);
+}
+
+/* Reserves size words at heapnext for the allocator. Returns 0 on success. */
+FORTH_INLINE forth_word_t forth_enablealloc(forth_t* forth, forth_word_t size) {
+	if (!FORTH_HEADER_HAS(forth, gcrun) || forth_hasalloc(forth) || size > forth->header.heapend - forth->header.heapnext) {
+		return -1;
 	}
-	forth_word_t tmp = forth_pokestrl(forth, forth->header.heapnext, len, str);
-	if (tmp > 0) {
-		forth_word_t oldnext = forth->header.heapnext;
-		forth->header.heapnext = tmp;
-		//fprintf(stderr, "Allocated '%s' at %d with size %d\n", str, oldnext, tmp - oldnext);
-		return oldnext;
-	} else {
-		return 0;
+	forth_word_t overhead = FORTH_ALLOC_CLASSES + forth_allocmapsize(size) * 2;
+	if (size < overhead + 2) {
+		return -1;
+	}
+	forth_word_t i;
+	for (i = 0; i < overhead; i++) {
+		forth->data.words[forth->header.heapnext + i] = 0;
 	}
+	forth->header.allocstart = forth->header.heapnext;
+	forth->header.allocnext = forth->header.allocstart + overhead;
+	forth->header.allocend = forth->header.allocstart + size;
+	forth->header.heapnext = forth->header.allocend;
+	forth->header.gcphase = FORTH_GC_IDLE;
+	return 0;
 }
 
-FORTH_INLINE forth_word_t forth_allocstr(forth_t* forth, const char* str) {
-	return forth_allocstrl(forth, forth_strlen(forth, str), str);
+FORTH_INLINE bool forth_gcmarking(forth_t* forth) {
+	return FORTH_HEADER_HAS(forth, gcrun) && (forth->header.gcphase & FORTH_GC_PHASEMASK) >= FORTH_GC_ROOTS;
 }
 
-FORTH_INLINE forth_word_t forth_lookuptableaddrl(forth_t* forth, const char* name, forth_word_t len) {
-	if (len >= 100) {
-		return 0;
+/* The mark bits a new block starts with. Blocks allocated while the collector is marking are reachable as far as
+ * it's concerned, and so are blocks the sweep hasn't got to yet.
+ */
+FORTH_INLINE forth_word_t forth_gcnewmark(forth_t* forth, forth_word_t block) {
+	forth_word_t phase = forth->header.gcphase & FORTH_GC_PHASEMASK;
+	if (phase >= FORTH_GC_ROOTS) {
+		return FORTH_ALLOC_MARKED | FORTH_ALLOC_SCANNED;
 	}
-	char tmpstr[100];
-	forth_word_t tmpl;
-	forth_word_t i;
+	return (phase == FORTH_GC_SWEEP && block >= forth->header.gccursor) ? FORTH_ALLOC_MARKED : 0;
+}
 
-	for (i = forth->header.indexstart; i < forth->header.indexnext; i += 2) {
-		tmpl = forth_peekstrl(forth, forth_peek(forth, i), 100, tmpstr);
-		//fprintf(stderr, "Looking at '%s'", tmpstr);
-		if (tmpl == len) {
-			int j;
-			bool iseq = true;
-			for (j = 0; j < len; j++) {
-				if (tmpstr[j] != name[j]) {
-					iseq = false;
-				}
-			}
-			if (iseq) {
-				return i;
-			}
+// Takes a free block of class c, or returns 0 if there isn't one.
+FORTH_INLINE forth_word_t forth_alloctake(forth_t* forth, forth_word_t c) {
+	forth_word_t* words = forth->data.words;
+	forth_word_t* heads = words + forth->header.allocstart;
+	forth_word_t block = heads[c];
+	if (block != 0) {
+		heads[c] = words[block + 1];
+	} else if (forth->header.allocend - forth->header.allocnext >= ((forth_word_t)2 << c)) {
+		block = forth->header.allocnext;
+		forth->header.allocnext += (forth_word_t)2 << c;
+		forth_allocsetblock(forth, block, true);
+	} else {
+		forth_word_t d = c + 1;
+		while (d < FORTH_ALLOC_CLASSES && heads[d] == 0) {
+			d++;
+		}
+		if (d == FORTH_ALLOC_CLASSES) {
+			return 0;
+		}
+		block = heads[d];
+		heads[d] = words[block + 1];
+		while (d > c) { // Free the second half, keep the first
+			d--;
+			forth_word_t half = block + ((forth_word_t)2 << d);
+			words[half] = (d << 4) | FORTH_ALLOC_FREE;
+			words[half + 1] = heads[d];
+			heads[d] = half;
+			forth_allocsetblock(forth, half, true);
 		}
 	}
+	return block;
+}
 
-	if (forth->header.indexnext + 2 > forth->header.indexend) {
+typedef struct forth_gcstats forth_gcstats_t;
+FORTH_INLINE forth_word_t forth_gcslice(forth_t* forth, long budget, forth_gcstats_t* stats);
+
+/* Returns the address of len free words (all zero), or 0 if there isn't room (or no allocator). Apart from clearing
+ * the block, each call does a bounded amount of work: reusing a block of the right size, taking a new one from the
+ * end of the arena, or failing that splitting the smallest bigger free block. The one exception is while the
+ * collector is sweeping, since the free lists only get back the blocks it's been past: if none of those will do, the
+ * sweep carries on until one does.
+ */
+FORTH_INLINE forth_word_t forth_alloc(forth_t* forth, forth_word_t len) {
+	if (!forth_hasalloc(forth) || len < 0) {
+		return 0;
+	}
+	forth_word_t c = 0;
+	while (c < FORTH_ALLOC_CLASSES && ((forth_word_t)2 << c) - 1 < len) {
+		c++;
+	}
+	if (c == FORTH_ALLOC_CLASSES) {
 		return 0;
 	}
+	forth_word_t block;
+	while ((block = forth_alloctake(forth, c)) == 0) {
+		if (forth->header.gcphase != FORTH_GC_SWEEP || forth_gcslice(forth, 64, NULL) < 0) {
+			return 0;
+		}
+	}
+	forth_word_t* words = forth->data.words;
+	words[block] = (c << 4) | FORTH_ALLOC_USED | forth_gcnewmark(forth, block);
+	// Old addresses left in the block would keep whatever they point to alive.
+	memset(words + block + 1, 0, (((size_t)2 << c) - 1) * sizeof(forth_word_t));
+	return block + 1;
+}
 
-	if (forth_poke(forth, forth->header.indexnext, forth_allocstrl(forth, len, name))) {
+// Returns the header of the block whose words start at addr, or 0 if addr isn't one from forth_alloc.
+FORTH_INLINE forth_word_t forth_allocheader(forth_t* forth, forth_word_t addr) {
+	// Only blocks have their bit set, so the bitmap keeps out addresses before the first block too.
+	if (!forth_hasalloc(forth) || addr <= forth->header.allocstart || addr > forth->header.allocnext || !forth_allocisblock(forth, addr - 1)) {
 		return 0;
 	}
-	if (forth_poke(forth, forth->header.indexnext + 1, 0)) { // TODO: Better code to signal "not set yet" ? Maybe a function that's called in this case?
+	forth_word_t h = forth->data.words[addr - 1];
+	if ((h & 3) != FORTH_ALLOC_USED || h >> 4 < 0 || h >> 4 >= FORTH_ALLOC_CLASSES || ((forth_word_t)2 << (h >> 4)) > forth->header.allocnext - (addr - 1)) {
 		return 0;
 	}
-	forth_word_t result = forth->header.indexnext;
-	forth->header.indexnext += 2;
-	return result;
+	return h;
 }
 
-FORTH_INLINE forth_word_t forth_lookuptableaddr(forth_t* forth, const char* name) {
-	return forth_lookuptableaddrl(forth, name, forth_strlen(forth, name));
+/* Marks the block starting at addr (if there is one) as reachable, and queues it for its words to be looked at. */
+FORTH_INLINE void forth_gcshade(forth_t* forth, forth_word_t addr) {
+	forth_word_t h = forth_allocheader(forth, addr);
+	if (h == 0 || (h & FORTH_ALLOC_MARKED)) {
+		return;
+	}
+	forth->data.words[addr - 1] = h | FORTH_ALLOC_MARKED;
+	if (forth->header.gcgrey < forth_allocmapsize(forth->header.allocend - forth->header.allocstart)) {
+		forth->data.words[forth->header.allocstart + FORTH_ALLOC_CLASSES + forth->header.gcgrey++] = addr - 1;
+	} else {
+		forth->header.gcphase |= FORTH_GC_OVERFLOW;
+	}
 }
 
-FORTH_INLINE forth_word_t forth_lookupinstrl(forth_t* forth, const char* name, forth_word_t len) {
-	forth_word_t tableaddr = forth_lookuptableaddrl(forth, name, len);
-	if (tableaddr == NULL) {
-		return 0;
+/* The write barrier: call it before overwriting a word in the heap while the collector might be marking. Whatever
+ * the word pointed to stays reachable until the end of the collection, so moving the only reference to a block from
+ * the heap to the stacks can't lose it (forth_poke and the bulk operations do this already).
+ */
+FORTH_INLINE void forth_gcwrite(forth_t* forth, forth_word_t addr) {
+	if (forth_gcmarking(forth)) {
+		forth_gcshade(forth, forth->data.words[addr]);
 	}
-	return forth_peek(forth, tableaddr + 1);
 }
 
-FORTH_INLINE forth_word_t forth_lookupinstr(forth_t* forth, const char* name) {
-	return forth_lookupinstrl(forth, name, forth_strlen(forth, name));
+/* Gives back a block from forth_alloc. Returns 0 on success, or -1 if addr isn't an allocated block. */
+FORTH_INLINE forth_word_t forth_free(forth_t* forth, forth_word_t addr) {
+	forth_word_t h = forth_allocheader(forth, addr);
+	if (h == 0) {
+		return -1;
+	}
+	forth_word_t size = (forth_word_t)2 << (h >> 4);
+	forth_word_t i;
+	if (forth_gcmarking(forth) && !(h & FORTH_ALLOC_SCANNED)) { // Nothing can be lost with the block's words
+		for (i = 0; i < size - 1; i++) {
+			forth_gcshade(forth, forth->data.words[addr + i]);
+		}
+		if (forth->header.gcblock == addr - 1) {
+			forth->header.gcblock = 0;
+		}
+	}
+	forth->data.words[addr - 1] = (h & ~0xF) | FORTH_ALLOC_FREE;
+	if (forth->header.gcphase == FORTH_GC_SWEEP && addr - 1 >= forth->header.gccursor) {
+		return 0; // The sweep will put it on a free list when it gets to it
+	}
+	forth_word_t* heads = forth->data.words + forth->header.allocstart;
+	forth->data.words[addr] = heads[h >> 4];
+	heads[h >> 4] = addr - 1;
+	return 0;
 }
 
-FORTH_INLINE forth_word_t forth_setlookupinstrl(forth_t* forth, const char* name, forth_word_t len, forth_word_t instr) {
-	return forth_poke(forth, forth_lookuptableaddrl(forth, name, len) + 1, instr);
+/* Returns how many words the block at addr can hold (at least as many as were asked for), or -1 if it isn't one. */
+FORTH_INLINE forth_word_t forth_allocsize(forth_t* forth, forth_word_t addr) {
+	forth_word_t h = forth_allocheader(forth, addr);
+	return (h == 0) ? -1 : ((forth_word_t)2 << (h >> 4)) - 1;
 }
 
-FORTH_INLINE forth_word_t forth_setlookupinstr(forth_t* forth, const char* name, forth_word_t instr) {
-	return forth_setlookupinstrl(forth, name, forth_strlen(forth, name), instr);
+/* Where the allocator's arena is going, in words. Walks every block, so it's for diagnostics rather than scripts. */
+typedef struct forth_allocstats forth_allocstats_t;
+struct forth_allocstats {
+	long used;		// In allocated blocks (including their headers)
+	long free;		// In free blocks
+	long untouched;		// Never allocated yet, between allocnext and allocend
+	long blocks;		// Allocated blocks
+};
+
+FORTH_INLINE void forth_getallocstats(forth_t* forth, forth_allocstats_t* stats) {
+	stats->used = stats->free = stats->untouched = stats->blocks = 0;
+	if (!forth_hasalloc(forth)) {
+		return;
+	}
+	forth_word_t block = forth_allocbase(forth);
+	while (block < forth->header.allocnext) {
+		forth_word_t h = forth->data.words[block];
+		if (h >> 4 < 0 || h >> 4 >= FORTH_ALLOC_CLASSES) {
+			break; // Not a block, something's overwritten it
+		}
+		forth_word_t size = (forth_word_t)2 << (h >> 4);
+		if ((h & 3) == FORTH_ALLOC_USED) {
+			stats->used += size;
+			stats->blocks++;
+		} else {
+			stats->free += size;
+		}
+		block += size;
+	}
+	stats->untouched = forth->header.allocend - forth->header.allocnext;
 }
 
-FORTH_INLINE forth_word_t forth_tokentype(forth_t* forth, const char* source, forth_word_t i, forth_word_t totallen) {
-	if (i >= totallen || source[i] == 0) {
+/* Tasks let one image run several scripts that take turns, each with its own registers and stacks. A task is a
+ * record allocated from the arena, holding its registers while it isn't running, with its return and data stacks
+ * right after it (the first task, which forth_enabletasks makes from the running program, keeps the image's stacks). The running task's
+ * registers are the header's, so switching only saves its pc, rsp and dsp and loads the next task's registers and
+ * stack bounds. The tasks that can run are kept in a ring, in the order they take turns; one waiting to join another
+ * is taken out of it until the other one has returned from its block.
+ */
+#define FORTH_TASK_NEXT		0 // The next and previous tasks in the ring (0 if it isn't in it)
+#define FORTH_TASK_PREV		1
+#define FORTH_TASK_JOINER	2 // The task waiting for this one to finish, or 0
+#define FORTH_TASK_STATE	3
+#define FORTH_TASK_PC		4
+#define FORTH_TASK_RSP		5
+#define FORTH_TASK_DSP		6
+#define FORTH_TASK_RSSTART	7
+#define FORTH_TASK_RSEND	8
+#define FORTH_TASK_DSSTART	9
+#define FORTH_TASK_DSEND	10
+#define FORTH_TASK_WORDS	11 // Where a spawned task's stacks start
+
+#define FORTH_TASK_READY	0 // In the ring (the running task is too)
+#define FORTH_TASK_JOINING	1 // Waiting for another task to finish
+#define FORTH_TASK_DONE		2 // Returned from its block, and waiting to be joined
+
+FORTH_INLINE bool forth_hastasks(forth_t* forth) {
+	return FORTH_HEADER_HAS(forth, taskdsize) && forth->header.task != 0;
+}
+
+/* The collector finds the blocks that can't be reached any more and frees them, a slice at a time so it can be
+ * interleaved with running the program. It's conservative: any word on the data or return stack, in the index or in
+ * a reachable block that holds the address forth_alloc returned for a block keeps that block alive (numbers that
+ * happen to look like one just keep it a little longer). Hosts keeping addresses of their own should leave them on
+ * the data stack or in a reachable block.
+ *
+ * Marking starts from a snapshot of the stacks, then the index, then the grey stack. Blocks aren't moved, since a
+ * word that looks like an address might be a number after all. Instead, the sweep merges each run of free blocks
+ * into as few big ones as possible and hands a run at the end of the arena back to the untouched part, so the
+ * arena shrinks back to the blocks still in use.
+ */
+struct forth_gcstats {
+	long cycles;		// Collections finished
+	long slices;		// Calls to forth_gcslice that had work to do
+	long reclaimed;		// Bytes in unreachable blocks that were freed
+	long released;		// Bytes handed back to the untouched end of the arena
+	long lastpause;		// How long the last slice took, in nanoseconds
+	long maxpause;		// And the longest one
+	long long totalpause;
+};
+
+FORTH_INLINE bool forth_hasgc(forth_t* forth) {
+	return forth_hasalloc(forth);
+}
+
+/* Starts a collection, if one isn't running already. Returns 0 on success. */
+FORTH_INLINE forth_word_t forth_gcstart(forth_t* forth) {
+	if (!forth_hasgc(forth) || forth->header.gcphase != FORTH_GC_IDLE) {
 		return -1;
-	} else if (source[i] == ' ' || source[i] == '\n' || source[i] == '\t' || source[i] == '\r') {
-		return 0;
-	} else if (source[i] >= '0' && source[i] <= '9') {
-		return 1;
-	} else if (source[i] == '\"') {
-		return 2;
-	} else if ((source[i] >= 'a' && source[i] <= 'z') || (source[i] >= 'A' && source[i] <= 'Z') || (source[i] == '_')) {
-		return 3;
-	} else if (source[i] == '+' || source[i] == '-' || source[i] == '*' || source[i] == '/' || source[i] == '%' || source[i] == '=' || source[i] == '&' || source[i] == '|' || source[i] == '?' || source[i] == '!' || source[i] == ';') {
-		return 4;
-	} else if (source[i] == '[' || source[i] == ']') {
-		return 5;
-	} else {
-		return -2;
 	}
+	forth->header.gcgrey = 0;
+	forth->header.gcblock = 0;
+	forth->header.gcrun = 0;
+	forth->header.gcphase = FORTH_GC_ROOTS;
+	return 0;
 }
 
-FORTH_INLINE forth_word_t forth_tokenlength(forth_t* forth, const char* source, forth_word_t i, forth_word_t totallen) {
-	if (i >= totallen || source[i] == 0) {
-		return 0;
+// Shades the words from start up to end (or limit, if that comes first), returning how many there were.
+FORTH_INLINE long forth_gcshaderange(forth_t* forth, forth_word_t start, forth_word_t end, forth_word_t limit) {
+	long n = 0;
+	for (end = (end < limit) ? end : limit; start < end; start++, n++) {
+		forth_gcshade(forth, forth->data.words[start]);
 	}
-	forth_word_t result = 0;
-	switch (forth_tokentype(forth, source, i, totallen)) {
-	case 0:
-	case 4:
-	case 5:
-		return 1;
-	case 1:
-		while (i + result < totallen && source[i + result] >= '0' && source[i + result] <= '9') {
+	return n;
+}
+
+/* Shades what's on the stacks of the task t (which isn't running) and of the tasks waiting for it to finish, since
+ * they're all roots too. Returns how many words there were.
+ */
+FORTH_INLINE long forth_gcshadetask(forth_t* forth, forth_word_t t) {
+	const forth_word_t* words = forth->data.words;
+	long n = 0;
+	for (; t != 0; t = words[t + FORTH_TASK_JOINER]) {
+		n += forth_gcshaderange(forth, words[t + FORTH_TASK_RSSTART], words[t + FORTH_TASK_RSP], words[t + FORTH_TASK_RSEND]);
+		n += forth_gcshaderange(forth, words[t + FORTH_TASK_DSSTART], words[t + FORTH_TASK_DSP], words[t + FORTH_TASK_DSEND]);
+	}
+	return n;
+}
+
+// Frees a run of words the sweep found, as few blocks as possible.
+FORTH_INLINE void forth_gcfreerun(forth_t* forth, forth_word_t start, forth_word_t end) {
+	forth_word_t* words = forth->data.words;
+	forth_word_t* heads = words + forth->header.allocstart;
+	while (start < end) {
+		forth_word_t c = FORTH_ALLOC_CLASSES - 1;
+		while (((forth_word_t)2 << c) > end - start) {
+			c--;
+		}
+		words[start] = (c << 4) | FORTH_ALLOC_FREE;
+		words[start + 1] = heads[c];
+		heads[c] = start;
+		forth_allocsetblock(forth, start, true);
+		start += (forth_word_t)2 << c;
+	}
+}
+
+FORTH_INLINE int64_t forth_gcnow(void) {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Does up to about budget words' worth of the current collection (the first slice also looks at all of both stacks,
+ * and every task's, which has to be done in one go). Returns 1 if there's more to do, 0 once the collection has finished (or if there
+ * isn't one running), or -1 if the arena's been overwritten and the collection had to be abandoned. stats can be
+ * NULL.
+ */
+FORTH_INLINE forth_word_t forth_gcslice(forth_t* forth, long budget, forth_gcstats_t* stats) {
+	if (!forth_hasgc(forth) || forth->header.gcphase == FORTH_GC_IDLE) {
+		return 0;
+	}
+	int64_t started = (stats != NULL) ? forth_gcnow() : 0;
+	forth_header_t* hdr = &forth->header;
+	forth_word_t* words = forth->data.words;
+	forth_word_t* heads = words + hdr->allocstart;
+	forth_word_t* grey = heads + FORTH_ALLOC_CLASSES;
+	const forth_word_t* index; // Where to read the index from (an instance's is shared)
+	forth_word_t base = forth_allocbase(forth);
+	forth_word_t result = 1;
+	long reclaimed = 0;
+	long released = 0;
+	forth_word_t h;
+	forth_word_t size;
+	forth_word_t t;
+	while (budget > 0 && result == 1) {
+		if (hdr->gcblock != 0) { // Looking through the words of a grey block
+			h = words[hdr->gcblock];
+			forth_word_t end = hdr->gcblock + ((forth_word_t)2 << (h >> 4));
+			forth_word_t i = hdr->gcoffset;
+			for (; i < end && budget > 0; i++, budget--) {
+				forth_gcshade(forth, words[i]);
+			}
+			hdr->gcoffset = i;
+			if (i == end) {
+				words[hdr->gcblock] |= FORTH_ALLOC_SCANNED;
+				hdr->gcblock = 0;
+			}
+			continue;
+		}
+		switch (hdr->gcphase & FORTH_GC_PHASEMASK) {
+		case FORTH_GC_ROOTS:
+			budget -= forth_gcshaderange(forth, hdr->dsstart, hdr->dsp, hdr->dsend);
+			budget -= forth_gcshaderange(forth, hdr->rsstart, hdr->rsp, hdr->rsend);
+			if (forth_hastasks(forth)) { // And every other task's, with the ring reached from the running one
+				forth_gcshade(forth, hdr->task);
+				budget -= forth_gcshadetask(forth, words[hdr->task + FORTH_TASK_JOINER]);
+				for (t = words[hdr->task + FORTH_TASK_NEXT]; t != hdr->task; t = words[t + FORTH_TASK_NEXT]) {
+					budget -= forth_gcshadetask(forth, t);
+				}
+			}
+			hdr->gcphase += FORTH_GC_INDEX - FORTH_GC_ROOTS;
+			hdr->gccursor = hdr->indexstart;
+			break;
+		case FORTH_GC_INDEX:
+			for (index = forth_codewords(forth); hdr->gccursor < hdr->indexnext && budget > 0; hdr->gccursor++, budget--) {
+				forth_gcshade(forth, index[hdr->gccursor]);
+			}
+			if (hdr->gccursor >= hdr->indexnext) {
+				hdr->gcphase += FORTH_GC_MARK - FORTH_GC_INDEX;
+			}
+			break;
+		case FORTH_GC_MARK:
+			if (hdr->gcgrey > 0) {
+				forth_word_t block = grey[--hdr->gcgrey];
+				if ((words[block] & 3) == FORTH_ALLOC_USED && !(words[block] & FORTH_ALLOC_SCANNED)) {
+					hdr->gcblock = block;
+					hdr->gcoffset = block + 1;
+				}
+				budget--;
+			} else if (hdr->gcphase & FORTH_GC_OVERFLOW) {
+				hdr->gcphase = FORTH_GC_RESCAN;
+				hdr->gccursor = base;
+			} else { // Everything reachable is marked, the free lists get rebuilt by the sweep
+				int c;
+				for (c = 0; c < FORTH_ALLOC_CLASSES; c++) {
+					heads[c] = 0;
+				}
+				hdr->gcphase = FORTH_GC_SWEEP;
+				hdr->gccursor = base;
+				hdr->gcrun = 0;
+			}
+			break;
+		case FORTH_GC_RESCAN: // Looking for grey blocks that didn't fit on the grey stack
+		case FORTH_GC_SWEEP:
+			if (hdr->gccursor >= hdr->allocnext) {
+				if ((hdr->gcphase & FORTH_GC_PHASEMASK) == FORTH_GC_RESCAN) {
+					hdr->gcphase += FORTH_GC_MARK - FORTH_GC_RESCAN;
+					break;
+				}
+				if (hdr->gcrun != 0) {
+					released += (long)(hdr->allocnext - hdr->gcrun) * sizeof(forth_word_t);
+					hdr->allocnext = hdr->gcrun;
+				}
+				hdr->gcphase = FORTH_GC_IDLE;
+				result = 0;
+				break;
+			}
+			h = words[hdr->gccursor];
+			if (h >> 4 < 0 || h >> 4 >= FORTH_ALLOC_CLASSES || ((forth_word_t)2 << (h >> 4)) > hdr->allocnext - hdr->gccursor) {
+				hdr->gcphase = FORTH_GC_IDLE;
+				result = -1;
+				break;
+			}
+			size = (forth_word_t)2 << (h >> 4);
+			if ((hdr->gcphase & FORTH_GC_PHASEMASK) == FORTH_GC_RESCAN) {
+				if ((h & 3) == FORTH_ALLOC_USED && (h & (FORTH_ALLOC_MARKED | FORTH_ALLOC_SCANNED)) == FORTH_ALLOC_MARKED) {
+					hdr->gcblock = hdr->gccursor;
+					hdr->gcoffset = hdr->gccursor + 1;
+				}
+			} else if ((h & 3) == FORTH_ALLOC_USED && (h & FORTH_ALLOC_MARKED)) {
+				words[hdr->gccursor] = h & ~(FORTH_ALLOC_MARKED | FORTH_ALLOC_SCANNED);
+				if (hdr->gcrun != 0) {
+					forth_gcfreerun(forth, hdr->gcrun, hdr->gccursor);
+					hdr->gcrun = 0;
+				}
+			} else { // Unreachable or already free, either way it joins the current run of free blocks
+				if ((h & 3) == FORTH_ALLOC_USED) {
+					reclaimed += (long)size * sizeof(forth_word_t);
+				}
+				words[hdr->gccursor] = (h & ~0xF) | FORTH_ALLOC_FREE;
+				forth_allocsetblock(forth, hdr->gccursor, false);
+				if (hdr->gcrun == 0) {
+					hdr->gcrun = hdr->gccursor;
+				}
+			}
+			hdr->gccursor += size;
+			budget--;
+			break;
+		default:
+			hdr->gcphase = FORTH_GC_IDLE;
+			result = -1;
+		}
+	}
+	if (stats != NULL) {
+		long pause = (long)(forth_gcnow() - started);
+		stats->slices++;
+		stats->cycles += (result == 0);
+		stats->reclaimed += reclaimed;
+		stats->released += released;
+		stats->lastpause = pause;
+		stats->maxpause = (pause > stats->maxpause) ? pause : stats->maxpause;
+		stats->totalpause += pause;
+	}
+	return result;
+}
+
+/* Runs a whole collection (finishing the current one if there is one). Returns 0 on success. */
+FORTH_INLINE forth_word_t forth_gccollect(forth_t* forth, forth_gcstats_t* stats) {
+	if (!forth_hasgc(forth)) {
+		return -1;
+	}
+	if (forth->header.gcphase == FORTH_GC_IDLE && forth_gcstart(forth) != 0) {
+		return -1;
+	}
+	forth_word_t result;
+	while ((result = forth_gcslice(forth, 1L << 20, stats)) == 1) {
+	}
+	return result;
+}
+
+/* Allocator operations, as the argument of a FORTH_OP_HEAP instruction:
+ *
+ *   FORTH_HEAP_ALLOC	len -- addr		(0 if there isn't room)
+ *   FORTH_HEAP_FREE	addr --			(stops the program if addr isn't an allocated block)
+ *   FORTH_HEAP_SIZE	addr -- len		(how many words the block can hold, or -1 if it isn't one)
+ */
+#define FORTH_HEAP_ALLOC	0
+#define FORTH_HEAP_FREE		1
+#define FORTH_HEAP_SIZE		2
+#define FORTH_HEAP_COUNT	3
+
+/* Defines the allocator operations as words (heap.alloc, heap.free and heap.size). Returns 0 on success. */
+FORTH_INLINE forth_word_t forth_defineheapops(forth_t* forth);
+
+/* Gives the image tasks (see FORTH_TASK_NEXT), with the running program as the first one. Spawned tasks get rsize
+ * and dsize words for their stacks, allocated along with their records, so the image needs an allocator. The stacks
+ * can't be moved with forth_setstacks after this. Returns 0 on success.
+ */
+FORTH_INLINE forth_word_t forth_enabletasks(forth_t* forth, forth_word_t rsize, forth_word_t dsize) {
+	if (!FORTH_HEADER_HAS(forth, taskdsize) || forth->header.task != 0 || rsize < 1 || dsize < 1) {
+		return -1;
+	}
+	forth_word_t t = forth_alloc(forth, FORTH_TASK_WORDS);
+	if (t == 0) {
+		return -1;
+	}
+	forth_word_t* r = forth->data.words + t;
+	r[FORTH_TASK_NEXT] = r[FORTH_TASK_PREV] = t;
+	r[FORTH_TASK_RSSTART] = forth->header.rsstart;
+	r[FORTH_TASK_RSEND] = forth->header.rsend;
+	r[FORTH_TASK_DSSTART] = forth->header.dsstart;
+	r[FORTH_TASK_DSEND] = forth->header.dsend;
+	forth->header.task = forth->header.taskmain = t;
+	forth->header.taskrsize = rsize;
+	forth->header.taskdsize = dsize;
+	return 0;
+}
+
+// Whether t is a task made by forth_taskspawn (which hasn't been joined yet).
+FORTH_INLINE bool forth_istask(forth_t* forth, forth_word_t t) {
+	forth_word_t size = forth_allocsize(forth, t);
+	return size >= FORTH_TASK_WORDS && forth->data.words[t + FORTH_TASK_RSSTART] == t + FORTH_TASK_WORDS
+		&& forth->data.words[t + FORTH_TASK_DSEND] <= t + size && forth->data.words[t + FORTH_TASK_STATE] >= FORTH_TASK_READY
+		&& forth->data.words[t + FORTH_TASK_STATE] <= FORTH_TASK_DONE;
+}
+
+// Puts t in the ring right before at (so if at is running, t gets the last turn).
+FORTH_INLINE void forth_taskinsert(forth_t* forth, forth_word_t t, forth_word_t at) {
+	forth_word_t* words = forth->data.words;
+	forth_word_t prev = words[at + FORTH_TASK_PREV];
+	words[t + FORTH_TASK_NEXT] = at;
+	words[t + FORTH_TASK_PREV] = prev;
+	words[t + FORTH_TASK_STATE] = FORTH_TASK_READY;
+	forth_gcwrite(forth, prev + FORTH_TASK_NEXT);
+	words[prev + FORTH_TASK_NEXT] = t;
+	forth_gcwrite(forth, at + FORTH_TASK_PREV);
+	words[at + FORTH_TASK_PREV] = t;
+}
+
+// Takes t out of the ring.
+FORTH_INLINE void forth_taskremove(forth_t* forth, forth_word_t t) {
+	forth_word_t* words = forth->data.words;
+	forth_word_t next = words[t + FORTH_TASK_NEXT], prev = words[t + FORTH_TASK_PREV];
+	forth_gcwrite(forth, prev + FORTH_TASK_NEXT);
+	words[prev + FORTH_TASK_NEXT] = next;
+	forth_gcwrite(forth, next + FORTH_TASK_PREV);
+	words[next + FORTH_TASK_PREV] = prev;
+	forth_gcwrite(forth, t + FORTH_TASK_NEXT);
+	forth_gcwrite(forth, t + FORTH_TASK_PREV);
+	words[t + FORTH_TASK_NEXT] = words[t + FORTH_TASK_PREV] = 0;
+}
+
+// Makes t the running task, saving the registers of the one that was running.
+FORTH_INLINE void forth_taskswitchto(forth_t* forth, forth_word_t t) {
+	forth_header_t* h = &forth->header;
+	forth_word_t* r = forth->data.words + h->task;
+	r[FORTH_TASK_PC] = h->pc;
+	r[FORTH_TASK_RSP] = h->rsp;
+	r[FORTH_TASK_DSP] = h->dsp;
+	r = forth->data.words + t;
+	h->pc = r[FORTH_TASK_PC];
+	h->rsp = r[FORTH_TASK_RSP];
+	h->dsp = r[FORTH_TASK_DSP];
+	h->rsstart = r[FORTH_TASK_RSSTART];
+	h->rsend = r[FORTH_TASK_RSEND];
+	h->dsstart = r[FORTH_TASK_DSSTART];
+	h->dsend = r[FORTH_TASK_DSEND];
+	h->task = t;
+}
+
+/* Switches to the next task in the ring, e.g. so a host can give each task a time slice of forth_run instead of
+ * waiting for it to yield. Returns 0 on success.
+ */
+FORTH_INLINE forth_word_t forth_taskswitch(forth_t* forth) {
+	if (!forth_hastasks(forth)) {
+		return -1;
+	}
+	forth_taskswitchto(forth, forth->data.words[forth->header.task + FORTH_TASK_NEXT]);
+	return 0;
+}
+
+/* Makes a task that runs the code at block (usually a block ending in a return, which finishes the task) with arg on
+ * its data stack, and puts it last in line to run. Returns the task, or 0 if there isn't room for it.
+ */
+FORTH_INLINE forth_word_t forth_taskspawn(forth_t* forth, forth_word_t block, forth_word_t arg) {
+	if (!forth_hastasks(forth)) {
+		return 0;
+	}
+	forth_word_t rsize = forth->header.taskrsize, dsize = forth->header.taskdsize;
+	forth_word_t t = (rsize <= forth->header.fsize - dsize - FORTH_TASK_WORDS) ? forth_alloc(forth, FORTH_TASK_WORDS + rsize + dsize) : 0;
+	if (t == 0) {
+		return 0;
+	}
+	forth_word_t* r = forth->data.words + t;
+	r[FORTH_TASK_PC] = block;
+	r[FORTH_TASK_RSSTART] = r[FORTH_TASK_RSP] = t + FORTH_TASK_WORDS;
+	r[FORTH_TASK_RSEND] = r[FORTH_TASK_DSSTART] = t + FORTH_TASK_WORDS + rsize;
+	r[FORTH_TASK_DSEND] = r[FORTH_TASK_DSSTART] + dsize;
+	forth->data.words[r[FORTH_TASK_DSSTART]] = arg;
+	r[FORTH_TASK_DSP] = r[FORTH_TASK_DSSTART] + 1;
+	forth_taskinsert(forth, t, forth->header.task);
+	return t;
+}
+
+/* Task operations, as the rest of the argument of a FORTH_EXT_TASK instruction:
+ *
+ *   FORTH_TASKOP_SPAWN	arg block -- task	(forth_taskspawn, so 0 if there isn't room)
+ *   FORTH_TASKOP_YIELD	--			(lets the other tasks in the ring have a turn)
+ *   FORTH_TASKOP_JOIN	task -- result		(waits for the task to finish, then frees it and leaves the word on top of
+ *						its data stack, or 0; stops the program if it isn't a task or joining it
+ *						would wait forever)
+ *
+ * A switch only copies a few registers, so a task can yield as often as it likes (e.g. every time round a polling
+ * loop).
+ */
+#define FORTH_TASKOP_SPAWN	0
+#define FORTH_TASKOP_YIELD	1
+#define FORTH_TASKOP_JOIN	2
+#define FORTH_TASKOP_COUNT	3
+
+/* Runs a task operation for the interpreter (with its registers saved to the header and pc at the instruction),
+ * leaving the registers of whichever task runs next. Returns 0 on success.
+ */
+FORTH_INLINE forth_word_t forth_taskop(forth_t* forth, forth_word_t op) {
+	forth_header_t* h = &forth->header;
+	forth_word_t* words = forth->data.words;
+	forth_word_t t, arg, j;
+	if (!forth_hastasks(forth)) {
+		return -1;
+	}
+	switch (op) {
+	case FORTH_TASKOP_SPAWN:
+		t = forth_popdata(forth);
+		arg = forth_popdata(forth);
+		forth_pushdata(forth, forth_taskspawn(forth, t, arg));
+		h->pc++;
+		return 0;
+	case FORTH_TASKOP_YIELD:
+		h->pc++;
+		forth_taskswitchto(forth, words[h->task + FORTH_TASK_NEXT]);
+		return 0;
+	case FORTH_TASKOP_JOIN:
+		if (h->dsp <= h->dsstart || h->dsp > h->dsend || !forth_istask(forth, t = words[h->dsp - 1])) {
+			return -1;
+		}
+		if (words[t + FORTH_TASK_STATE] == FORTH_TASK_DONE) {
+			if (words[t + FORTH_TASK_JOINER] != 0 && words[t + FORTH_TASK_JOINER] != h->task) {
+				return -1;
+			}
+			words[h->dsp - 1] = (words[t + FORTH_TASK_DSP] > words[t + FORTH_TASK_DSSTART]) ? words[words[t + FORTH_TASK_DSP] - 1] : 0;
+			forth_free(forth, t);
+			h->pc++;
+			return 0;
+		}
+		// It has to be the only task waiting, and it can't be waiting for this one (or that would be forever).
+		if (words[t + FORTH_TASK_JOINER] != 0) {
+			return -1;
+		}
+		for (j = h->task; j != 0; j = words[j + FORTH_TASK_JOINER]) {
+			if (j == t) {
+				return -1;
+			}
+		}
+		// Wait out of the ring, running the join again once it's finished.
+		words[t + FORTH_TASK_JOINER] = j = h->task;
+		forth_taskswitchto(forth, words[j + FORTH_TASK_NEXT]);
+		words[j + FORTH_TASK_STATE] = FORTH_TASK_JOINING;
+		forth_taskremove(forth, j);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* Finishes the running task, which has returned from its block (the interpreter calls it with its registers saved),
+ * and switches to the task waiting to join it or else the next one. Returns 0 on success.
+ */
+FORTH_INLINE forth_word_t forth_taskend(forth_t* forth) {
+	forth_word_t* words = forth->data.words;
+	forth_word_t t = forth->header.task;
+	forth_word_t next = words[t + FORTH_TASK_NEXT];
+	forth_word_t j = words[t + FORTH_TASK_JOINER];
+	if (j != 0) {
+		forth_taskinsert(forth, j, next);
+		next = j;
+	} else if (next == t) {
+		return -1; // Nothing else can run (which can't happen while the first task is waiting for something)
+	}
+	forth_taskswitchto(forth, next);
+	words[t + FORTH_TASK_STATE] = FORTH_TASK_DONE;
+	forth_taskremove(forth, t);
+	return 0;
+}
+
+/* Defines the task operations as words (task.spawn, task.yield and task.join), once forth_enabletasks has been
+ * called. Returns 0 on success.
+ */
+FORTH_INLINE forth_word_t forth_definetaskops(forth_t* forth);
+
+/* Allocates a string, from the allocator if the image has one (so it can be freed with forth_free) or otherwise from
+ * the top of the heap.
+ */
+FORTH_INLINE forth_word_t forth_allocstrl(forth_t* forth, forth_word_t len, const char* str) {
+	if (forth_hasalloc(forth)) {
+		forth_word_t addr = forth_alloc(forth, len + 1);
+		if (addr != 0 && forth_pokestrl(forth, addr, len, str) == 0) {
+			forth_free(forth, addr);
+			return 0;
+		}
+		return addr;
+	}
+	if (forth->header.heapnext + len + 1 > forth->header.heapend) {
+		return 0;
+	}
+	forth_word_t tmp = forth_pokestrl(forth, forth->header.heapnext, len, str);
+	if (tmp > 0) {
+		forth_word_t oldnext = forth->header.heapnext;
+		forth->header.heapnext = tmp;
+		//fprintf(stderr, "Allocated '%s' at %d with size %d\n", str, oldnext, tmp - oldnext);
+		return oldnext;
+	} else {
+		return 0;
+	}
+}
+
+FORTH_INLINE forth_word_t forth_allocstr(forth_t* forth, const char* str) {
+	return forth_allocstrl(forth, forth_strlen(forth, str), str);
+}
+
+/* Allocates a packed string, like forth_allocstrl. Returns 0 if there isn't room or it's too long to pack. */
+FORTH_INLINE forth_word_t forth_allocbytesl(forth_t* forth, forth_word_t len, const char* str) {
+	if (len < 0 || len > FORTH_PACKED_MAXLEN) {
+		return 0;
+	}
+	if (forth_hasalloc(forth)) {
+		forth_word_t addr = forth_alloc(forth, 1 + forth_packedsize(len));
+		if (addr != 0 && forth_pokebytesl(forth, addr, len, str) == 0) {
+			forth_free(forth, addr);
+			return 0;
+		}
+		return addr;
+	}
+	if (forth->header.heapnext + 1 + forth_packedsize(len) > forth->header.heapend) {
+		return 0;
+	}
+	forth_word_t tmp = forth_pokebytesl(forth, forth->header.heapnext, len, str);
+	if (tmp == 0) {
+		return 0;
+	}
+	forth_word_t oldnext = forth->header.heapnext;
+	forth->header.heapnext = tmp;
+	return oldnext;
+}
+
+FORTH_INLINE forth_word_t forth_allocbytes(forth_t* forth, const char* str) {
+	return forth_allocbytesl(forth, forth_strlen(forth, str), str);
+}
+
+/* Set FORTH_ASM_PACKED in header.asmflags to have the assembler store string literals, and the names it adds to
+ * the index, as packed strings (when they aren't too long for them).
+ */
+#define FORTH_ASM_PACKED	2
+
+// Allocates a name for the index, packed if FORTH_ASM_PACKED is set.
+FORTH_INLINE forth_word_t forth_allocnamel(forth_t* forth, forth_word_t len, const char* name) {
+	if (FORTH_HEADER_HAS(forth, asmflags) && (forth->header.asmflags & FORTH_ASM_PACKED) && len <= FORTH_PACKED_MAXLEN) {
+		return forth_allocbytesl(forth, len, name);
+	}
+	return forth_allocstrl(forth, len, name);
+}
+
+/* Compares a name against a string stored in the image, without copying it out first. */
+FORTH_INLINE bool forth_namematchl(forth_t* forth, forth_word_t nameaddr, const char* name, forth_word_t len) {
+	forth_word_t avail;
+	const forth_word_t* words = forth_readable(forth, nameaddr, &avail);
+	if (words == NULL) {
+		return false;
+	}
+	if (words[0] == forth_encode(forth, FORTH_OP_EXT, (len << 4) | FORTH_EXT_PUSHBYTES)) {
+		return forth_packedsize(len) < avail && memcmp(words + 1, name, (size_t)len) == 0;
+	}
+	if (len >= avail || words[0] != ((len << 4) | 4)) {
+		return false;
+	}
+	const forth_word_t* chars = words + 1;
+	forth_word_t j;
+	for (j = 0; j < len; j++) {
+		if (chars[j] != (forth_word_t)name[j]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* FNV-1a over the name. Unpacked names hold each char in its own word, so hashing the low byte of those words
+ * gives the same result as hashing the original chars.
+ */
+FORTH_INLINE uint32_t forth_namehashl(const char* name, forth_word_t len) {
+	uint32_t h = 2166136261u;
+	forth_word_t j;
+	for (j = 0; j < len; j++) {
+		h = (h ^ (unsigned char)name[j]) * 16777619u;
+	}
+	return h;
+}
+
+FORTH_INLINE bool forth_hashashindex(forth_t* forth) {
+	return FORTH_HEADER_HAS(forth, hashsize) && forth->header.hashsize > 0;
+}
+
+/* Adds an index entry to the hash index (if there is one), given the hash of its name. Returns 0 on success. */
+FORTH_INLINE forth_word_t forth_hashinsert(forth_t* forth, forth_word_t tableaddr, uint32_t hash) {
+	if (!forth_hashashindex(forth)) {
+		return 0;
+	}
+	uint32_t mask = (uint32_t)forth->header.hashsize - 1;
+	uint32_t b = hash & mask;
+	forth_word_t n;
+	for (n = 0; n < forth->header.hashsize; n++) {
+		forth_word_t* bucket = forth->data.words + forth->header.hashstart + b;
+		if (*bucket == 0) {
+			*bucket = tableaddr;
+			return 0;
+		}
+		b = (b + 1) & mask;
+	}
+	return -1;
+}
+
+/* Rebuilds the hash index from the index table, e.g. for an image whose index was filled in by other means. */
+FORTH_INLINE forth_word_t forth_rehash(forth_t* forth) {
+	if (!forth_hashashindex(forth) || forth_isinstance(forth)) {
+		return -1;
+	}
+	forth_word_t i;
+	for (i = 0; i < forth->header.hashsize; i++) {
+		forth->data.words[forth->header.hashstart + i] = 0;
+	}
+	for (i = forth->header.indexstart; i < forth->header.indexnext; i += 2) {
+		forth_word_t nameaddr = forth_peek(forth, i);
+		bool packed;
+		forth_word_t len = forth_strheader(forth, nameaddr, &packed);
+		if (len < 0) {
+			return -1;
+		}
+		const unsigned char* bytes = (const unsigned char*)(forth->data.words + nameaddr + 1);
+		uint32_t hash = 2166136261u;
+		forth_word_t j;
+		for (j = 0; j < len; j++) {
+			hash = (hash ^ (packed ? bytes[j] : (unsigned char)forth->data.words[nameaddr + 1 + j])) * 16777619u;
+		}
+		if (forth_hashinsert(forth, i, hash) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+FORTH_INLINE forth_word_t forth_lookuptableaddrl(forth_t* forth, const char* name, forth_word_t len) {
+	forth_word_t i;
+
+	if (forth_hashashindex(forth)) {
+		const forth_word_t* buckets = forth_codewords(forth) + forth->header.hashstart;
+		uint32_t mask = (uint32_t)forth->header.hashsize - 1;
+		uint32_t b = forth_namehashl(name, len) & mask;
+		for (i = 0; i < forth->header.hashsize; i++) {
+			forth_word_t entry = buckets[b];
+			if (entry == 0) {
+				break; // Not found, add it below.
+			}
+			if (forth_namematchl(forth, forth_peek(forth, entry), name, len)) {
+				return entry;
+			}
+			b = (b + 1) & mask;
+		}
+	} else {
+		for (i = forth->header.indexstart; i < forth->header.indexnext; i += 2) {
+			if (forth_namematchl(forth, forth_peek(forth, i), name, len)) {
+				return i;
+			}
+		}
+	}
+
+	if (forth->header.indexnext + 2 > forth->header.indexend) {
+		return 0;
+	}
+
+	if (forth_poke(forth, forth->header.indexnext, forth_allocnamel(forth, len, name))) {
+		return 0;
+	}
+	if (forth_poke(forth, forth->header.indexnext + 1, 0)) { // TODO: Better code to signal "not set yet" ? Maybe a function that's called in this case?
+		return 0;
+	}
+	if (forth_hashinsert(forth, forth->header.indexnext, forth_namehashl(name, len))) {
+		return 0;
+	}
+	forth_word_t result = forth->header.indexnext;
+	forth->header.indexnext += 2;
+	return result;
+}
+
+FORTH_INLINE forth_word_t forth_lookuptableaddr(forth_t* forth, const char* name) {
+	return forth_lookuptableaddrl(forth, name, forth_strlen(forth, name));
+}
+
+FORTH_INLINE forth_word_t forth_lookupinstrl(forth_t* forth, const char* name, forth_word_t len) {
+	forth_word_t tableaddr = forth_lookuptableaddrl(forth, name, len);
+	if (tableaddr == 0) {
+		return 0;
+	}
+	return forth_peek(forth, tableaddr + 1);
+}
+
+FORTH_INLINE forth_word_t forth_lookupinstr(forth_t* forth, const char* name) {
+	return forth_lookupinstrl(forth, name, forth_strlen(forth, name));
+}
+
+/* Tail calls do the work of a call and the return right after it: instead of pushing a return address that the
+ * return pops straight away, they jump to the function, whose own return then goes back to the caller's caller
+ * (or round a '!' loop, just like the return it replaced would have). Chains of them use no return stack at all.
+ * The return is still there after them, like the second instruction of a superinstruction, and a tail call by
+ * index to anything but a function (e.g. a host call) runs like FORTH_OP_CALLINDEX and carries on into it.
+ */
+#define FORTH_TAILINDEX_TAG	((FORTH_EXT_TAILINDEX << 4) | FORTH_OP_EXT)
+
+// The address of the index entry a call by index (of either kind) reads, or -1 for any other instruction.
+FORTH_INLINE forth_word_t forth_indexcallentry(forth_word_t instr) {
+	if ((instr & 0xF) == FORTH_OP_CALLINDEX) {
+		return instr >> 4;
+	}
+	return ((instr & 0xFF) == FORTH_TAILINDEX_TAG) ? instr >> 8 : -1;
+}
+
+/* A call by index to the entry at instraddr, as a tail call if tail is set and the address fits (a tail call has 4
+ * bits less for it, so in 16-bit builds only the first 40 or so index entries can be tail called by index).
+ */
+FORTH_INLINE forth_word_t forth_encodeindexcall(forth_t* forth, forth_word_t instraddr, bool tail) {
+	if (tail && (forth_word_t)((uintmax_t)instraddr << 8) >> 8 == instraddr) {
+		return forth_encode(forth, FORTH_OP_EXT, (instraddr << 4) | FORTH_EXT_TAILINDEX);
+	}
+	return forth_encode(forth, FORTH_OP_CALLINDEX, instraddr);
+}
+
+// What a call to instr (from the index) is quickened to, at a tail call if tail is set.
+FORTH_INLINE forth_word_t forth_quickform(forth_t* forth, forth_word_t instr, bool tail) {
+	return (tail && (instr & 0xF) == FORTH_OP_CALLADDR) ? forth_encode(forth, FORTH_OP_TAILCALL, instr >> 4) : instr;
+}
+
+/* Quickening: once enabled, the first run of each FORTH_OP_CALLINDEX instruction replaces it with the
+ * FORTH_OP_CALLADDR/FORTH_OP_CALLSYS instruction (or built-in operation) found in the index, saving the lookup every
+ * time after that. Tail calls by index to a function become FORTH_OP_TAILCALL instead (and to anything else, the
+ * same as any other call, since the return after them is still there).
+ * Each patched site is logged as a (site, instruction address in the index) pair between qstart and qnext, so that
+ * forth_setlookupinstrl can re-patch the sites when a word is redefined. The log is reserved from the heap.
+ */
+FORTH_INLINE forth_word_t forth_enablequicken(forth_t* forth, forth_word_t maxsites) {
+	if (!FORTH_HEADER_HAS(forth, qend) || maxsites < 1 || forth->header.heapnext + (maxsites * 2) > forth->header.heapend) {
+		return -1;
+	}
+	forth->header.qstart = forth->header.heapnext;
+	forth->header.qnext = forth->header.qstart;
+	forth->header.qend = forth->header.qstart + (maxsites * 2);
+	forth->header.heapnext = forth->header.qend;
+	return 0;
+}
+
+/* Patches the call at site to instr (the current value of the index entry at instraddr), if quickening is
+ * enabled and there's room left to log it. Calls through anything other than an index entry's instruction (e.g. a
+ * heap cell used as a variable) are left alone, since only forth_setindexinstr re-patches sites.
+ */
+FORTH_INLINE bool forth_quicken(forth_t* forth, forth_word_t site, forth_word_t instraddr, forth_word_t instr) {
+	if (!FORTH_HEADER_HAS(forth, qend) || forth->header.qnext + 2 > forth->header.qend
+		|| instraddr <= forth->header.indexstart || instraddr >= forth->header.indexnext
+		|| (instraddr - forth->header.indexstart) % 2 != 1) {
+		return false;
+	}
+	forth->data.words[forth->header.qnext++] = site;
+	forth->data.words[forth->header.qnext++] = instraddr;
+	forth->data.words[site] = instr;
+	return true;
+}
+
+/* Updates the sites quickened from the index entry at instraddr, whose instruction is about to change from oldinstr
+ * to newinstr. Sites are re-patched if the new instruction is a direct call, otherwise they go back to being
+ * FORTH_OP_CALLINDEX (and may be quickened again later).
+ */
+FORTH_INLINE void forth_requicken(forth_t* forth, forth_word_t instraddr, forth_word_t oldinstr, forth_word_t newinstr) {
+	if (!FORTH_HEADER_HAS(forth, qend)) {
+		return;
+	}
+	bool direct = (newinstr & 0xF) == FORTH_OP_CALLADDR || (newinstr & 0xF) == FORTH_OP_CALLSYS;
+	forth_word_t i = forth->header.qstart;
+	while (i < forth->header.qnext) {
+		forth_word_t* log = forth->data.words + i;
+		forth_word_t* site = forth->data.words + log[0];
+		bool tail = *site != oldinstr && *site == forth_quickform(forth, oldinstr, true);
+		if (log[1] != instraddr) {
+			i += 2;
+		} else if (direct && (*site == oldinstr || tail)) {
+			*site = forth_quickform(forth, newinstr, tail);
+			i += 2;
+		} else {
+			if (*site == oldinstr || tail) {
+				*site = forth_encodeindexcall(forth, instraddr, tail);
+			}
+			// Drop the entry by moving the last one into its place.
+			forth->header.qnext -= 2;
+			log[0] = forth->data.words[forth->header.qnext];
+			log[1] = forth->data.words[forth->header.qnext + 1];
+		}
+	}
+}
+
+/* Turns every quickened site back into a call by index (a tail call if it was one) and empties the log (e.g. before
+ * extracting code that should stay late-bound).
+ */
+FORTH_INLINE void forth_unquicken(forth_t* forth) {
+	if (!FORTH_HEADER_HAS(forth, qend)) {
+		return;
+	}
+	forth_word_t i;
+	for (i = forth->header.qstart; i < forth->header.qnext; i += 2) {
+		forth_word_t site = forth->data.words[i];
+		forth_word_t instraddr = forth->data.words[i + 1];
+		if (forth->data.words[site] == forth->data.words[instraddr]) {
+			forth->data.words[site] = forth_encode(forth, FORTH_OP_CALLINDEX, instraddr);
+		} else if (forth->data.words[site] == forth_quickform(forth, forth->data.words[instraddr], true)) {
+			forth->data.words[site] = forth_encodeindexcall(forth, instraddr, true);
+		}
+	}
+	forth->header.qnext = forth->header.qstart;
+}
+
+/* Sets the instruction of the index entry at tableaddr (as found by forth_lookuptableaddrl). */
+FORTH_INLINE forth_word_t forth_setindexinstr(forth_t* forth, forth_word_t tableaddr, forth_word_t instr) {
+	if (forth_isinstance(forth) || tableaddr < forth->header.indexstart || tableaddr + 1 >= forth->header.indexnext
+		|| (tableaddr - forth->header.indexstart) % 2 != 0) {
+		return -1;
+	}
+	forth_requicken(forth, tableaddr + 1, forth_peek(forth, tableaddr + 1), instr);
+	if (FORTH_HEADER_HAS(forth, indexgen)) {
+		forth->header.indexgen++;
+	}
+	return forth_poke(forth, tableaddr + 1, instr);
+}
+
+FORTH_INLINE forth_word_t forth_setlookupinstrl(forth_t* forth, const char* name, forth_word_t len, forth_word_t instr) {
+	forth_word_t tableaddr = forth_isinstance(forth) ? 0 : forth_lookuptableaddrl(forth, name, len);
+	if (tableaddr == 0) {
+		return -1;
+	}
+	return forth_setindexinstr(forth, tableaddr, instr);
+}
+
+FORTH_INLINE forth_word_t forth_setlookupinstr(forth_t* forth, const char* name, forth_word_t instr) {
+	return forth_setlookupinstrl(forth, name, forth_strlen(forth, name), instr);
+}
+
+/* Bulk operations over ranges of the heap, as the argument of a FORTH_OP_BULK instruction. Each takes three operands
+ * with the number of words on top:
+ *
+ *   FORTH_BULK_FILL	value addr count --
+ *   FORTH_BULK_COPY	src dst count --		(the ranges can overlap)
+ *   FORTH_BULK_COMPARE	a b count -- result		(0 if they're equal, otherwise -1 or 1 by the first difference)
+ *   FORTH_BULK_SUM	acc addr count -- acc		(acc plus every word)
+ *   FORTH_BULK_MIN	acc addr count -- acc		(the smallest of acc and every word)
+ *   FORTH_BULK_MAX	acc addr count -- acc		(the largest of acc and every word)
+ *   FORTH_BULK_FIND	value addr count -- addr	(of the first word equal to value, or -1)
+ *
+ * Every range has to be inside heapstart..heapend.
+ */
+#define FORTH_BULK_FILL		0
+#define FORTH_BULK_COPY		1
+#define FORTH_BULK_COMPARE	2
+#define FORTH_BULK_SUM		3
+#define FORTH_BULK_MIN		4
+#define FORTH_BULK_MAX		5
+#define FORTH_BULK_FIND		6
+#define FORTH_BULK_COUNT	7
+
+// The most words a bulk operation works through in one step.
+#ifndef FORTH_BULK_CHUNK
+#define FORTH_BULK_CHUNK	1024
+#endif
+
+/* With GCC or Clang the kernels use generic vectors, which become SSE2 instructions (AVX2 with -mavx2, NEON on ARM
+ * etc.). Other compilers (or FORTH_NOVECTOR) get plain loops.
+ */
+#if defined(__GNUC__) && !defined(FORTH_NOVECTOR)
+#define FORTH_BULK_VECTOR
+#ifdef __AVX2__
+#define FORTH_BULK_VECBYTES	32
+#else
+#define FORTH_BULK_VECBYTES	16
+#endif
+#define FORTH_BULK_LANES	((forth_word_t)(FORTH_BULK_VECBYTES / sizeof(forth_word_t)))
+#if defined(FORTH_16BIT)
+typedef uint16_t forth_bulkuword_t;
+#elif defined(FORTH_64BIT)
+typedef uint64_t forth_bulkuword_t;
+#else
+typedef uint32_t forth_bulkuword_t;
+#endif
+// Unaligned, since ranges can start at any word.
+typedef forth_word_t forth_bulkvec_t __attribute__((vector_size(FORTH_BULK_VECBYTES), aligned(sizeof(forth_word_t)), may_alias));
+typedef forth_bulkuword_t forth_bulkuvec_t __attribute__((vector_size(FORTH_BULK_VECBYTES), aligned(sizeof(forth_word_t)), may_alias));
+typedef uint64_t forth_bulkbits_t __attribute__((vector_size(FORTH_BULK_VECBYTES)));
+
+FORTH_INLINE bool forth_bulkany(forth_bulkvec_t mask) {
+	forth_bulkbits_t bits = (forth_bulkbits_t)mask;
+#if FORTH_BULK_VECBYTES == 32
+	return (bits[0] | bits[1] | bits[2] | bits[3]) != 0;
+#else
+	return (bits[0] | bits[1]) != 0;
+#endif
+}
+#endif
+
+FORTH_INLINE void forth_bulkfill(forth_word_t* p, forth_word_t n, forth_word_t value) {
+	forth_word_t i = 0;
+#ifdef FORTH_BULK_VECTOR
+	forth_bulkvec_t v = (forth_bulkvec_t){ 0 } + value;
+	for (; i + FORTH_BULK_LANES <= n; i += FORTH_BULK_LANES) {
+		*(forth_bulkvec_t*)(p + i) = v;
+	}
+#endif
+	for (; i < n; i++) {
+		p[i] = value;
+	}
+}
+
+/* The scanning kernels look at four vectors at a time and leave finding the exact word to the scalar loop. */
+
+// Returns the index of the first word that differs, or n.
+FORTH_INLINE forth_word_t forth_bulkmismatch(const forth_word_t* a, const forth_word_t* b, forth_word_t n) {
+	forth_word_t i = 0;
+#ifdef FORTH_BULK_VECTOR
+	const forth_bulkvec_t* va = (const forth_bulkvec_t*)a;
+	const forth_bulkvec_t* vb = (const forth_bulkvec_t*)b;
+	for (; i + 4 * FORTH_BULK_LANES <= n; i += 4 * FORTH_BULK_LANES, va += 4, vb += 4) {
+		if (forth_bulkany((va[0] != vb[0]) | (va[1] != vb[1]) | (va[2] != vb[2]) | (va[3] != vb[3]))) {
+			break;
+		}
+	}
+#endif
+	while (i < n && a[i] == b[i]) {
+		i++;
+	}
+	return i;
+}
+
+// Returns the index of the first word equal to value, or n.
+FORTH_INLINE forth_word_t forth_bulkfind(const forth_word_t* p, forth_word_t n, forth_word_t value) {
+	forth_word_t i = 0;
+#ifdef FORTH_BULK_VECTOR
+	forth_bulkvec_t x = (forth_bulkvec_t){ 0 } + value;
+	const forth_bulkvec_t* v = (const forth_bulkvec_t*)p;
+	for (; i + 4 * FORTH_BULK_LANES <= n; i += 4 * FORTH_BULK_LANES, v += 4) {
+		if (forth_bulkany((v[0] == x) | (v[1] == x) | (v[2] == x) | (v[3] == x))) {
+			break;
+		}
+	}
+#endif
+	while (i < n && p[i] != value) {
+		i++;
+	}
+	return i;
+}
+
+// Sums the words into acc, wrapping around like '+' does.
+FORTH_INLINE forth_word_t forth_bulksum(const forth_word_t* p, forth_word_t n, forth_word_t acc) {
+	uintmax_t sum = (uintmax_t)acc;
+	forth_word_t i = 0;
+#ifdef FORTH_BULK_VECTOR
+	forth_bulkuvec_t s0 = { 0 }, s1 = { 0 }, s2 = { 0 }, s3 = { 0 };
+	const forth_bulkuvec_t* v = (const forth_bulkuvec_t*)p;
+	for (; i + 4 * FORTH_BULK_LANES <= n; i += 4 * FORTH_BULK_LANES, v += 4) {
+		s0 += v[0];
+		s1 += v[1];
+		s2 += v[2];
+		s3 += v[3];
+	}
+	s0 += s1 + s2 + s3;
+	forth_word_t j;
+	for (j = 0; j < FORTH_BULK_LANES; j++) {
+		sum += s0[j];
+	}
+#endif
+	for (; i < n; i++) {
+		sum += (uintmax_t)p[i];
+	}
+	return (forth_word_t)sum;
+}
+
+/* The smallest (or with max, largest) of acc and the words. SSE2 can't compare 64-bit words, so those are only done
+ * with vectors from SSE4.2 on.
+ */
+FORTH_INLINE forth_word_t forth_bulkminmax(const forth_word_t* p, forth_word_t n, forth_word_t acc, bool max) {
+	forth_word_t i = 0;
+#if defined(FORTH_BULK_VECTOR) && !(defined(FORTH_64BIT) && (defined(__x86_64__) || defined(__i386__)) && !defined(__SSE4_2__))
+	if (n >= 4 * FORTH_BULK_LANES) {
+		forth_bulkvec_t m[4];
+		const forth_bulkvec_t* v = (const forth_bulkvec_t*)p;
+		int k;
+		for (k = 0; k < 4; k++) {
+			m[k] = (forth_bulkvec_t){ 0 } + acc;
+		}
+		for (; i + 4 * FORTH_BULK_LANES <= n; i += 4 * FORTH_BULK_LANES, v += 4) {
+			for (k = 0; k < 4; k++) {
+				forth_bulkvec_t take = max ? (v[k] > m[k]) : (v[k] < m[k]);
+				m[k] = (v[k] & take) | (m[k] & ~take);
+			}
+		}
+		forth_word_t j;
+		for (k = 0; k < 4; k++) {
+			for (j = 0; j < FORTH_BULK_LANES; j++) {
+				acc = (max ? m[k][j] > acc : m[k][j] < acc) ? m[k][j] : acc;
+			}
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		acc = (max ? p[i] > acc : p[i] < acc) ? p[i] : acc;
+	}
+	return acc;
+}
+
+/* Runs the next chunk (up to FORTH_BULK_CHUNK words) of bulk operation op on the operands at the top of the data
+ * stack. Until it's finished, its progress is kept by updating the operands in place. Returns 1 if there's more to
+ * do, 0 when it's finished (with the operands replaced by the result, if it has one), or -1 if the operands are
+ * missing or out of range (leaving them alone).
+ */
+FORTH_INLINE forth_word_t forth_bulk(forth_t* forth, forth_word_t op) {
+	forth_word_t* words = forth->data.words;
+	forth_word_t dsp = forth->header.dsp;
+	if (op < 0 || op >= FORTH_BULK_COUNT || dsp - 3 < forth->header.dsstart || dsp > forth->header.dsend) {
+		return -1;
+	}
+	forth_word_t* operands = words + dsp - 3;
+	forth_word_t x = operands[0];
+	forth_word_t addr = operands[1];
+	forth_word_t count = operands[2];
+	forth_word_t heapstart = forth->header.heapstart;
+	forth_word_t heapend = forth->header.heapend;
+	if (count < 0 || addr < heapstart || addr > heapend || count > heapend - addr) {
+		return -1;
+	}
+	if ((op == FORTH_BULK_COPY || op == FORTH_BULK_COMPARE) && (x < heapstart || x > heapend || count > heapend - x)) {
+		return -1;
+	}
+	forth_word_t n = (count < FORTH_BULK_CHUNK) ? count : FORTH_BULK_CHUNK;
+	bool finished = n == count;
+	bool advance = true; // Whether the chunk was taken from the start of the range
+	forth_word_t i;
+	forth_word_t result = -1;
+	if ((op == FORTH_BULK_FILL || op == FORTH_BULK_COPY) && forth_gcmarking(forth)) {
+		forth_word_t dst = (op == FORTH_BULK_COPY && addr > x && addr - x < count) ? addr + count - n : addr;
+		for (i = 0; i < n; i++) {
+			forth_gcwrite(forth, dst + i);
+		}
+	}
+	switch (op) {
+	case FORTH_BULK_FILL:
+		forth_bulkfill(words + addr, n, x);
+		break;
+	case FORTH_BULK_COPY:
+		if (addr > x && addr - x < count) { // The end of the source would be overwritten first, so copy backwards
+			memmove(words + addr + count - n, words + x + count - n, (size_t)n * sizeof(forth_word_t));
+			advance = false;
+		} else {
+			memmove(words + addr, words + x, (size_t)n * sizeof(forth_word_t));
+			x += n;
+		}
+		break;
+	case FORTH_BULK_COMPARE:
+		i = forth_bulkmismatch(words + x, words + addr, n);
+		if (i < n) {
+			result = (words[x + i] < words[addr + i]) ? -1 : 1;
+			finished = true;
+		} else {
+			result = 0;
+			x += n;
+		}
+		break;
+	case FORTH_BULK_SUM:
+		x = result = forth_bulksum(words + addr, n, x);
+		break;
+	case FORTH_BULK_MIN:
+	case FORTH_BULK_MAX:
+		x = result = forth_bulkminmax(words + addr, n, x, op == FORTH_BULK_MAX);
+		break;
+	case FORTH_BULK_FIND:
+		i = forth_bulkfind(words + addr, n, x);
+		if (i < n) {
+			result = addr + i;
+			finished = true;
+		}
+		break;
+	}
+	if (!finished) {
+		operands[0] = x;
+		operands[1] = advance ? addr + n : addr;
+		operands[2] = count - n;
+		return 1;
+	}
+	if (op == FORTH_BULK_FILL || op == FORTH_BULK_COPY) {
+		forth->header.dsp = dsp - 3;
+	} else {
+		operands[0] = result;
+		forth->header.dsp = dsp - 2;
+	}
+	return 0;
+}
+
+/* Defines the bulk operations as words (bulk.fill, bulk.copy, bulk.compare, bulk.sum, bulk.min, bulk.max and
+ * bulk.find), so scripts can call them by name. Returns 0 on success.
+ */
+FORTH_INLINE forth_word_t forth_definebulkops(forth_t* forth) {
+	static const char* const names[FORTH_BULK_COUNT] = {
+		"bulk.fill", "bulk.copy", "bulk.compare", "bulk.sum", "bulk.min", "bulk.max", "bulk.find"
+	};
+	forth_word_t op;
+	for (op = 0; op < FORTH_BULK_COUNT; op++) {
+		if (forth_setlookupinstr(forth, names[op], forth_encode(forth, FORTH_OP_BULK, op)) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+FORTH_INLINE forth_word_t forth_defineheapops(forth_t* forth) {
+	static const char* const names[FORTH_HEAP_COUNT] = { "heap.alloc", "heap.free", "heap.size" };
+	forth_word_t op;
+	for (op = 0; op < FORTH_HEAP_COUNT; op++) {
+		if (forth_setlookupinstr(forth, names[op], forth_encode(forth, FORTH_OP_HEAP, op)) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+FORTH_INLINE forth_word_t forth_definetaskops(forth_t* forth) {
+	static const char* const names[FORTH_TASKOP_COUNT] = { "task.spawn", "task.yield", "task.join" };
+	forth_word_t op;
+	if (!forth_hastasks(forth)) {
+		return -1;
+	}
+	for (op = 0; op < FORTH_TASKOP_COUNT; op++) {
+		if (forth_setlookupinstr(forth, names[op], forth_encode(forth, FORTH_OP_EXT, (op << 4) | FORTH_EXT_TASK)) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Character classes for the assembler, so each character of the source only has to be looked at once. */
+#define FORTH_CHAR_BAD		0
+#define FORTH_CHAR_SPACE	1
+#define FORTH_CHAR_DIGIT	2
+#define FORTH_CHAR_QUOTE	3
+#define FORTH_CHAR_LETTER	4 // Can start a name
+#define FORTH_CHAR_DOT		5 // Can only be part of a name after its first character
+#define FORTH_CHAR_OP		6
+#define FORTH_CHAR_BRACKET	7
+
+#define FORTH_CHAR_L(c)	[c] = FORTH_CHAR_LETTER, [c - 'a' + 'A'] = FORTH_CHAR_LETTER
+
+FORTH_INLINE int forth_charclass(char c) {
+	static const unsigned char classes[256] = {
+		[' '] = FORTH_CHAR_SPACE, ['\n'] = FORTH_CHAR_SPACE, ['\t'] = FORTH_CHAR_SPACE, ['\r'] = FORTH_CHAR_SPACE,
+		['0'] = FORTH_CHAR_DIGIT, ['1'] = FORTH_CHAR_DIGIT, ['2'] = FORTH_CHAR_DIGIT, ['3'] = FORTH_CHAR_DIGIT,
+		['4'] = FORTH_CHAR_DIGIT, ['5'] = FORTH_CHAR_DIGIT, ['6'] = FORTH_CHAR_DIGIT, ['7'] = FORTH_CHAR_DIGIT,
+		['8'] = FORTH_CHAR_DIGIT, ['9'] = FORTH_CHAR_DIGIT,
+		['\"'] = FORTH_CHAR_QUOTE,
+		FORTH_CHAR_L('a'), FORTH_CHAR_L('b'), FORTH_CHAR_L('c'), FORTH_CHAR_L('d'), FORTH_CHAR_L('e'), FORTH_CHAR_L('f'),
+		FORTH_CHAR_L('g'), FORTH_CHAR_L('h'), FORTH_CHAR_L('i'), FORTH_CHAR_L('j'), FORTH_CHAR_L('k'), FORTH_CHAR_L('l'),
+		FORTH_CHAR_L('m'), FORTH_CHAR_L('n'), FORTH_CHAR_L('o'), FORTH_CHAR_L('p'), FORTH_CHAR_L('q'), FORTH_CHAR_L('r'),
+		FORTH_CHAR_L('s'), FORTH_CHAR_L('t'), FORTH_CHAR_L('u'), FORTH_CHAR_L('v'), FORTH_CHAR_L('w'), FORTH_CHAR_L('x'),
+		FORTH_CHAR_L('y'), FORTH_CHAR_L('z'), ['_'] = FORTH_CHAR_LETTER,
+		['.'] = FORTH_CHAR_DOT,
+		['+'] = FORTH_CHAR_OP, ['-'] = FORTH_CHAR_OP, ['*'] = FORTH_CHAR_OP, ['/'] = FORTH_CHAR_OP, ['%'] = FORTH_CHAR_OP,
+		['='] = FORTH_CHAR_OP, ['&'] = FORTH_CHAR_OP, ['|'] = FORTH_CHAR_OP, ['?'] = FORTH_CHAR_OP, ['!'] = FORTH_CHAR_OP,
+		[';'] = FORTH_CHAR_OP,
+		['['] = FORTH_CHAR_BRACKET, [']'] = FORTH_CHAR_BRACKET
+	};
+	return classes[(unsigned char)c];
+}
+
+#undef FORTH_CHAR_L
+
+// Whether a character can be part of a name after its first character.
+FORTH_INLINE bool forth_charinname(char c) {
+	int cls = forth_charclass(c);
+	return cls == FORTH_CHAR_LETTER || cls == FORTH_CHAR_DIGIT || cls == FORTH_CHAR_DOT;
+}
+
+FORTH_INLINE forth_word_t forth_tokentype(forth_t* forth, const char* source, forth_word_t i, forth_word_t totallen) {
+	static const signed char types[] = {
+		[FORTH_CHAR_BAD] = -2, [FORTH_CHAR_SPACE] = 0, [FORTH_CHAR_DIGIT] = 1, [FORTH_CHAR_QUOTE] = 2,
+		[FORTH_CHAR_LETTER] = 3, [FORTH_CHAR_DOT] = -2, [FORTH_CHAR_OP] = 4, [FORTH_CHAR_BRACKET] = 5
+	};
+	if (i >= totallen || source[i] == 0) {
+		return -1;
+	}
+	return types[forth_charclass(source[i])];
+}
+
+FORTH_INLINE forth_word_t forth_tokenlength(forth_t* forth, const char* source, forth_word_t i, forth_word_t totallen) {
+	if (i >= totallen || source[i] == 0) {
+		return 0;
+	}
+	forth_word_t result = 1;
+	switch (forth_charclass(source[i])) {
+	case FORTH_CHAR_SPACE:
+	case FORTH_CHAR_OP:
+	case FORTH_CHAR_BRACKET:
+		return 1;
+	case FORTH_CHAR_DIGIT:
+		while (i + result < totallen && forth_charclass(source[i + result]) == FORTH_CHAR_DIGIT) {
+			result++;
+		}
+		break;
+	case FORTH_CHAR_QUOTE:
+		while (i + result < totallen && source[i + result] != '\"') {
 			result++;
 		}
-		break;
-	case 2:
-		result = 1;
-		while (i + result < totallen && source[i + result] != '\"') {
-			result++;
+		if (i + result < totallen) {
+			result++;
+		} else {
+			return 0;
+		}
+		break;
+	case FORTH_CHAR_LETTER:
+		while (i + result < totallen && forth_charinname(source[i + result])) {
+			result++;
+		}
+		break;
+	default:
+		return 0;
+	}
+
+	return result;
+}
+
+FORTH_INLINE forth_word_t forth_tokenmemorysize(forth_t* forth, const char* source, forth_word_t i, forth_word_t totallen) {
+	switch (forth_tokentype(forth, source, i, totallen)) {
+	case 0:
+		return 0;
+	case 1:
+	case 3:
+	case 4:
+	case 5:
+		return 1;
+	case 2:
+		return forth_tokenlength(forth, source, i, totallen) - 1;
+	default:
+		return 0;
+	}
+}
+
+FORTH_INLINE forth_word_t forth_simpleopcode(char c) {
+	forth_word_t i;
+	for (i = 0; i < FORTH_SIMPLEOPCOUNT; i++) {
+		if (FORTH_SIMPLEOPS[i] == c) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Dense instructions (FORTH_EXT_DENSE) pack runs of simple ops and numbers into 4-bit slots, filled from bit 8 up
+ * (so 2 slots in 16-bit builds, 6 in 32-bit and 14 in 64-bit ones), and the whole run takes one step. Each slot is:
+ *
+ *   0				the end of the run (the rest of the slots are empty too)
+ *   1 to FORTH_SIMPLEOPCOUNT	a simple op, by its code plus one ('?' can only be the last one)
+ *   FORTH_DENSE_SMALL		push the number (0 to 15) in the next slot
+ *   FORTH_DENSE_WIDE		push the next of the whole words right after the instruction, for numbers of any size
+ *
+ * so "1 2 + 3 *" takes a single word, and any wide numbers follow it (the next instruction comes after them).
+ */
+#define FORTH_DENSE_SMALL	14
+#define FORTH_DENSE_WIDE	15
+#define FORTH_DENSE_TAG		((FORTH_EXT_DENSE << 4) | FORTH_OP_EXT)
+#define FORTH_DENSE_SLOTS	((int)sizeof(forth_word_t) * 2 - 2)
+
+FORTH_INLINE bool forth_isdense(forth_word_t instr) {
+	return (instr & 0xFF) == FORTH_DENSE_TAG;
+}
+
+// The code in one of the slots of a dense instruction.
+FORTH_INLINE int forth_denseslot(forth_word_t instr, int slot) {
+	return (int)((instr >> (8 + 4 * slot)) & 0xF);
+}
+
+/* Returns how many slots a dense instruction uses, setting *wide to how many words of numbers follow it, or -1 if it
+ * has a '?' before its last op or ends in the middle of a small number.
+ */
+FORTH_INLINE int forth_densecount(forth_word_t instr, forth_word_t* wide) {
+	int slot;
+	*wide = 0;
+	for (slot = 0; slot < FORTH_DENSE_SLOTS && forth_denseslot(instr, slot) != 0; slot++) {
+		switch (forth_denseslot(instr, slot)) {
+		case FORTH_DENSE_SMALL:
+			if (++slot == FORTH_DENSE_SLOTS) {
+				return -1;
+			}
+			break;
+		case FORTH_DENSE_WIDE:
+			(*wide)++;
+			break;
+		case FORTH_SIMPLEOPCOUNT: // '?'
+			if (slot + 1 < FORTH_DENSE_SLOTS && forth_denseslot(instr, slot + 1) != 0) {
+				return -1;
+			}
+			break;
+		}
+	}
+	return slot;
+}
+
+/* Set FORTH_ASM_PEEPHOLE in header.asmflags to have the assembler fuse common pairs of instructions. */
+#define FORTH_ASM_PEEPHOLE	1
+/* Set FORTH_ASM_DENSE to have it pack simple ops and numbers into dense instructions instead. It keeps adding to the
+ * last one until it's full or something else is assembled, so call forth_asmseal before assembling code that's
+ * going to start running at codenext (forth_asmend does).
+ */
+#define FORTH_ASM_DENSE		4
+
+// Counts a rewrite by the peephole pass or forth_asmtail, if the header has room for the counter.
+#define FORTH_ASM_COUNT(forth,field) do { if (FORTH_HEADER_HAS(forth, field)) { (forth)->header.field++; } } while (0)
+
+/* Records the address of the instruction the assembler just emitted (and of the block it closed, if it was a ']'). */
+FORTH_INLINE void forth_asmnote(forth_t* forth, forth_word_t instraddr, forth_word_t closedblock) {
+	if (FORTH_HEADER_HAS(forth, asmblock)) {
+		forth->header.asmlast = instraddr;
+		forth->header.asmblock = closedblock;
+	}
+}
+
+/* The peephole pass, called once the assembler has stored instr at codenext (so a superinstruction never does the
+ * work of an instruction that couldn't be assembled). If the previous instruction is right before it, that
+ * instruction is replaced by a superinstruction doing the work of both:
+ *
+ *   number then simple op	-> FORTH_OP_PUSHOP (literal << 8) | (op code << 4)
+ *   simple op then simple op	-> FORTH_OP_OPOP (second op code << 8) | (first op code << 4), first op isn't '?'
+ *   '[' ... ']' then '!'	-> the block's FORTH_OP_PUSHBLOCK becomes FORTH_OP_BLOCKLOOP
+ *
+ * The second instruction is still emitted as normal and a superinstruction skips over it, so code that jumps or
+ * starts running there (like the REPL does after assembling each line) still works.
+ */
+FORTH_INLINE void forth_peephole(forth_t* forth, forth_word_t instr) {
+	if (!FORTH_HEADER_HAS(forth, asmblock) || (forth->header.asmflags & FORTH_ASM_PEEPHOLE) == 0) {
+		return;
+	}
+	forth_word_t prevaddr = forth->header.asmlast;
+	if (prevaddr < forth->header.codestart || prevaddr != forth->header.codenext - 1 || prevaddr >= forth->header.fsize) {
+		return;
+	}
+	forth_word_t prev = forth->data.words[prevaddr];
+	if ((instr & 0xF) == FORTH_OP_SIMPLE) {
+		forth_word_t code = forth_simpleopcode((char)(instr >> 4));
+		if (code < 0) {
+			return;
+		}
+		// Shifted as unsigned (like forth_asmnumber does), since the number can be negative or not fit.
+		forth_word_t shifted = (forth_word_t)((uintmax_t)(prev >> 4) << 8);
+		if ((prev & 0xF) == FORTH_OP_PUSHINT && (shifted >> 8) == (prev >> 4)) {
+			forth->data.words[prevaddr] = shifted | (code << 4) | FORTH_OP_PUSHOP;
+			FORTH_ASM_COUNT(forth, fusedpushop);
+		} else if ((prev & 0xF) == FORTH_OP_SIMPLE) {
+			forth_word_t prevcode = forth_simpleopcode((char)(prev >> 4));
+			if (prevcode >= 0 && FORTH_SIMPLEOPS[prevcode] != '?') {
+				forth->data.words[prevaddr] = (code << 8) | (prevcode << 4) | FORTH_OP_OPOP;
+				FORTH_ASM_COUNT(forth, fusedopop);
+			}
+		}
+	} else if (instr == FORTH_OP_LOOP && prev == FORTH_OP_CONTROL) {
+		forth_word_t blockaddr = forth->header.asmblock;
+		if (blockaddr >= forth->header.codestart && blockaddr < prevaddr && forth->data.words[blockaddr] == ((forth->header.codenext << 4) | FORTH_OP_PUSHBLOCK)) {
+			forth->data.words[blockaddr] = (forth->header.codenext << 4) | FORTH_OP_BLOCKLOOP;
+			FORTH_ASM_COUNT(forth, fusedblockloop);
+		}
+	}
+}
+
+/* Set FORTH_ASM_TAILCALL in header.asmflags to have the assembler turn calls right before a return (a ';' or the end
+ * of a block) into tail calls. Calls that are tail calls don't show up on the return stack, e.g. to forth_prof.h.
+ */
+#define FORTH_ASM_TAILCALL	8
+
+// Called once the assembler has stored a return at codenext, to make the call right before it a tail call.
+FORTH_INLINE void forth_asmtail(forth_t* forth) {
+	if (!FORTH_HEADER_HAS(forth, asmblock) || (forth->header.asmflags & FORTH_ASM_TAILCALL) == 0) {
+		return;
+	}
+	forth_word_t prevaddr = forth->header.asmlast;
+	if (prevaddr < forth->header.codestart || prevaddr != forth->header.codenext - 1 || prevaddr >= forth->header.fsize) {
+		return;
+	}
+	forth_word_t prev = forth->data.words[prevaddr];
+	forth_word_t tail = prev;
+	if ((prev & 0xF) == FORTH_OP_CALLINDEX) {
+		tail = forth_encodeindexcall(forth, prev >> 4, true);
+	} else if ((prev & 0xF) == FORTH_OP_CALLADDR) { // Quickened since it was assembled
+		tail = forth_quickform(forth, prev, true);
+	}
+	if (tail != prev) {
+		forth->data.words[prevaddr] = tail;
+		FORTH_ASM_COUNT(forth, tailcalls);
+	}
+}
+
+/* How many pairs the peephole pass has fused into each kind of superinstruction, and how many calls the assembler
+ * has made into tail calls. They're counted as the assembler makes them, so code that was loaded already fused (e.g.
+ * from a module) or has since been written over doesn't change them.
+ */
+typedef struct forth_peepholestats forth_peepholestats_t;
+struct forth_peepholestats {
+	long pushop;
+	long opop;
+	long blockloop;
+	long tailcalls;
+};
+
+FORTH_INLINE void forth_getpeepholestats(forth_t* forth, forth_peepholestats_t* stats) {
+	bool has = FORTH_HEADER_HAS(forth, tailcalls);
+	stats->pushop = has ? (long)forth->header.fusedpushop : 0;
+	stats->opop = has ? (long)forth->header.fusedopop : 0;
+	stats->blockloop = has ? (long)forth->header.fusedblockloop : 0;
+	stats->tailcalls = has ? (long)forth->header.tailcalls : 0;
+}
+
+/* Emitting each kind of token, for forth_assemble and the streaming assembler. They return 0 on success. */
+FORTH_INLINE forth_word_t forth_asmemit(forth_t* forth, forth_word_t instr) {
+	if (forth_poke(forth, forth->header.codenext, instr)) {
+		return -1;
+	}
+	forth_peephole(forth, instr);
+	if (instr == FORTH_OP_CONTROL) {
+		forth_asmtail(forth);
+	}
+	forth_asmnote(forth, forth->header.codenext, 0);
+	forth->header.codenext++;
+	return 0;
+}
+
+/* Starts the next instruction the assembler emits in a new word, rather than in the dense instruction it's filling. */
+FORTH_INLINE void forth_asmseal(forth_t* forth) {
+	if (FORTH_HEADER_HAS(forth, asmblock) && (forth->header.asmflags & FORTH_ASM_DENSE)) {
+		forth->header.asmlast = -1;
+	}
+}
+
+/* Returns the address of the dense instruction the assembler's filling if it has n more slots free (and didn't end
+ * with a '?'), setting *used to how many it's used, or returns -1.
+ */
+FORTH_INLINE forth_word_t forth_asmdenseopen(forth_t* forth, int n, int* used) {
+	forth_word_t addr = forth->header.asmlast;
+	forth_word_t wide;
+	if (addr < forth->header.codestart || addr >= forth->header.codenext || !forth_isdense(forth->data.words[addr])) {
+		return -1;
+	}
+	*used = forth_densecount(forth->data.words[addr], &wide);
+	if (*used < 0 || *used + n > FORTH_DENSE_SLOTS || addr + 1 + wide != forth->header.codenext
+		|| (*used > 0 && forth_denseslot(forth->data.words[addr], *used - 1) == FORTH_SIMPLEOPCOUNT)) {
+		return -1;
+	}
+	return addr;
+}
+
+/* Puts n slots (the first in the lowest 4 bits of slots) in the dense instruction being filled, or in a new one. */
+FORTH_INLINE forth_word_t forth_asmdense(forth_t* forth, forth_word_t slots, int n) {
+	int used = 0;
+	forth_word_t addr = forth_asmdenseopen(forth, n, &used);
+	if (addr < 0) {
+		if (forth_asmemit(forth, FORTH_DENSE_TAG)) {
+			return -1;
+		}
+		addr = forth->header.codenext - 1;
+		used = 0;
+	}
+	return forth_poke(forth, addr, (forth_word_t)((uintmax_t)forth->data.words[addr] | ((uintmax_t)slots << (8 + 4 * used))));
+}
+
+// Adds a digit to a number being parsed (wrapping around like the instructions do).
+FORTH_INLINE forth_word_t forth_asmdigit(forth_word_t number, char c) {
+	return (forth_word_t)((uintmax_t)number * 10 + (uintmax_t)(c - '0'));
+}
+
+/* Numbers that don't fit in a FORTH_OP_PUSHINT (or would just as well go in the dense instruction being filled) are
+ * wide numbers in dense code.
+ */
+FORTH_INLINE forth_word_t forth_asmnumber(forth_t* forth, forth_word_t number) {
+	int used;
+	if (FORTH_HEADER_HAS(forth, asmblock) && (forth->header.asmflags & FORTH_ASM_DENSE)) {
+		if (number >= 0 && number < 16) {
+			return forth_asmdense(forth, (number << 4) | FORTH_DENSE_SMALL, 2);
 		}
-		if (source[i + result] == '\"') {
-			result++;
-		} else {
+		if ((forth_word_t)((uintmax_t)number << 4) >> 4 != number || forth_asmdenseopen(forth, 1, &used) >= 0) {
+			if (forth_asmdense(forth, FORTH_DENSE_WIDE, 1) || forth_poke(forth, forth->header.codenext, number)) {
+				return -1;
+			}
+			forth->header.codenext++;
 			return 0;
 		}
-		break;
-	case 3:
-		while (i + result < totallen && (source[i + result] >= 'a' && source[i + result] <= 'z') || (source[i + result] >= 'A' && source[i + result] <= 'Z') || (source[i + result] >= '0' && source[i + result] <= '9') || (source[i + result] == '_') || (source[i + result] == '.')) {
-			result++;
-		}
-		break;
-	default:
-		return 0;
 	}
+	return forth_asmemit(forth, (forth_word_t)((uintmax_t)number << 4));
+}
 
-	return result;
+FORTH_INLINE forth_word_t forth_asmname(forth_t* forth, const char* name, forth_word_t len) {
+	forth_word_t tableaddr = forth_lookuptableaddrl(forth, name, len);
+	if (tableaddr <= 0) {
+		return -1;
+	}
+	return forth_asmemit(forth, ((tableaddr + 1) << 4) | FORTH_OP_CALLINDEX);
 }
 
-FORTH_INLINE forth_word_t forth_tokenmemorysize(forth_t* forth, const char* source, forth_word_t i, forth_word_t totallen) {
-	switch (forth_tokentype(forth, source, i, totallen)) {
-	case 0:
-		return 0;
-	case 1:
-	case 3:
-	case 4:
-	case 5:
-		return 1;
-	case 2:
-		return forth_tokenlength(forth, source, i, totallen) - 1;
-	default:
-		return 0;
+// A simple op, with special handling of ! and ;
+FORTH_INLINE forth_word_t forth_asmop(forth_t* forth, char c) {
+	forth_word_t instr = (c == '!') ? FORTH_OP_LOOP : (c == ';') ? FORTH_OP_CONTROL : (((forth_word_t)c) << 4) | FORTH_OP_SIMPLE;
+	forth_word_t code = forth_simpleopcode(c);
+	if (code >= 0 && FORTH_HEADER_HAS(forth, asmblock) && (forth->header.asmflags & FORTH_ASM_DENSE)) {
+		return forth_asmdense(forth, code + 1, 1);
 	}
+	return forth_asmemit(forth, instr);
 }
 
+FORTH_INLINE forth_word_t forth_asmbracket(forth_t* forth, char c) {
+	if (c == '[') {
+		forth_pushasm(forth, forth->header.codenext);
+		forth_poke(forth, forth->header.codenext, FORTH_OP_PUSHBLOCK);
+		forth_asmnote(forth, forth->header.codenext, 0);
+		forth->header.codenext++;
+	} else { // ']'
+		if (forth_poke(forth, forth->header.codenext, FORTH_OP_CONTROL) == 0) { // Add a return statement
+			forth_asmtail(forth);
+		}
+		forth_word_t startaddr = forth_popasm(forth);
+		forth_asmnote(forth, forth->header.codenext, startaddr);
+		forth->header.codenext++;
+		forth_poke(forth, startaddr, (forth->header.codenext << 4) | FORTH_OP_PUSHBLOCK); // Patch end address
+	}
+	return 0;
+}
+
+/* Assembles the token at source[i], returning its length, or 0 at the end of the source or if it couldn't be
+ * assembled. See forth_asmfeed for assembling a whole file in chunks.
+ */
 FORTH_INLINE forth_word_t forth_assemble(forth_t* forth, const char* source, forth_word_t i, forth_word_t totallen) {
 	forth_word_t len = forth_tokenlength(forth, source, i, totallen);
 	forth_word_t tmp = 0;
-	char tmpchar[20];
-	switch (forth_tokentype(forth, source, i, totallen)) {
-	case 0: // Whitespace
+	forth_word_t number = 0;
+	if (len == 0) {
+		return 0;
+	}
+	switch (forth_charclass(source[i])) {
+	case FORTH_CHAR_SPACE:
 		break;
-	case 1: // Number
-		for (tmp = 0; tmp <= len; tmp++) {
-			if (tmp < len) {
-				tmpchar[tmp] = source[i + tmp];
-			} else {
-				tmpchar[tmp] = 0;
-			}
+	case FORTH_CHAR_DIGIT: // Number
+		for (tmp = 0; tmp < len; tmp++) {
+			number = forth_asmdigit(number, source[i + tmp]);
 		}
-		if (forth_poke(forth, forth->header.codenext, atoi((const char*)tmpchar) << 4)) {
+		if (forth_asmnumber(forth, number)) {
 			return 0;
 		}
-		forth->header.codenext++;
 		break;
-	case 2: // String
-		tmp = forth_pokestrl(forth, forth->header.codenext, len - 2, source + i + 1);
+	case FORTH_CHAR_QUOTE: // String
+		if (FORTH_HEADER_HAS(forth, asmflags) && (forth->header.asmflags & FORTH_ASM_PACKED) && len - 2 <= FORTH_PACKED_MAXLEN) {
+			tmp = forth_pokebytesl(forth, forth->header.codenext, len - 2, source + i + 1);
+		} else {
+			tmp = forth_pokestrl(forth, forth->header.codenext, len - 2, source + i + 1);
+		}
 		if (tmp == 0) {
 			return 0;
 		} else {
+			forth_asmnote(forth, forth->header.codenext, 0);
 			forth->header.codenext = tmp;
 		}
 		break;
-	case 3: // Name
-		tmp = forth_lookuptableaddrl(forth, source + i, len);
-		if (tmp > 0) {
-			if (forth_poke(forth, forth->header.codenext, ((tmp + 1) << 4) | 7)) {
-				//fprintf(stderr, "Failed to store within index\n");
-				return 0;
-			}
-			//fprintf(stderr, "Put a %x at %d\n", ((tmp + 1) << 4) | 7, forth->header.codenext);
-			forth->header.codenext++;
-		} else {
-			//fprintf(stderr, "Failed to index\n");
+	case FORTH_CHAR_LETTER: // Name
+		if (forth_asmname(forth, source + i, len)) {
 			return 0;
 		}
 		break;
-	case 4: // Simple op, with special handling of ! and ;
-		if (forth_poke(forth, forth->header.codenext, (source[i] == '!' ? (9) : (source[i] == ';' ? (6) : (((int)source[i]) << 4) | 5)))) {
+	case FORTH_CHAR_OP:
+		if (forth_asmop(forth, source[i])) {
 			return 0;
-		} else {
-			forth->header.codenext++;
 		}
 		break;
-	case 5: // '[' ... ']'
-		if (source[i] == '[') {
-			forth_pushasm(forth, forth->header.codenext);
-			forth_poke(forth, forth->header.codenext, 8);
-			forth->header.codenext++;
-		} else { // ']'
-			forth_poke(forth, forth->header.codenext, 6); // Add a return statement
-			forth->header.codenext++;
-			forth_word_t startaddr = forth_popasm(forth);
-			forth_poke(forth, startaddr, (forth->header.codenext << 4) | 8); // Patch end address
-		}
+	case FORTH_CHAR_BRACKET: // '[' ... ']'
+		forth_asmbracket(forth, source[i]);
 		break;
 	default:
 		return 0;
@@ -441,148 +2457,895 @@ FORTH_INLINE forth_word_t forth_assemble(forth_t* forth, const char* source, for
 	return len;
 }
 
-#define FORTH_OP_PUSHINT	0
-#define FORTH_OP_CALLADDR	1
-#define FORTH_OP_CALLSYS	2
-#define FORTH_OP_PUSHSTR	4
-#define FORTH_OP_SIMPLE		5
-#define FORTH_OP_CONTROL	6
-#define FORTH_OP_CALLINDEX	7
+/* The streaming assembler takes the source in chunks of any size, split anywhere (even in the middle of a token or
+ * a string), and assembles it as it goes exactly like forth_assemble would assemble all of it at once. Start with
+ * forth_asmbegin, call forth_asmfeed for each chunk, then forth_asmend at the end of the source (which assembles
+ * a number or name it ended with). Names split between chunks can't be longer than FORTH_ASM_MAXNAME.
+ */
+#define FORTH_ASM_MAXNAME	256
 
-FORTH_INLINE forth_word_t forth_encode(forth_t* forth, forth_word_t opcode, forth_word_t arg) {
-	return (arg << 4) | opcode;
+typedef struct forth_asmstream forth_asmstream_t;
+struct forth_asmstream {
+	int state;		// The class of the token the last chunk ended in the middle of, or FORTH_CHAR_SPACE
+	forth_word_t number;	// The number so far
+	forth_word_t strnext;	// Where the next character of a string goes
+	forth_word_t strbytes;	// How many bytes of a packed string there are so far, or -1 if it isn't packed
+	int namelen;
+	long pos;		// Bytes fed so far
+	long tokenpos;		// Where the last token started
+	long errorpos;		// Where the token that couldn't be assembled started, or -1
+	char name[FORTH_ASM_MAXNAME];	// The name so far, if it's split between chunks
+};
+
+FORTH_INLINE void forth_asmbegin(forth_asmstream_t* stream) {
+	stream->state = FORTH_CHAR_SPACE;
+	stream->number = 0;
+	stream->strnext = 0;
+	stream->strbytes = -1;
+	stream->namelen = 0;
+	stream->pos = 0;
+	stream->tokenpos = 0;
+	stream->errorpos = -1;
 }
 
-FORTH_INLINE forth_word_t forth_step(forth_t* forth, forth_callback_t callback, void* udata) {
-	if (forth->header.pc < forth->header.codestart || forth->header.pc >= forth->header.codenext) {
+/* Turns the packed string the stream is in the middle of (one too long to pack) back into a character per word,
+ * working back from the end so the bytes aren't overwritten before they're moved.
+ */
+FORTH_INLINE forth_word_t forth_asmunpack(forth_t* forth, forth_asmstream_t* stream) {
+	forth_word_t start = forth->header.codenext + 1;
+	forth_word_t j;
+	if (start + stream->strbytes > forth->header.fsize) {
 		return -1;
 	}
-	forth_word_t instr = forth->data.words[forth->header.pc];
-	forth_word_t result = 0;
-
-	switch (instr & 0xF) {
-	case 0: // Push integer value
-		forth_pushdata(forth, instr >> 4);
-		forth->header.pc++;
-		break;
-	case 1: // Call already-known function
-		forth_pushreturn(forth, forth->header.pc);
-		forth->header.pc = instr >> 4;
-		break;
-	case 2: // Call system function
-		result = callback(forth, udata, instr >> 4);
-		if (result == 0) {
-			// A system function can return non-zero to pause the interpreter for later execution. In this case the same instruction will run again.
-			// But normally, we return to the following instruction.
-			forth->header.pc++;
+	for (j = stream->strbytes - 1; j >= 0; j--) {
+		forth_word_t c = (char)((char*)(forth->data.words + start))[j];
+		if (forth_poke(forth, start + j, c)) {
+			return -1;
 		}
-		break;
-	case 4: // Push inline string
-		//fprintf(stderr, "Pushing string %d\n", forth->header.pc);
-		forth_pushdata(forth, forth->header.pc);
-		forth->header.pc++;
-		forth->header.pc += instr >> 4;
-		//fprintf(stderr, "Done %d\n", forth->header.pc);
-		break;
-	case 5: { // Simple op
-		forth_word_t rhs = forth_popdata(forth);
-		forth_word_t lhs = forth_popdata(forth);
-		forth_word_t res = 0;
-		char c = (char)(instr >> 4);
-		switch (c) {
-		case '+':
-			res = lhs + rhs;
-			break;
-		case '-':
-			res = lhs - rhs;
-			break;
-		case '*':
-			res = lhs * rhs;
+	}
+	stream->strnext = start + stream->strbytes;
+	stream->strbytes = -1;
+	return 0;
+}
+
+/* Assembles the next len bytes of the source. Returns 0 on success, or -1 if a token couldn't be assembled (with its
+ * position in the source in stream->errorpos), after which the stream has to be started again with forth_asmbegin.
+ */
+FORTH_INLINE forth_word_t forth_asmfeed(forth_t* forth, forth_asmstream_t* stream, const char* chunk, long len) {
+	long i = 0;
+	long start;
+	forth_word_t tmp;
+	if (stream->errorpos >= 0) {
+		return -1;
+	}
+	while (i < len) {
+		switch (stream->state) {
+		case FORTH_CHAR_SPACE: // Between tokens
+			stream->tokenpos = stream->pos + i;
+			switch (forth_charclass(chunk[i])) {
+			case FORTH_CHAR_SPACE:
+				i++;
+				break;
+			case FORTH_CHAR_DIGIT:
+				stream->state = FORTH_CHAR_DIGIT;
+				stream->number = 0;
+				break;
+			case FORTH_CHAR_QUOTE:
+				stream->state = FORTH_CHAR_QUOTE;
+				stream->strnext = forth->header.codenext + 1;
+				stream->strbytes = (FORTH_HEADER_HAS(forth, asmflags) && (forth->header.asmflags & FORTH_ASM_PACKED)) ? 0 : -1;
+				i++;
+				break;
+			case FORTH_CHAR_LETTER:
+				start = i++;
+				while (i < len && forth_charinname(chunk[i])) {
+					i++;
+				}
+				if (i < len) { // The whole name is in this chunk
+					if (forth_asmname(forth, chunk + start, (forth_word_t)(i - start))) {
+						goto fail;
+					}
+				} else {
+					stream->state = FORTH_CHAR_LETTER;
+					stream->namelen = 0;
+					i = start;
+				}
+				break;
+			case FORTH_CHAR_OP:
+				if (forth_asmop(forth, chunk[i])) {
+					goto fail;
+				}
+				i++;
+				break;
+			case FORTH_CHAR_BRACKET:
+				forth_asmbracket(forth, chunk[i]);
+				i++;
+				break;
+			default:
+				goto fail;
+			}
 			break;
-		case '/':
-			res = lhs / rhs;
+		case FORTH_CHAR_DIGIT:
+			while (i < len && forth_charclass(chunk[i]) == FORTH_CHAR_DIGIT) {
+				stream->number = forth_asmdigit(stream->number, chunk[i]);
+				i++;
+			}
+			if (i < len) {
+				if (forth_asmnumber(forth, stream->number)) {
+					goto fail;
+				}
+				stream->state = FORTH_CHAR_SPACE;
+			}
 			break;
-		case '%':
-			res = lhs % rhs;
+		case FORTH_CHAR_QUOTE:
+			while (i < len && chunk[i] != '\"') {
+				if (stream->strbytes >= 0) { // Packed, a byte at a time into the words after the header
+					if (stream->strbytes % (forth_word_t)sizeof(forth_word_t) == 0 && forth_poke(forth, stream->strnext++, 0)) {
+						goto fail;
+					}
+					((char*)(forth->data.words + forth->header.codenext + 1))[stream->strbytes++] = chunk[i];
+				} else if (forth_poke(forth, stream->strnext++, chunk[i])) {
+					goto fail;
+				}
+				i++;
+			}
+			if (i < len) {
+				i++; // The closing quote
+				if (stream->strbytes > FORTH_PACKED_MAXLEN && forth_asmunpack(forth, stream)) {
+					goto fail;
+				}
+				if (stream->strbytes >= 0) {
+					tmp = forth_encode(forth, FORTH_OP_EXT, (stream->strbytes << 4) | FORTH_EXT_PUSHBYTES);
+				} else {
+					tmp = ((stream->strnext - forth->header.codenext - 1) << 4) | FORTH_OP_PUSHSTR;
+				}
+				if (forth_poke(forth, forth->header.codenext, tmp)) {
+					goto fail;
+				}
+				forth_asmnote(forth, forth->header.codenext, 0);
+				forth->header.codenext = stream->strnext;
+				stream->state = FORTH_CHAR_SPACE;
+			}
 			break;
-		case 'R':
-			res = lhs >> rhs;
+		case FORTH_CHAR_LETTER:
+			while (i < len && (stream->namelen == 0 || forth_charinname(chunk[i]))) { // The first one is a letter
+				if (stream->namelen == FORTH_ASM_MAXNAME) {
+					goto fail;
+				}
+				stream->name[stream->namelen++] = chunk[i++];
+			}
+			if (i < len) {
+				if (forth_asmname(forth, stream->name, stream->namelen)) {
+					goto fail;
+				}
+				stream->state = FORTH_CHAR_SPACE;
+			}
 			break;
-		case 'L':
-			res = lhs << rhs;
+		}
+	}
+	stream->pos += len;
+	return 0;
+fail:
+	stream->errorpos = stream->tokenpos;
+	return -1;
+}
+
+/* Finishes the source, assembling the number or name it might have ended with. Returns 0 on success or -1 if that
+ * couldn't be assembled or the source ended in the middle of a string. The stream can be used for more source
+ * afterwards.
+ */
+FORTH_INLINE forth_word_t forth_asmend(forth_t* forth, forth_asmstream_t* stream) {
+	forth_word_t result = 0;
+	if (stream->errorpos >= 0) {
+		return -1;
+	}
+	switch (stream->state) {
+	case FORTH_CHAR_DIGIT:
+		result = forth_asmnumber(forth, stream->number);
+		break;
+	case FORTH_CHAR_LETTER:
+		result = forth_asmname(forth, stream->name, stream->namelen);
+		break;
+	case FORTH_CHAR_QUOTE:
+		result = -1;
+		break;
+	}
+	forth_asmseal(forth);
+	stream->state = FORTH_CHAR_SPACE;
+	if (result != 0) {
+		stream->errorpos = stream->tokenpos;
+	}
+	return result;
+}
+
+/* Results of forth_run, besides the -1 (error or ran off the end of the code) and 1 (call to an unset index entry)
+ * it shares with forth_step.
+ */
+#define FORTH_RUN_BUDGET	0 // Ran all of the allowed steps, can be resumed
+#define FORTH_RUN_PAUSED	2 // A callback returned non-zero, the same call will run again when resumed
+#define FORTH_RUN_WAITING	3 // A callback parked it with forth_park, it carries on after forth_complete
+
+/* Asynchronous host calls. Rather than have the same call retried until it can finish, a callback can park the VM
+ * with forth_park and return non-zero. forth_run then returns FORTH_RUN_WAITING (straight away, until the call is
+ * completed), and once the host has the call's results (e.g. when its I/O finishes) it passes them to forth_complete
+ * with the number forth_park returned. That pushes them and moves on to the instruction after the call. See
+ * forth_async.h for running lots of VMs like this from an event loop.
+ */
+FORTH_INLINE bool forth_iswaiting(forth_t* forth) {
+	return FORTH_HEADER_HAS(forth, waiting) && forth->header.waiting != 0;
+}
+
+/* Parks the VM in the callback that's running (which then has to return non-zero). Returns the number to complete
+ * the call with, which is different every time (until it wraps around), or -1 if the header is too old to park.
+ */
+FORTH_INLINE forth_word_t forth_park(forth_t* forth) {
+	if (!FORTH_HEADER_HAS(forth, waiting)) {
+		return -1;
+	}
+	forth->header.waitseq = (forth_word_t)(((uintmax_t)forth->header.waitseq + 1) & (((uintmax_t)1 << (sizeof(forth_word_t) * 8 - 1)) - 1));
+	forth->header.waiting = 1;
+	return forth->header.waitseq;
+}
+
+/* Completes the call the VM is parked in, pushing the n results. Returns 0, or -1 if it isn't waiting for seq (e.g.
+ * that call was already completed) or there isn't room for the results, in which case nothing changes. It can also
+ * be called from the callback that parked it, and forth_run then carries on after the call when it's resumed.
+ */
+FORTH_INLINE forth_word_t forth_complete(forth_t* forth, forth_word_t seq, const forth_word_t* values, int n) {
+	if (!forth_iswaiting(forth) || forth->header.waitseq != seq || n < 0 || forth->header.dsp < forth->header.dsstart
+		|| forth->header.dsend - forth->header.dsp < n) {
+		return -1;
+	}
+	int i;
+	for (i = 0; i < n; i++) {
+		forth_pushdata(forth, values[i]);
+	}
+	forth->header.pc++;
+	forth->header.waiting = 0;
+	return 0;
+}
+
+/* Native functions. Instead of sending every host call through one callback that pops its arguments one at a time,
+ * a host can register a function for each sysnum, saying how many arguments it takes and results it leaves. Run
+ * with forth_nativecallback as the callback and the registry as udata: then forth_run checks the stack once for the
+ * whole call and hands the function its arguments where they are (deepest first), and the function writes its
+ * results over them. Leaf functions only do that (they can read and write the rest of the image, but can't push,
+ * pop, pause or change the header), so they're called without even saving the registers. Sysnums without a function
+ * go to the fallback callback, as do calls whose arguments or results don't fit on the stack (the function then gets
+ * -1 for any argument that's missing, as if it had popped them, and results that don't fit are dropped). Any other
+ * way of running an image (e.g. forth_jitrun) just gets the slower path through forth_nativecallback.
+ */
+#define FORTH_NATIVE_MAXARGS	8 // Most arguments or results a native function can have
+
+typedef void (*forth_leaffn_t)(forth_t* forth, void* udata, forth_word_t* args);
+// Returns non-zero to pause like a callback (and be called again, unless it parked the VM with forth_park).
+typedef bool (*forth_nativefn_t)(forth_t* forth, void* udata, forth_word_t* args);
+
+typedef struct forth_native forth_native_t;
+typedef struct forth_natives forth_natives_t;
+
+struct forth_native {
+	forth_leaffn_t leaf;
+	forth_nativefn_t fn;
+	void* udata;
+	int nargs;
+	int nresults;
+};
+
+struct forth_natives {
+	forth_native_t* table;	// Indexed by sysnum
+	int size;
+	forth_callback_t fallback;
+	void* udata;		// For the fallback
+};
+
+/* Starts a registry for sysnums 0 to size - 1 in table (which it clears). The fallback can be NULL if every sysnum
+ * the code calls is registered, and calls to any other one then do nothing.
+ */
+FORTH_INLINE void forth_nativeinit(forth_natives_t* natives, forth_native_t* table, int size, forth_callback_t fallback, void* udata) {
+	natives->table = table;
+	natives->size = size;
+	natives->fallback = fallback;
+	natives->udata = udata;
+	memset(table, 0, (size_t)size * sizeof(forth_native_t));
+}
+
+FORTH_INLINE forth_word_t forth_nativeset(forth_natives_t* natives, int sysnum, int nargs, int nresults, forth_leaffn_t leaf, forth_nativefn_t fn, void* udata) {
+	if (sysnum < 0 || sysnum >= natives->size || nargs < 0 || nargs > FORTH_NATIVE_MAXARGS || nresults < 0 || nresults > FORTH_NATIVE_MAXARGS
+		|| (leaf == NULL && fn == NULL)) {
+		return -1;
+	}
+	forth_native_t* n = natives->table + sysnum;
+	n->leaf = leaf;
+	n->fn = fn;
+	n->udata = udata;
+	n->nargs = nargs;
+	n->nresults = nresults;
+	return 0;
+}
+
+// Registers a leaf function for sysnum. Returns 0 on success.
+FORTH_INLINE forth_word_t forth_nativeleaf(forth_natives_t* natives, int sysnum, int nargs, int nresults, forth_leaffn_t fn, void* udata) {
+	return forth_nativeset(natives, sysnum, nargs, nresults, fn, NULL, udata);
+}
+
+// Registers any other function for sysnum. Returns 0 on success.
+FORTH_INLINE forth_word_t forth_nativebind(forth_natives_t* natives, int sysnum, int nargs, int nresults, forth_nativefn_t fn, void* udata) {
+	return forth_nativeset(natives, sysnum, nargs, nresults, NULL, fn, udata);
+}
+
+// Gives sysnum a name in the index, so scripts can call it.
+FORTH_INLINE forth_word_t forth_nativename(forth_t* forth, const char* name, int sysnum) {
+	return forth_setlookupinstr(forth, name, forth_encode(forth, FORTH_OP_CALLSYS, sysnum));
+}
+
+/* The function registered for sysnum, if its arguments and results fit on a data stack with dsp as its top, or NULL. */
+FORTH_INLINE const forth_native_t* forth_nativefits(const forth_natives_t* natives, forth_word_t sysnum, forth_word_t dsp, forth_word_t dsstart, forth_word_t dsend) {
+	if (sysnum < 0 || sysnum >= natives->size) {
+		return NULL;
+	}
+	const forth_native_t* n = natives->table + sysnum;
+	if ((n->leaf == NULL && n->fn == NULL) || dsp - n->nargs < dsstart || dsp > dsend
+		|| dsp - n->nargs + (n->nresults > n->nargs ? n->nresults : n->nargs) > dsend) {
+		return NULL;
+	}
+	return n;
+}
+
+/* Calls a function that fits (see forth_nativefits) on the data stack in the header. */
+FORTH_INLINE bool forth_nativecall(forth_t* forth, const forth_native_t* n) {
+	forth_word_t* args = forth->data.words + forth->header.dsp - n->nargs;
+	if (n->leaf != NULL) {
+		n->leaf(forth, n->udata, args);
+		forth->header.dsp += n->nresults - n->nargs;
+		return false;
+	}
+	forth_word_t seq = forth->header.waitseq;
+	forth_word_t dsp = forth->header.dsp;
+	bool pause = n->fn(forth, n->udata, args);
+	if (!pause) {
+		forth->header.dsp += n->nresults - n->nargs;
+	} else if (forth_iswaiting(forth)) { // Its results come from forth_complete
+		forth->header.dsp -= n->nargs;
+	} else if (FORTH_HEADER_HAS(forth, waiting) && forth->header.waitseq != seq && forth->header.dsp >= dsp) {
+		// It parked and completed the call itself, which pushed the results on top of the arguments.
+		memmove(args, forth->data.words + dsp, (size_t)(forth->header.dsp - dsp) * sizeof(forth_word_t));
+		forth->header.dsp -= n->nargs;
+	}
+	return pause;
+}
+
+/* The callback to run with a registry as udata. */
+FORTH_INLINE bool forth_nativecallback(forth_t* forth, void* udata, int sysnum) {
+	forth_natives_t* natives = udata;
+	const forth_native_t* n = forth_nativefits(natives, sysnum, forth->header.dsp, forth->header.dsstart, forth->header.dsend);
+	if (n != NULL) {
+		return forth_nativecall(forth, n);
+	}
+	if (sysnum < 0 || sysnum >= natives->size || (natives->table[sysnum].leaf == NULL && natives->table[sysnum].fn == NULL)) {
+		return natives->fallback != NULL && natives->fallback(forth, natives->udata, sysnum);
+	}
+	// It doesn't fit, so pop and push one at a time like any other callback.
+	n = natives->table + sysnum;
+	forth_word_t args[FORTH_NATIVE_MAXARGS];
+	forth_word_t saved[FORTH_NATIVE_MAXARGS];
+	int i;
+	for (i = n->nargs - 1; i >= 0; i--) {
+		args[i] = saved[i] = forth_popdata(forth);
+	}
+	bool pause = false;
+	forth_word_t seq = forth->header.waitseq;
+	if (n->leaf != NULL) {
+		n->leaf(forth, n->udata, args);
+	} else {
+		pause = n->fn(forth, n->udata, args);
+	}
+	if (pause && !forth_iswaiting(forth) && (!FORTH_HEADER_HAS(forth, waiting) || forth->header.waitseq == seq)) {
+		// It'll be called again, so put back the arguments it popped (including any that were missing).
+		for (i = 0; i < n->nargs; i++) {
+			forth_word_t at = forth->header.dsp++;
+			if (at >= forth->header.dsstart && at < forth->header.dsend) {
+				forth->data.words[at] = saved[i];
+			}
+		}
+	}
+	for (i = 0; i < n->nresults && !pause; i++) {
+		forth_pushdata(forth, args[i]);
+	}
+	return pause;
+}
+
+/* Define FORTH_THREADED to have forth_run dispatch through a table of computed goto labels (GCC and Clang only,
+ * other compilers quietly get the switch). Every handler then ends in its own dispatch and each simple-op
+ * character gets its own handler, so the branch predictor can learn sequences of instructions. The portable
+ * switch is used otherwise. Both engines leave exactly the same images behind.
+ */
+#if defined(FORTH_THREADED) && defined(__GNUC__)
+#define FORTH_USE_THREADED
+#endif
+
+/* Define FORTH_TOSCACHE to have forth_run keep the top of the data stack in a local (so usually a register) instead
+ * of in the image. A simple op then reads one word of the stack and writes none, where otherwise it reads two and
+ * writes one. The top is written back to the image whenever the host can see it (around callbacks and hooks, and
+ * when forth_run returns), so it leaves the same stacks behind (as long as they haven't run into each other), but
+ * the words above the top of the data stack (which have already been popped) can be different.
+ */
+
+/* A hook for forth_runhooked. It's called with the registers saved to the header whenever execution is about to
+ * carry on at a new pc after a call, a return or the start of a loop iteration (e.g. so a JIT compiler can take
+ * over from there). It can run up to maxsteps instructions itself, storing how many in *used, and returns
+ * FORTH_RUN_BUDGET to carry on interpreting from the header's registers or anything else to stop with that result.
+ */
+typedef forth_word_t (*forth_hook_t)(forth_t* forth, void* hookdata, forth_callback_t callback, void* udata, long maxsteps, long* used);
+
+/* Same as forth_run, but calls hook (if it isn't NULL) at calls, returns and loops. */
+FORTH_INLINE forth_word_t forth_runhooked(forth_t* forth, forth_callback_t callback, void* udata, long maxsteps, long* stepsout, forth_hook_t hook, void* hookdata) {
+	if (forth_isinstance(forth) && forth_sharedsegment(forth) == NULL) { // Loaded, but not linked to its segment yet
+		if (stepsout != NULL) {
+			*stepsout = 0;
+		}
+		return -1;
+	}
+	forth_word_t* words = forth->data.words;
+	// Instructions and index entries are read from code, which is only different for instances.
+	const forth_word_t* code = forth_codewords(forth);
+	forth_word_t codebase = forth_isinstance(forth) ? forth->header.sharedstart : 0;
+	// Host calls go straight to the native functions (when they fit) if they're registered.
+	const forth_natives_t* natives = (callback == &forth_nativecallback) ? udata : NULL;
+	const forth_native_t* native;
+	forth_word_t pc, rsp, dsp;
+	forth_word_t codelimit, codestart, codenext, rsstart, rsend, dsstart, dsend;
+	forth_word_t instr, tmp, lhs, rhs, res;
+	int slot;
+#ifdef FORTH_TOSCACHE
+	forth_word_t tos = 0, popped;
+#endif
+	forth_word_t status = FORTH_RUN_BUDGET;
+	long steps = 0;
+
+#ifdef FORTH_TOSCACHE
+	/* While the data stack isn't empty, tos is the word at dsp - 1 (the one in the image is out of date, the words
+	 * under it aren't). FORTH_RUN_POP2 pops two words without reloading tos, so it has to be followed by
+	 * FORTH_RUN_PUSHRES (or FORTH_RUN_FILL if that doesn't happen).
+	 */
+#define FORTH_RUN_FILL() ((dsp > dsstart && dsp <= dsend) ? (void)(tos = words[dsp - 1]) : (void)0)
+#define FORTH_RUN_SPILL() ((dsp > dsstart && dsp <= dsend) ? (void)(words[dsp - 1] = tos) : (void)0)
+#define FORTH_RUN_PUSHD(v) do { \
+		forth_word_t forth_pushv = (v); \
+		if (dsp >= dsstart && dsp < dsend) { \
+			if (dsp > dsstart) { words[dsp - 1] = tos; } \
+			tos = forth_pushv; \
+			dsp++; \
+		} \
+	} while (0)
+#define FORTH_RUN_POPD() (--dsp, (dsp >= dsstart && dsp < dsend) ? (popped = tos, FORTH_RUN_FILL(), popped) : -1)
+#define FORTH_RUN_POP2() do { \
+		if (dsp - 2 >= dsstart && dsp <= dsend) { \
+			rhs = tos; \
+			lhs = words[dsp - 2]; \
+			dsp -= 2; \
+		} else { \
+			rhs = FORTH_RUN_POPD(); \
+			lhs = FORTH_RUN_POPD(); \
+		} \
+	} while (0)
+#define FORTH_RUN_PUSHRES() do { \
+		if (dsp >= dsstart && dsp < dsend) { \
+			tos = res; \
+			dsp++; \
+		} else { \
+			FORTH_RUN_FILL(); \
+		} \
+	} while (0)
+#else
+#define FORTH_RUN_FILL() ((void)0)
+#define FORTH_RUN_SPILL() ((void)0)
+	// These behave exactly like forth_pushdata/forth_popdata etc. (including how they fail) but on the locals.
+#define FORTH_RUN_PUSHD(v) do { forth_word_t forth_pushv = (v); if (dsp >= dsstart && dsp < dsend) { words[dsp++] = forth_pushv; } } while (0)
+#define FORTH_RUN_POPD() (--dsp, (dsp >= dsstart && dsp < dsend) ? words[dsp] : -1)
+#define FORTH_RUN_POP2() (rhs = FORTH_RUN_POPD(), lhs = FORTH_RUN_POPD())
+#define FORTH_RUN_PUSHRES() FORTH_RUN_PUSHD(res)
+#endif
+#define FORTH_RUN_LOAD() ( \
+		pc = forth->header.pc, rsp = forth->header.rsp, dsp = forth->header.dsp, \
+		codelimit = forth_codelimit(forth), codestart = forth->header.codestart, codenext = forth->header.codenext, \
+		rsstart = forth->header.rsstart, rsend = forth->header.rsend, dsstart = forth->header.dsstart, dsend = forth->header.dsend, \
+		FORTH_RUN_FILL())
+#define FORTH_RUN_SAVE() (FORTH_RUN_SPILL(), forth->header.pc = pc, forth->header.rsp = rsp, forth->header.dsp = dsp)
+#define FORTH_RUN_PUSHR(v) do { forth_word_t forth_pushv = (v); if (rsp >= rsstart && rsp < rsend) { words[rsp++] = forth_pushv; } } while (0)
+#define FORTH_RUN_POPR() (--rsp, (rsp >= rsstart && rsp < rsend) ? words[rsp] : -1)
+#define FORTH_RUN_CALLBACK(sysnum) (FORTH_RUN_SAVE(), tmp = callback(forth, udata, (sysnum)), FORTH_RUN_LOAD(), tmp)
+#define FORTH_RUN_FAIL(s) do { status = (s); goto done; } while (0)
+	// A host call, which pauses if it returns non-zero.
+#define FORTH_RUN_SYS(sysnum) do { \
+		native = (natives != NULL) ? forth_nativefits(natives, (sysnum), dsp, dsstart, dsend) : NULL; \
+		if (native != NULL && native->leaf != NULL) { \
+			FORTH_RUN_SPILL(); \
+			native->leaf(forth, native->udata, words + dsp - native->nargs); \
+			dsp += native->nresults - native->nargs; \
+			FORTH_RUN_FILL(); \
+		} else if (native != NULL) { \
+			FORTH_RUN_SAVE(); \
+			tmp = forth_nativecall(forth, native); \
+			FORTH_RUN_LOAD(); \
+			if (tmp != 0) { FORTH_RUN_PAUSE(); } \
+		} else if (FORTH_RUN_CALLBACK(sysnum) != 0) { \
+			FORTH_RUN_PAUSE(); \
+		} \
+	} while (0)
+	// After a callback returns non-zero.
+#define FORTH_RUN_PAUSE() FORTH_RUN_FAIL(forth_iswaiting(forth) ? FORTH_RUN_WAITING : FORTH_RUN_PAUSED)
+#define FORTH_RUN_HOOK() do { \
+		if (hook != NULL) { \
+			long forth_hookused = 0; \
+			FORTH_RUN_SAVE(); \
+			tmp = hook(forth, hookdata, callback, udata, maxsteps - steps, &forth_hookused); \
+			steps += forth_hookused; \
+			FORTH_RUN_LOAD(); \
+			if (tmp != FORTH_RUN_BUDGET) { FORTH_RUN_FAIL(tmp); } \
+		} \
+	} while (0)
+	// The simple ops, as (character, name, code) for FORTH_RUN_SIMPLE and FORTH_RUN_CALC.
+#define FORTH_RUN_SIMPLEOPS(X) \
+	X('+', add, res = lhs + rhs) \
+	X('-', sub, res = lhs - rhs) \
+	X('*', mul, res = lhs * rhs) \
+	X('/', div, res = lhs / rhs) \
+	X('%', mod, res = lhs % rhs) \
+	X('R', shr, res = lhs >> rhs) \
+	X('L', shl, res = lhs << rhs) \
+	X('=', eq, res = (lhs == rhs) ? -1 : 0) \
+	X('A', and, res = (lhs && rhs) ? -1 : 0) \
+	X('O', or, res = (lhs || rhs) ? -1 : 0) \
+	X('&', bitand, res = lhs & rhs) \
+	X('|', bitor, res = lhs | rhs) \
+	/* Quick conditional jump, if lhs != 0 then jump to rhs (pc will be +1 again at end!) */ \
+	X('?', cond, res = 0; if (lhs != 0) { pc = rhs - 1; })
+#define FORTH_RUN_CALC(c, name, code) case c: code; break;
+	// Checks the budget and pc and fetches the next instruction (the rest of the dispatch depends on the engine).
+#define FORTH_RUN_FETCH() do { \
+		if (steps >= maxsteps) { goto done; } \
+		if (pc < codestart || pc >= codenext) { FORTH_RUN_FAIL(-1); } \
+		instr = code[pc]; \
+		steps++; \
+	} while (0)
+
+#ifdef FORTH_USE_THREADED
+	/* Handlers 0-15 are the opcodes, the simple ops follow them. forth_simplecode maps a character to its
+	 * handler's offset from FORTH_OP_SIMPLE, or to 0 for unknown characters (which op_simple rejects).
+	 */
+	static const void* const optable[] = {
+		&&op_pushint, &&op_calladdr, &&op_callsys, &&op_tailcall, &&op_pushstr, &&op_simple, &&op_control, &&op_callindex,
+		&&op_pushblock, &&op_loop, &&op_pushop, &&op_opop, &&op_blockloop, &&op_bulk, &&op_heap, &&op_ext,
+		&&simple_add, &&simple_sub, &&simple_mul, &&simple_div, &&simple_mod, &&simple_shr, &&simple_shl,
+		&&simple_eq, &&simple_and, &&simple_or, &&simple_bitand, &&simple_bitor, &&simple_cond
+	};
+	static const unsigned char forth_simplecode[256] = {
+		['+'] = 11, ['-'] = 12, ['*'] = 13, ['/'] = 14, ['%'] = 15, ['R'] = 16, ['L'] = 17,
+		['='] = 18, ['A'] = 19, ['O'] = 20, ['&'] = 21, ['|'] = 22, ['?'] = 23
+	};
+#define FORTH_RUN_NEXT() do { \
+		FORTH_RUN_FETCH(); \
+		tmp = instr & 0xF; \
+		goto *optable[tmp + (-(tmp == FORTH_OP_SIMPLE) & forth_simplecode[(unsigned char)(instr >> 4)])]; \
+	} while (0)
+	// Runs the simple op in instr without fetching it (used by the superinstructions).
+#define FORTH_RUN_SIMPLEDISPATCH() goto *optable[FORTH_OP_SIMPLE + forth_simplecode[(unsigned char)(instr >> 4)]]
+#define FORTH_RUN_OP(opcode, name) op_##name:
+#define FORTH_RUN_OPDEFAULT() // Every opcode has a handler
+#define FORTH_RUN_SIMPLEBEGIN() goto simple_bad;
+#define FORTH_RUN_SIMPLE(c, name, code) \
+	simple_##name: \
+		FORTH_RUN_POP2(); \
+		code; \
+		FORTH_RUN_PUSHRES(); \
+		pc++; \
+		FORTH_RUN_NEXT();
+#define FORTH_RUN_SIMPLEEND() \
+	simple_bad: \
+		(void)FORTH_RUN_POPD(); \
+		(void)FORTH_RUN_POPD(); \
+		FORTH_RUN_FAIL(-1);
+#else
+#define FORTH_RUN_NEXT() goto next
+#define FORTH_RUN_SIMPLEDISPATCH() goto simple_entry
+#define FORTH_RUN_OP(opcode, name) case opcode:
+#define FORTH_RUN_OPDEFAULT() default:
+#define FORTH_RUN_SIMPLEBEGIN() \
+	simple_entry: \
+		FORTH_RUN_POP2(); \
+		switch ((char)(instr >> 4)) {
+#define FORTH_RUN_SIMPLE FORTH_RUN_CALC
+#define FORTH_RUN_SIMPLEEND() \
+		default: \
+			FORTH_RUN_FILL(); \
+			FORTH_RUN_FAIL(-1); \
+		} \
+		FORTH_RUN_PUSHRES(); \
+		pc++; \
+		FORTH_RUN_NEXT();
+#endif
+
+	FORTH_RUN_LOAD();
+	if (forth_iswaiting(forth)) {
+		FORTH_RUN_FAIL(FORTH_RUN_WAITING);
+	}
+
+#ifdef FORTH_USE_THREADED
+	FORTH_RUN_NEXT();
+	{
+#else
+next:
+	FORTH_RUN_FETCH();
+	switch (instr & 0xF) {
+#endif
+	FORTH_RUN_OP(0, pushint) // Push integer value
+		FORTH_RUN_PUSHD(instr >> 4);
+		pc++;
+		FORTH_RUN_NEXT();
+	FORTH_RUN_OP(1, calladdr) // Call already-known function
+		FORTH_RUN_PUSHR(pc);
+		pc = instr >> 4;
+		FORTH_RUN_HOOK();
+		FORTH_RUN_NEXT();
+	FORTH_RUN_OP(2, callsys) // Call system function
+		// A system function can return non-zero to pause the interpreter for later execution. In this case the same instruction will run again
+		// (unless it parked the VM, see forth_park).
+		FORTH_RUN_SYS(instr >> 4);
+		// But normally, we return to the following instruction.
+		pc++;
+		FORTH_RUN_NEXT();
+	FORTH_RUN_OP(3, tailcall) // Call already-known function, and return from this one when it does
+		pc = instr >> 4;
+		FORTH_RUN_HOOK();
+		FORTH_RUN_NEXT();
+	FORTH_RUN_OP(4, pushstr) // Push inline string
+		FORTH_RUN_PUSHD(pc);
+		pc++;
+		pc += instr >> 4;
+		FORTH_RUN_NEXT();
+	FORTH_RUN_OP(5, simple) // Simple op
+		FORTH_RUN_SIMPLEBEGIN()
+		FORTH_RUN_SIMPLEOPS(FORTH_RUN_SIMPLE)
+		FORTH_RUN_SIMPLEEND()
+	FORTH_RUN_OP(6, control) // Return op
+		if (rsp <= rsstart && forth_hastasks(forth) && forth->header.task != forth->header.taskmain) { // A task finishing
+			FORTH_RUN_SAVE();
+			tmp = forth_taskend(forth);
+			FORTH_RUN_LOAD();
+			if (tmp != 0) {
+				FORTH_RUN_FAIL(-1);
+			}
+			FORTH_RUN_NEXT();
+		}
+		pc = FORTH_RUN_POPR() + 1;
+		if (pc - 1 >= codebase && pc - 1 < codelimit && code[pc - 1] == 9) { // Special handling of return-to-!-loop
+			if (FORTH_RUN_POPD() != 0) { // Pop a boolean value from the stack, repeat loop if value != 0
+				pc--;
+			}
+		}
+		FORTH_RUN_HOOK();
+		FORTH_RUN_NEXT();
+	FORTH_RUN_OP(7, callindex) // Call by index lookup (data is pointer to instruction in table)
+	callindex_entry:
+		tmp = (instr >> 4 >= codebase && instr >> 4 < codelimit) ? code[instr >> 4] : -1;
+		// Execute a single function or system call inline (or, if quickening, replace this instruction with it)
+		switch (tmp & 0xF) {
+		case 1: // Call already-known function
+			forth_quicken(forth, pc, instr >> 4, tmp);
+			FORTH_RUN_PUSHR(pc);
+			pc = tmp >> 4;
+			FORTH_RUN_HOOK();
 			break;
-		case '=':
-			res = (lhs == rhs) ? -1 : 0;
+		case 2: // Call system function, which can pause the same way as a direct one
+			forth_quicken(forth, pc, instr >> 4, tmp);
+			FORTH_RUN_SYS(tmp >> 4);
+			pc++;
 			break;
-		case 'A':
-			res = (lhs && rhs) ? -1 : 0;
+		case FORTH_OP_BULK:
+			forth_quicken(forth, pc, instr >> 4, tmp);
+			instr = tmp;
+			goto bulk_entry;
+		case FORTH_OP_HEAP:
+			forth_quicken(forth, pc, instr >> 4, tmp);
+			instr = tmp;
+			goto heap_entry;
+		case FORTH_OP_EXT: // Only task ops go in the index
+			if (((tmp >> 4) & 0xF) != FORTH_EXT_TASK) {
+				FORTH_RUN_FAIL(1);
+			}
+			forth_quicken(forth, pc, instr >> 4, tmp);
+			instr = tmp;
+			goto task_entry;
+		default:
+			FORTH_RUN_FAIL(1);
+		}
+		FORTH_RUN_NEXT();
+	FORTH_RUN_OP(8, pushblock) // Push simple block address as data and jump over it.
+		FORTH_RUN_PUSHD(pc + 1);
+		pc = instr >> 4;
+		FORTH_RUN_NEXT();
+	FORTH_RUN_OP(9, loop) // Quick loop, pop loop address from stack, call it, upon returning there is special handling to loop only if popped != 0
+	loop_entry:
+		FORTH_RUN_PUSHR(pc);
+		pc = FORTH_RUN_POPD();
+		FORTH_RUN_PUSHD(pc); // Push it again for next iteration
+		FORTH_RUN_HOOK();
+		FORTH_RUN_NEXT();
+	/* The superinstructions do the first instruction's work and then go straight to the code for the second one
+	 * (which is also in the following word), in the same step.
+	 */
+	FORTH_RUN_OP(10, pushop) // Push integer value then simple op
+		FORTH_RUN_PUSHD(instr >> 8);
+		pc++;
+		instr = (FORTH_SIMPLEOPS[(instr >> 4) & 0xF] << 4) | FORTH_OP_SIMPLE;
+		FORTH_RUN_SIMPLEDISPATCH();
+	FORTH_RUN_OP(11, opop) // Two simple ops (the first can't be a jump)
+		if (((instr >> 4) & 0xF) >= FORTH_SIMPLEOPCOUNT - 1 || ((instr >> 8) & 0xF) >= FORTH_SIMPLEOPCOUNT) {
+			FORTH_RUN_FAIL(-1);
+		}
+		FORTH_RUN_POP2();
+		switch (FORTH_SIMPLEOPS[(instr >> 4) & 0xF]) {
+		FORTH_RUN_SIMPLEOPS(FORTH_RUN_CALC)
+		default:
+			FORTH_RUN_FILL();
+			FORTH_RUN_FAIL(-1);
+		}
+		FORTH_RUN_PUSHRES();
+		pc++;
+		instr = (FORTH_SIMPLEOPS[(instr >> 8) & 0xF] << 4) | FORTH_OP_SIMPLE;
+		FORTH_RUN_SIMPLEDISPATCH();
+	FORTH_RUN_OP(12, blockloop) // Push simple block address, jump over it and start looping over it
+		FORTH_RUN_PUSHD(pc + 1);
+		pc = instr >> 4;
+		goto loop_entry;
+	FORTH_RUN_OP(13, bulk) // Bulk operation, which runs again (a chunk per step) until it's finished
+	bulk_entry:
+		FORTH_RUN_SPILL();
+		forth->header.dsp = dsp;
+		tmp = forth_bulk(forth, instr >> 4);
+		dsp = forth->header.dsp;
+		FORTH_RUN_FILL();
+		if (tmp < 0) {
+			FORTH_RUN_FAIL(-1);
+		}
+		pc += (tmp == 0);
+		FORTH_RUN_NEXT();
+	FORTH_RUN_OP(14, heap) // Allocator op
+	heap_entry:
+		lhs = FORTH_RUN_POPD();
+		switch (instr >> 4) {
+		case FORTH_HEAP_ALLOC:
+			FORTH_RUN_PUSHD(forth_alloc(forth, lhs));
 			break;
-		case 'O':
-			res = (lhs || rhs) ? -1 : 0;
+		case FORTH_HEAP_FREE:
+			if (forth_free(forth, lhs) != 0) {
+				FORTH_RUN_FAIL(-1);
+			}
 			break;
-		case '&':
-			res = lhs & rhs;
+		case FORTH_HEAP_SIZE:
+			FORTH_RUN_PUSHD(forth_allocsize(forth, lhs));
 			break;
-		case '|':
-			res = lhs | rhs;
+		default:
+			FORTH_RUN_FAIL(-1);
+		}
+		pc++;
+		FORTH_RUN_NEXT();
+	FORTH_RUN_OP(15, ext) // Extended instruction
+		switch ((instr >> 4) & 0xF) {
+		case FORTH_EXT_PUSHBYTES: // Push a packed string and jump over it, like pushstr
+			FORTH_RUN_PUSHD(pc);
+			pc += 1 + forth_packedsize(instr >> 8);
 			break;
-		case '?': // Quick conditional jump, if lhs != 0 then jump to rhs
-			if (lhs != 0) {
-				forth->header.pc = rhs - 1; // will be +1 again at end!
+		case FORTH_EXT_TAILINDEX: // Tail call by index lookup, to a function (anything else is called like callindex does)
+			tmp = (instr >> 8 >= codebase && instr >> 8 < codelimit) ? code[instr >> 8] : -1;
+			if ((tmp & 0xF) != FORTH_OP_CALLADDR) {
+				instr = forth_encode(forth, FORTH_OP_CALLINDEX, instr >> 8);
+				goto callindex_entry;
 			}
+			forth_quicken(forth, pc, instr >> 8, forth_quickform(forth, tmp, true));
+			pc = tmp >> 4;
+			FORTH_RUN_HOOK();
 			break;
-		default:
-			return -1;
-		}
-		forth_pushdata(forth, res);
-		forth->header.pc++;
-	} break;
-	case 6: // Return op
-		forth->header.pc = forth_popreturn(forth) + 1;
-		if (forth_peek(forth, forth->header.pc - 1) == 9) { // Special handling of return-to-!-loop
-			//fprintf(stderr, "Returning to loop\n");
-			forth_word_t w = forth_popdata(forth); // Pop a boolean value from the stack
-			if (w != 0) { // Repeat loop if value != 0
-				//fprintf(stderr, "Repeating loop\n");
-				forth->header.pc--;
+		case FORTH_EXT_TASK: // Task op, which may carry on with another task
+		task_entry:
+			FORTH_RUN_SAVE();
+			tmp = forth_taskop(forth, instr >> 8);
+			FORTH_RUN_LOAD();
+			if (tmp != 0) {
+				FORTH_RUN_FAIL(-1);
 			}
-		} else {
-			//fprintf(stderr, "Eventual return address is %d\n", forth->header.pc);
-		}
-		break;
-	case 7: { // Call by index lookup (data is pointer to instruction in table)
-		forth_word_t tmp = forth_peek(forth, instr >> 4);
-		//fprintf(stderr, "Looking up %d (type %d)\n", tmp, tmp & 0xf);
-		// Execute a single function or system call inline
-		switch (tmp & 0xF) {
-		case 1: // Call already-known function
-			//fprintf(stderr, "Pushing return addr %d\n", forth->header.pc);
-			forth_pushreturn(forth, forth->header.pc);
-			forth->header.pc = tmp >> 4;
 			break;
-		case 2: // Call system function
-			result = callback(forth, udata, tmp >> 4);
-			forth->header.pc++;
+		case FORTH_EXT_DENSE: // The slots in order, with pc moving over the wide numbers as they're pushed
+			pc++;
+			for (slot = 8; slot < (int)sizeof(forth_word_t) * 8 && (tmp = (instr >> slot) & 0xF) != 0; slot += 4) {
+				if (tmp == FORTH_DENSE_SMALL) {
+					slot += 4;
+					if (slot >= (int)sizeof(forth_word_t) * 8) {
+						FORTH_RUN_FAIL(-1);
+					}
+					FORTH_RUN_PUSHD((instr >> slot) & 0xF);
+				} else if (tmp == FORTH_DENSE_WIDE) {
+					if (pc >= codenext) {
+						FORTH_RUN_FAIL(-1);
+					}
+					FORTH_RUN_PUSHD(code[pc]);
+					pc++;
+				} else {
+					FORTH_RUN_POP2();
+					pc--; // For '?', which jumps to rhs (and has to be the last slot)
+					switch (FORTH_SIMPLEOPS[tmp - 1]) {
+					FORTH_RUN_SIMPLEOPS(FORTH_RUN_CALC)
+					default:
+						FORTH_RUN_FILL();
+						FORTH_RUN_FAIL(-1);
+					}
+					pc++;
+					FORTH_RUN_PUSHRES();
+					if (tmp == FORTH_SIMPLEOPCOUNT) {
+						break;
+					}
+				}
+			}
 			break;
 		default:
-			return 1;
-		}
-	} break;
-	case 8: { // Push simple block address as data and jump over it.
-		forth_pushdata(forth, forth->header.pc + 1);
-		forth->header.pc = instr >> 4;
-	} break;
-	case 9: { // Quick loop, pop loop address from stack, call it, upon returning there is special handling to loop only if popped != 0
-		forth_pushreturn(forth, forth->header.pc);
-		forth->header.pc = forth_popdata(forth);
-		forth_pushdata(forth, forth->header.pc); // Push it again for next iteration
-	} break;
-	default:
-		return -1;
+			FORTH_RUN_FAIL(-1);
+		}
+		FORTH_RUN_NEXT();
+	FORTH_RUN_OPDEFAULT()
+		FORTH_RUN_FAIL(-1);
 	}
 
-	return 0;
+done:
+	FORTH_RUN_SAVE();
+	if (stepsout != NULL) {
+		*stepsout = steps;
+	}
+	return status;
+
+#undef FORTH_RUN_LOAD
+#undef FORTH_RUN_SAVE
+#undef FORTH_RUN_FILL
+#undef FORTH_RUN_SPILL
+#undef FORTH_RUN_PUSHD
+#undef FORTH_RUN_POPD
+#undef FORTH_RUN_POP2
+#undef FORTH_RUN_PUSHRES
+#undef FORTH_RUN_PUSHR
+#undef FORTH_RUN_POPR
+#undef FORTH_RUN_CALLBACK
+#undef FORTH_RUN_SYS
+#undef FORTH_RUN_FAIL
+#undef FORTH_RUN_PAUSE
+#undef FORTH_RUN_HOOK
+#undef FORTH_RUN_FETCH
+#undef FORTH_RUN_NEXT
+#undef FORTH_RUN_OP
+#undef FORTH_RUN_OPDEFAULT
+#undef FORTH_RUN_SIMPLEBEGIN
+#undef FORTH_RUN_SIMPLE
+#undef FORTH_RUN_SIMPLEEND
+#undef FORTH_RUN_SIMPLEOPS
+#undef FORTH_RUN_CALC
+#undef FORTH_RUN_SIMPLEDISPATCH
+}
+
+/* Runs up to maxsteps instructions. The registers are kept in locals and only written back to the header around
+ * callbacks and when returning, so every step is still of bounded complexity but without the memory traffic of
+ * calling forth_step in a loop. If stepsout isn't NULL the number of instructions dispatched (including one
+ * that failed or paused) is stored there.
+ */
+FORTH_INLINE forth_word_t forth_run(forth_t* forth, forth_callback_t callback, void* udata, long maxsteps, long* stepsout) {
+	return forth_runhooked(forth, callback, udata, maxsteps, stepsout, NULL, NULL);
+}
+
+/* Runs a single instruction. Returns 0 if the program can continue (including when a callback asked for the call
+ * to be repeated later), otherwise the same results as forth_run (e.g. FORTH_RUN_WAITING while it's parked).
+ */
+FORTH_INLINE forth_word_t forth_step(forth_t* forth, forth_callback_t callback, void* udata) {
+	forth_word_t result = forth_run(forth, callback, udata, 1, NULL);
+	return (result == FORTH_RUN_PAUSED) ? 0 : result;
 }
 
 /* From ifndef FORTH_H at top of file: */
-#endif 
\ No newline at end of file
+#endif
\ No newline at end of file
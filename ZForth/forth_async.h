@@ -0,0 +1,208 @@
+/* A readiness queue for running lots of FORTH images that wait on asynchronous host calls (see forth_park in
+ * forth.h), from a single-threaded event loop such as one built on epoll or io_uring.
+ *
+ * A callback that starts some I/O parks its VM with forth_asyncpark and hands the token that returns to whatever
+ * will finish the I/O, then returns non-zero. The VM isn't run again (or its callback retried) until the event loop
+ * passes the token to forth_asynccomplete with the results, which queues it to carry on after the call. The event
+ * loop just alternates between waiting for its events and forth_asyncdrain, which runs the queued VMs:
+ *
+ *	while (forth_asynclive(q) > 0) {
+ *		forth_asyncdrain(q, -1);
+ *		n = epoll_wait(epfd, events, max, -1);
+ *		... forth_asynccomplete(q, token, results, nresults) for each one that's done ...
+ *	}
+ *
+ * Everything has to be called from the same thread (including from the callbacks, which can also complete their
+ * own calls straight away).
+ */
+
+#ifndef FORTH_ASYNC_H
+#define FORTH_ASYNC_H
+
+#include "forth.h"
+
+#define FORTH_ASYNC_READY	0 // Queued to run
+#define FORTH_ASYNC_RUNNING	1
+#define FORTH_ASYNC_WAITING	2 // Parked until its call is completed
+#define FORTH_ASYNC_DONE	3
+
+/* Tokens name a VM (in the low 32 bits) and the call it's parked in (forth_park's number), so a token for a call
+ * that's already been completed can't complete a later one.
+ */
+typedef uint64_t forth_asynctoken_t;
+
+typedef struct forth_asyncvm forth_asyncvm_t;
+typedef struct forth_async forth_async_t;
+
+struct forth_asyncvm {
+	forth_t* forth;
+	forth_callback_t callback;
+	void* udata;
+	int state;
+	forth_word_t result;	// What forth_run returned when it finished
+};
+
+struct forth_async {
+	forth_asyncvm_t* vms;
+	int nvms;
+	int maxvms;
+	int live;		// VMs not finished yet
+	long slicesteps;
+	int* queue;		// Ready VMs, in the order they'll run
+	long mask;		// Size of the queue minus one
+	long head;
+	long count;
+	long slices;		// Time slices run
+	long steps;		// Instructions run
+	long waits;		// Calls parked
+	long completions;	// Calls completed
+};
+
+/* Creates a queue for up to maxvms VMs, which will run for up to slicesteps instructions at a time. Returns NULL on
+ * failure.
+ */
+FORTH_INLINE forth_async_t* forth_asynccreate(int maxvms, long slicesteps) {
+	if (maxvms < 1 || slicesteps < 1) {
+		return NULL;
+	}
+	forth_async_t* q = calloc(1, sizeof(forth_async_t));
+	if (q == NULL) {
+		return NULL;
+	}
+	long size = 1;
+	while (size < maxvms) {
+		size <<= 1;
+	}
+	q->mask = size - 1;
+	q->maxvms = maxvms;
+	q->slicesteps = slicesteps;
+	q->vms = calloc(maxvms, sizeof(forth_asyncvm_t));
+	q->queue = calloc(size, sizeof(int));
+	if (q->vms == NULL || q->queue == NULL) {
+		free(q->vms);
+		free(q->queue);
+		free(q);
+		return NULL;
+	}
+	return q;
+}
+
+/* Frees the queue (but not the images, which still belong to the caller). */
+FORTH_INLINE void forth_asyncdestroy(forth_async_t* q) {
+	free(q->queue);
+	free(q->vms);
+	free(q);
+}
+
+// A VM can only be in the queue once, so it never overflows.
+FORTH_INLINE void forth_asyncpush(forth_async_t* q, int id) {
+	q->vms[id].state = FORTH_ASYNC_READY;
+	q->queue[(q->head + q->count++) & q->mask] = id;
+}
+
+/* Adds an image to be run from its current pc, returning its id (or -1 if the queue is full). */
+FORTH_INLINE int forth_asyncadd(forth_async_t* q, forth_t* forth, forth_callback_t callback, void* udata) {
+	if (q->nvms >= q->maxvms) {
+		return -1;
+	}
+	int id = q->nvms++;
+	forth_asyncvm_t* vm = &q->vms[id];
+	vm->forth = forth;
+	vm->callback = callback;
+	vm->udata = udata;
+	vm->result = 0;
+	q->live++;
+	if (forth_iswaiting(forth)) { // Saved while it was parked, so it's completed like any other
+		vm->state = FORTH_ASYNC_WAITING;
+	} else {
+		forth_asyncpush(q, id);
+	}
+	return id;
+}
+
+/* Parks VM id from inside its callback (which then has to return non-zero), returning the token to complete the
+ * call with, or 0 if it can't be parked.
+ */
+FORTH_INLINE forth_asynctoken_t forth_asyncpark(forth_async_t* q, int id) {
+	if (id < 0 || id >= q->nvms || q->vms[id].state != FORTH_ASYNC_RUNNING) {
+		return 0;
+	}
+	forth_word_t seq = forth_park(q->vms[id].forth);
+	if (seq < 0) {
+		return 0;
+	}
+	q->waits++;
+	return ((forth_asynctoken_t)(uint32_t)seq << 32) | (uint32_t)id;
+}
+
+/* Completes a parked call, pushing its n results, and queues the VM to carry on after it. Returns 0, or -1 if the
+ * token's call isn't waiting any more (e.g. it was already completed) or the results don't fit on the stack.
+ */
+FORTH_INLINE int forth_asynccomplete(forth_async_t* q, forth_asynctoken_t token, const forth_word_t* values, int n) {
+	int id = (int)(uint32_t)token;
+	if (id < 0 || id >= q->nvms) {
+		return -1;
+	}
+	forth_asyncvm_t* vm = &q->vms[id];
+	if ((vm->state != FORTH_ASYNC_WAITING && vm->state != FORTH_ASYNC_RUNNING)
+		|| (uint32_t)vm->forth->header.waitseq != (uint32_t)(token >> 32)
+		|| forth_complete(vm->forth, vm->forth->header.waitseq, values, n) != 0) {
+		return -1;
+	}
+	q->completions++;
+	// A VM completing its own call is queued again when its slice ends.
+	if (vm->state == FORTH_ASYNC_WAITING) {
+		forth_asyncpush(q, id);
+	}
+	return 0;
+}
+
+/* Runs up to maxslices time slices (or as many as it takes to empty the queue if maxslices is negative), taking
+ * the ready VMs in turn. VMs that run out of time or pause (i.e. their callback asks for a retry without parking)
+ * go to the back of the queue. Returns the number of slices run.
+ */
+FORTH_INLINE long forth_asyncdrain(forth_async_t* q, long maxslices) {
+	long slices = 0;
+	while (q->count > 0 && (maxslices < 0 || slices < maxslices)) {
+		int id = q->queue[q->head++ & q->mask];
+		q->count--;
+		forth_asyncvm_t* vm = &q->vms[id];
+		vm->state = FORTH_ASYNC_RUNNING;
+		long steps = 0;
+		forth_word_t result = forth_run(vm->forth, vm->callback, vm->udata, q->slicesteps, &steps);
+		q->steps += steps;
+		slices++;
+		if (result == FORTH_RUN_WAITING) {
+			vm->state = FORTH_ASYNC_WAITING;
+		} else if (result == FORTH_RUN_BUDGET || result == FORTH_RUN_PAUSED) {
+			forth_asyncpush(q, id);
+		} else {
+			vm->result = result;
+			vm->state = FORTH_ASYNC_DONE;
+			q->live--;
+		}
+	}
+	q->slices += slices;
+	return slices;
+}
+
+// How many VMs are queued to run.
+FORTH_INLINE long forth_asyncready(forth_async_t* q) {
+	return q->count;
+}
+
+// How many VMs haven't finished yet (running, queued or waiting).
+FORTH_INLINE int forth_asynclive(forth_async_t* q) {
+	return q->live;
+}
+
+FORTH_INLINE int forth_asyncstate(forth_async_t* q, int id) {
+	return (id >= 0 && id < q->nvms) ? q->vms[id].state : -1;
+}
+
+/* What forth_run returned when the VM finished (only meaningful once its state is FORTH_ASYNC_DONE). */
+FORTH_INLINE forth_word_t forth_asyncresult(forth_async_t* q, int id) {
+	return (id >= 0 && id < q->nvms) ? q->vms[id].result : -1;
+}
+
+#endif
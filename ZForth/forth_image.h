@@ -0,0 +1,197 @@
+/* Saving images to files and mapping them back into memory, and starting new instances from a template image as
+ * copy-on-write mappings (so they only cost memory for the pages they change).
+ * Unlike forth.h this needs POSIX mmap. On Linux, templates use memfd_create if it's declared (i.e. with
+ * _GNU_SOURCE), otherwise POSIX shared memory.
+ *
+ * Images are saved exactly as they are in memory, so a file only loads on machines with the same word size and
+ * byte order (forth_checkimage rejects the rest, since fmagic won't match).
+ */
+
+#ifndef FORTH_IMAGE_H
+#define FORTH_IMAGE_H
+
+#include "forth.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FORTH_MAP_PRIVATE	0 // Changes to the image only happen in memory
+#define FORTH_MAP_SHARED	1 // Changes to the image are written back to the file
+
+typedef struct forth_template forth_template_t;
+
+struct forth_template {
+	int fd;
+	forth_word_t fsize;
+};
+
+/* Maps size words of fd as an image, or the whole file if size is 0. Returns NULL if it can't be mapped or isn't a
+ * valid image.
+ */
+FORTH_INLINE forth_t* forth_mapfd(int fd, forth_word_t size, int flags) {
+	if (size == 0) {
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size % sizeof(forth_word_t) != 0) {
+			return NULL;
+		}
+		size = (forth_word_t)(st.st_size / sizeof(forth_word_t));
+		if ((off_t)size * (off_t)sizeof(forth_word_t) != st.st_size) { // Too big for the word size
+			return NULL;
+		}
+	}
+	if (size < FORTH_HEADER_MINSIZE) {
+		return NULL;
+	}
+	size_t bytes = (size_t)size * sizeof(forth_word_t);
+	void* mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, (flags & FORTH_MAP_SHARED) ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	if (mem == MAP_FAILED) {
+		return NULL;
+	}
+	if (forth_checkimage((forth_t*)mem, size) != 0) {
+		munmap(mem, bytes);
+		return NULL;
+	}
+	return (forth_t*)mem;
+}
+
+/* Maps an image file into memory (FORTH_MAP_PRIVATE or FORTH_MAP_SHARED), returning NULL if that fails or the file
+ * isn't a valid image. Free it with forth_unmapimage.
+ */
+FORTH_INLINE forth_t* forth_mapimage(const char* path, int flags) {
+	int fd = open(path, (flags & FORTH_MAP_SHARED) ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	forth_t* forth = forth_mapfd(fd, 0, flags);
+	close(fd); // The mapping keeps the file open
+	return forth;
+}
+
+/* Unmaps an image from forth_mapimage or forth_forkimage (its fsize can't have been changed). */
+FORTH_INLINE forth_word_t forth_unmapimage(forth_t* forth) {
+	return munmap(forth, (size_t)forth->header.fsize * sizeof(forth_word_t)) == 0 ? 0 : -1;
+}
+
+FORTH_INLINE forth_word_t forth_writefd(int fd, forth_t* forth) {
+	const char* data = (const char*)forth;
+	size_t bytes = (size_t)forth->header.fsize * sizeof(forth_word_t);
+	while (bytes > 0) {
+		ssize_t n = write(fd, data, bytes);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return -1;
+		}
+		data += n;
+		bytes -= n;
+	}
+	return 0;
+}
+
+/* Saves an image (which shouldn't be running at the same time) to a file. It's written to path.tmp first and then
+ * renamed, so the file is never left half-written. Returns 0 on success.
+ */
+FORTH_INLINE forth_word_t forth_saveimage(forth_t* forth, const char* path) {
+	if (forth_checkheader(forth, forth->header.fsize) != 0) {
+		return -1;
+	}
+	size_t len = strlen(path);
+	char* tmppath = malloc(len + 5);
+	if (tmppath == NULL) {
+		return -1;
+	}
+	memcpy(tmppath, path, len);
+	memcpy(tmppath + len, ".tmp", 5);
+	forth_word_t result = -1;
+	int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd >= 0) {
+		result = forth_writefd(fd, forth);
+		if (fsync(fd) != 0) {
+			result = -1;
+		}
+		if (close(fd) != 0) {
+			result = -1;
+		}
+		if (result == 0 && rename(tmppath, path) != 0) {
+			result = -1;
+		}
+		if (result != 0) {
+			unlink(tmppath);
+		}
+	}
+	free(tmppath);
+	return result;
+}
+
+/* Makes a template from an image in memory, e.g. one with a standard library already assembled. The image can be
+ * changed or freed afterwards without affecting the template. Returns 0 on success.
+ */
+FORTH_INLINE forth_word_t forth_maketemplate(forth_template_t* tmpl, forth_t* forth) {
+	if (forth_checkheader(forth, forth->header.fsize) != 0) {
+		return -1;
+	}
+	int fd;
+#ifdef MFD_CLOEXEC
+	fd = memfd_create("forth", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+	static int counter = 0;
+	char name[64];
+	do {
+		snprintf(name, sizeof(name), "/forth-%ld-%d", (long)getpid(), counter++);
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	} while (fd < 0 && errno == EEXIST);
+	if (fd >= 0) {
+		shm_unlink(name);
+	}
+#endif
+	if (fd < 0) {
+		return -1;
+	}
+	if (ftruncate(fd, (off_t)forth->header.fsize * sizeof(forth_word_t)) != 0 || forth_writefd(fd, forth) != 0) {
+		close(fd);
+		return -1;
+	}
+#ifdef F_SEAL_WRITE
+	// Nothing can change it from now on (private mappings of it can still be written to).
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+	tmpl->fd = fd;
+	tmpl->fsize = forth->header.fsize;
+	return 0;
+}
+
+/* Uses an image file as a template. The file shouldn't be changed while the template is open. Returns 0 on success. */
+FORTH_INLINE forth_word_t forth_opentemplate(forth_template_t* tmpl, const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	forth_t* forth = forth_mapfd(fd, 0, FORTH_MAP_PRIVATE);
+	if (forth == NULL) {
+		close(fd);
+		return -1;
+	}
+	tmpl->fd = fd;
+	tmpl->fsize = forth->header.fsize;
+	forth_unmapimage(forth);
+	return 0;
+}
+
+/* Closes a template. Images already forked from it aren't affected. */
+FORTH_INLINE void forth_closetemplate(forth_template_t* tmpl) {
+	close(tmpl->fd);
+	tmpl->fd = -1;
+}
+
+/* Starts a new instance of a template, as a private copy-on-write mapping of it: only the pages that the instance
+ * writes to get copied. Free it with forth_unmapimage. Returns NULL on failure.
+ */
+FORTH_INLINE forth_t* forth_forkimage(forth_template_t* tmpl) {
+	return forth_mapfd(tmpl->fd, tmpl->fsize, FORTH_MAP_PRIVATE);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,1314 @@
+/* A JIT compiler which turns hot words into native code, for x86-64 Linux hosts with 32- or 64-bit words (elsewhere
+ * forth_jitrun just interprets, and FORTH_JIT_NATIVE isn't defined). Unlike forth.h this needs mmap and mprotect. Native
+ * code is never writable and executable at once: the pages it's written to are made executable once it's compiled,
+ * and only the page it left off in (and the unused ones after it) are writable while compiling more, so it works
+ * where W^X is enforced (e.g. SELinux's execmem or PaX MPROTECT).
+ *
+ * forth_jitrun runs an image like forth_run, but counts how many times the interpreter arrives at each address
+ * through a call, a return or a loop. Once an address reaches the threshold, the code from there to the return at
+ * the end of the word (including any blocks and loops inside it) is compiled. The native code is split into basic
+ * blocks like the bytecode, and each block checks the step budget and the data stack bounds for the whole block up
+ * front, then keeps copies of values in registers and folds constants. Anything unusual (an unset index entry, a
+ * stack that would overflow, running out of steps, division by zero) goes back to the interpreter at the instruction
+ * it was about to run, so images always end up exactly as forth_run would leave them, and pc/dsp/rsp in the header are
+ * always up to date at callbacks and whenever forth_jitrun returns (so pausing, resuming and saving images works
+ * the same). The only difference is that compiled calls don't quicken their call sites, since they don't need to.
+ *
+ * The native code is compiled from the code as it was at the time. Call forth_jitflush after changing or removing
+ * code that's already run (adding code with forth_assemble is fine, and so are calls that forth_setlookupinstr
+ * redirects, since compiled calls re-read the instruction every time).
+ */
+
+#ifndef FORTH_JIT_H
+#define FORTH_JIT_H
+
+#include "forth.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(FORTH_16BIT)
+#define FORTH_JIT_NATIVE
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define FORTH_JIT_THRESHOLD	100 // Default number of arrivals before compiling
+#define FORTH_JIT_CODESIZE	(4 << 20) // Default bytes of native code
+#define FORTH_JIT_MAXREGION	4096 // Most instructions compiled at once
+#define FORTH_JIT_NEVER	UINT32_MAX // Count for addresses that can't be compiled
+
+typedef struct forth_jit forth_jit_t;
+typedef long (*forth_jitenter_t)(forth_jit_t* jit, void* native, long budget);
+
+struct forth_jit {
+	forth_t* forth;
+	// These are also read by the native code.
+	void** entry;		// Native code for each code address that starts a compiled block, or NULL
+	int64_t codestart;
+	int64_t ntable;	// Entries in entry and counts (the size of the code segment)
+	forth_callback_t callback;
+	void* udata;
+	long budget;		// Steps left when the native code returned
+	// The rest are only used by the compiler.
+	uint32_t* counts;
+	uint32_t threshold;
+	unsigned char* code;
+	size_t codesize;
+	size_t codeused;
+	size_t codebase;	// Size of the entry and exit code at the start of code (a whole number of pages)
+	size_t pagesize;
+	forth_jitenter_t enter;
+	unsigned char* exitcode;
+	unsigned char* dispatchcode;
+	long regions;		// How many times something was compiled
+};
+
+FORTH_INLINE void forth_jitflush(forth_jit_t* jit);
+
+#ifdef FORTH_JIT_NATIVE
+
+#define FORTH_JIT_RAX	0
+#define FORTH_JIT_RCX	1
+#define FORTH_JIT_RDX	2
+#define FORTH_JIT_RBX	3 // The image
+#define FORTH_JIT_RSP	4
+#define FORTH_JIT_RBP	5
+#define FORTH_JIT_RSI	6
+#define FORTH_JIT_RDI	7
+#define FORTH_JIT_R8	8
+#define FORTH_JIT_R11	11
+#define FORTH_JIT_R12	12 // dsp
+#define FORTH_JIT_R13	13 // rsp
+#define FORTH_JIT_R14	14 // Steps left
+#define FORTH_JIT_R15	15 // The forth_jit_t
+// Registers that can hold values, rax/rcx/rdx are kept free for division and shifts.
+#define FORTH_JIT_VALREGS	((1u << FORTH_JIT_RSI) | (1u << FORTH_JIT_RDI) | (0xFu << FORTH_JIT_R8))
+#define FORTH_JIT_MAXVALS	32
+
+// Condition codes
+#define FORTH_JIT_B	2
+#define FORTH_JIT_AE	3
+#define FORTH_JIT_E	4
+#define FORTH_JIT_NE	5
+#define FORTH_JIT_S	8
+#define FORTH_JIT_L	12
+#define FORTH_JIT_GE	13
+#define FORTH_JIT_G	15
+
+#define FORTH_JIT_W	(sizeof(forth_word_t) == 8) // Whether word-sized operations need REX.W
+#define FORTH_JIT_SCALE	(sizeof(forth_word_t) == 8 ? 3 : 2)
+
+typedef struct forth_jitmem forth_jitmem_t;
+typedef struct forth_jitval forth_jitval_t;
+typedef struct forth_jitpatch forth_jitpatch_t;
+typedef struct forth_jitasm forth_jitasm_t;
+
+// A memory operand, [base + index << scale + disp] (index is -1 for none).
+struct forth_jitmem {
+	int base;
+	int index;
+	int scale;
+	int32_t disp;
+};
+
+#define FORTH_JIT_HDR(field)	((forth_jitmem_t) { FORTH_JIT_RBX, -1, 0, (int32_t)offsetof(forth_header_t, field) })
+#define FORTH_JIT_CTX(field)	((forth_jitmem_t) { FORTH_JIT_R15, -1, 0, (int32_t)offsetof(forth_jit_t, field) })
+#define FORTH_JIT_WORD(addr)	((forth_jitmem_t) { FORTH_JIT_RBX, -1, 0, (int32_t)((addr) * (int32_t)sizeof(forth_word_t)) })
+// words[reg + off]
+#define FORTH_JIT_AT(reg, off)	((forth_jitmem_t) { FORTH_JIT_RBX, (reg), FORTH_JIT_SCALE, (int32_t)((off) * (int32_t)sizeof(forth_word_t)) })
+
+// A value on the compiler's copy of the data stack, either a constant or in a register.
+struct forth_jitval {
+	bool isconst;
+	int reg;
+	forth_word_t value;
+};
+
+struct forth_jitpatch {
+	unsigned char* at;
+	forth_word_t pc;	// Code address to jump to, or steps charged before the exit
+};
+
+struct forth_jitasm {
+	forth_jit_t* jit;
+	forth_t* forth;
+	unsigned char* p;
+	unsigned char* end;
+	bool full;
+	forth_word_t start;	// The region being compiled
+	forth_word_t stop;
+	unsigned char* islabel;
+	unsigned char** labels;
+	forth_jitpatch_t* jumps;	// Jumps to other code addresses
+	int njumps;
+	forth_jitpatch_t* exits;	// Jumps to exits before running anything in a block
+	int nexits;
+	forth_jitpatch_t* refunds;	// Steps to give back when exiting part way through a block
+	int nrefunds;
+	int maxpatches;
+	// The block being compiled.
+	int blockrefunds;
+	long steps;
+	unsigned char* stepsat[2];
+	unsigned char* lowat;
+	unsigned char* highat;
+	// What's known about the top of the data stack: the values pushed since r12 was last moved, after popping base
+	// items below it. They're stored too, this just saves loading them again. r12 has been moved by shift since the
+	// block started, and the lowest and highest positions used (relative to the start) are tracked so the block
+	// can check them up front.
+	forth_jitval_t vals[FORTH_JIT_MAXVALS];
+	int nvals;
+	int base;
+	int shift;
+	int low;
+	int high;
+	unsigned freeregs;
+};
+
+FORTH_INLINE void forth_jitbyte(forth_jitasm_t* a, int b) {
+	if (a->p < a->end) {
+		*a->p++ = (unsigned char)b;
+	} else {
+		a->full = true;
+	}
+}
+
+FORTH_INLINE void forth_jitu32(forth_jitasm_t* a, uint32_t v) {
+	forth_jitbyte(a, v);
+	forth_jitbyte(a, v >> 8);
+	forth_jitbyte(a, v >> 16);
+	forth_jitbyte(a, v >> 24);
+}
+
+FORTH_INLINE void forth_jitset32(forth_jitasm_t* a, unsigned char* at, uint32_t v) {
+	if (!a->full) {
+		memcpy(at, &v, 4);
+	}
+}
+
+// Emits op (with a 0x0F prefix if it's above 0xFF) with a ModRM byte for reg and a register operand.
+FORTH_INLINE void forth_jitregop(forth_jitasm_t* a, int w, int op, int reg, int rm) {
+	int rex = (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+	if (rex != 0) {
+		forth_jitbyte(a, 0x40 | rex);
+	}
+	if (op > 0xFF) {
+		forth_jitbyte(a, op >> 8);
+	}
+	forth_jitbyte(a, op);
+	forth_jitbyte(a, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// Same with a memory operand (always with a 32-bit displacement, to keep it simple).
+FORTH_INLINE void forth_jitmemop(forth_jitasm_t* a, int w, int op, int reg, forth_jitmem_t m) {
+	int rex = (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((m.index >= 0 && (m.index & 8)) ? 2 : 0) | ((m.base & 8) ? 1 : 0);
+	if (rex != 0) {
+		forth_jitbyte(a, 0x40 | rex);
+	}
+	if (op > 0xFF) {
+		forth_jitbyte(a, op >> 8);
+	}
+	forth_jitbyte(a, op);
+	if (m.index >= 0) {
+		forth_jitbyte(a, 0x84 | ((reg & 7) << 3));
+		forth_jitbyte(a, (m.scale << 6) | ((m.index & 7) << 3) | (m.base & 7));
+	} else if ((m.base & 7) == FORTH_JIT_RSP) {
+		forth_jitbyte(a, 0x84 | ((reg & 7) << 3));
+		forth_jitbyte(a, 0x24);
+	} else {
+		forth_jitbyte(a, 0x80 | ((reg & 7) << 3) | (m.base & 7));
+	}
+	forth_jitu32(a, (uint32_t)m.disp);
+}
+
+// Loads a word, sign-extended to 64 bits.
+FORTH_INLINE void forth_jitload(forth_jitasm_t* a, int reg, forth_jitmem_t m) {
+	forth_jitmemop(a, 1, FORTH_JIT_W ? 0x8B : 0x63, reg, m);
+}
+
+FORTH_INLINE void forth_jitstore(forth_jitasm_t* a, forth_jitmem_t m, int reg) {
+	forth_jitmemop(a, FORTH_JIT_W, 0x89, reg, m);
+}
+
+FORTH_INLINE void forth_jitstoreimm(forth_jitasm_t* a, forth_jitmem_t m, int32_t imm) {
+	forth_jitmemop(a, FORTH_JIT_W, 0xC7, 0, m);
+	forth_jitu32(a, (uint32_t)imm);
+}
+
+FORTH_INLINE bool forth_jitfits32(int64_t v) {
+	return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+FORTH_INLINE void forth_jitmovimm(forth_jitasm_t* a, int reg, int64_t v) {
+	if (forth_jitfits32(v)) {
+		forth_jitregop(a, 1, 0xC7, 0, reg);
+		forth_jitu32(a, (uint32_t)v);
+	} else {
+		forth_jitbyte(a, 0x48 | ((reg & 8) ? 1 : 0));
+		forth_jitbyte(a, 0xB8 | (reg & 7));
+		forth_jitu32(a, (uint32_t)v);
+		forth_jitu32(a, (uint32_t)((uint64_t)v >> 32));
+	}
+}
+
+// add/or/and/sub/cmp (digit 0/1/4/5/7) with a 32-bit immediate, returning where the immediate is.
+FORTH_INLINE unsigned char* forth_jitaluimm(forth_jitasm_t* a, int w, int digit, int reg, int32_t imm) {
+	forth_jitregop(a, w, 0x81, digit, reg);
+	unsigned char* at = a->p;
+	forth_jitu32(a, (uint32_t)imm);
+	return at;
+}
+
+FORTH_INLINE void forth_jitshiftimm(forth_jitasm_t* a, int w, int digit, int reg, int n) {
+	forth_jitregop(a, w, 0xC1, digit, reg);
+	forth_jitbyte(a, n);
+}
+
+FORTH_INLINE void forth_jitlea(forth_jitasm_t* a, int reg, int base, int32_t disp) {
+	forth_jitmemop(a, 1, 0x8D, reg, (forth_jitmem_t) { base, -1, 0, disp });
+}
+
+FORTH_INLINE void forth_jitpush(forth_jitasm_t* a, int reg) {
+	if (reg & 8) {
+		forth_jitbyte(a, 0x41);
+	}
+	forth_jitbyte(a, 0x50 | (reg & 7));
+}
+
+FORTH_INLINE void forth_jitpop(forth_jitasm_t* a, int reg) {
+	if (reg & 8) {
+		forth_jitbyte(a, 0x41);
+	}
+	forth_jitbyte(a, 0x58 | (reg & 7));
+}
+
+// Jumps return where to patch in the target with forth_jitbind.
+FORTH_INLINE unsigned char* forth_jitjcc(forth_jitasm_t* a, int cc) {
+	forth_jitbyte(a, 0x0F);
+	forth_jitbyte(a, 0x80 | cc);
+	unsigned char* at = a->p;
+	forth_jitu32(a, 0);
+	return at;
+}
+
+FORTH_INLINE unsigned char* forth_jitjmp(forth_jitasm_t* a) {
+	forth_jitbyte(a, 0xE9);
+	unsigned char* at = a->p;
+	forth_jitu32(a, 0);
+	return at;
+}
+
+FORTH_INLINE void forth_jitbindto(forth_jitasm_t* a, unsigned char* at, unsigned char* target) {
+	forth_jitset32(a, at, (uint32_t)(int32_t)(target - (at + 4)));
+}
+
+FORTH_INLINE void forth_jitbind(forth_jitasm_t* a, unsigned char* at) {
+	forth_jitbindto(a, at, a->p);
+}
+
+// The common exit (status in rax).
+FORTH_INLINE void forth_jitleave(forth_jitasm_t* a) {
+	forth_jitbindto(a, forth_jitjmp(a), a->jit->exitcode);
+}
+
+// Jumps to the code address in rax, natively if it's been compiled.
+FORTH_INLINE void forth_jitdispatch(forth_jitasm_t* a) {
+	forth_jitbindto(a, forth_jitjmp(a), a->jit->dispatchcode);
+}
+
+FORTH_INLINE void forth_jitzero(forth_jitasm_t* a, int reg) {
+	forth_jitregop(a, 0, 0x31, reg, reg);
+}
+
+// Sign-extends a value register into rax.
+FORTH_INLINE void forth_jitsext(forth_jitasm_t* a, int reg) {
+	if (FORTH_JIT_W) {
+		forth_jitregop(a, 1, 0x89, reg, FORTH_JIT_RAX);
+	} else {
+		forth_jitregop(a, 1, 0x63, FORTH_JIT_RAX, reg);
+	}
+}
+
+// Jumps to the native code for the code address pc (resolved at the end).
+FORTH_INLINE void forth_jitjumpto(forth_jitasm_t* a, unsigned char* at, forth_word_t pc) {
+	if (a->njumps < a->maxpatches) {
+		a->jumps[a->njumps++] = (forth_jitpatch_t) { at, pc };
+	} else {
+		a->full = true;
+	}
+}
+
+/* Leaves the native code before the instruction at pc (which hasn't done anything yet), giving back the steps
+ * charged from there to the end of the block. r12 must have been moved to the top of the stack first.
+ */
+FORTH_INLINE void forth_jitexit(forth_jitasm_t* a, forth_word_t pc, long before) {
+	unsigned char* at = forth_jitaluimm(a, 1, 0, FORTH_JIT_R14, 0);
+	if (a->nrefunds < a->maxpatches) {
+		a->refunds[a->nrefunds++] = (forth_jitpatch_t) { at, (forth_word_t)before };
+	} else {
+		a->full = true;
+	}
+	forth_jitstoreimm(a, FORTH_JIT_HDR(pc), (int32_t)pc);
+	forth_jitzero(a, FORTH_JIT_RAX);
+	forth_jitleave(a);
+}
+
+// Moves r12 to the top of the stack, which is already in memory.
+FORTH_INLINE void forth_jitsettop(forth_jitasm_t* a, int n) {
+	if (n != a->base) {
+		forth_jitaluimm(a, 1, 0, FORTH_JIT_R12, n - a->base);
+	}
+}
+
+// Forgets the values in registers and moves r12, e.g. at the end of a block.
+FORTH_INLINE void forth_jitspill(forth_jitasm_t* a) {
+	forth_jitsettop(a, a->nvals);
+	int i;
+	for (i = 0; i < a->nvals; i++) {
+		if (!a->vals[i].isconst) {
+			a->freeregs |= 1u << a->vals[i].reg;
+		}
+	}
+	a->shift += a->nvals - a->base;
+	a->nvals = 0;
+	a->base = 0;
+}
+
+FORTH_INLINE int forth_jitalloc(forth_jitasm_t* a) {
+	if ((a->freeregs & FORTH_JIT_VALREGS) == 0) {
+		forth_jitspill(a);
+	}
+	int reg = __builtin_ctz(a->freeregs);
+	a->freeregs &= ~(1u << reg);
+	return reg;
+}
+
+FORTH_INLINE void forth_jitfree(forth_jitasm_t* a, int reg) {
+	a->freeregs |= 1u << reg;
+}
+
+FORTH_INLINE void forth_jitpushval(forth_jitasm_t* a, forth_jitval_t v) {
+	if (a->nvals == FORTH_JIT_MAXVALS) {
+		forth_jitspill(a);
+	}
+	// Every value is still written as it's pushed, so memory always ends up like the interpreter leaves it.
+	forth_jitmem_t slot = FORTH_JIT_AT(FORTH_JIT_R12, a->nvals - a->base);
+	if (!v.isconst) {
+		forth_jitstore(a, slot, v.reg);
+	} else if (forth_jitfits32(v.value)) {
+		forth_jitstoreimm(a, slot, (int32_t)v.value);
+	} else {
+		forth_jitmovimm(a, FORTH_JIT_RAX, v.value);
+		forth_jitstore(a, slot, FORTH_JIT_RAX);
+	}
+	a->vals[a->nvals++] = v;
+	if (a->shift - a->base + a->nvals > a->high) {
+		a->high = a->shift - a->base + a->nvals;
+	}
+}
+
+FORTH_INLINE void forth_jitpushconst(forth_jitasm_t* a, forth_word_t value) {
+	forth_jitpushval(a, (forth_jitval_t) { true, -1, value });
+}
+
+FORTH_INLINE forth_jitval_t forth_jitpopval(forth_jitasm_t* a) {
+	if (a->nvals > 0) {
+		return a->vals[--a->nvals];
+	}
+	forth_jitval_t v = { false, forth_jitalloc(a), 0 };
+	a->base++;
+	if (a->shift - a->base < a->low) {
+		a->low = a->shift - a->base;
+	}
+	forth_jitload(a, v.reg, FORTH_JIT_AT(FORTH_JIT_R12, -a->base));
+	return v;
+}
+
+// Gets a value into a register of its own.
+FORTH_INLINE int forth_jittake(forth_jitasm_t* a, forth_jitval_t v) {
+	if (!v.isconst) {
+		return v.reg;
+	}
+	int reg = forth_jitalloc(a);
+	forth_jitmovimm(a, reg, v.value);
+	return reg;
+}
+
+// Works out a simple op at compile time, if it behaves the same as it would at run time.
+FORTH_INLINE bool forth_jitfold(char c, forth_word_t lhs, forth_word_t rhs, forth_word_t* res) {
+	const forth_word_t bits = sizeof(forth_word_t) * 8;
+	const forth_word_t min = (forth_word_t)((uintmax_t)1 << (bits - 1));
+	switch (c) {
+	case '+': *res = (forth_word_t)((uintmax_t)lhs + (uintmax_t)rhs); return true;
+	case '-': *res = (forth_word_t)((uintmax_t)lhs - (uintmax_t)rhs); return true;
+	case '*': *res = (forth_word_t)((uintmax_t)lhs * (uintmax_t)rhs); return true;
+	case '/': if (rhs == 0 || (rhs == -1 && lhs == min)) { return false; } *res = lhs / rhs; return true;
+	case '%': if (rhs == 0 || (rhs == -1 && lhs == min)) { return false; } *res = lhs % rhs; return true;
+	case 'R': if (rhs < 0 || rhs >= bits) { return false; } *res = lhs >> rhs; return true;
+	case 'L': if (rhs < 0 || rhs >= bits) { return false; } *res = (forth_word_t)((uintmax_t)lhs << rhs); return true;
+	case '=': *res = (lhs == rhs) ? -1 : 0; return true;
+	case 'A': *res = (lhs && rhs) ? -1 : 0; return true;
+	case 'O': *res = (lhs || rhs) ? -1 : 0; return true;
+	case '&': *res = lhs & rhs; return true;
+	case '|': *res = lhs | rhs; return true;
+	default: return false;
+	}
+}
+
+/* Compiles the simple op c, part of the instruction at pc (which continues at next). A '?' ends the block, and
+ * returns true. The caller makes sure a division by a constant isn't by zero if it can't exit part way through.
+ */
+FORTH_INLINE bool forth_jitsimple(forth_jitasm_t* a, char c, forth_word_t pc, forth_word_t next, long before) {
+	forth_jitval_t rhs = forth_jitpopval(a);
+	forth_jitval_t lhs = forth_jitpopval(a);
+	forth_word_t res;
+	if (c == '?') {
+		int l = forth_jittake(a, lhs);
+		int r = forth_jittake(a, rhs);
+		forth_jitpushconst(a, 0);
+		forth_jitspill(a);
+		forth_jitregop(a, FORTH_JIT_W, 0x85, l, l);
+		forth_jitjumpto(a, forth_jitjcc(a, FORTH_JIT_E), next);
+		forth_jitsext(a, r);
+		forth_jitdispatch(a);
+		return true;
+	}
+	if (lhs.isconst && rhs.isconst && forth_jitfold(c, lhs.value, rhs.value, &res)) {
+		forth_jitpushconst(a, res);
+		return false;
+	}
+	int l = forth_jittake(a, lhs);
+	if (rhs.isconst && forth_jitfits32(rhs.value) && (c == '+' || c == '-' || c == '&' || c == '|' || c == '*')) {
+		if (c == '*') {
+			forth_jitregop(a, FORTH_JIT_W, 0x69, l, l);
+			forth_jitu32(a, (uint32_t)rhs.value);
+		} else {
+			forth_jitaluimm(a, FORTH_JIT_W, c == '+' ? 0 : c == '-' ? 5 : c == '&' ? 4 : 1, l, (int32_t)rhs.value);
+		}
+		forth_jitpushval(a, (forth_jitval_t) { false, l, 0 });
+		return false;
+	}
+	if (rhs.isconst && c == '/' && rhs.value > 1 && rhs.value < 0x40000000 && (rhs.value & (rhs.value - 1)) == 0) {
+		// Dividing by a power of two is a shift, after rounding negative numbers up (towards zero) like idiv does
+		const int bits = (int)sizeof(forth_word_t) * 8;
+		int k = __builtin_ctz((unsigned)rhs.value);
+		forth_jitregop(a, FORTH_JIT_W, 0x89, l, FORTH_JIT_RAX);
+		forth_jitshiftimm(a, FORTH_JIT_W, 7, FORTH_JIT_RAX, bits - 1);
+		forth_jitshiftimm(a, FORTH_JIT_W, 5, FORTH_JIT_RAX, bits - k);
+		forth_jitregop(a, FORTH_JIT_W, 0x01, FORTH_JIT_RAX, l);
+		forth_jitshiftimm(a, FORTH_JIT_W, 7, l, k);
+		forth_jitpushval(a, (forth_jitval_t) { false, l, 0 });
+		return false;
+	}
+	int r = forth_jittake(a, rhs);
+	switch (c) {
+	case '+': forth_jitregop(a, FORTH_JIT_W, 0x01, r, l); break;
+	case '-': forth_jitregop(a, FORTH_JIT_W, 0x29, r, l); break;
+	case '&': forth_jitregop(a, FORTH_JIT_W, 0x21, r, l); break;
+	case '|': forth_jitregop(a, FORTH_JIT_W, 0x09, r, l); break;
+	case '*': forth_jitregop(a, FORTH_JIT_W, 0x0FAF, l, r); break;
+	case '/':
+	case '%':
+		if (!rhs.isconst) { // Leave division by zero to the interpreter
+			forth_jitregop(a, FORTH_JIT_W, 0x85, r, r);
+			unsigned char* ok = forth_jitjcc(a, FORTH_JIT_NE);
+			forth_jitsettop(a, a->nvals + 2); // Both operands are still in memory
+			forth_jitexit(a, pc, before);
+			forth_jitbind(a, ok);
+		}
+		forth_jitregop(a, FORTH_JIT_W, 0x89, l, FORTH_JIT_RAX);
+		if (FORTH_JIT_W) {
+			forth_jitbyte(a, 0x48);
+		}
+		forth_jitbyte(a, 0x99); // cdq/cqo
+		forth_jitregop(a, FORTH_JIT_W, 0xF7, 7, r); // idiv
+		forth_jitregop(a, FORTH_JIT_W, 0x89, c == '/' ? FORTH_JIT_RAX : FORTH_JIT_RDX, l);
+		break;
+	case 'R':
+	case 'L':
+		forth_jitregop(a, 0, 0x89, r, FORTH_JIT_RCX);
+		forth_jitregop(a, FORTH_JIT_W, 0xD3, c == 'R' ? 7 : 4, l);
+		break;
+	case '=':
+		forth_jitregop(a, FORTH_JIT_W, 0x39, r, l);
+		forth_jitregop(a, 0, 0x0F94, 0, FORTH_JIT_RAX); // sete al
+		goto boolean;
+	case 'A':
+	case 'O':
+		forth_jitregop(a, FORTH_JIT_W, 0x85, l, l);
+		forth_jitregop(a, 0, 0x0F95, 0, FORTH_JIT_RAX); // setne al
+		forth_jitregop(a, FORTH_JIT_W, 0x85, r, r);
+		forth_jitregop(a, 0, 0x0F95, 0, FORTH_JIT_RCX); // setne cl
+		forth_jitregop(a, 0, c == 'A' ? 0x20 : 0x08, FORTH_JIT_RCX, FORTH_JIT_RAX);
+	boolean:
+		forth_jitregop(a, 0, 0x0FB6, FORTH_JIT_RAX, FORTH_JIT_RAX);
+		forth_jitregop(a, FORTH_JIT_W, 0xF7, 3, FORTH_JIT_RAX); // neg
+		forth_jitregop(a, FORTH_JIT_W, 0x89, FORTH_JIT_RAX, l);
+		break;
+	}
+	forth_jitfree(a, r);
+	forth_jitpushval(a, (forth_jitval_t) { false, l, 0 });
+	return false;
+}
+
+// Jumps to out unless dsstart <= reg (or rsstart for the return stack) and reg < dsend, using tmp.
+FORTH_INLINE void forth_jitcheck(forth_jitasm_t* a, int reg, int tmp, bool rs, unsigned char** out, int* nout) {
+	forth_jitload(a, tmp, rs ? FORTH_JIT_HDR(rsstart) : FORTH_JIT_HDR(dsstart));
+	forth_jitregop(a, 1, 0x39, tmp, reg);
+	out[(*nout)++] = forth_jitjcc(a, FORTH_JIT_L);
+	forth_jitload(a, tmp, rs ? FORTH_JIT_HDR(rsend) : FORTH_JIT_HDR(dsend));
+	forth_jitregop(a, 1, 0x39, tmp, reg);
+	out[(*nout)++] = forth_jitjcc(a, FORTH_JIT_GE);
+}
+
+// Pushes pc to the return stack, unless it's full (like forth_pushreturn). Only changes rdx.
+FORTH_INLINE void forth_jitpushreturn(forth_jitasm_t* a, forth_word_t pc) {
+	unsigned char* skip[2];
+	int nskip = 0;
+	forth_jitcheck(a, FORTH_JIT_R13, FORTH_JIT_RDX, true, skip, &nskip);
+	forth_jitstoreimm(a, FORTH_JIT_AT(FORTH_JIT_R13, 0), (int32_t)pc);
+	forth_jitaluimm(a, 1, 0, FORTH_JIT_R13, 1);
+	forth_jitbind(a, skip[0]);
+	forth_jitbind(a, skip[1]);
+}
+
+// Loads the index entry at the address in rax into rax, or -1 if the address is outside the image. Changes rcx.
+FORTH_INLINE void forth_jitindexentry(forth_jitasm_t* a) {
+	forth_jitregop(a, 1, 0x85, FORTH_JIT_RAX, FORTH_JIT_RAX);
+	unsigned char* bad1 = forth_jitjcc(a, FORTH_JIT_S);
+	forth_jitload(a, FORTH_JIT_RCX, FORTH_JIT_HDR(fsize));
+	forth_jitregop(a, 1, 0x39, FORTH_JIT_RCX, FORTH_JIT_RAX);
+	unsigned char* bad2 = forth_jitjcc(a, FORTH_JIT_GE);
+	forth_jitload(a, FORTH_JIT_RAX, FORTH_JIT_AT(FORTH_JIT_RAX, 0));
+	unsigned char* found = forth_jitjmp(a);
+	forth_jitbind(a, bad1);
+	forth_jitbind(a, bad2);
+	forth_jitmovimm(a, FORTH_JIT_RAX, -1);
+	forth_jitbind(a, found);
+}
+
+/* Compiles a call, system call, call by index or tail call at pc. The instruction is read again every time, since
+ * quickening and forth_setlookupinstr change them.
+ */
+FORTH_INLINE void forth_jitcall(forth_jitasm_t* a, forth_word_t pc, long before) {
+	forth_jitload(a, FORTH_JIT_RAX, FORTH_JIT_WORD(pc));
+	forth_jitregop(a, 0, 0x89, FORTH_JIT_RAX, FORTH_JIT_RCX);
+	forth_jitaluimm(a, 0, 4, FORTH_JIT_RCX, 0xF);
+	forth_jitaluimm(a, 0, 7, FORTH_JIT_RCX, FORTH_OP_CALLINDEX);
+	unsigned char* notindex = forth_jitjcc(a, FORTH_JIT_NE);
+	forth_jitshiftimm(a, 1, 7, FORTH_JIT_RAX, 4);
+	forth_jitindexentry(a);
+	unsigned char* found = forth_jitjmp(a);
+	forth_jitbind(a, notindex);
+	forth_jitregop(a, 0, 0x89, FORTH_JIT_RAX, FORTH_JIT_RCX);
+	forth_jitaluimm(a, 0, 4, FORTH_JIT_RCX, 0xFF);
+	forth_jitaluimm(a, 0, 7, FORTH_JIT_RCX, FORTH_TAILINDEX_TAG);
+	unsigned char* direct = forth_jitjcc(a, FORTH_JIT_NE);
+	forth_jitshiftimm(a, 1, 7, FORTH_JIT_RAX, 8);
+	forth_jitindexentry(a);
+	// A tail call by index to a function is a tail call to it.
+	forth_jitregop(a, 0, 0x89, FORTH_JIT_RAX, FORTH_JIT_RCX);
+	forth_jitaluimm(a, 0, 4, FORTH_JIT_RCX, 0xF);
+	forth_jitaluimm(a, 0, 7, FORTH_JIT_RCX, FORTH_OP_CALLADDR);
+	unsigned char* nottail = forth_jitjcc(a, FORTH_JIT_NE);
+	forth_jitaluimm(a, 1, 0, FORTH_JIT_RAX, FORTH_OP_TAILCALL - FORTH_OP_CALLADDR);
+	forth_jitbind(a, direct);
+	forth_jitbind(a, found);
+	forth_jitbind(a, nottail);
+	forth_jitregop(a, 0, 0x89, FORTH_JIT_RAX, FORTH_JIT_RCX);
+	forth_jitaluimm(a, 0, 4, FORTH_JIT_RCX, 0xF);
+	forth_jitshiftimm(a, 1, 7, FORTH_JIT_RAX, 4);
+	forth_jitaluimm(a, 0, 7, FORTH_JIT_RCX, FORTH_OP_CALLADDR);
+	unsigned char* calladdr = forth_jitjcc(a, FORTH_JIT_E);
+	forth_jitaluimm(a, 0, 7, FORTH_JIT_RCX, FORTH_OP_TAILCALL);
+	unsigned char* tailcall = forth_jitjcc(a, FORTH_JIT_E);
+	forth_jitaluimm(a, 0, 7, FORTH_JIT_RCX, FORTH_OP_CALLSYS);
+	unsigned char* unset = forth_jitjcc(a, FORTH_JIT_NE);
+
+	// A system call, with the registers in the header like forth_run leaves them.
+	forth_jitregop(a, 0, 0x89, FORTH_JIT_RAX, FORTH_JIT_RDX);
+	forth_jitstoreimm(a, FORTH_JIT_HDR(pc), (int32_t)pc);
+	forth_jitstore(a, FORTH_JIT_HDR(dsp), FORTH_JIT_R12);
+	forth_jitstore(a, FORTH_JIT_HDR(rsp), FORTH_JIT_R13);
+	forth_jitregop(a, 1, 0x89, FORTH_JIT_RBX, FORTH_JIT_RDI);
+	forth_jitmemop(a, 1, 0x8B, FORTH_JIT_RSI, FORTH_JIT_CTX(udata));
+	forth_jitmemop(a, 0, 0xFF, 2, FORTH_JIT_CTX(callback));
+	forth_jitload(a, FORTH_JIT_R12, FORTH_JIT_HDR(dsp));
+	forth_jitload(a, FORTH_JIT_R13, FORTH_JIT_HDR(rsp));
+	forth_jitregop(a, 0, 0x84, FORTH_JIT_RAX, FORTH_JIT_RAX);
+	unsigned char* paused = forth_jitjcc(a, FORTH_JIT_NE);
+	forth_jitload(a, FORTH_JIT_RAX, FORTH_JIT_HDR(pc));
+	forth_jitaluimm(a, 1, 7, FORTH_JIT_RAX, (int32_t)pc);
+	unsigned char* moved = forth_jitjcc(a, FORTH_JIT_NE);
+	forth_jitjumpto(a, forth_jitjmp(a), pc + 1);
+	forth_jitbind(a, moved); // The callback changed pc
+	forth_jitaluimm(a, 1, 0, FORTH_JIT_RAX, 1);
+	forth_jitdispatch(a);
+	forth_jitbind(a, paused);
+	forth_jitmovimm(a, FORTH_JIT_RAX, FORTH_RUN_PAUSED);
+	forth_jitleave(a);
+
+	forth_jitbind(a, calladdr);
+	forth_jitpushreturn(a, pc);
+	forth_jitbind(a, tailcall);
+	forth_jitdispatch(a);
+
+	forth_jitbind(a, unset); // Let the interpreter fail
+	forth_jitexit(a, pc, before);
+}
+
+FORTH_INLINE void forth_jitreturn(forth_jitasm_t* a, forth_word_t pc, long before) {
+	unsigned char* out[4];
+	int nout = 0;
+	forth_jitlea(a, FORTH_JIT_RCX, FORTH_JIT_R13, -1);
+	forth_jitcheck(a, FORTH_JIT_RCX, FORTH_JIT_RAX, true, out, &nout);
+	forth_jitload(a, FORTH_JIT_RDX, FORTH_JIT_AT(FORTH_JIT_RCX, 0));
+	// Returning to a '!' loop, which pops a flag to decide whether to go round again?
+	forth_jitregop(a, 1, 0x85, FORTH_JIT_RDX, FORTH_JIT_RDX);
+	unsigned char* notloop1 = forth_jitjcc(a, FORTH_JIT_S);
+	forth_jitload(a, FORTH_JIT_RAX, FORTH_JIT_HDR(fsize));
+	forth_jitregop(a, 1, 0x39, FORTH_JIT_RAX, FORTH_JIT_RDX);
+	unsigned char* notloop2 = forth_jitjcc(a, FORTH_JIT_GE);
+	forth_jitmemop(a, FORTH_JIT_W, 0x81, 7, FORTH_JIT_AT(FORTH_JIT_RDX, 0));
+	forth_jitu32(a, FORTH_OP_LOOP);
+	unsigned char* notloop3 = forth_jitjcc(a, FORTH_JIT_NE);
+	forth_jitlea(a, FORTH_JIT_RSI, FORTH_JIT_R12, -1);
+	forth_jitcheck(a, FORTH_JIT_RSI, FORTH_JIT_RAX, false, out, &nout);
+	forth_jitregop(a, 1, 0x89, FORTH_JIT_RSI, FORTH_JIT_R12);
+	forth_jitregop(a, 1, 0x89, FORTH_JIT_RCX, FORTH_JIT_R13);
+	forth_jitregop(a, 1, 0x89, FORTH_JIT_RDX, FORTH_JIT_RAX);
+	forth_jitmemop(a, FORTH_JIT_W, 0x83, 7, FORTH_JIT_AT(FORTH_JIT_RSI, 0));
+	forth_jitbyte(a, 0);
+	forth_jitbindto(a, forth_jitjcc(a, FORTH_JIT_NE), a->jit->dispatchcode);
+	unsigned char* done = forth_jitjmp(a);
+	forth_jitbind(a, notloop1);
+	forth_jitbind(a, notloop2);
+	forth_jitbind(a, notloop3);
+	forth_jitregop(a, 1, 0x89, FORTH_JIT_RCX, FORTH_JIT_R13);
+	forth_jitregop(a, 1, 0x89, FORTH_JIT_RDX, FORTH_JIT_RAX);
+	forth_jitbind(a, done);
+	forth_jitaluimm(a, 1, 0, FORTH_JIT_RAX, 1);
+	forth_jitdispatch(a);
+	while (nout > 0) {
+		forth_jitbind(a, out[--nout]);
+	}
+	forth_jitexit(a, pc, before);
+}
+
+// Starts a '!' loop at pc, i.e. calls the block whose address is on top of the data stack.
+FORTH_INLINE void forth_jitloop(forth_jitasm_t* a, forth_word_t pc, long before) {
+	unsigned char* out[4];
+	int nout = 0;
+	forth_jitcheck(a, FORTH_JIT_R13, FORTH_JIT_RAX, true, out, &nout);
+	forth_jitlea(a, FORTH_JIT_RCX, FORTH_JIT_R12, -1);
+	forth_jitcheck(a, FORTH_JIT_RCX, FORTH_JIT_RAX, false, out, &nout);
+	forth_jitstoreimm(a, FORTH_JIT_AT(FORTH_JIT_R13, 0), (int32_t)pc);
+	forth_jitaluimm(a, 1, 0, FORTH_JIT_R13, 1);
+	forth_jitload(a, FORTH_JIT_RAX, FORTH_JIT_AT(FORTH_JIT_R12, -1));
+	forth_jitdispatch(a);
+	while (nout > 0) {
+		forth_jitbind(a, out[--nout]);
+	}
+	forth_jitexit(a, pc, before);
+}
+
+// The same for a block at pc + 1 that ends at end, and is pushed first.
+FORTH_INLINE void forth_jitblockloop(forth_jitasm_t* a, forth_word_t pc, forth_word_t end, long before) {
+	unsigned char* out[4];
+	int nout = 0;
+	forth_jitcheck(a, FORTH_JIT_R13, FORTH_JIT_RAX, true, out, &nout);
+	forth_jitcheck(a, FORTH_JIT_R12, FORTH_JIT_RAX, false, out, &nout);
+	forth_jitstoreimm(a, FORTH_JIT_AT(FORTH_JIT_R12, 0), (int32_t)(pc + 1));
+	forth_jitaluimm(a, 1, 0, FORTH_JIT_R12, 1);
+	forth_jitstoreimm(a, FORTH_JIT_AT(FORTH_JIT_R13, 0), (int32_t)end);
+	forth_jitaluimm(a, 1, 0, FORTH_JIT_R13, 1);
+	// Read the block address back in case the stacks overlap.
+	forth_jitload(a, FORTH_JIT_RAX, FORTH_JIT_AT(FORTH_JIT_R12, -1));
+	forth_jitaluimm(a, 1, 7, FORTH_JIT_RAX, (int32_t)(pc + 1));
+	forth_jitbindto(a, forth_jitjcc(a, FORTH_JIT_NE), a->jit->dispatchcode);
+	forth_jitjumpto(a, forth_jitjmp(a), pc + 1);
+	while (nout > 0) {
+		forth_jitbind(a, out[--nout]);
+	}
+	forth_jitexit(a, pc, before);
+}
+
+// Starts a basic block at pc, which checks up front that it can run to the end.
+FORTH_INLINE void forth_jitbeginblock(forth_jitasm_t* a, forth_word_t pc) {
+	a->labels[pc - a->start] = a->p;
+	a->islabel[pc - a->start] = 1;
+	a->steps = 0;
+	a->shift = 0;
+	a->low = 0;
+	a->high = 0;
+	a->blockrefunds = a->nrefunds;
+	a->freeregs = FORTH_JIT_VALREGS;
+	unsigned char* out[3];
+	a->stepsat[0] = forth_jitaluimm(a, 1, 7, FORTH_JIT_R14, 0);
+	out[0] = forth_jitjcc(a, FORTH_JIT_L);
+	forth_jitlea(a, FORTH_JIT_RAX, FORTH_JIT_R12, 0);
+	a->lowat = a->p - 4;
+	forth_jitload(a, FORTH_JIT_RCX, FORTH_JIT_HDR(dsstart));
+	forth_jitregop(a, 1, 0x39, FORTH_JIT_RCX, FORTH_JIT_RAX);
+	out[1] = forth_jitjcc(a, FORTH_JIT_L);
+	forth_jitlea(a, FORTH_JIT_RAX, FORTH_JIT_R12, 0);
+	a->highat = a->p - 4;
+	forth_jitload(a, FORTH_JIT_RCX, FORTH_JIT_HDR(dsend));
+	forth_jitregop(a, 1, 0x39, FORTH_JIT_RCX, FORTH_JIT_RAX);
+	out[2] = forth_jitjcc(a, FORTH_JIT_G);
+	a->stepsat[1] = forth_jitaluimm(a, 1, 5, FORTH_JIT_R14, 0);
+	int i;
+	for (i = 0; i < 3; i++) {
+		if (a->nexits < 3 * a->maxpatches) {
+			a->exits[a->nexits++] = (forth_jitpatch_t) { out[i], pc };
+		} else {
+			a->full = true;
+		}
+	}
+}
+
+FORTH_INLINE void forth_jitendblock(forth_jitasm_t* a) {
+	forth_jitset32(a, a->stepsat[0], (uint32_t)a->steps);
+	forth_jitset32(a, a->stepsat[1], (uint32_t)a->steps);
+	forth_jitset32(a, a->lowat, (uint32_t)a->low);
+	forth_jitset32(a, a->highat, (uint32_t)a->high);
+	int i;
+	for (i = a->blockrefunds; i < a->nrefunds; i++) {
+		forth_jitset32(a, a->refunds[i].at, (uint32_t)(a->steps - a->refunds[i].pc));
+	}
+}
+
+// Works out where the instruction at pc ends, or returns 0 if it can't be compiled.
+FORTH_INLINE forth_word_t forth_jitnext(forth_t* forth, forth_word_t pc) {
+	forth_word_t instr = forth->data.words[pc];
+	forth_word_t next = pc + 1;
+	switch (instr & 0xF) {
+	case FORTH_OP_PUSHSTR:
+		next += instr >> 4;
+		return (instr >> 4 >= 0 && next <= forth->header.codenext) ? next : 0;
+	case FORTH_OP_EXT:
+		if (forth_ispacked(instr)) {
+			next += forth_packedsize(instr >> 8);
+			return (instr >> 8 >= 0 && next <= forth->header.codenext) ? next : 0;
+		}
+		if (forth_isdense(instr)) {
+			forth_word_t wide;
+			return (forth_densecount(instr, &wide) >= 0 && next + wide <= forth->header.codenext) ? next + wide : 0;
+		}
+		return next;
+	case FORTH_OP_PUSHOP:
+	case FORTH_OP_OPOP:
+		return next + 1;
+	case FORTH_OP_PUSHBLOCK:
+	case FORTH_OP_BLOCKLOOP:
+		return (instr >> 4 > pc && instr >> 4 <= forth->header.codenext) ? next : 0;
+	default:
+		return next;
+	}
+}
+
+/* Whether a dense instruction (with its wide numbers at wide) can be compiled: like with the superinstructions, only
+ * an op in its first slot can go back to the interpreter to divide by zero, others need a non-zero number right
+ * before them.
+ */
+FORTH_INLINE bool forth_jitdensecheck(forth_word_t instr, const forth_word_t* wide) {
+	forth_word_t count, divisor = 0; // The number in the slot before, or 0
+	int n = forth_densecount(instr, &count);
+	int slot;
+	for (slot = 0; slot < n; slot++) {
+		int code = forth_denseslot(instr, slot);
+		if (code == FORTH_DENSE_SMALL) {
+			divisor = forth_denseslot(instr, ++slot);
+		} else if (code == FORTH_DENSE_WIDE) {
+			divisor = *wide++;
+		} else {
+			char c = FORTH_SIMPLEOPS[code - 1];
+			if ((c == '/' || c == '%') && slot > 0 && divisor == 0) {
+				return false;
+			}
+			divisor = 0;
+		}
+	}
+	return n >= 0;
+}
+
+// Compiles a dense instruction a slot at a time (after forth_jitdensecheck), returning true if it ends the block.
+FORTH_INLINE bool forth_jitdense(forth_jitasm_t* a, forth_word_t instr, forth_word_t pc, forth_word_t next, long before) {
+	const forth_word_t* wide = a->forth->data.words + pc + 1;
+	forth_word_t count;
+	int n = forth_densecount(instr, &count);
+	int slot;
+	for (slot = 0; slot < n; slot++) {
+		int code = forth_denseslot(instr, slot);
+		if (code == FORTH_DENSE_SMALL) {
+			forth_jitpushconst(a, forth_denseslot(instr, ++slot));
+		} else if (code == FORTH_DENSE_WIDE) {
+			forth_jitpushconst(a, *wide++);
+		} else if (forth_jitsimple(a, FORTH_SIMPLEOPS[code - 1], pc, next, before)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Compiles one instruction, returning true if it ends the block.
+FORTH_INLINE bool forth_jitinstr(forth_jitasm_t* a, forth_word_t pc, forth_word_t next) {
+	forth_word_t instr = a->forth->data.words[pc];
+	long before = a->steps;
+	char c, c2;
+	if (next == 0) {
+		goto unsupported;
+	}
+	switch (instr & 0xF) {
+	case FORTH_OP_PUSHINT:
+		a->steps++;
+		forth_jitpushconst(a, instr >> 4);
+		return false;
+	case FORTH_OP_PUSHSTR:
+		a->steps++;
+		forth_jitpushconst(a, pc);
+		return false;
+	case FORTH_OP_EXT:
+		if (forth_isdense(instr)) {
+			if (!forth_jitdensecheck(instr, a->forth->data.words + pc + 1)) {
+				goto unsupported;
+			}
+			a->steps++;
+			return forth_jitdense(a, instr, pc, next, before);
+		}
+		if ((instr & 0xFF) == FORTH_TAILINDEX_TAG) {
+			goto call;
+		}
+		if (!forth_ispacked(instr)) {
+			goto unsupported;
+		}
+		a->steps++;
+		forth_jitpushconst(a, pc);
+		return false;
+	case FORTH_OP_SIMPLE:
+		c = (char)(instr >> 4);
+		if (c == 0 || strchr(FORTH_SIMPLEOPS, c) == NULL) {
+			goto unsupported;
+		}
+		a->steps++;
+		return forth_jitsimple(a, c, pc, next, before);
+	case FORTH_OP_PUSHOP:
+		if (((instr >> 4) & 0xF) >= FORTH_SIMPLEOPCOUNT) {
+			goto unsupported;
+		}
+		c = FORTH_SIMPLEOPS[(instr >> 4) & 0xF];
+		if ((c == '/' || c == '%') && instr >> 8 == 0) {
+			goto unsupported;
+		}
+		a->steps++;
+		forth_jitpushconst(a, instr >> 8);
+		return forth_jitsimple(a, c, pc, next, before);
+	case FORTH_OP_OPOP:
+		if (((instr >> 4) & 0xF) >= FORTH_SIMPLEOPCOUNT - 1 || ((instr >> 8) & 0xF) >= FORTH_SIMPLEOPCOUNT) {
+			goto unsupported;
+		}
+		c = FORTH_SIMPLEOPS[(instr >> 4) & 0xF];
+		c2 = FORTH_SIMPLEOPS[(instr >> 8) & 0xF];
+		if (c2 == '/' || c2 == '%') { // Can't go back to before the first op to divide by zero
+			goto unsupported;
+		}
+		a->steps++;
+		forth_jitsimple(a, c, pc, next, before);
+		return forth_jitsimple(a, c2, pc, next, before);
+	case FORTH_OP_CALLADDR:
+	case FORTH_OP_CALLSYS:
+	case FORTH_OP_TAILCALL:
+	case FORTH_OP_CALLINDEX:
+	call:
+		a->steps++;
+		forth_jitspill(a);
+		forth_jitcall(a, pc, before);
+		return true;
+	case FORTH_OP_CONTROL:
+		a->steps++;
+		forth_jitspill(a);
+		forth_jitreturn(a, pc, before);
+		return true;
+	case FORTH_OP_PUSHBLOCK:
+		a->steps++;
+		forth_jitpushconst(a, pc + 1);
+		forth_jitspill(a);
+		forth_jitjumpto(a, forth_jitjmp(a), instr >> 4);
+		return true;
+	case FORTH_OP_LOOP:
+		a->steps++;
+		forth_jitspill(a);
+		forth_jitloop(a, pc, before);
+		return true;
+	case FORTH_OP_BLOCKLOOP:
+		a->steps++;
+		forth_jitspill(a);
+		forth_jitblockloop(a, pc, instr >> 4, before);
+		return true;
+	}
+unsupported:
+	forth_jitspill(a);
+	forth_jitexit(a, pc, before);
+	return true;
+}
+
+/* Makes the pages of native code covering the bytes from start to end writable, or else executable (so they're never
+ * both). Returns false if it can't.
+ */
+FORTH_INLINE bool forth_jitprotect(forth_jit_t* jit, size_t start, size_t end, bool writable) {
+	start -= start % jit->pagesize;
+	end = (end + jit->pagesize - 1) / jit->pagesize * jit->pagesize;
+	return start >= end || mprotect(jit->code + start, end - start, writable ? (PROT_READ | PROT_WRITE) : (PROT_READ | PROT_EXEC)) == 0;
+}
+
+/* Compiles the code from start to the return at the end of its word, making its blocks available to the hook and
+ * to other native code. Returns false if it can't (e.g. there's no room left).
+ */
+FORTH_INLINE bool forth_jitcompile(forth_jit_t* jit, forth_word_t start) {
+	forth_t* forth = jit->forth;
+	forth_word_t* words = forth->data.words;
+	forth_word_t codenext = forth->header.codenext;
+	if (jit->code == NULL || start < forth->header.codestart || start >= codenext || forth_jitnext(forth, start) == 0) {
+		return false;
+	}
+	size_t used = jit->codeused;
+	if (!forth_jitprotect(jit, used, jit->codesize, true)) {
+		return false;
+	}
+
+	// Find the end, skipping over blocks (which end with returns of their own).
+	forth_word_t nest[64];
+	int depth = 0;
+	long count = 0;
+	forth_word_t pc = start;
+	forth_word_t next;
+	while (pc < codenext && count < FORTH_JIT_MAXREGION && (next = forth_jitnext(forth, pc)) != 0) {
+		count++;
+		forth_word_t op = words[pc] & 0xF;
+		if ((op == FORTH_OP_PUSHBLOCK || op == FORTH_OP_BLOCKLOOP) && depth < 64) {
+			nest[depth++] = words[pc] >> 4;
+		} else if (op == FORTH_OP_CONTROL && depth == 0) {
+			pc = next;
+			break;
+		}
+		pc = next;
+		while (depth > 0 && pc >= nest[depth - 1]) {
+			depth--;
+		}
+	}
+	if (pc < codenext && count < FORTH_JIT_MAXREGION && forth_jitnext(forth, pc) == 0) {
+		pc++; // Include the instruction that stopped it, to exit there
+		count++;
+	}
+
+	forth_jitasm_t a;
+	memset(&a, 0, sizeof(a));
+	a.jit = jit;
+	a.forth = forth;
+	a.p = jit->code + jit->codeused;
+	a.end = jit->code + jit->codesize;
+	a.start = start;
+	a.stop = pc;
+	a.maxpatches = 2 * (int)count + 8;
+	a.islabel = calloc(a.stop - a.start, 1);
+	a.labels = calloc(a.stop - a.start, sizeof(unsigned char*));
+	a.jumps = malloc(a.maxpatches * sizeof(forth_jitpatch_t));
+	a.exits = malloc(3 * a.maxpatches * sizeof(forth_jitpatch_t));
+	a.refunds = malloc(a.maxpatches * sizeof(forth_jitpatch_t));
+	a.freeregs = FORTH_JIT_VALREGS;
+	bool ok = a.islabel != NULL && a.labels != NULL && a.jumps != NULL && a.exits != NULL && a.refunds != NULL;
+
+	/* Mark where blocks start inside the code that runs straight through: where blocks end (after jumping over
+	 * them) and at loops (returning from a loop's block runs the loop instruction again). Blocks also start after
+	 * anything that jumps.
+	 */
+	for (pc = start; ok && pc < a.stop; pc = next) {
+		next = forth_jitnext(forth, pc);
+		if (next == 0) {
+			break;
+		}
+		forth_word_t instr = words[pc];
+		forth_word_t targets[2] = { -1, -1 };
+		switch (instr & 0xF) {
+		case FORTH_OP_LOOP:
+			targets[0] = pc;
+			break;
+		case FORTH_OP_PUSHBLOCK:
+		case FORTH_OP_BLOCKLOOP:
+			targets[0] = pc + 1;
+			targets[1] = instr >> 4;
+			break;
+		}
+		int i;
+		for (i = 0; i < 2; i++) {
+			if (targets[i] >= start && targets[i] < a.stop) {
+				a.islabel[targets[i] - start] = 1;
+			}
+		}
+	}
+
+	bool ended = true;
+	for (pc = start; ok && pc < a.stop; pc = next) {
+		next = forth_jitnext(forth, pc);
+		if (ended || a.islabel[pc - start]) {
+			if (!ended) {
+				forth_jitspill(&a);
+			}
+			if (pc != start) {
+				forth_jitendblock(&a);
+			}
+			forth_jitbeginblock(&a, pc);
+		}
+		ended = forth_jitinstr(&a, pc, next);
+		if (pc == start && ended && a.steps == 0) {
+			ok = false; // It would only ever exit straight away
+		}
+		if (next == 0) {
+			pc = a.stop;
+			break;
+		}
+	}
+	if (ok) {
+		if (!ended) {
+			forth_jitspill(&a);
+			forth_jitjumpto(&a, forth_jitjmp(&a), pc);
+		}
+		forth_jitendblock(&a);
+		int i;
+		for (i = 0; i < a.nexits; i++) { // Out of steps or the stack needs checking
+			forth_jitbind(&a, a.exits[i].at);
+			if (i + 1 < a.nexits && a.exits[i + 1].pc == a.exits[i].pc) {
+				continue;
+			}
+			forth_jitstoreimm(&a, FORTH_JIT_HDR(pc), (int32_t)a.exits[i].pc);
+			forth_jitzero(&a, FORTH_JIT_RAX);
+			forth_jitleave(&a);
+		}
+		for (i = 0; i < a.njumps; i++) {
+			forth_word_t target = a.jumps[i].pc;
+			if (target >= start && target < a.stop && a.labels[target - start] != NULL) {
+				forth_jitbindto(&a, a.jumps[i].at, a.labels[target - start]);
+			} else { // Somewhere else, which might be compiled by the time it gets there
+				forth_jitbind(&a, a.jumps[i].at);
+				forth_jitmovimm(&a, FORTH_JIT_RAX, target);
+				forth_jitdispatch(&a);
+			}
+		}
+		ok = !a.full;
+	}
+	if (ok) {
+		for (pc = start; pc < a.stop; pc++) {
+			if (a.labels[pc - start] != NULL) {
+				jit->entry[pc - jit->codestart] = a.labels[pc - start];
+			}
+		}
+		jit->codeused = a.p - jit->code;
+		jit->regions++;
+	}
+	free(a.islabel);
+	free(a.labels);
+	free(a.jumps);
+	free(a.exits);
+	free(a.refunds);
+	// Make what's just been compiled executable (and the code before it again).
+	if (!forth_jitprotect(jit, used, jit->codeused, false)) {
+		forth_jitflush(jit);
+		return false;
+	}
+	return ok;
+}
+
+// Emits the code to enter native code and to leave it, and to jump to a code address.
+FORTH_INLINE void forth_jitbasecode(forth_jit_t* jit) {
+	forth_jitasm_t a;
+	memset(&a, 0, sizeof(a));
+	a.jit = jit;
+	a.p = jit->code;
+	a.end = jit->code + jit->codesize;
+	static const int saved[] = { FORTH_JIT_RBX, FORTH_JIT_RBP, FORTH_JIT_R12, FORTH_JIT_R13, FORTH_JIT_R14, FORTH_JIT_R15 };
+	int i;
+
+	// long enter(forth_jit_t* jit, void* native, long budget)
+	jit->enter = (forth_jitenter_t)(void*)a.p;
+	for (i = 0; i < 6; i++) {
+		forth_jitpush(&a, saved[i]);
+	}
+	forth_jitaluimm(&a, 1, 5, FORTH_JIT_RSP, 8); // Keep the stack aligned for callbacks
+	forth_jitregop(&a, 1, 0x89, FORTH_JIT_RDI, FORTH_JIT_R15);
+	forth_jitmemop(&a, 1, 0x8B, FORTH_JIT_RBX, FORTH_JIT_CTX(forth));
+	forth_jitload(&a, FORTH_JIT_R12, FORTH_JIT_HDR(dsp));
+	forth_jitload(&a, FORTH_JIT_R13, FORTH_JIT_HDR(rsp));
+	forth_jitregop(&a, 1, 0x89, FORTH_JIT_RDX, FORTH_JIT_R14);
+	forth_jitregop(&a, 0, 0xFF, 4, FORTH_JIT_RSI);
+
+	jit->exitcode = a.p;
+	forth_jitstore(&a, FORTH_JIT_HDR(dsp), FORTH_JIT_R12);
+	forth_jitstore(&a, FORTH_JIT_HDR(rsp), FORTH_JIT_R13);
+	forth_jitmemop(&a, 1, 0x89, FORTH_JIT_R14, FORTH_JIT_CTX(budget));
+	forth_jitaluimm(&a, 1, 0, FORTH_JIT_RSP, 8);
+	for (i = 5; i >= 0; i--) {
+		forth_jitpop(&a, saved[i]);
+	}
+	forth_jitbyte(&a, 0xC3);
+
+	jit->dispatchcode = a.p;
+	forth_jitstore(&a, FORTH_JIT_HDR(pc), FORTH_JIT_RAX);
+	forth_jitregop(&a, 1, 0x89, FORTH_JIT_RAX, FORTH_JIT_RCX);
+	forth_jitmemop(&a, 1, 0x2B, FORTH_JIT_RCX, FORTH_JIT_CTX(codestart));
+	forth_jitmemop(&a, 1, 0x3B, FORTH_JIT_RCX, FORTH_JIT_CTX(ntable));
+	unsigned char* out1 = forth_jitjcc(&a, FORTH_JIT_AE);
+	forth_jitmemop(&a, 1, 0x8B, FORTH_JIT_RDX, FORTH_JIT_CTX(entry));
+	forth_jitmemop(&a, 1, 0x8B, FORTH_JIT_RDX, (forth_jitmem_t) { FORTH_JIT_RDX, FORTH_JIT_RCX, 3, 0 });
+	forth_jitregop(&a, 1, 0x85, FORTH_JIT_RDX, FORTH_JIT_RDX);
+	unsigned char* out2 = forth_jitjcc(&a, FORTH_JIT_E);
+	forth_jitregop(&a, 0, 0xFF, 4, FORTH_JIT_RDX);
+	forth_jitbind(&a, out1);
+	forth_jitbind(&a, out2);
+	forth_jitzero(&a, FORTH_JIT_RAX);
+	forth_jitleave(&a);
+
+	// The rest starts on a page of its own, so this stays executable while it's written.
+	jit->codebase = ((size_t)(a.p - jit->code) + jit->pagesize - 1) / jit->pagesize * jit->pagesize;
+	jit->codeused = jit->codebase;
+}
+
+#undef FORTH_JIT_RAX
+#undef FORTH_JIT_RCX
+#undef FORTH_JIT_RDX
+#undef FORTH_JIT_RBX
+#undef FORTH_JIT_RSP
+#undef FORTH_JIT_RBP
+#undef FORTH_JIT_RSI
+#undef FORTH_JIT_RDI
+#undef FORTH_JIT_R8
+#undef FORTH_JIT_R11
+#undef FORTH_JIT_R12
+#undef FORTH_JIT_R13
+#undef FORTH_JIT_R14
+#undef FORTH_JIT_R15
+
+#else
+
+FORTH_INLINE bool forth_jitcompile(forth_jit_t* jit, forth_word_t start) {
+	return false;
+}
+
+#endif // FORTH_JIT_NATIVE
+
+/* Makes a JIT compiler for an image, compiling code once it's been arrived at threshold times (0 for the default)
+ * into up to codesize bytes of native code (0 for the default). Returns NULL on failure (including for instances of
+ * a shared segment). Use it with forth_jitrun instead of forth_run, and free it with forth_jitdestroy (before the
+ * image).
+ */
+FORTH_INLINE forth_jit_t* forth_jitcreate(forth_t* forth, long threshold, size_t codesize) {
+	(void)codesize;
+	if (forth_isinstance(forth)) {
+		return NULL;
+	}
+	forth_jit_t* jit = calloc(1, sizeof(forth_jit_t));
+	if (jit == NULL) {
+		return NULL;
+	}
+	jit->forth = forth;
+	jit->codestart = forth->header.codestart;
+	jit->ntable = forth->header.codeend - forth->header.codestart;
+	jit->threshold = (threshold > 0 && threshold < FORTH_JIT_NEVER) ? (uint32_t)threshold : FORTH_JIT_THRESHOLD;
+	jit->entry = calloc(jit->ntable > 0 ? jit->ntable : 1, sizeof(void*));
+	jit->counts = calloc(jit->ntable > 0 ? jit->ntable : 1, sizeof(uint32_t));
+	if (jit->entry == NULL || jit->counts == NULL) {
+		free(jit->entry);
+		free(jit->counts);
+		free(jit);
+		return NULL;
+	}
+#ifdef FORTH_JIT_NATIVE
+	long pagesize = sysconf(_SC_PAGESIZE);
+	jit->pagesize = pagesize > 0 ? (size_t)pagesize : 4096;
+	jit->codesize = codesize > 0 ? codesize : FORTH_JIT_CODESIZE;
+	jit->codesize = (jit->codesize + jit->pagesize - 1) / jit->pagesize * jit->pagesize;
+	void* code = mmap(NULL, jit->codesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code != MAP_FAILED) { // Otherwise it just interprets
+		jit->code = code;
+		forth_jitbasecode(jit);
+		if (jit->codebase >= jit->codesize || !forth_jitprotect(jit, 0, jit->codebase, false)) {
+			munmap(jit->code, jit->codesize);
+			jit->code = NULL;
+		}
+	}
+#endif
+	return jit;
+}
+
+FORTH_INLINE void forth_jitdestroy(forth_jit_t* jit) {
+#ifdef FORTH_JIT_NATIVE
+	if (jit->code != NULL) {
+		munmap(jit->code, jit->codesize);
+	}
+#endif
+	free(jit->entry);
+	free(jit->counts);
+	free(jit);
+}
+
+// Throws away all native code (and the counts), e.g. after changing code that had already run.
+FORTH_INLINE void forth_jitflush(forth_jit_t* jit) {
+	memset(jit->entry, 0, jit->ntable * sizeof(void*));
+	memset(jit->counts, 0, jit->ntable * sizeof(uint32_t));
+	jit->codeused = jit->codebase;
+	jit->regions = 0;
+}
+
+/* The hook that forth_jitrun gives forth_runhooked: runs native code from pc if there is any, or compiles it if
+ * it's hot enough, then carries on natively for as long as it can.
+ */
+FORTH_INLINE forth_word_t forth_jithook(forth_t* forth, void* hookdata, forth_callback_t callback, void* udata, long maxsteps, long* used) {
+	forth_jit_t* jit = (forth_jit_t*)hookdata;
+	if (jit->code == NULL || forth_iswaiting(forth)) { // The interpreter returns FORTH_RUN_WAITING for a parked VM
+		return FORTH_RUN_BUDGET;
+	}
+	jit->callback = callback;
+	jit->udata = udata;
+	while (*used < maxsteps) {
+		int64_t i = (int64_t)forth->header.pc - jit->codestart;
+		if (i < 0 || i >= jit->ntable) {
+			break;
+		}
+		void* native = jit->entry[i];
+		if (native == NULL) {
+			if (jit->counts[i] == FORTH_JIT_NEVER || ++jit->counts[i] < jit->threshold) {
+				break;
+			}
+			if (!forth_jitcompile(jit, forth->header.pc)) {
+				jit->counts[i] = FORTH_JIT_NEVER;
+				break;
+			}
+			native = jit->entry[i];
+		}
+		long budget = maxsteps - *used;
+		long status = jit->enter(jit, native, budget);
+		*used += budget - jit->budget;
+		if (status != FORTH_RUN_BUDGET) {
+			return (status == FORTH_RUN_PAUSED && forth_iswaiting(forth)) ? FORTH_RUN_WAITING : (forth_word_t)status;
+		}
+		if (jit->budget == budget) { // Didn't get anywhere, let the interpreter deal with it
+			break;
+		}
+	}
+	return FORTH_RUN_BUDGET;
+}
+
+// Runs up to maxsteps instructions like forth_run, using native code where it's been compiled.
+FORTH_INLINE forth_word_t forth_jitrun(forth_jit_t* jit, forth_callback_t callback, void* udata, long maxsteps, long* stepsout) {
+	long used = 0;
+	long more = 0;
+	forth_word_t status = forth_jithook(jit->forth, jit, callback, udata, maxsteps, &used);
+	if (status == FORTH_RUN_BUDGET) {
+		status = forth_runhooked(jit->forth, callback, udata, maxsteps - used, &more, &forth_jithook, jit);
+	}
+	if (stepsout != NULL) {
+		*stepsout = used + more;
+	}
+	return status;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,343 @@
+/* Precompiled modules, so a program can start without assembling its source again (and looking up every name in it
+ * and defining every word as it goes). A module holds a stretch of assembled code (string literals and all), where
+ * in it the code refers to its own addresses or to index entries, and the names it uses and defines. Loading one is
+ * a copy of its code to codenext and one pass over those places, with each name looked up just once.
+ *
+ * To make one, mark where it starts, assemble and define words as usual, then write out everything since the mark:
+ *
+ *	forth_modmark_t mark;
+ *	forth_modbegin(forth, &mark);
+ *	... forth_asmfeed, forth_setlookupinstr and so on ...
+ *	forth_word_t size = forth_modwrite(forth, &mark, NULL, 0);
+ *	forth_word_t* mod = malloc(size * sizeof(forth_word_t));
+ *	forth_modwrite(forth, &mark, mod, size);
+ *	...
+ *	forth_word_t addr = forth_modload(other, mod, size);
+ *
+ * The words a module defines are the index entries added since the mark that have been set (including host words,
+ * so a module can bring its own sys.* definitions along), and older ones that now call or push its code. Any other
+ * name its code calls is imported, i.e. it's linked to the entry of the same name in the image it's loaded into
+ * (which is added if there isn't one yet, just like the assembler would). The code can't call or push code outside
+ * the module by its address, and forth_modload turns down a module that tries to.
+ *
+ * Modules are stored as words in the host's word size and byte order, like saved images.
+ */
+
+#ifndef FORTH_MODULE_H
+#define FORTH_MODULE_H
+
+#include "forth.h"
+
+#define FORTH_MODULE_MAGIC	((forth_word_t) 0x4D0D0CE5) // Truncated in 16-bit mode
+#define FORTH_MODULE_VERSION	1
+
+// Kinds of symbols.
+#define FORTH_MODULE_IMPORT	0 // A name the code calls, linked to whatever it is in the image
+#define FORTH_MODULE_EXPORT	1 // A name it defines, as the instruction given
+#define FORTH_MODULE_EXPORTCODE	2 // A name it defines, as an instruction calling or pushing an address in its code
+
+/* A module starts with this header, followed by codesize words of code, nrelocs relocations, nsymbols symbols and
+ * namesize words of names. In the code, the arguments of calls and blocks are offsets from the start of the module
+ * and those of calls by index (including tail calls) are symbol numbers. Each relocation is the offset of one of those
+ * instructions (in increasing order), and each name is a packed string.
+ */
+typedef struct forth_modheader forth_modheader_t;
+typedef struct forth_modsymbol forth_modsymbol_t;
+typedef struct forth_modmark forth_modmark_t;
+
+struct forth_modheader {
+	forth_word_t magic;
+	forth_word_t version;
+	forth_word_t codesize;
+	forth_word_t nrelocs;
+	forth_word_t nsymbols;
+	forth_word_t namesize;
+};
+
+struct forth_modsymbol {
+	forth_word_t kind;
+	forth_word_t instr;	// For the ones it defines
+	forth_word_t name;	// Offset of the name from the start of the names
+};
+
+#define FORTH_MODULE_HEADERWORDS	((forth_word_t)(sizeof(forth_modheader_t) / sizeof(forth_word_t)))
+#define FORTH_MODULE_SYMBOLWORDS	((forth_word_t)(sizeof(forth_modsymbol_t) / sizeof(forth_word_t)))
+
+struct forth_modmark {
+	forth_word_t codestart;
+	forth_word_t indexnext;
+};
+
+// Whether an instruction's argument is an address in the code.
+FORTH_INLINE bool forth_modiscode(forth_word_t instr) {
+	forth_word_t op = instr & 0xF;
+	return op == FORTH_OP_CALLADDR || op == FORTH_OP_TAILCALL || op == FORTH_OP_PUSHBLOCK || op == FORTH_OP_BLOCKLOOP;
+}
+
+/* Whether an instruction's argument is an address between start and end (which a block can end at, but a call
+ * can't go to).
+ */
+FORTH_INLINE bool forth_modinrange(forth_word_t instr, forth_word_t start, forth_word_t end) {
+	forth_word_t addr = instr >> 4;
+	return addr >= start && (addr < end || (addr == end && (instr & 0xF) != FORTH_OP_CALLADDR && (instr & 0xF) != FORTH_OP_TAILCALL));
+}
+
+// How many words after an instruction belong to it (the characters of a string or the numbers of dense code).
+FORTH_INLINE forth_word_t forth_modoperands(forth_word_t instr) {
+	forth_word_t n = 0;
+	if ((instr & 0xF) == FORTH_OP_PUSHSTR) {
+		n = instr >> 4;
+	} else if (forth_ispacked(instr)) {
+		n = forth_packedsize(instr >> 8);
+	} else if (forth_isdense(instr) && forth_densecount(instr, &n) < 0) {
+		n = 0;
+	}
+	return n;
+}
+
+/* Marks the start of a module at codenext. Nothing assembled after this is fused into (or packed into the dense
+ * instruction of) code before it.
+ */
+FORTH_INLINE void forth_modbegin(forth_t* forth, forth_modmark_t* mark) {
+	mark->codestart = forth->header.codenext;
+	mark->indexnext = forth->header.indexnext;
+	forth_asmnote(forth, -1, 0);
+}
+
+/* Whether the index entry at tableaddr is one the module defines, setting *kind. Returns -1 if it should be but
+ * can't be (because it calls code outside the module by address, or is an alias for another entry).
+ */
+FORTH_INLINE int forth_modexported(forth_t* forth, const forth_modmark_t* mark, forth_word_t tableaddr, forth_word_t* kind) {
+	forth_word_t instr = forth->data.words[tableaddr + 1];
+	bool inrange = forth_modiscode(instr) && forth_modinrange(instr, mark->codestart, forth->header.codenext);
+	if (!inrange && (tableaddr < mark->indexnext || instr == 0)) {
+		return 0;
+	}
+	if ((forth_modiscode(instr) && !inrange) || forth_indexcallentry(instr) >= 0) {
+		return -1;
+	}
+	*kind = inrange ? FORTH_MODULE_EXPORTCODE : FORTH_MODULE_EXPORT;
+	return 1;
+}
+
+// Copies the name of the index entry at tableaddr to out as a packed string.
+FORTH_INLINE void forth_modputname(forth_t* forth, forth_word_t tableaddr, forth_word_t* out) {
+	forth_word_t nameaddr = forth->data.words[tableaddr];
+	bool packed = false;
+	forth_word_t len = forth_strheader(forth, nameaddr, &packed);
+	forth_word_t j;
+	out[forth_packedsize(len)] = 0; // Clear the end of the last word
+	out[0] = forth_encode(forth, FORTH_OP_EXT, (len << 4) | FORTH_EXT_PUSHBYTES);
+	if (packed) {
+		memcpy(out + 1, forth->data.words + nameaddr + 1, (size_t)len);
+	} else {
+		for (j = 0; j < len; j++) {
+			((char*)(out + 1))[j] = (char)forth->data.words[nameaddr + 1 + j];
+		}
+	}
+}
+
+/* Writes the module made of the code and index entries added since the mark to out, if it fits in outsize words.
+ * Returns the size of the module in words either way (so it can be called with a NULL out to find out how much room
+ * it needs), or -1 if the code can't be made into one. Quickened calls are turned back into calls by name first.
+ */
+FORTH_INLINE forth_word_t forth_modwrite(forth_t* forth, const forth_modmark_t* mark, forth_word_t* out, forth_word_t outsize) {
+	forth_header_t* h = &forth->header;
+	forth_word_t* words = forth->data.words;
+	forth_word_t start = mark->codestart;
+	forth_word_t end = h->codenext;
+	if (forth_isinstance(forth) || start < h->codestart || start > end || end > h->codeend
+		|| mark->indexnext < h->indexstart || mark->indexnext > h->indexnext) {
+		return -1;
+	}
+	forth_unquicken(forth);
+
+	// Number every entry the module defines or calls, defined ones first.
+	forth_word_t nentries = (h->indexnext - h->indexstart) / 2;
+	forth_word_t* symbols = calloc((size_t)nentries * 2 + 1, sizeof(forth_word_t)); // Entry to symbol number + 1, then symbol to entry
+	if (symbols == NULL) {
+		return -1;
+	}
+	forth_word_t* entries = symbols + nentries;
+	long nsymbols = 0, nrelocs = 0, namesize = 0;
+	forth_word_t i, kind, instr;
+	bool packed;
+	int result = 0;
+	for (i = 0; i < nentries && result >= 0; i++) {
+		forth_word_t tableaddr = h->indexstart + i * 2;
+		result = forth_modexported(forth, mark, tableaddr, &kind);
+		if (result > 0) {
+			symbols[i] = ++nsymbols;
+			entries[nsymbols - 1] = tableaddr;
+		}
+	}
+	forth_word_t nexports = nsymbols;
+	for (i = start; i < end && result >= 0; i++) {
+		instr = words[i];
+		if (forth_modiscode(instr)) {
+			result = forth_modinrange(instr, start, end) ? 0 : -1;
+			nrelocs++;
+		} else if (forth_indexcallentry(instr) >= 0) {
+			forth_word_t tableaddr = forth_indexcallentry(instr) - 1;
+			forth_word_t e = (tableaddr - h->indexstart) / 2;
+			if (tableaddr < h->indexstart || (tableaddr - h->indexstart) % 2 != 0 || e >= nentries) {
+				result = -1;
+			} else if (symbols[e] == 0) {
+				symbols[e] = ++nsymbols;
+				entries[nsymbols - 1] = tableaddr;
+			}
+			nrelocs++;
+		}
+		if (forth_modoperands(instr) > end - 1 - i) {
+			result = -1;
+		}
+		i += forth_modoperands(instr);
+	}
+	for (i = 0; i < nsymbols && result >= 0; i++) {
+		forth_word_t len = forth_strheader(forth, words[entries[i]], &packed);
+		if (len < 0 || len > FORTH_PACKED_MAXLEN) {
+			result = -1;
+		}
+		namesize += 1 + forth_packedsize(len);
+	}
+	long total = FORTH_MODULE_HEADERWORDS + (long)(end - start) + nrelocs + nsymbols * FORTH_MODULE_SYMBOLWORDS + namesize;
+	if (result < 0 || (forth_word_t)total != total || total < 0) {
+		free(symbols);
+		return -1;
+	}
+	if (out == NULL || outsize < total) {
+		free(symbols);
+		return (forth_word_t)total;
+	}
+
+	forth_modheader_t* mh = (forth_modheader_t*)out;
+	mh->magic = FORTH_MODULE_MAGIC;
+	mh->version = FORTH_MODULE_VERSION;
+	mh->codesize = end - start;
+	mh->nrelocs = (forth_word_t)nrelocs;
+	mh->nsymbols = (forth_word_t)nsymbols;
+	mh->namesize = (forth_word_t)namesize;
+	forth_word_t* code = out + FORTH_MODULE_HEADERWORDS;
+	forth_word_t* relocs = code + mh->codesize;
+	forth_modsymbol_t* syms = (forth_modsymbol_t*)(relocs + nrelocs);
+	forth_word_t* names = (forth_word_t*)(syms + nsymbols);
+	memcpy(code, words + start, (size_t)mh->codesize * sizeof(forth_word_t));
+	nrelocs = 0;
+	for (i = 0; i < mh->codesize; i++) {
+		instr = code[i];
+		if (forth_modiscode(instr)) {
+			code[i] = forth_encode(forth, instr & 0xF, (instr >> 4) - start);
+			relocs[nrelocs++] = i;
+		} else if (forth_indexcallentry(instr) >= 0) {
+			code[i] = forth_encodeindexcall(forth, symbols[(forth_indexcallentry(instr) - 1 - h->indexstart) / 2] - 1, (instr & 0xF) == FORTH_OP_EXT);
+			relocs[nrelocs++] = i;
+		}
+		i += forth_modoperands(instr);
+	}
+	forth_word_t nameoffset = 0;
+	for (i = 0; i < nsymbols; i++) {
+		instr = words[entries[i] + 1];
+		syms[i].kind = FORTH_MODULE_IMPORT;
+		syms[i].instr = 0;
+		if (i < nexports) {
+			forth_modexported(forth, mark, entries[i], &syms[i].kind);
+			syms[i].instr = (syms[i].kind == FORTH_MODULE_EXPORTCODE) ? forth_encode(forth, instr & 0xF, (instr >> 4) - start) : instr;
+		}
+		syms[i].name = nameoffset;
+		forth_modputname(forth, entries[i], names + nameoffset);
+		nameoffset += 1 + forth_packedsize(names[nameoffset] >> 8);
+	}
+	free(symbols);
+	return (forth_word_t)total;
+}
+
+// Adds base to the address an instruction's argument is an offset of, or returns -1 if the result can't be encoded.
+FORTH_INLINE forth_word_t forth_modrelocate(forth_t* forth, forth_word_t instr, forth_word_t base) {
+	forth_word_t addr = (instr >> 4) + base;
+	if (addr < base || (forth_word_t)((uintmax_t)addr << 4) >> 4 != addr) {
+		return -1;
+	}
+	return forth_encode(forth, instr & 0xF, addr);
+}
+
+/* Loads a module of size words at codenext, linking its code to the index and defining its words. Returns the address
+ * its code starts at, or -1 if it isn't a valid module or doesn't fit (in which case the code isn't kept, though the
+ * index may have gained some of the names it uses).
+ */
+FORTH_INLINE forth_word_t forth_modload(forth_t* forth, const forth_word_t* mod, forth_word_t size) {
+	forth_header_t* h = &forth->header;
+	const forth_modheader_t* mh = (const forth_modheader_t*)mod;
+	if (size < FORTH_MODULE_HEADERWORDS || mh->magic != FORTH_MODULE_MAGIC || mh->version != FORTH_MODULE_VERSION
+		|| mh->codesize < 0 || mh->nrelocs < 0 || mh->nsymbols < 0 || mh->namesize < 0
+		|| FORTH_MODULE_HEADERWORDS + (long)mh->codesize + mh->nrelocs + (long)mh->nsymbols * FORTH_MODULE_SYMBOLWORDS + mh->namesize != size
+		|| forth_isinstance(forth) || h->codenext < h->codestart || mh->codesize > h->codeend - h->codenext) {
+		return -1;
+	}
+	forth_word_t base = h->codenext;
+	forth_word_t* code = forth->data.words + base;
+	const forth_word_t* relocs = mod + FORTH_MODULE_HEADERWORDS + mh->codesize;
+	const forth_modsymbol_t* syms = (const forth_modsymbol_t*)(relocs + mh->nrelocs);
+	const forth_word_t* names = (const forth_word_t*)(syms + mh->nsymbols);
+	forth_word_t* tableaddrs = malloc(((size_t)mh->nsymbols + 1) * sizeof(forth_word_t));
+	forth_word_t i, instr;
+	if (tableaddrs == NULL) {
+		return -1;
+	}
+	memcpy(code, mod + FORTH_MODULE_HEADERWORDS, (size_t)mh->codesize * sizeof(forth_word_t));
+
+	// Each name is looked up (or added) once.
+	for (i = 0; i < mh->nsymbols; i++) {
+		forth_word_t offset = syms[i].name;
+		forth_word_t len = (offset >= 0 && offset < mh->namesize && forth_ispacked(names[offset])) ? names[offset] >> 8 : -1;
+		if (len < 0 || forth_packedsize(len) > mh->namesize - 1 - offset || syms[i].kind < FORTH_MODULE_IMPORT || syms[i].kind > FORTH_MODULE_EXPORTCODE
+			|| (syms[i].kind == FORTH_MODULE_EXPORTCODE && (!forth_modiscode(syms[i].instr) || !forth_modinrange(syms[i].instr, 0, mh->codesize)
+				|| forth_modrelocate(forth, syms[i].instr, base) == -1))
+			|| (syms[i].kind == FORTH_MODULE_EXPORT && (forth_modiscode(syms[i].instr) || forth_indexcallentry(syms[i].instr) >= 0))
+			|| (tableaddrs[i] = forth_lookuptableaddrl(forth, (const char*)(names + offset + 1), len)) == 0) {
+			goto fail;
+		}
+	}
+
+	/* Then a single pass over the code links it, going through the relocations in step. Every call or block and every
+	 * call by index has to be one of them (so nothing can refer to code outside the module), and nothing else.
+	 */
+	forth_word_t r = 0;
+	for (i = 0; i < mh->codesize; i++) {
+		instr = code[i];
+		bool linked = forth_modiscode(instr) || forth_indexcallentry(instr) >= 0;
+		if (forth_modoperands(instr) > mh->codesize - 1 - i || linked != (r < mh->nrelocs && relocs[r] == i)) {
+			goto fail;
+		}
+		if (forth_indexcallentry(instr) >= 0) {
+			if (forth_indexcallentry(instr) >= mh->nsymbols) {
+				goto fail;
+			}
+			code[i] = forth_encodeindexcall(forth, tableaddrs[forth_indexcallentry(instr)] + 1, (instr & 0xF) == FORTH_OP_EXT);
+		} else if (linked && (!forth_modinrange(instr, 0, mh->codesize) || (code[i] = forth_modrelocate(forth, instr, base)) == -1)) {
+			goto fail;
+		}
+		r += linked;
+		i += forth_modoperands(instr);
+	}
+	if (r != mh->nrelocs) {
+		goto fail;
+	}
+
+	// Everything's been checked, so the words it defines can't be left pointing at code that isn't kept.
+	for (i = 0; i < mh->nsymbols; i++) {
+		instr = syms[i].kind == FORTH_MODULE_EXPORTCODE ? forth_modrelocate(forth, syms[i].instr, base) : syms[i].instr;
+		if (syms[i].kind != FORTH_MODULE_IMPORT) {
+			forth_setindexinstr(forth, tableaddrs[i], instr);
+		}
+	}
+	free(tableaddrs);
+	h->codenext += mh->codesize;
+	forth_asmnote(forth, -1, 0);
+	return base;
+
+fail:
+	free(tableaddrs);
+	return -1;
+}
+
+#endif
@@ -0,0 +1,504 @@
+/* A profiler that works out which words a script spends its time in.
+ *
+ * forth_profrun runs an image like forth_run, but one instruction at a time (each is a forth_run of a single step,
+ * i.e. forth_step without losing FORTH_RUN_PAUSED). Every instruction, call, host callback and the time in between is
+ * charged to the index entry whose code it's in, with code outside of any word charged to "(top)". A word's code is
+ * everything from the address in its FORTH_OP_CALLADDR entry to the return that ends it, including its blocks. Host
+ * words (FORTH_OP_CALLSYS entries) are charged the calls to them and the time spent in their callbacks. Every period
+ * steps it can also take a sample of the return stack, from rsstart to rsp, and forth_profwritefolded writes the
+ * samples in the "folded" format flamegraph tools read (one "outer;inner;leaf count" line per stack). A word that
+ * ends in a tail call (see FORTH_ASM_TAILCALL) has left the stack by the time the word it calls runs.
+ *
+ * It's only compiled in if FORTH_PROFILE is defined. Otherwise a forth_prof_t just holds the image, forth_profrun is
+ * forth_run and the rest do nothing, so hosts can leave their profiling calls in every build.
+ */
+
+#ifndef FORTH_PROF_H
+#define FORTH_PROF_H
+
+#include "forth.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct forth_profstats forth_profstats_t;
+typedef struct forth_prof forth_prof_t;
+
+// What has been charged to a word.
+struct forth_profstats {
+	long instrs;		// Instructions run in its own code
+	long calls;		// Times it was called (for host words, times their callback ran)
+	long callbacks;		// Host callbacks its own code made
+	int64_t ns;		// Nanoseconds spent in its own code, or in the callback for host words
+};
+
+#ifdef FORTH_PROFILE
+
+#define FORTH_PROF_MAXDEPTH	128 // Deeper stacks are sampled without their outermost frames
+#define FORTH_PROF_MAXNAME	64
+
+typedef struct forth_profstack forth_profstack_t;
+typedef struct forth_profsys forth_profsys_t;
+
+struct forth_profstack {
+	uint32_t hash;
+	int depth;
+	int* ids;		// Words from the outermost to the innermost, or NULL for an empty slot
+	long count;
+};
+
+struct forth_profsys {
+	forth_word_t sysnum;
+	int id;
+};
+
+/* Words are numbered by their position in the index (plus one, 0 is for "(top)"), so counts stay with the same
+ * word when more are defined.
+ */
+struct forth_prof {
+	forth_t* forth;
+	forth_callback_t callback;	// The host's, while forth_profrun is running
+	void* udata;
+	forth_profstats_t* words;
+	int nwords;
+	int* owner;		// The word each address in the code segment belongs to
+	forth_word_t ownerlen;
+	forth_profsys_t* sys;	// Host words by sysnum, sorted
+	int nsys;
+	forth_word_t scannedindex;	// indexnext and codenext when owner and sys were worked out
+	forth_word_t scannedcode;
+	int current;		// The word running the instruction being stepped
+	int64_t last;		// When time was last charged to a word
+	long period;
+	long untilsample;
+	forth_profstack_t* stacks;
+	long nstacks;
+	long stackslots;	// A power of two
+	int frames[FORTH_PROF_MAXDEPTH];
+};
+
+FORTH_INLINE int64_t forth_profnow(void) {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Makes a profiler for an image, which takes a sample of the stack every period steps (or never if it's 0).
+ * Returns NULL if it runs out of memory, or for an instance of a shared segment (profile the master instead).
+ */
+FORTH_INLINE forth_prof_t* forth_profcreate(forth_t* forth, long period) {
+	if (forth_isinstance(forth)) {
+		return NULL;
+	}
+	forth_prof_t* prof = calloc(1, sizeof(forth_prof_t));
+	if (prof == NULL) {
+		return NULL;
+	}
+	prof->forth = forth;
+	prof->period = period;
+	prof->untilsample = period;
+	prof->nwords = 1 + (int)((forth->header.indexend - forth->header.indexstart) / 2);
+	prof->words = calloc(prof->nwords, sizeof(forth_profstats_t));
+	prof->owner = calloc(forth->header.codeend - forth->header.codestart + 1, sizeof(int));
+	prof->sys = calloc(prof->nwords, sizeof(forth_profsys_t));
+	prof->stackslots = 256;
+	prof->stacks = calloc(prof->stackslots, sizeof(forth_profstack_t));
+	prof->scannedindex = -1;
+	if (prof->words == NULL || prof->owner == NULL || prof->sys == NULL || prof->stacks == NULL) {
+		free(prof->words);
+		free(prof->owner);
+		free(prof->sys);
+		free(prof->stacks);
+		free(prof);
+		return NULL;
+	}
+	return prof;
+}
+
+FORTH_INLINE void forth_profdestroy(forth_prof_t* prof) {
+	long i;
+	for (i = 0; i < prof->stackslots; i++) {
+		free(prof->stacks[i].ids);
+	}
+	free(prof->words);
+	free(prof->owner);
+	free(prof->sys);
+	free(prof->stacks);
+	free(prof);
+}
+
+// Forgets everything charged and sampled so far.
+FORTH_INLINE void forth_profreset(forth_prof_t* prof) {
+	long i;
+	for (i = 0; i < prof->stackslots; i++) {
+		free(prof->stacks[i].ids);
+		prof->stacks[i].ids = NULL;
+	}
+	prof->nstacks = 0;
+	memset(prof->words, 0, prof->nwords * sizeof(forth_profstats_t));
+	prof->untilsample = prof->period;
+}
+
+FORTH_INLINE int forth_profid(forth_prof_t* prof, forth_word_t addr) {
+	forth_word_t i = addr - prof->forth->header.codestart;
+	return (i >= 0 && i < prof->ownerlen) ? prof->owner[i] : 0;
+}
+
+// Marks the code of a word, up to the return at the end of it, as belonging to id.
+FORTH_INLINE void forth_profmark(forth_prof_t* prof, forth_word_t start, int id) {
+	forth_word_t* words = prof->forth->data.words;
+	forth_word_t codestart = prof->forth->header.codestart;
+	forth_word_t nest[64];
+	int depth = 0;
+	forth_word_t pc = start;
+	while (pc >= codestart && pc < codestart + prof->ownerlen && prof->owner[pc - codestart] == 0) {
+		forth_word_t instr = words[pc];
+		forth_word_t next = pc + 1;
+		forth_word_t wide;
+		switch (instr & 0xF) {
+		case FORTH_OP_PUSHSTR:
+			next += (instr >> 4 > 0) ? instr >> 4 : 0;
+			break;
+		case FORTH_OP_EXT:
+			if (forth_ispacked(instr) && instr >> 8 > 0) {
+				next += forth_packedsize(instr >> 8);
+			} else if (forth_isdense(instr) && forth_densecount(instr, &wide) > 0) {
+				next += wide;
+			}
+			break;
+		case FORTH_OP_PUSHOP:
+		case FORTH_OP_OPOP:
+			next++;
+			break;
+		case FORTH_OP_PUSHBLOCK:
+		case FORTH_OP_BLOCKLOOP:
+			if (instr >> 4 > pc && depth < 64) {
+				nest[depth++] = instr >> 4;
+			}
+			break;
+		}
+		for (; pc < next && pc < codestart + prof->ownerlen; pc++) {
+			prof->owner[pc - codestart] = id;
+		}
+		if ((instr & 0xF) == FORTH_OP_CONTROL && depth == 0) {
+			break;
+		}
+		while (depth > 0 && pc >= nest[depth - 1]) {
+			depth--;
+		}
+	}
+}
+
+FORTH_INLINE int forth_profcomparesys(const void* a, const void* b) {
+	forth_word_t x = ((const forth_profsys_t*)a)->sysnum;
+	forth_word_t y = ((const forth_profsys_t*)b)->sysnum;
+	return (x > y) - (x < y);
+}
+
+// Works out which code belongs to which word, and the host words, from the index.
+FORTH_INLINE void forth_profscan(forth_prof_t* prof) {
+	forth_t* forth = prof->forth;
+	forth_word_t* words = forth->data.words;
+	forth_word_t len = forth->header.codenext - forth->header.codestart;
+	forth_word_t max = forth->header.codeend - forth->header.codestart;
+	prof->ownerlen = (len < 0) ? 0 : (len > max) ? max : len;
+	memset(prof->owner, 0, prof->ownerlen * sizeof(int));
+	prof->nsys = 0;
+	forth_word_t t;
+	for (t = forth->header.indexstart; t + 1 < forth->header.indexnext && t + 1 < forth->header.indexend; t += 2) {
+		forth_word_t instr = words[t + 1];
+		int id = 1 + (int)((t - forth->header.indexstart) / 2);
+		if ((instr & 0xF) == FORTH_OP_CALLADDR) {
+			forth_profmark(prof, instr >> 4, id);
+		} else if ((instr & 0xF) == FORTH_OP_CALLSYS && prof->nsys < prof->nwords) {
+			prof->sys[prof->nsys++] = (forth_profsys_t) { instr >> 4, id };
+		}
+	}
+	qsort(prof->sys, prof->nsys, sizeof(forth_profsys_t), &forth_profcomparesys);
+	prof->scannedindex = forth->header.indexnext;
+	prof->scannedcode = forth->header.codenext;
+}
+
+FORTH_INLINE int forth_profsysid(forth_prof_t* prof, forth_word_t sysnum) {
+	int lo = 0, hi = prof->nsys;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (prof->sys[mid].sysnum < sysnum) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo < prof->nsys && prof->sys[lo].sysnum == sysnum) ? prof->sys[lo].id : -1;
+}
+
+FORTH_INLINE uint32_t forth_profhash(const int* ids, int depth) {
+	uint32_t h = 2166136261u;
+	int i;
+	for (i = 0; i < depth; i++) {
+		h = (h ^ (uint32_t)ids[i]) * 16777619u;
+	}
+	return h;
+}
+
+FORTH_INLINE forth_profstack_t* forth_profslot(forth_profstack_t* stacks, long slots, uint32_t hash, const int* ids, int depth) {
+	long i = hash & (slots - 1);
+	while (stacks[i].ids != NULL && (stacks[i].hash != hash || stacks[i].depth != depth || memcmp(stacks[i].ids, ids, depth * sizeof(int)) != 0)) {
+		i = (i + 1) & (slots - 1);
+	}
+	return &stacks[i];
+}
+
+FORTH_INLINE void forth_profcount(forth_prof_t* prof, const int* ids, int depth) {
+	uint32_t hash = forth_profhash(ids, depth);
+	forth_profstack_t* s = forth_profslot(prof->stacks, prof->stackslots, hash, ids, depth);
+	if (s->ids == NULL) {
+		if (prof->nstacks * 2 >= prof->stackslots) {
+			forth_profstack_t* bigger = calloc(prof->stackslots * 2, sizeof(forth_profstack_t));
+			if (bigger == NULL) {
+				return; // Drop the sample
+			}
+			long i;
+			for (i = 0; i < prof->stackslots; i++) {
+				if (prof->stacks[i].ids != NULL) {
+					*forth_profslot(bigger, prof->stackslots * 2, prof->stacks[i].hash, prof->stacks[i].ids, prof->stacks[i].depth) = prof->stacks[i];
+				}
+			}
+			free(prof->stacks);
+			prof->stacks = bigger;
+			prof->stackslots *= 2;
+			s = forth_profslot(prof->stacks, prof->stackslots, hash, ids, depth);
+		}
+		s->ids = malloc(depth * sizeof(int));
+		if (s->ids == NULL) {
+			return;
+		}
+		memcpy(s->ids, ids, depth * sizeof(int));
+		s->hash = hash;
+		s->depth = depth;
+		s->count = 0;
+		prof->nstacks++;
+	}
+	s->count++;
+}
+
+/* Samples the stack: the word of each call on the return stack (skipping loops, which also push their address),
+ * then the word that's running.
+ */
+FORTH_INLINE void forth_profsample(forth_prof_t* prof) {
+	forth_t* forth = prof->forth;
+	forth_word_t* words = forth->data.words;
+	forth_word_t r = forth->header.rsstart;
+	forth_word_t rsp = forth->header.rsp;
+	if (rsp - r > FORTH_PROF_MAXDEPTH - 1) {
+		r = rsp - (FORTH_PROF_MAXDEPTH - 1);
+	}
+	int depth = 0;
+	for (; r < rsp; r++) {
+		if (r < 0 || r >= forth->header.fsize) {
+			continue;
+		}
+		forth_word_t site = words[r];
+		if (site < forth->header.codestart || site >= forth->header.codenext) {
+			continue;
+		}
+		forth_word_t op = words[site] & 0xF;
+		if (op == FORTH_OP_CALLADDR || op == FORTH_OP_CALLINDEX) {
+			prof->frames[depth++] = forth_profid(prof, site);
+		}
+	}
+	prof->frames[depth++] = prof->current;
+	forth_profcount(prof, prof->frames, depth);
+}
+
+FORTH_INLINE bool forth_profcallback(forth_t* forth, void* udata, int sysnum) {
+	forth_prof_t* prof = (forth_prof_t*)udata;
+	int64_t start = forth_profnow();
+	prof->words[prof->current].ns += start - prof->last;
+	prof->words[prof->current].callbacks++;
+	bool result = prof->callback(forth, prof->udata, sysnum);
+	prof->last = forth_profnow();
+	int id = forth_profsysid(prof, sysnum);
+	if (id < 0) { // Unnamed, so it counts as the caller's own time
+		prof->words[prof->current].ns += prof->last - start;
+	} else {
+		prof->words[id].calls++;
+		prof->words[id].ns += prof->last - start;
+	}
+	return result;
+}
+
+/* Runs up to maxsteps instructions like forth_run, charging them to the words they run in. Words defined or
+ * redefined since the last call are picked up automatically, as long as the index or the code has grown since.
+ */
+FORTH_INLINE forth_word_t forth_profrun(forth_prof_t* prof, forth_callback_t callback, void* udata, long maxsteps, long* stepsout) {
+	forth_t* forth = prof->forth;
+	forth_word_t* words = forth->data.words;
+	forth_word_t status = FORTH_RUN_BUDGET;
+	long steps = 0;
+	if (forth->header.indexnext != prof->scannedindex || forth->header.codenext != prof->scannedcode) {
+		forth_profscan(prof);
+	}
+	prof->callback = callback;
+	prof->udata = udata;
+	prof->last = forth_profnow();
+	prof->current = forth_profid(prof, forth->header.pc);
+	while (steps < maxsteps) {
+		forth_word_t pc = forth->header.pc;
+		forth_word_t instr = (pc >= forth->header.codestart && pc < forth->header.codenext) ? words[pc] : -1;
+		bool call = (instr & 0xF) == FORTH_OP_CALLADDR || (instr & 0xF) == FORTH_OP_TAILCALL || forth_indexcallentry(instr) >= 0;
+		if (prof->period > 0 && --prof->untilsample <= 0) {
+			prof->untilsample = prof->period;
+			forth_profsample(prof);
+		}
+		long n = 0;
+		status = forth_run(forth, &forth_profcallback, prof, 1, &n);
+		steps += n;
+		prof->words[prof->current].instrs += n;
+		if (status != FORTH_RUN_BUDGET) {
+			break;
+		}
+		int next = forth_profid(prof, forth->header.pc);
+		if (call && forth->header.pc != pc + 1) {
+			prof->words[next].calls++;
+		}
+		if (next != prof->current) {
+			int64_t now = forth_profnow();
+			prof->words[prof->current].ns += now - prof->last;
+			prof->last = now;
+			prof->current = next;
+		}
+	}
+	prof->words[prof->current].ns += forth_profnow() - prof->last;
+	if (stepsout != NULL) {
+		*stepsout = steps;
+	}
+	return status;
+}
+
+// Gets the name of a word, or "(top)" for id 0.
+FORTH_INLINE void forth_profname(forth_prof_t* prof, int id, char* buf, int size) {
+	forth_t* forth = prof->forth;
+	if (id == 0) {
+		snprintf(buf, size, "(top)");
+	} else if (forth_peekstrl(forth, forth_peek(forth, forth->header.indexstart + (id - 1) * 2), size, buf) < 0) {
+		snprintf(buf, size, "?%d", id);
+	}
+}
+
+/* Gets what has been charged to the word at tableaddr in the index (e.g. from forth_lookuptableaddr), or to code
+ * outside of any word if it's 0. Returns 0 on success.
+ */
+FORTH_INLINE forth_word_t forth_profgetstats(forth_prof_t* prof, forth_word_t tableaddr, forth_profstats_t* stats) {
+	forth_word_t id = (tableaddr == 0) ? 0 : 1 + (tableaddr - prof->forth->header.indexstart) / 2;
+	if (id < 0 || id >= prof->nwords || (tableaddr != 0 && (tableaddr - prof->forth->header.indexstart) % 2 != 0)) {
+		return -1;
+	}
+	*stats = prof->words[id];
+	return 0;
+}
+
+typedef struct forth_profrow forth_profrow_t;
+struct forth_profrow {
+	int id;
+	forth_profstats_t stats;
+};
+
+FORTH_INLINE int forth_profcomparerows(const void* a, const void* b) {
+	const forth_profrow_t* x = (const forth_profrow_t*)a;
+	const forth_profrow_t* y = (const forth_profrow_t*)b;
+	if (x->stats.ns != y->stats.ns) {
+		return (x->stats.ns < y->stats.ns) ? 1 : -1;
+	}
+	return (x->stats.instrs < y->stats.instrs) - (x->stats.instrs > y->stats.instrs);
+}
+
+/* Writes a table of every word that has had anything charged to it, the most time first. Returns 0 on success. */
+FORTH_INLINE forth_word_t forth_profwritereport(forth_prof_t* prof, FILE* out) {
+	forth_profrow_t* rows = malloc(prof->nwords * sizeof(forth_profrow_t));
+	if (rows == NULL) {
+		return -1;
+	}
+	int i, n = 0;
+	int64_t total = 0;
+	for (i = 0; i < prof->nwords; i++) {
+		forth_profstats_t* s = &prof->words[i];
+		if (s->instrs != 0 || s->calls != 0 || s->callbacks != 0 || s->ns != 0) {
+			rows[n].id = i;
+			rows[n].stats = *s;
+			total += s->ns;
+			n++;
+		}
+	}
+	qsort(rows, n, sizeof(forth_profrow_t), &forth_profcomparerows);
+	fprintf(out, "%-24s %12s %10s %10s %12s %6s\n", "word", "instrs", "calls", "callbacks", "ms", "%time");
+	for (i = 0; i < n; i++) {
+		char name[FORTH_PROF_MAXNAME];
+		forth_profname(prof, rows[i].id, name, sizeof(name));
+		fprintf(out, "%-24s %12ld %10ld %10ld %12.3f %6.2f\n", name, rows[i].stats.instrs, rows[i].stats.calls, rows[i].stats.callbacks,
+			rows[i].stats.ns / 1e6, (total > 0) ? rows[i].stats.ns * 100.0 / total : 0.0);
+	}
+	free(rows);
+	return ferror(out) ? -1 : 0;
+}
+
+/* Writes the stack samples as folded stacks, e.g. for flamegraph.pl or speedscope. Returns 0 on success. */
+FORTH_INLINE forth_word_t forth_profwritefolded(forth_prof_t* prof, FILE* out) {
+	long i;
+	int j;
+	for (i = 0; i < prof->stackslots; i++) {
+		forth_profstack_t* s = &prof->stacks[i];
+		if (s->ids == NULL) {
+			continue;
+		}
+		for (j = 0; j < s->depth; j++) {
+			char name[FORTH_PROF_MAXNAME];
+			forth_profname(prof, s->ids[j], name, sizeof(name));
+			fprintf(out, "%s%s", (j > 0) ? ";" : "", name);
+		}
+		fprintf(out, " %ld\n", s->count);
+	}
+	return ferror(out) ? -1 : 0;
+}
+
+#else
+
+struct forth_prof {
+	forth_t* forth;
+};
+
+FORTH_INLINE forth_prof_t* forth_profcreate(forth_t* forth, long period) {
+	forth_prof_t* prof = malloc(sizeof(forth_prof_t));
+	if (prof != NULL) {
+		prof->forth = forth;
+	}
+	return prof;
+}
+
+FORTH_INLINE void forth_profdestroy(forth_prof_t* prof) {
+	free(prof);
+}
+
+FORTH_INLINE void forth_profreset(forth_prof_t* prof) {
+}
+
+FORTH_INLINE forth_word_t forth_profrun(forth_prof_t* prof, forth_callback_t callback, void* udata, long maxsteps, long* stepsout) {
+	return forth_run(prof->forth, callback, udata, maxsteps, stepsout);
+}
+
+FORTH_INLINE forth_word_t forth_profgetstats(forth_prof_t* prof, forth_word_t tableaddr, forth_profstats_t* stats) {
+	return -1;
+}
+
+FORTH_INLINE forth_word_t forth_profwritereport(forth_prof_t* prof, FILE* out) {
+	return 0;
+}
+
+FORTH_INLINE forth_word_t forth_profwritefolded(forth_prof_t* prof, FILE* out) {
+	return 0;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,453 @@
+/* A scheduler for running many FORTH images at once, on a pool of worker threads.
+ * Unlike forth.h this needs POSIX threads and C11 atomics (build with -pthread).
+ *
+ * Each VM runs in time slices of up to slicesteps instructions (using forth_run). Every worker keeps the VMs it's
+ * running in its own deque and always takes the one that has waited longest (so VMs on a worker take turns), then
+ * steals from the other workers when it runs out. A VM whose callback returns non-zero is parked instead of being
+ * retried straight away, until the host calls forth_schedwake for it (from any thread, even inside the callback).
+ * One that parks itself in a callback with forth_park waits for forth_schedcomplete instead (see forth_async.h for
+ * doing the same from a single-threaded event loop). A VM is finished when forth_run returns anything else, e.g. -1 when it runs off the end of its code.
+ *
+ * Callbacks are called from the worker threads, but never for the same VM from two threads at once.
+ */
+
+#ifndef FORTH_SCHED_H
+#define FORTH_SCHED_H
+
+#include "forth.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define FORTH_SCHED_READY	0 // Queued to run
+#define FORTH_SCHED_RUNNING	1
+#define FORTH_SCHED_WOKEN	2 // Running, and woken up before it could be parked
+#define FORTH_SCHED_PARKED	3 // Waiting for forth_schedwake (or forth_schedcomplete)
+#define FORTH_SCHED_DONE	4
+
+typedef struct forth_schedstats forth_schedstats_t;
+typedef struct forth_schedvm forth_schedvm_t;
+typedef struct forth_schedworker forth_schedworker_t;
+typedef struct forth_sched forth_sched_t;
+
+struct forth_schedstats {
+	long slices;		// Time slices run
+	long steps;		// Instructions run
+	long parks;		// Times a callback parked it
+	int64_t runns;		// Nanoseconds spent running
+	int64_t waitns;		// Nanoseconds spent ready to run but waiting for a worker
+	int64_t maxwaitns;	// Longest wait for a worker (i.e. the worst scheduling latency)
+};
+
+struct forth_schedvm {
+	forth_t* forth;
+	forth_callback_t callback;
+	void* udata;
+	atomic_int state;
+	forth_word_t result;	// What forth_run returned when it finished
+	int64_t readyat;	// When it was last queued
+	forth_schedstats_t stats;
+};
+
+/* Each worker's deque is a Chase-Lev deque without the owner's pop (everyone takes from the top). It never needs
+ * to grow, since a VM is only ever in one queue and there's room for all of them.
+ */
+struct forth_schedworker {
+	_Alignas(64) atomic_long top;
+	_Alignas(64) atomic_long bottom;
+	atomic_int* items;
+	forth_sched_t* sched;
+	pthread_t thread;
+	int id;
+	uint32_t seed;
+};
+
+struct forth_sched {
+	forth_schedvm_t* vms;
+	int nvms;
+	int maxvms;
+	long mask;		// Size of each queue minus one
+	long slicesteps;
+	forth_schedworker_t* workers;
+	int nworkers;
+	atomic_int live;	// VMs not finished yet
+	atomic_int stop;
+	// New and woken VMs go through the inbox, since only a worker can push to its own deque.
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	int* inbox;
+	long inboxhead;
+	atomic_long inboxcount;
+};
+
+FORTH_INLINE int64_t forth_schednow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Creates a scheduler for up to maxvms VMs, which will run on nworkers threads (including the one calling
+ * forth_schedrun). Returns NULL on failure.
+ */
+FORTH_INLINE forth_sched_t* forth_schedcreate(int nworkers, int maxvms, long slicesteps) {
+	if (nworkers < 1 || maxvms < 1 || slicesteps < 1) {
+		return NULL;
+	}
+	forth_sched_t* sched = calloc(1, sizeof(forth_sched_t));
+	if (sched == NULL) {
+		return NULL;
+	}
+	long size = 1;
+	while (size < maxvms) {
+		size <<= 1;
+	}
+	sched->mask = size - 1;
+	sched->maxvms = maxvms;
+	sched->nworkers = nworkers;
+	sched->slicesteps = slicesteps;
+	sched->vms = calloc(maxvms, sizeof(forth_schedvm_t));
+	sched->inbox = calloc(size, sizeof(int));
+	sched->workers = aligned_alloc(64, ((nworkers * sizeof(forth_schedworker_t) + 63) / 64) * 64);
+	bool okay = sched->vms != NULL && sched->inbox != NULL && sched->workers != NULL;
+	int i;
+	for (i = 0; okay && i < nworkers; i++) {
+		forth_schedworker_t* worker = &sched->workers[i];
+		atomic_init(&worker->top, 0);
+		atomic_init(&worker->bottom, 0);
+		worker->items = calloc(size, sizeof(atomic_int));
+		worker->sched = sched;
+		worker->id = i;
+		worker->seed = 2463534242u + i;
+		okay = worker->items != NULL;
+	}
+	if (!okay) {
+		while (sched->workers != NULL && i-- > 0) {
+			free(sched->workers[i].items);
+		}
+		free(sched->workers);
+		free(sched->inbox);
+		free(sched->vms);
+		free(sched);
+		return NULL;
+	}
+	atomic_init(&sched->live, 0);
+	atomic_init(&sched->stop, 0);
+	atomic_init(&sched->inboxcount, 0);
+	pthread_mutex_init(&sched->lock, NULL);
+	pthread_cond_init(&sched->wakeup, NULL);
+	return sched;
+}
+
+/* Frees the scheduler (but not the images, which still belong to the caller). It mustn't be running. */
+FORTH_INLINE void forth_scheddestroy(forth_sched_t* sched) {
+	int i;
+	for (i = 0; i < sched->nworkers; i++) {
+		free(sched->workers[i].items);
+	}
+	pthread_cond_destroy(&sched->wakeup);
+	pthread_mutex_destroy(&sched->lock);
+	free(sched->workers);
+	free(sched->inbox);
+	free(sched->vms);
+	free(sched);
+}
+
+/* Queues a VM through the inbox. The VM must already be marked ready. */
+FORTH_INLINE void forth_schedpost(forth_sched_t* sched, int id) {
+	sched->vms[id].readyat = forth_schednow();
+	sched->inbox[(sched->inboxhead + atomic_load(&sched->inboxcount)) & sched->mask] = id;
+	atomic_fetch_add(&sched->inboxcount, 1);
+	pthread_cond_signal(&sched->wakeup);
+}
+
+/* Adds an image to be run from its current pc, returning its id in the scheduler (or -1 if it's full). This can be
+ * done while the scheduler is running.
+ */
+FORTH_INLINE int forth_schedadd(forth_sched_t* sched, forth_t* forth, forth_callback_t callback, void* udata) {
+	pthread_mutex_lock(&sched->lock);
+	if (sched->nvms >= sched->maxvms) {
+		pthread_mutex_unlock(&sched->lock);
+		return -1;
+	}
+	int id = sched->nvms++;
+	forth_schedvm_t* vm = &sched->vms[id];
+	vm->forth = forth;
+	vm->callback = callback;
+	vm->udata = udata;
+	vm->result = 0;
+	atomic_init(&vm->state, FORTH_SCHED_READY);
+	atomic_fetch_add(&sched->live, 1);
+	forth_schedpost(sched, id);
+	pthread_mutex_unlock(&sched->lock);
+	return id;
+}
+
+/* Makes a parked VM ready to run again (so the call that parked it is retried). Returns -1 if the VM has finished,
+ * otherwise 0 (waking a VM that isn't parked does nothing, except that if it's running and parks at the end of its
+ * slice it'll be requeued straight away).
+ */
+FORTH_INLINE int forth_schedwake(forth_sched_t* sched, int id) {
+	if (id < 0 || id >= sched->nvms) {
+		return -1;
+	}
+	forth_schedvm_t* vm = &sched->vms[id];
+	for (;;) {
+		int state = atomic_load(&vm->state);
+		if (state == FORTH_SCHED_PARKED) {
+			if (atomic_compare_exchange_weak(&vm->state, &state, FORTH_SCHED_READY)) {
+				pthread_mutex_lock(&sched->lock);
+				forth_schedpost(sched, id);
+				pthread_mutex_unlock(&sched->lock);
+				return 0;
+			}
+		} else if (state == FORTH_SCHED_RUNNING) {
+			if (atomic_compare_exchange_weak(&vm->state, &state, FORTH_SCHED_WOKEN)) {
+				return 0;
+			}
+		} else {
+			return (state == FORTH_SCHED_DONE) ? -1 : 0;
+		}
+	}
+}
+
+/* Completes the call a VM parked itself in with forth_park (seq is what that returned), like forth_complete, and
+ * makes it ready to run again. Returns -1 if it isn't waiting for that call or the results don't fit. If the VM is
+ * still finishing the slice it parked in, this waits for it, so it can't be called from that VM's own callback (use
+ * forth_complete there).
+ */
+FORTH_INLINE int forth_schedcomplete(forth_sched_t* sched, int id, forth_word_t seq, const forth_word_t* values, int n) {
+	if (id < 0 || id >= sched->nvms) {
+		return -1;
+	}
+	forth_schedvm_t* vm = &sched->vms[id];
+	for (;;) {
+		int state = atomic_load(&vm->state);
+		if (state == FORTH_SCHED_PARKED) {
+			// Take it over while it's changed, so a forth_schedwake in the meantime can't queue it.
+			if (atomic_compare_exchange_weak(&vm->state, &state, FORTH_SCHED_RUNNING)) {
+				if (forth_complete(vm->forth, seq, values, n) != 0) {
+					atomic_store(&vm->state, FORTH_SCHED_PARKED);
+					return -1;
+				}
+				atomic_store(&vm->state, FORTH_SCHED_READY);
+				pthread_mutex_lock(&sched->lock);
+				forth_schedpost(sched, id);
+				pthread_mutex_unlock(&sched->lock);
+				return 0;
+			}
+		} else if (state == FORTH_SCHED_RUNNING || state == FORTH_SCHED_WOKEN) {
+			sched_yield();
+		} else {
+			return -1;
+		}
+	}
+}
+
+/* Stops forth_schedrun after the slices being run finish. Unfinished VMs stay queued for the next forth_schedrun. */
+FORTH_INLINE void forth_schedstop(forth_sched_t* sched) {
+	atomic_store(&sched->stop, 1);
+	pthread_mutex_lock(&sched->lock);
+	pthread_cond_broadcast(&sched->wakeup);
+	pthread_mutex_unlock(&sched->lock);
+}
+
+FORTH_INLINE int forth_schedstate(forth_sched_t* sched, int id) {
+	return (id >= 0 && id < sched->nvms) ? atomic_load(&sched->vms[id].state) : -1;
+}
+
+/* What forth_run returned when the VM finished (only meaningful once its state is FORTH_SCHED_DONE). */
+FORTH_INLINE forth_word_t forth_schedresult(forth_sched_t* sched, int id) {
+	return (id >= 0 && id < sched->nvms) ? sched->vms[id].result : -1;
+}
+
+/* Copies the statistics of a VM, or of all of them added together (with the longest wait of any) if id is -1.
+ * While the scheduler is running they can be slightly out of date.
+ */
+FORTH_INLINE void forth_schedgetstats(forth_sched_t* sched, int id, forth_schedstats_t* stats) {
+	stats->slices = 0;
+	stats->steps = 0;
+	stats->parks = 0;
+	stats->runns = 0;
+	stats->waitns = 0;
+	stats->maxwaitns = 0;
+	int i;
+	for (i = (id < 0 ? 0 : id); i < sched->nvms && (id < 0 || i == id); i++) {
+		forth_schedstats_t* s = &sched->vms[i].stats;
+		stats->slices += s->slices;
+		stats->steps += s->steps;
+		stats->parks += s->parks;
+		stats->runns += s->runns;
+		stats->waitns += s->waitns;
+		if (s->maxwaitns > stats->maxwaitns) {
+			stats->maxwaitns = s->maxwaitns;
+		}
+	}
+}
+
+/* Jain's fairness index of the number of instructions each VM has run: 1 if they've all had the same, down to 1/n
+ * if one VM had all of them. Only meaningful for VMs that were all busy over the same period. (Running time would
+ * also count any time the worker thread itself wasn't scheduled.)
+ */
+FORTH_INLINE double forth_schedfairness(forth_sched_t* sched) {
+	double sum = 0, sumsq = 0;
+	int i;
+	for (i = 0; i < sched->nvms; i++) {
+		double x = (double)sched->vms[i].stats.steps;
+		sum += x;
+		sumsq += x * x;
+	}
+	return (sumsq > 0) ? (sum * sum) / (sched->nvms * sumsq) : 1.0;
+}
+
+// Only the worker owning the deque can push to it.
+FORTH_INLINE void forth_schedpush(forth_schedworker_t* worker, int id) {
+	long b = atomic_load_explicit(&worker->bottom, memory_order_relaxed);
+	atomic_store_explicit(&worker->items[b & worker->sched->mask], id, memory_order_relaxed);
+	atomic_store_explicit(&worker->bottom, b + 1, memory_order_release);
+}
+
+// Takes the oldest VM from a deque (any worker can do this), or returns -1 if it's empty or another worker got it.
+FORTH_INLINE int forth_schedsteal(forth_schedworker_t* worker) {
+	// Without the owner's pop there's nothing to race with but other steals, so this doesn't need a fence.
+	long t = atomic_load_explicit(&worker->top, memory_order_acquire);
+	long b = atomic_load_explicit(&worker->bottom, memory_order_acquire);
+	if (t >= b) {
+		return -1;
+	}
+	int id = atomic_load_explicit(&worker->items[t & worker->sched->mask], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&worker->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+		return -1;
+	}
+	return id;
+}
+
+FORTH_INLINE int forth_schedtake(forth_schedworker_t* worker) {
+	forth_sched_t* sched = worker->sched;
+	int id = -1;
+	// New and woken VMs go first, then our own, then other workers'.
+	if (atomic_load_explicit(&sched->inboxcount, memory_order_relaxed) > 0) {
+		pthread_mutex_lock(&sched->lock);
+		if (atomic_load(&sched->inboxcount) > 0) {
+			id = sched->inbox[sched->inboxhead++ & sched->mask];
+			atomic_fetch_sub(&sched->inboxcount, 1);
+		}
+		pthread_mutex_unlock(&sched->lock);
+		if (id >= 0) {
+			return id;
+		}
+	}
+	id = forth_schedsteal(worker);
+	if (id >= 0 || sched->nworkers == 1) {
+		return id;
+	}
+	worker->seed ^= worker->seed << 13;
+	worker->seed ^= worker->seed >> 17;
+	worker->seed ^= worker->seed << 5;
+	int start = (int)(worker->seed % (uint32_t)sched->nworkers);
+	int i;
+	for (i = 0; i < sched->nworkers && id < 0; i++) {
+		forth_schedworker_t* victim = &sched->workers[(start + i) % sched->nworkers];
+		if (victim != worker) {
+			id = forth_schedsteal(victim);
+		}
+	}
+	return id;
+}
+
+FORTH_INLINE void forth_schedslice(forth_schedworker_t* worker, int id) {
+	forth_sched_t* sched = worker->sched;
+	forth_schedvm_t* vm = &sched->vms[id];
+	atomic_store(&vm->state, FORTH_SCHED_RUNNING);
+	int64_t start = forth_schednow();
+	int64_t wait = start - vm->readyat;
+	long steps = 0;
+	forth_word_t result = forth_run(vm->forth, vm->callback, vm->udata, sched->slicesteps, &steps);
+	int64_t end = forth_schednow();
+
+	vm->stats.slices++;
+	vm->stats.steps += steps;
+	vm->stats.runns += end - start;
+	vm->stats.waitns += wait;
+	if (wait > vm->stats.maxwaitns) {
+		vm->stats.maxwaitns = wait;
+	}
+
+	if (result == FORTH_RUN_BUDGET) {
+		atomic_store(&vm->state, FORTH_SCHED_READY);
+		vm->readyat = end;
+		forth_schedpush(worker, id);
+	} else if (result == FORTH_RUN_PAUSED || result == FORTH_RUN_WAITING) {
+		int state = FORTH_SCHED_RUNNING;
+		vm->stats.parks++;
+		if (!atomic_compare_exchange_strong(&vm->state, &state, FORTH_SCHED_PARKED)) {
+			// Already woken up again
+			atomic_store(&vm->state, FORTH_SCHED_READY);
+			vm->readyat = end;
+			forth_schedpush(worker, id);
+		}
+	} else {
+		vm->result = result;
+		atomic_store(&vm->state, FORTH_SCHED_DONE);
+		if (atomic_fetch_sub(&sched->live, 1) == 1) {
+			pthread_mutex_lock(&sched->lock);
+			pthread_cond_broadcast(&sched->wakeup);
+			pthread_mutex_unlock(&sched->lock);
+		}
+	}
+}
+
+FORTH_INLINE void* forth_schedmain(void* arg) {
+	forth_schedworker_t* worker = arg;
+	forth_sched_t* sched = worker->sched;
+	int idle = 0;
+	while (atomic_load(&sched->live) > 0 && !atomic_load(&sched->stop)) {
+		int id = forth_schedtake(worker);
+		if (id >= 0) {
+			idle = 0;
+			forth_schedslice(worker, id);
+		} else if (++idle < 64) {
+			sched_yield();
+		} else {
+			// Nothing to steal for a while, so sleep until something is queued (but check the others every 1ms).
+			pthread_mutex_lock(&sched->lock);
+			if (atomic_load(&sched->inboxcount) == 0 && atomic_load(&sched->live) > 0 && !atomic_load(&sched->stop)) {
+				struct timespec ts;
+				clock_gettime(CLOCK_REALTIME, &ts);
+				ts.tv_nsec += 1000000;
+				if (ts.tv_nsec >= 1000000000) {
+					ts.tv_sec++;
+					ts.tv_nsec -= 1000000000;
+				}
+				pthread_cond_timedwait(&sched->wakeup, &sched->lock, &ts);
+			}
+			pthread_mutex_unlock(&sched->lock);
+		}
+	}
+	return NULL;
+}
+
+/* Runs the VMs until they've all finished (which includes waiting for any parked ones to be woken up), or until
+ * forth_schedstop is called. The calling thread is used as one of the workers. Returns 0, or -1 if the threads
+ * couldn't be started.
+ */
+FORTH_INLINE int forth_schedrun(forth_sched_t* sched) {
+	atomic_store(&sched->stop, 0);
+	int i;
+	for (i = 1; i < sched->nworkers; i++) {
+		if (pthread_create(&sched->workers[i].thread, NULL, &forth_schedmain, &sched->workers[i]) != 0) {
+			forth_schedstop(sched);
+			while (--i > 0) {
+				pthread_join(sched->workers[i].thread, NULL);
+			}
+			return -1;
+		}
+	}
+	forth_schedmain(&sched->workers[0]);
+	for (i = 1; i < sched->nworkers; i++) {
+		pthread_join(sched->workers[i].thread, NULL);
+	}
+	return 0;
+}
+
+#endif
\ No newline at end of file
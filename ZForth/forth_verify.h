@@ -0,0 +1,915 @@
+/* A verifier that works out the stack effects of code ahead of time, so that code it's sure about can run without
+ * the interpreter checking the stacks and pc on every instruction.
+ *
+ * forth_verifyword follows the code from an address to the return at the end of its block (a word, or the body of
+ * a loop), through any blocks, '!' loops, '?' jumps and calls inside it, and works out how far below and above where
+ * it started the data stack can go and how deep the return stack can get. It only accepts code whose stack use
+ * doesn't depend on the data: loop bodies have to leave a flag on top of the block they were called with, jumps and
+ * loops have to be to blocks the code pushed itself, and calls have to be to words it can verify (so not recursive
+ * ones) or to host functions declared with forth_verifysys. Anything else (e.g. the bulk and heap ops) just isn't
+ * verified.
+ *
+ * forth_verifyrun runs an image like forth_run, but whenever the interpreter calls, returns or loops to code that's
+ * verified (or can be) and the stacks have room for all of it, it checks that once and runs the code up to its
+ * return with no other checks. Images end up exactly as forth_run would leave them.
+ *
+ * Host functions have to do what they're declared to do. The fast path checks the depth of the stacks after every
+ * callback, and that each '!' loops over the block it was verified with, and hands back to the interpreter if not,
+ * but it trusts callbacks not to write to the stacks other than by pushing and popping. Results are kept until the
+ * index changes (forth_setlookupinstr bumps header.indexgen), since calls by name are verified as calls to whatever
+ * they're defined as at the time. Call forth_verifyflush after changing code in any other way (adding code with
+ * forth_assemble is fine).
+ */
+
+#ifndef FORTH_VERIFY_H
+#define FORTH_VERIFY_H
+
+#include "forth.h"
+#include <stdint.h>
+#include <string.h>
+
+#define FORTH_VERIFY_MAXDEPTH	64 // Most words followed above (or taken from under) where the code started
+#define FORTH_VERIFY_MAXNEST	32 // Most blocks, loops, jumps and calls followed inside each other at once
+#define FORTH_VERIFY_MAXWORK	65536 // Most instructions looked at to verify one address
+#define FORTH_VERIFY_MAXTRIES	16 // Most times an address is retried after hitting FORTH_VERIFY_MAXNEST in a call
+#define FORTH_VERIFY_MAXPICTURE	8 // Most words a host function can take or leave
+
+#define FORTH_VERIFY_UNKNOWN	0
+#define FORTH_VERIFY_BUSY	1 // Being verified, so a call back to it is recursion
+#define FORTH_VERIFY_OK		2
+#define FORTH_VERIFY_FAILED	3
+
+typedef struct forth_effect forth_effect_t;
+typedef struct forth_verifyinfo forth_verifyinfo_t;
+typedef struct forth_verifysys forth_verifysys_t;
+typedef struct forth_verify forth_verify_t;
+
+// What forth_verifyword found out about some code.
+struct forth_effect {
+	int in;		// Words it takes from the data stack
+	int out;	// Words it leaves in their place, or -1 if that depends on which way it goes
+	int maxdata;	// Most words it has on the data stack at once, counting the ones it takes
+	int maxreturn;	// Most words it pushes on the return stack
+};
+
+// What's known about the code from one address to its return, relative to where the stacks were when it started.
+struct forth_verifyinfo {
+	unsigned char state;
+	unsigned char fixed;	// Whether every way out leaves the data stack at the same depth (net)
+	int32_t low;		// Lowest the data stack goes (0 or less)
+	int32_t high;		// Highest it goes
+	int32_t rhigh;		// Most words pushed on the return stack
+	int32_t net;
+	forth_word_t check;	// For a '!' here, the block it loops over, or for a host call, how it changes the depth
+};
+
+// A host function's stack picture (see forth_verifysys).
+struct forth_verifysys {
+	int sysnum;
+	int in;
+	int out;
+	signed char from[FORTH_VERIFY_MAXPICTURE]; // Which input each output is a copy of (0 is the deepest), or -1
+};
+
+struct forth_verify {
+	forth_t* forth;
+	forth_verifyinfo_t* info;	// For each code address
+	forth_word_t codestart;
+	forth_word_t ntable;		// Entries in info (the size of the code segment)
+	forth_word_t indexgen;		// The index generation info was worked out for
+	forth_verifysys_t* sys;
+	int nsys;
+	int maxsys;
+	long work;			// Instructions looked at for the address being verified
+	forth_word_t deep;		// Where a call went over FORTH_VERIFY_MAXNEST, or -1
+	long verified;			// Addresses verified
+	long rejected;			// Addresses that couldn't be
+	long entries;			// Times the fast path was started
+	long faststeps;			// Instructions it ran
+};
+
+// The data stack while following code.
+typedef struct forth_verifystate forth_verifystate_t;
+struct forth_verifystate {
+	int depth;	// Words above where the code started (negative once it's taken some from under it)
+	bool mixed;	// When merging the ways out of a block, whether they left different depths
+	/* What's known about each word from where the code started: the address of a block the code pushed, minus
+	 * that if it's been through a host function (whose picture might be wrong), or 0.
+	 */
+	forth_word_t slots[FORTH_VERIFY_MAXDEPTH];
+};
+
+// How far the stacks go while following code, relative to where it started.
+typedef struct forth_verifyrange forth_verifyrange_t;
+struct forth_verifyrange {
+	int low;
+	int high;
+	int rhigh;
+};
+
+FORTH_INLINE bool forth_verifypush(forth_verifyrange_t* range, forth_verifystate_t* s, forth_word_t value) {
+	if (s->depth >= FORTH_VERIFY_MAXDEPTH) {
+		return false;
+	}
+	if (s->depth >= 0) {
+		s->slots[s->depth] = value;
+	}
+	s->depth++;
+	if (s->depth > range->high) {
+		range->high = s->depth;
+	}
+	return true;
+}
+
+// Returns what's known about the word popped (nothing, for words from under where the code started).
+FORTH_INLINE forth_word_t forth_verifypop(forth_verifyrange_t* range, forth_verifystate_t* s) {
+	s->depth--;
+	if (s->depth < range->low) {
+		range->low = s->depth;
+	}
+	return (s->depth >= 0) ? s->slots[s->depth] : 0;
+}
+
+// A simple op other than '?', which pops two words and pushes an unknown one.
+FORTH_INLINE void forth_verifysimple(forth_verifyrange_t* range, forth_verifystate_t* s) {
+	forth_verifypop(range, s);
+	forth_verifypop(range, s);
+	(void)forth_verifypush(range, s, 0);
+}
+
+FORTH_INLINE bool forth_verifyblock(forth_verify_t* v, forth_verifyrange_t* range, forth_word_t pc, forth_verifystate_t s, forth_verifystate_t* out, int* outs, int r, int nest);
+FORTH_INLINE forth_verifyinfo_t* forth_verifyat(forth_verify_t* v, forth_word_t addr, int nest);
+
+/* A '?' whose target (what's known about the word it popped) has to be a block the code pushed. Where the jump goes
+ * ends at that block's return, which is a way out of the block the '?' is in, so it's merged into out.
+ */
+FORTH_INLINE bool forth_verifycond(forth_verify_t* v, forth_verifyrange_t* range, forth_verifystate_t* s, forth_word_t target, forth_verifystate_t* out, int* outs, int r, int nest) {
+	forth_verifypop(range, s);
+	(void)forth_verifypush(range, s, 0);
+	return target > 0 && forth_verifyblock(v, range, target, *s, out, outs, r, nest + 1);
+}
+
+// A call to addr from code r words down the return stack, using what's known about addr.
+FORTH_INLINE bool forth_verifycall(forth_verify_t* v, forth_verifyrange_t* range, forth_verifystate_t* s, int r, forth_word_t addr, int nest) {
+	forth_verifyinfo_t* callee = forth_verifyat(v, addr, nest + 1);
+	if (callee == NULL || !callee->fixed || s->depth + callee->high > FORTH_VERIFY_MAXDEPTH) {
+		return false;
+	}
+	if (s->depth + callee->low < range->low) {
+		range->low = s->depth + callee->low;
+	}
+	if (s->depth + callee->high > range->high) {
+		range->high = s->depth + callee->high;
+	}
+	if (r + 1 + callee->rhigh > range->rhigh) {
+		range->rhigh = r + 1 + callee->rhigh;
+	}
+	// Anything it took could have been replaced.
+	int i;
+	for (i = (s->depth + callee->low > 0) ? s->depth + callee->low : 0; i < FORTH_VERIFY_MAXDEPTH; i++) {
+		s->slots[i] = 0;
+	}
+	s->depth += callee->net;
+	return true;
+}
+
+// A call to host function sysnum at pc, using its picture.
+FORTH_INLINE bool forth_verifyhost(forth_verify_t* v, forth_verifyrange_t* range, forth_verifystate_t* s, forth_word_t pc, forth_word_t sysnum) {
+	forth_verifysys_t* d = NULL;
+	forth_word_t in[FORTH_VERIFY_MAXPICTURE];
+	int i;
+	for (i = 0; i < v->nsys; i++) {
+		if (v->sys[i].sysnum == sysnum) {
+			d = &v->sys[i];
+		}
+	}
+	if (d == NULL) {
+		return false;
+	}
+	for (i = d->in - 1; i >= 0; i--) {
+		in[i] = forth_verifypop(range, s);
+	}
+	for (i = 0; i < d->out; i++) {
+		forth_word_t value = (d->from[i] >= 0) ? in[d->from[i]] : 0;
+		if (!forth_verifypush(range, s, (value > 0) ? -value : value)) {
+			return false;
+		}
+	}
+	v->info[pc - v->codestart].check = d->out - d->in;
+	return true;
+}
+
+/* A '!' (or the end of a blockloop) that calls the block on top of the stack from code r words down the return
+ * stack, returning to ret. If ret is a '!' the return pops a flag and goes round again if it isn't 0, so the body
+ * is followed until what's known about the stack at its start stops changing.
+ */
+FORTH_INLINE bool forth_verifyloop(forth_verify_t* v, forth_verifyrange_t* range, forth_verifystate_t* s, int r, forth_word_t ret, int nest) {
+	forth_word_t target = forth_verifypop(range, s);
+	forth_word_t block = (target < 0) ? -target : target;
+	if (target == 0 || !forth_verifypush(range, s, target)) {
+		return false;
+	}
+	// The fast path checks a '!' is looping over the same block every time.
+	if ((v->forth->data.words[ret] & 0xF) == FORTH_OP_LOOP) {
+		forth_word_t* check = &v->info[ret - v->codestart].check;
+		if (*check != 0 && *check != block) {
+			return false;
+		}
+		*check = block;
+	}
+	if (r + 1 > range->rhigh) {
+		range->rhigh = r + 1;
+	}
+	bool loops = v->forth->data.words[ret] == FORTH_OP_LOOP;
+	forth_verifystate_t start = *s;
+	forth_verifystate_t end;
+	int iter, i;
+	for (iter = 0; iter <= FORTH_VERIFY_MAXDEPTH; iter++) {
+		int ends = 0;
+		if (!forth_verifyblock(v, range, block, start, &end, &ends, r + 1, nest + 1) || end.mixed) {
+			return false;
+		}
+		if (!loops) {
+			*s = end;
+			return true;
+		}
+		forth_verifypop(range, &end);
+		if (end.depth != start.depth || end.slots[end.depth - 1] != target) {
+			return false;
+		}
+		bool changed = false;
+		for (i = 0; i < start.depth; i++) {
+			if (start.slots[i] != 0 && start.slots[i] != end.slots[i]) {
+				start.slots[i] = 0;
+				changed = true;
+			}
+		}
+		if (!changed) {
+			*s = start;
+			return true;
+		}
+	}
+	return false;
+}
+
+// A return with the stack in s, which is merged into what's known about the ways out of the block.
+FORTH_INLINE void forth_verifyreturn(const forth_verifystate_t* s, forth_verifystate_t* out, int* outs) {
+	int i;
+	if ((*outs)++ == 0) {
+		*out = *s;
+		out->mixed = false;
+	} else if (out->depth != s->depth) {
+		out->mixed = true;
+	} else {
+		for (i = 0; i < s->depth; i++) {
+			if (out->slots[i] != s->slots[i]) {
+				out->slots[i] = 0;
+			}
+		}
+	}
+}
+
+/* Follows the code from pc to the return at the end of its block, r words down the return stack, starting with s, and
+ * merges the stack at each way out of it into out (*outs counts them). Returns false if it can't be verified.
+ */
+FORTH_INLINE bool forth_verifyblock(forth_verify_t* v, forth_verifyrange_t* range, forth_word_t pc, forth_verifystate_t s, forth_verifystate_t* out, int* outs, int r, int nest) {
+	forth_t* forth = v->forth;
+	forth_word_t* words = forth->data.words;
+	forth_word_t instr, tmp, next;
+	int slot;
+	if (nest > FORTH_VERIFY_MAXNEST) {
+		return false;
+	}
+	while (true) {
+		if (pc < forth->header.codestart || pc >= forth->header.codenext || ++v->work > FORTH_VERIFY_MAXWORK || s.depth < -FORTH_VERIFY_MAXDEPTH) {
+			return false;
+		}
+		instr = words[pc];
+		switch (instr & 0xF) {
+		case FORTH_OP_PUSHINT:
+			if (!forth_verifypush(range, &s, 0)) {
+				return false;
+			}
+			pc++;
+			break;
+		case FORTH_OP_CALLADDR:
+			if (!forth_verifycall(v, range, &s, r, instr >> 4, nest)) {
+				return false;
+			}
+			pc++;
+			break;
+		case FORTH_OP_CALLSYS:
+			if (!forth_verifyhost(v, range, &s, pc, instr >> 4)) {
+				return false;
+			}
+			pc++;
+			break;
+		case FORTH_OP_PUSHSTR:
+			if (instr >> 4 < 0 || !forth_verifypush(range, &s, 0)) {
+				return false;
+			}
+			pc += 1 + (instr >> 4);
+			break;
+		case FORTH_OP_SIMPLE:
+			tmp = forth_simpleopcode((char)(instr >> 4));
+			if (tmp < 0) {
+				return false;
+			}
+			if (FORTH_SIMPLEOPS[tmp] == '?') {
+				if (!forth_verifycond(v, range, &s, forth_verifypop(range, &s), out, outs, r, nest)) {
+					return false;
+				}
+			} else {
+				forth_verifysimple(range, &s);
+			}
+			pc++;
+			break;
+		case FORTH_OP_TAILCALL: // A call that the function returns from for this code too, so it runs a level up
+			if (!forth_verifycall(v, range, &s, r - 1, instr >> 4, nest)) {
+				return false;
+			}
+			forth_verifyreturn(&s, out, outs);
+			return true;
+		case FORTH_OP_CONTROL:
+			forth_verifyreturn(&s, out, outs);
+			return true;
+		case FORTH_OP_CALLINDEX:
+			tmp = instr >> 4;
+		callindex: // Verified as a call to what the entry is now, so only with the index generation to check
+			if (!FORTH_HEADER_HAS(forth, indexgen) || tmp < 0 || tmp >= forth->header.fsize) {
+				return false;
+			}
+			tmp = words[tmp];
+			if ((tmp & 0xF) == FORTH_OP_CALLADDR && (instr & 0xF) == FORTH_OP_EXT) { // A tail call
+				if (!forth_verifycall(v, range, &s, r - 1, tmp >> 4, nest)) {
+					return false;
+				}
+				forth_verifyreturn(&s, out, outs);
+				return true;
+			}
+			if ((tmp & 0xF) == FORTH_OP_CALLADDR) {
+				if (!forth_verifycall(v, range, &s, r, tmp >> 4, nest)) {
+					return false;
+				}
+			} else if ((tmp & 0xF) != FORTH_OP_CALLSYS || !forth_verifyhost(v, range, &s, pc, tmp >> 4)) {
+				return false;
+			}
+			pc++;
+			break;
+		case FORTH_OP_PUSHBLOCK:
+			if (instr >> 4 <= pc || instr >> 4 > forth->header.codenext || !forth_verifypush(range, &s, pc + 1)) {
+				return false;
+			}
+			pc = instr >> 4;
+			break;
+		case FORTH_OP_LOOP:
+			if (!forth_verifyloop(v, range, &s, r, pc, nest)) {
+				return false;
+			}
+			pc++;
+			break;
+		case FORTH_OP_PUSHOP:
+			tmp = (instr >> 4) & 0xF;
+			if (tmp >= FORTH_SIMPLEOPCOUNT || !forth_verifypush(range, &s, 0)) {
+				return false;
+			}
+			if (FORTH_SIMPLEOPS[tmp] == '?') { // Jumps to the number
+				forth_verifypop(range, &s);
+				if (!forth_verifycond(v, range, &s, instr >> 8, out, outs, r, nest)) {
+					return false;
+				}
+			} else {
+				forth_verifysimple(range, &s);
+			}
+			pc += 2;
+			break;
+		case FORTH_OP_OPOP: // A '?' second would jump to a number worked out by the first
+			if (((instr >> 4) & 0xF) >= FORTH_SIMPLEOPCOUNT - 1 || ((instr >> 8) & 0xF) >= FORTH_SIMPLEOPCOUNT - 1) {
+				return false;
+			}
+			forth_verifysimple(range, &s);
+			forth_verifysimple(range, &s);
+			pc += 2;
+			break;
+		case FORTH_OP_BLOCKLOOP:
+			tmp = instr >> 4;
+			if (tmp <= pc || tmp >= forth->header.codenext || !forth_verifypush(range, &s, pc + 1) || !forth_verifyloop(v, range, &s, r, tmp, nest)) {
+				return false;
+			}
+			pc = tmp + 1;
+			break;
+		case FORTH_OP_EXT:
+			if (forth_ispacked(instr)) {
+				if (instr >> 8 < 0 || !forth_verifypush(range, &s, 0)) {
+					return false;
+				}
+				pc += 1 + forth_packedsize(instr >> 8);
+				break;
+			}
+			if ((instr & 0xFF) == FORTH_TAILINDEX_TAG) {
+				tmp = instr >> 8;
+				goto callindex;
+			}
+			if (!forth_isdense(instr)) {
+				return false;
+			}
+			next = pc + 1;
+			for (slot = 8; slot < (int)sizeof(forth_word_t) * 8 && (tmp = (instr >> slot) & 0xF) != 0; slot += 4) {
+				if (tmp == FORTH_DENSE_SMALL) {
+					slot += 4;
+					if (slot >= (int)sizeof(forth_word_t) * 8 || !forth_verifypush(range, &s, 0)) {
+						return false;
+					}
+				} else if (tmp == FORTH_DENSE_WIDE) {
+					if (next >= forth->header.codenext || !forth_verifypush(range, &s, 0)) {
+						return false;
+					}
+					next++;
+				} else if (tmp == FORTH_SIMPLEOPCOUNT) {
+					if (!forth_verifycond(v, range, &s, forth_verifypop(range, &s), out, outs, r, nest)) {
+						return false;
+					}
+					break;
+				} else {
+					forth_verifysimple(range, &s);
+				}
+			}
+			pc = next;
+			break;
+		default: // The bulk and heap ops (which can run for several steps or fail) aren't verified
+			return false;
+		}
+	}
+}
+
+/* Verifies the code at addr if it hasn't been already, returning what's known about it or NULL if it can't be
+ * verified.
+ */
+FORTH_INLINE forth_verifyinfo_t* forth_verifyat(forth_verify_t* v, forth_word_t addr, int nest) {
+	forth_word_t i = addr - v->codestart;
+	if (i < 0 || i >= v->ntable) {
+		return NULL;
+	}
+	forth_verifyinfo_t* info = &v->info[i];
+	if (info->state == FORTH_VERIFY_OK) {
+		return info;
+	}
+	if (info->state != FORTH_VERIFY_UNKNOWN) {
+		return NULL;
+	}
+	if (nest > FORTH_VERIFY_MAXNEST) {
+		if (v->deep < 0) {
+			v->deep = addr;
+		}
+		return NULL;
+	}
+	info->state = FORTH_VERIFY_BUSY;
+	forth_verifyrange_t range = { 0, 0, 0 };
+	forth_verifystate_t s, out;
+	int outs = 0;
+	memset(&s, 0, sizeof(s));
+	if (!forth_verifyblock(v, &range, addr, s, &out, &outs, 0, nest)) {
+		// Running out of nesting depends on where it was verified from, so it can be tried again.
+		if (v->deep >= 0) {
+			info->state = FORTH_VERIFY_UNKNOWN;
+		} else {
+			info->state = FORTH_VERIFY_FAILED;
+			v->rejected++;
+		}
+		return NULL;
+	}
+	info->state = FORTH_VERIFY_OK;
+	info->fixed = !out.mixed;
+	info->low = range.low;
+	info->high = range.high;
+	info->rhigh = range.rhigh;
+	info->net = out.depth;
+	v->verified++;
+	return info;
+}
+
+/* Verifies the code at addr like forth_verifyat, but if a call goes too deep it verifies the innermost one first
+ * (so it's known next time) and tries again.
+ */
+FORTH_INLINE forth_verifyinfo_t* forth_verifyentry(forth_verify_t* v, forth_word_t addr) {
+	forth_verifyinfo_t* info;
+	forth_word_t start = addr;
+	int tries;
+	for (tries = 0; tries < FORTH_VERIFY_MAXTRIES; tries++) {
+		v->work = 0;
+		v->deep = -1;
+		info = forth_verifyat(v, start, 0);
+		if (v->deep >= 0) {
+			start = v->deep;
+		} else if (start == addr) {
+			return info;
+		} else {
+			start = addr;
+		}
+	}
+	// Don't keep trying every time it's arrived at.
+	if (addr - v->codestart >= 0 && addr - v->codestart < v->ntable && v->info[addr - v->codestart].state == FORTH_VERIFY_UNKNOWN) {
+		v->info[addr - v->codestart].state = FORTH_VERIFY_FAILED;
+		v->rejected++;
+	}
+	return NULL;
+}
+
+// Throws away everything worked out so far, e.g. after changing code.
+FORTH_INLINE void forth_verifyflush(forth_verify_t* v) {
+	memset(v->info, 0, (v->ntable > 0 ? v->ntable : 1) * sizeof(forth_verifyinfo_t));
+	v->indexgen = FORTH_HEADER_HAS(v->forth, indexgen) ? v->forth->header.indexgen : 0;
+}
+
+// Flushes everything if the index has changed since it was worked out.
+FORTH_INLINE void forth_verifycheckgen(forth_verify_t* v) {
+	if (FORTH_HEADER_HAS(v->forth, indexgen) && v->forth->header.indexgen != v->indexgen) {
+		forth_verifyflush(v);
+	}
+}
+
+/* Makes a verifier for an image. Returns NULL on failure (including for instances of a shared segment). Declare the host functions with forth_verifysys, then use
+ * it with forth_verifyrun instead of forth_run (or just forth_verifyword), and free it with forth_verifydestroy.
+ */
+FORTH_INLINE forth_verify_t* forth_verifycreate(forth_t* forth) {
+	if (forth_isinstance(forth)) {
+		return NULL;
+	}
+	forth_verify_t* v = calloc(1, sizeof(forth_verify_t));
+	if (v == NULL) {
+		return NULL;
+	}
+	v->forth = forth;
+	v->codestart = forth->header.codestart;
+	v->ntable = forth->header.codeend - forth->header.codestart;
+	v->info = calloc(v->ntable > 0 ? v->ntable : 1, sizeof(forth_verifyinfo_t));
+	if (v->info == NULL) {
+		free(v);
+		return NULL;
+	}
+	forth_verifyflush(v);
+	return v;
+}
+
+FORTH_INLINE void forth_verifydestroy(forth_verify_t* v) {
+	free(v->sys);
+	free(v->info);
+	free(v);
+}
+
+/* Declares what host function sysnum does to the data stack, as a picture like "a b -- b a" of the words it takes
+ * (the deepest first), "--", and the words it leaves. An output with the same name as an input is a copy of it
+ * (which matters for blocks that are passed around, e.g. to be looped over), others are new. Returns 0, or -1 if
+ * the picture can't be used.
+ */
+FORTH_INLINE int forth_verifysys(forth_verify_t* v, int sysnum, const char* picture) {
+	const char* names[2 * FORTH_VERIFY_MAXPICTURE];
+	size_t lens[2 * FORTH_VERIFY_MAXPICTURE];
+	int n = 0, in = -1, i, j;
+	const char* p = picture;
+	while (*p != '\0') {
+		if (*p == ' ') {
+			p++;
+			continue;
+		}
+		const char* name = p;
+		while (*p != '\0' && *p != ' ') {
+			p++;
+		}
+		if (p - name == 2 && name[0] == '-' && name[1] == '-') {
+			if (in >= 0) {
+				return -1;
+			}
+			in = n;
+		} else if (n == 2 * FORTH_VERIFY_MAXPICTURE) {
+			return -1;
+		} else {
+			names[n] = name;
+			lens[n++] = (size_t)(p - name);
+		}
+	}
+	if (in < 0 || in > FORTH_VERIFY_MAXPICTURE || n - in > FORTH_VERIFY_MAXPICTURE) {
+		return -1;
+	}
+	forth_verifysys_t d;
+	d.sysnum = sysnum;
+	d.in = in;
+	d.out = n - in;
+	for (i = 0; i < d.out; i++) {
+		d.from[i] = -1;
+		for (j = 0; j < in; j++) {
+			if (lens[j] == lens[in + i] && memcmp(names[j], names[in + i], lens[j]) == 0) {
+				d.from[i] = (signed char)j;
+			}
+		}
+	}
+	i = 0;
+	while (i < v->nsys && v->sys[i].sysnum != sysnum) {
+		i++;
+	}
+	if (i == v->maxsys) {
+		int maxsys = v->maxsys ? v->maxsys * 2 : 16;
+		forth_verifysys_t* sys = realloc(v->sys, maxsys * sizeof(forth_verifysys_t));
+		if (sys == NULL) {
+			return -1;
+		}
+		v->sys = sys;
+		v->maxsys = maxsys;
+	}
+	if (i == v->nsys) {
+		v->nsys++;
+	}
+	v->sys[i] = d;
+	forth_verifyflush(v); // Anything verified with the old picture
+	return 0;
+}
+
+/* Verifies the code at addr (e.g. the start of a word), filling in *effect if it isn't NULL. Returns 0, or -1 if it
+ * can't be verified.
+ */
+FORTH_INLINE int forth_verifyword(forth_verify_t* v, forth_word_t addr, forth_effect_t* effect) {
+	forth_verifycheckgen(v);
+	forth_verifyinfo_t* info = forth_verifyentry(v, addr);
+	if (info == NULL) {
+		return -1;
+	}
+	if (effect != NULL) {
+		effect->in = -info->low;
+		effect->out = info->fixed ? info->net - info->low : -1;
+		effect->maxdata = info->high - info->low;
+		effect->maxreturn = info->rhigh;
+	}
+	return 0;
+}
+
+// Whether the stacks have room for everything the code at pc does.
+FORTH_INLINE bool forth_verifyfits(forth_t* forth, const forth_verifyinfo_t* info) {
+	const forth_header_t* h = &forth->header;
+	return h->dsstart >= 0 && h->dsend <= h->fsize && h->rsstart >= 0 && h->rsend <= h->fsize
+		&& h->dsp + info->low >= h->dsstart && h->dsp + info->high <= h->dsend
+		&& h->rsp >= h->rsstart && h->rsp + info->rhigh <= h->rsend;
+}
+
+// A simple op other than '?', the same as the interpreter does it.
+FORTH_INLINE forth_word_t forth_verifycalc(char c, forth_word_t lhs, forth_word_t rhs) {
+	forth_word_t res = 0;
+	switch (c) {
+	case '+': res = lhs + rhs; break;
+	case '-': res = lhs - rhs; break;
+	case '*': res = lhs * rhs; break;
+	case '/': res = lhs / rhs; break;
+	case '%': res = lhs % rhs; break;
+	case 'R': res = lhs >> rhs; break;
+	case 'L': res = lhs << rhs; break;
+	case '=': res = (lhs == rhs) ? -1 : 0; break;
+	case 'A': res = (lhs && rhs) ? -1 : 0; break;
+	case 'O': res = (lhs || rhs) ? -1 : 0; break;
+	case '&': res = lhs & rhs; break;
+	case '|': res = lhs | rhs; break;
+	}
+	return res;
+}
+
+/* Runs the verified code from the header's pc up to (but not including) its return, without checking the stacks or
+ * pc, adding the steps it takes to *used. It hands back to the interpreter early if a callback doesn't do what it
+ * was declared to do (or changes the index or stacks), or a '!' isn't looping over the block it was verified with.
+ */
+FORTH_INLINE forth_word_t forth_verifyfast(forth_verify_t* v, forth_callback_t callback, void* udata, long maxsteps, long* used) {
+	forth_t* forth = v->forth;
+	forth_word_t* words = forth->data.words;
+	forth_word_t pc = forth->header.pc, dsp = forth->header.dsp, rsp = forth->header.rsp;
+	const forth_word_t start = pc, startdsp = dsp, startrsp = rsp;
+	const forth_word_t codestart = v->codestart, codenext = forth->header.codenext;
+	const forth_word_t rsstart = forth->header.rsstart, rsend = forth->header.rsend, dsstart = forth->header.dsstart, dsend = forth->header.dsend;
+	const bool hasgen = FORTH_HEADER_HAS(forth, indexgen);
+	forth_word_t instr, tmp, lhs, rhs;
+	long steps = *used;
+	long calls = 0; // Returns to run before the one that ends the code
+	int slot;
+	v->entries++;
+	while (steps < maxsteps) {
+		instr = words[pc];
+		if ((instr & 0xF) == FORTH_OP_CONTROL && calls == 0) {
+			/* If this is a loop body that's going round again (back to a '!' with the block under a non-zero flag),
+			 * the return and the '!' leave the stacks as they were when it started, so it can carry on here.
+			 */
+			if (dsp != startdsp + 1 || dsp - 2 < dsstart || rsp != startrsp || rsp <= rsstart || steps + 2 > maxsteps
+				|| words[rsp - 1] < codestart || words[rsp - 1] >= codenext || words[words[rsp - 1]] != FORTH_OP_LOOP
+				|| words[dsp - 1] == 0 || words[dsp - 2] != start) {
+				break;
+			}
+			steps += 2;
+			dsp--;
+			pc = start;
+			continue;
+		}
+		steps++;
+		switch (instr & 0xF) {
+		case FORTH_OP_PUSHINT:
+			words[dsp++] = instr >> 4;
+			pc++;
+			break;
+		case FORTH_OP_CALLADDR:
+			words[rsp++] = pc;
+			pc = instr >> 4;
+			calls++;
+			break;
+		case FORTH_OP_CALLSYS:
+			tmp = instr >> 4;
+			goto callsys;
+		case FORTH_OP_TAILCALL: // The function's return is the one that ends this code, if it's at the top
+			pc = instr >> 4;
+			break;
+		case FORTH_OP_PUSHSTR:
+			words[dsp++] = pc;
+			pc += 1 + (instr >> 4);
+			break;
+		case FORTH_OP_SIMPLE:
+			rhs = words[--dsp];
+			lhs = words[dsp - 1];
+			if ((char)(instr >> 4) == '?') {
+				words[dsp - 1] = 0;
+				pc = (lhs != 0) ? rhs : pc + 1;
+			} else {
+				words[dsp - 1] = forth_verifycalc((char)(instr >> 4), lhs, rhs);
+				pc++;
+			}
+			break;
+		case FORTH_OP_CONTROL:
+			pc = words[--rsp] + 1;
+			if (words[pc - 1] == FORTH_OP_LOOP && words[--dsp] != 0) {
+				pc--;
+			}
+			calls--;
+			break;
+		case FORTH_OP_CALLINDEX:
+			tmp = words[instr >> 4];
+			forth_quicken(forth, pc, instr >> 4, tmp);
+			if ((tmp & 0xF) == FORTH_OP_CALLADDR) {
+				words[rsp++] = pc;
+				pc = tmp >> 4;
+				calls++;
+				break;
+			}
+			tmp >>= 4;
+		callsys:
+			forth->header.pc = pc;
+			forth->header.dsp = dsp;
+			forth->header.rsp = rsp;
+			if (callback(forth, udata, (int)tmp) != 0) {
+				v->faststeps += steps - *used;
+				*used = steps;
+				return forth_iswaiting(forth) ? FORTH_RUN_WAITING : FORTH_RUN_PAUSED;
+			}
+			if (forth->header.pc != pc || forth->header.dsp != dsp + v->info[pc - codestart].check || forth->header.rsp != rsp
+				|| forth->header.rsstart != rsstart || forth->header.rsend != rsend || forth->header.dsstart != dsstart || forth->header.dsend != dsend
+				|| (hasgen && forth->header.indexgen != v->indexgen) || forth_iswaiting(forth)) {
+				// Carry on after the call in the interpreter, like it would have
+				forth->header.pc++;
+				v->faststeps += steps - *used;
+				*used = steps;
+				return FORTH_RUN_BUDGET;
+			}
+			pc++;
+			dsp = forth->header.dsp;
+			break;
+		case FORTH_OP_PUSHBLOCK:
+			words[dsp++] = pc + 1;
+			pc = instr >> 4;
+			break;
+		case FORTH_OP_LOOP:
+			if (words[dsp - 1] != v->info[pc - codestart].check) {
+				steps--;
+				goto done;
+			}
+			words[rsp++] = pc;
+			pc = words[dsp - 1];
+			calls++;
+			break;
+		case FORTH_OP_PUSHOP:
+			words[dsp] = instr >> 8;
+			lhs = words[dsp - 1];
+			if (FORTH_SIMPLEOPS[(instr >> 4) & 0xF] == '?') {
+				words[dsp - 1] = 0;
+				pc = (lhs != 0) ? instr >> 8 : pc + 2;
+			} else {
+				words[dsp - 1] = forth_verifycalc(FORTH_SIMPLEOPS[(instr >> 4) & 0xF], lhs, instr >> 8);
+				pc += 2;
+			}
+			break;
+		case FORTH_OP_OPOP:
+			rhs = words[--dsp];
+			words[dsp - 1] = forth_verifycalc(FORTH_SIMPLEOPS[(instr >> 4) & 0xF], words[dsp - 1], rhs);
+			rhs = words[--dsp];
+			words[dsp - 1] = forth_verifycalc(FORTH_SIMPLEOPS[(instr >> 8) & 0xF], words[dsp - 1], rhs);
+			pc += 2;
+			break;
+		case FORTH_OP_BLOCKLOOP:
+			words[dsp++] = pc + 1;
+			words[rsp++] = instr >> 4;
+			pc++;
+			calls++;
+			break;
+		case FORTH_OP_EXT:
+			if (forth_ispacked(instr)) {
+				words[dsp++] = pc;
+				pc += 1 + forth_packedsize(instr >> 8);
+				break;
+			}
+			if ((instr & 0xFF) == FORTH_TAILINDEX_TAG) {
+				tmp = words[instr >> 8];
+				forth_quicken(forth, pc, instr >> 8, forth_quickform(forth, tmp, true));
+				if ((tmp & 0xF) == FORTH_OP_CALLADDR) {
+					pc = tmp >> 4;
+					break;
+				}
+				tmp >>= 4;
+				goto callsys;
+			}
+			pc++;
+			for (slot = 8; slot < (int)sizeof(forth_word_t) * 8 && (tmp = (instr >> slot) & 0xF) != 0; slot += 4) {
+				if (tmp == FORTH_DENSE_SMALL) {
+					slot += 4;
+					words[dsp++] = (instr >> slot) & 0xF;
+				} else if (tmp == FORTH_DENSE_WIDE) {
+					words[dsp++] = words[pc++];
+				} else if (tmp == FORTH_SIMPLEOPCOUNT) {
+					rhs = words[--dsp];
+					if (words[dsp - 1] != 0) {
+						pc = rhs;
+					}
+					words[dsp - 1] = 0;
+					break;
+				} else {
+					rhs = words[--dsp];
+					words[dsp - 1] = forth_verifycalc(FORTH_SIMPLEOPS[tmp - 1], words[dsp - 1], rhs);
+				}
+			}
+			break;
+		default: // Not verified, so never gets here
+			steps--;
+			goto done;
+		}
+	}
+
+done:
+	forth->header.pc = pc;
+	forth->header.dsp = dsp;
+	forth->header.rsp = rsp;
+	v->faststeps += steps - *used;
+	*used = steps;
+	return FORTH_RUN_BUDGET;
+}
+
+/* The hook that forth_verifyrun gives forth_runhooked: runs the code from pc on the fast path if it's verified and
+ * the stacks have room, for as long as it can.
+ */
+FORTH_INLINE forth_word_t forth_verifyhook(forth_t* forth, void* hookdata, forth_callback_t callback, void* udata, long maxsteps, long* used) {
+	forth_verify_t* v = (forth_verify_t*)hookdata;
+	forth_word_t status, pc;
+	bool ran = false;
+	if (forth_iswaiting(forth)) { // The interpreter returns FORTH_RUN_WAITING for a parked VM
+		return FORTH_RUN_BUDGET;
+	}
+	while (*used < maxsteps) {
+		forth_verifycheckgen(v);
+		forth_verifyinfo_t* info = forth_verifyentry(v, forth->header.pc);
+		if (info != NULL && forth_verifyfits(forth, info)) {
+			status = forth_verifyfast(v, callback, udata, maxsteps, used);
+			if (status != FORTH_RUN_BUDGET || *used >= maxsteps) {
+				return status;
+			}
+			ran = true;
+		}
+		/* The fast path stops at the return at the end of the code, which (like a '!' it doesn't know) often leads
+		 * straight back into verified code, so those are run here rather than going back to the interpreter.
+		 */
+		pc = forth->header.pc;
+		if (!ran || pc < forth->header.codestart || pc >= forth->header.codenext
+			|| ((forth->data.words[pc] & 0xF) != FORTH_OP_CONTROL && (forth->data.words[pc] & 0xF) != FORTH_OP_LOOP)) {
+			break;
+		}
+		status = forth_run(forth, callback, udata, 1, NULL);
+		(*used)++;
+		if (status != FORTH_RUN_BUDGET) {
+			return status;
+		}
+	}
+	return FORTH_RUN_BUDGET;
+}
+
+// Runs up to maxsteps instructions like forth_run, using the fast path for verified code.
+FORTH_INLINE forth_word_t forth_verifyrun(forth_verify_t* v, forth_callback_t callback, void* udata, long maxsteps, long* stepsout) {
+	long used = 0;
+	long more = 0;
+	forth_word_t status = forth_verifyhook(v->forth, v, callback, udata, maxsteps, &used);
+	if (status == FORTH_RUN_BUDGET) {
+		status = forth_runhooked(v->forth, callback, udata, maxsteps - used, &more, &forth_verifyhook, v);
+	}
+	if (stepsout != NULL) {
+		*stepsout = used + more;
+	}
+	return status;
+}
+
+#endif
@@ -0,0 +1,531 @@
+/* A compact, portable stream format for images, for moving them (even while they're paused or waiting) between
+ * machines with a different byte order, or just over a network without sending the whole fsize words.
+ *
+ * Only the live parts of the image are written: the header, the index up to indexnext, the hash index, the code up
+ * to codenext, the heap up to heapnext (leaving out the unused parts of the stacks) and anything after heapend. Runs
+ * of zeros are skipped, and the rest goes in chunks of up to FORTH_WIRE_CHUNK words, each stored whichever way is
+ * smallest: as varints, as varints of the difference from the previous word (which suits the header and the index)
+ * or as raw little-endian words (which the importer just copies, byte-swapping them in bulk on big-endian hosts).
+ * Everything that isn't written comes back as zeros, including the popped parts of the stacks.
+ *
+ * The format is read and written through callbacks a buffer at a time, so neither side ever needs a second copy of
+ * the image:
+ *
+ *	forth_wireexport(forth, &mysend, sock);
+ *	...
+ *	forth_wire_t w;
+ *	forth_word_t size = forth_wireopen(&w, &myrecv, sock);
+ *	forth_t* forth = malloc(size * sizeof(forth_word_t));
+ *	if (size < 0 || forth == NULL || forth_wireimport(&w, forth, size) != 0) { ... }
+ *
+ * Words are moved by value, so the only thing that changes with the byte order is packed strings (whose bytes are in
+ * the host's order). The importer fixes up the ones it can find, i.e. the packed literals in the code and the names
+ * in the index. Packed strings a program makes for itself in the heap aren't known to be strings, so they come across
+ * with the bytes in each word reversed. Both ends need the same word size.
+ *
+ * An instance (see forth_clearinstance) goes without its shared segment, which the other end needs its own copy of:
+ * call forth_sharedlink on it after importing, and it's left to the host to swap the master's own packed strings.
+ */
+
+#ifndef FORTH_WIRE_H
+#define FORTH_WIRE_H
+
+#include "forth.h"
+
+#define FORTH_WIRE_VERSION	1
+#define FORTH_WIRE_BUFSIZE	4096	// Bytes buffered between callbacks
+#define FORTH_WIRE_CHUNK	256	// Most words in one run
+#define FORTH_WIRE_MINGAP	3	// Zeros it takes to end a run and skip them instead
+
+// How each run is stored (in the low 2 bits of its length).
+#define FORTH_WIRE_VALUES	0 // Zigzag varints of the words
+#define FORTH_WIRE_DELTAS	1 // Zigzag varints of each word minus the one before it (the first minus 0)
+#define FORTH_WIRE_RAW		2 // Little-endian words
+
+/* Callbacks to write len bytes (returning 0 on success) and to read up to len bytes (returning how many it read, 0
+ * at the end of the stream or -1 on an error).
+ */
+typedef int (*forth_wirewrite_t)(void* ctx, const void* data, size_t len);
+typedef long (*forth_wireread_t)(void* ctx, void* data, size_t len);
+
+typedef struct forth_wire forth_wire_t;
+typedef struct forth_wiremem forth_wiremem_t;
+
+struct forth_wire {
+	forth_wirewrite_t write;
+	forth_wireread_t read;
+	void* ctx;
+	size_t pos;		// Next byte of buf to write or read
+	size_t len;		// Bytes read into buf
+	bool failed;
+	bool bigendian;		// The byte order of the image being read
+	forth_word_t fsize;	// And its size
+	long bytes;		// Bytes written or read so far
+	unsigned char buf[FORTH_WIRE_BUFSIZE];
+};
+
+// A memory buffer to export to or import from, with forth_wirememwrite and forth_wirememread.
+struct forth_wiremem {
+	unsigned char* buf;
+	size_t size;
+	size_t pos;
+};
+
+FORTH_INLINE int forth_wirememwrite(void* ctx, const void* data, size_t len) {
+	forth_wiremem_t* m = ctx;
+	if (len > m->size - m->pos) {
+		return -1;
+	}
+	memcpy(m->buf + m->pos, data, len);
+	m->pos += len;
+	return 0;
+}
+
+FORTH_INLINE long forth_wirememread(void* ctx, void* data, size_t len) {
+	forth_wiremem_t* m = ctx;
+	if (len > m->size - m->pos) {
+		len = m->size - m->pos;
+	}
+	memcpy(data, m->buf + m->pos, len);
+	m->pos += len;
+	return (long)len;
+}
+
+FORTH_INLINE bool forth_wirebigendian(void) {
+	const uint16_t one = 1;
+	return *(const uint8_t*)&one == 0;
+}
+
+FORTH_INLINE forth_word_t forth_wireswap(forth_word_t w) {
+#if defined(__GNUC__)
+	if (sizeof(forth_word_t) == 2) {
+		return (forth_word_t)__builtin_bswap16((uint16_t)w);
+	} else if (sizeof(forth_word_t) == 4) {
+		return (forth_word_t)__builtin_bswap32((uint32_t)w);
+	}
+	return (forth_word_t)__builtin_bswap64((uint64_t)w);
+#else
+	uintmax_t v = (uintmax_t)w, r = 0;
+	size_t i;
+	for (i = 0; i < sizeof(forth_word_t); i++) {
+		r = (r << 8) | (v & 0xFF);
+		v >>= 8;
+	}
+	return (forth_word_t)r;
+#endif
+}
+
+// Reverses the bytes of n words, which compilers turn into vector shuffles.
+FORTH_INLINE void forth_wireswapwords(forth_word_t* words, size_t n) {
+	size_t i;
+	for (i = 0; i < n; i++) {
+		words[i] = forth_wireswap(words[i]);
+	}
+}
+
+FORTH_INLINE uint64_t forth_wirezigzag(forth_word_t w) {
+	int64_t v = (int64_t)w;
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+FORTH_INLINE int forth_wirevarlen(uint64_t v) {
+	int n = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+FORTH_INLINE void forth_wireflush(forth_wire_t* w) {
+	if (!w->failed && w->pos > 0 && w->write(w->ctx, w->buf, w->pos) != 0) {
+		w->failed = true;
+	}
+	w->bytes += (long)w->pos;
+	w->pos = 0;
+}
+
+FORTH_INLINE void forth_wireputbytes(forth_wire_t* w, const void* data, size_t len) {
+	const unsigned char* p = data;
+	while (len > 0) {
+		if (w->pos == FORTH_WIRE_BUFSIZE) {
+			forth_wireflush(w);
+		}
+		size_t n = FORTH_WIRE_BUFSIZE - w->pos;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(w->buf + w->pos, p, n);
+		w->pos += n;
+		p += n;
+		len -= n;
+	}
+}
+
+FORTH_INLINE void forth_wireputvar(forth_wire_t* w, uint64_t v) {
+	if (FORTH_WIRE_BUFSIZE - w->pos < 10) {
+		forth_wireflush(w);
+	}
+	while (v >= 0x80) {
+		w->buf[w->pos++] = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	w->buf[w->pos++] = (unsigned char)v;
+}
+
+// Writes the n words at words[start] as a run after gap skipped words, in whichever form is smallest.
+FORTH_INLINE void forth_wireputrun(forth_wire_t* w, const forth_word_t* words, forth_word_t start, forth_word_t n, forth_word_t gap) {
+	const forth_word_t* p = words + start;
+	size_t values = 0, deltas = 0, raw = (size_t)n * sizeof(forth_word_t);
+	forth_word_t i, prev = 0;
+	for (i = 0; i < n; i++) {
+		values += forth_wirevarlen(forth_wirezigzag(p[i]));
+		deltas += forth_wirevarlen(forth_wirezigzag((forth_word_t)((uint64_t)p[i] - (uint64_t)prev)));
+		prev = p[i];
+	}
+	forth_wireputvar(w, (uint64_t)gap);
+	if (raw <= values && raw <= deltas) {
+		forth_wireputvar(w, ((uint64_t)n << 2) | FORTH_WIRE_RAW);
+		if (!forth_wirebigendian()) {
+			forth_wireputbytes(w, p, raw);
+			return;
+		}
+		for (i = 0; i < n; i++) {
+			forth_word_t le = forth_wireswap(p[i]);
+			forth_wireputbytes(w, &le, sizeof(le));
+		}
+	} else if (values <= deltas) {
+		forth_wireputvar(w, ((uint64_t)n << 2) | FORTH_WIRE_VALUES);
+		for (i = 0; i < n; i++) {
+			forth_wireputvar(w, forth_wirezigzag(p[i]));
+		}
+	} else {
+		forth_wireputvar(w, ((uint64_t)n << 2) | FORTH_WIRE_DELTAS);
+		for (i = 0, prev = 0; i < n; i++) {
+			forth_wireputvar(w, forth_wirezigzag((forth_word_t)((uint64_t)p[i] - (uint64_t)prev)));
+			prev = p[i];
+		}
+	}
+}
+
+FORTH_INLINE void forth_wireaddrange(forth_word_t ranges[][2], int* n, forth_word_t start, forth_word_t end) {
+	ranges[*n][0] = start;
+	ranges[*n][1] = end;
+	(*n)++;
+}
+
+/* Works out the live ranges of the image (see the top of the file), sorted, merged and inside it. Returns how many
+ * there are (up to 12).
+ */
+FORTH_INLINE int forth_wireranges(forth_t* forth, forth_word_t ranges[12][2]) {
+	forth_header_t* h = &forth->header;
+	forth_word_t holes[3][2] = { { h->rsp, h->rsend }, { h->dsp, h->dsend }, { h->asp, h->asend } };
+	int n = 0, i, j;
+	forth_wireaddrange(ranges, &n, 0, h->hsize);
+	forth_wireaddrange(ranges, &n, h->indexstart, h->indexnext);
+	if (FORTH_HEADER_HAS(forth, hashsize)) {
+		forth_wireaddrange(ranges, &n, h->hashstart, h->hashstart + h->hashsize);
+	}
+	forth_wireaddrange(ranges, &n, h->codestart, h->codenext);
+	// The heap, less the parts of the stacks above their pointers
+	for (i = 1; i < 3; i++) {
+		for (j = i; j > 0 && holes[j][0] < holes[j - 1][0]; j--) {
+			forth_word_t s = holes[j][0], e = holes[j][1];
+			holes[j][0] = holes[j - 1][0];
+			holes[j][1] = holes[j - 1][1];
+			holes[j - 1][0] = s;
+			holes[j - 1][1] = e;
+		}
+	}
+	forth_word_t next = h->heapstart;
+	for (i = 0; i < 3; i++) {
+		if (holes[i][0] > next) {
+			forth_wireaddrange(ranges, &n, next, holes[i][0] < h->heapnext ? holes[i][0] : h->heapnext);
+		}
+		if (holes[i][1] > next) {
+			next = holes[i][1];
+		}
+	}
+	forth_wireaddrange(ranges, &n, next, h->heapnext);
+	// The stacks themselves, in case they aren't in the heap
+	forth_wireaddrange(ranges, &n, h->rsstart, h->rsp);
+	forth_wireaddrange(ranges, &n, h->dsstart, h->dsp);
+	forth_wireaddrange(ranges, &n, h->asstart, h->asp);
+	forth_wireaddrange(ranges, &n, h->heapend, h->fsize);
+
+	int m = 0;
+	for (i = 0; i < n; i++) {
+		forth_word_t s = ranges[i][0] < 0 ? 0 : ranges[i][0], e = ranges[i][1] > h->fsize ? h->fsize : ranges[i][1];
+		if (s >= e) {
+			continue;
+		}
+		for (j = m; j > 0 && ranges[j - 1][0] > s; j--) {
+			ranges[j][0] = ranges[j - 1][0];
+			ranges[j][1] = ranges[j - 1][1];
+		}
+		ranges[j][0] = s;
+		ranges[j][1] = e;
+		m++;
+	}
+	for (i = 1, n = m, m = (n > 0); i < n; i++) {
+		if (ranges[i][0] <= ranges[m - 1][1]) {
+			if (ranges[i][1] > ranges[m - 1][1]) {
+				ranges[m - 1][1] = ranges[i][1];
+			}
+		} else {
+			ranges[m][0] = ranges[i][0];
+			ranges[m][1] = ranges[i][1];
+			m++;
+		}
+	}
+	return m;
+}
+
+/* Writes the image to the stream. It doesn't have to be stopped at any particular point, but it can't run while it's
+ * being written. Returns the number of bytes written, or -1 if it isn't a valid image or the callback failed.
+ */
+FORTH_INLINE long forth_wireexport(forth_t* forth, forth_wirewrite_t write, void* ctx) {
+	if (forth == NULL || forth_checkheader(forth, forth->header.fsize) != 0) {
+		return -1;
+	}
+	forth_wire_t* w = malloc(sizeof(forth_wire_t));
+	if (w == NULL) {
+		return -1;
+	}
+	w->write = write;
+	w->read = NULL;
+	w->ctx = ctx;
+	w->pos = 0;
+	w->failed = false;
+	w->bytes = 0;
+	const unsigned char prelude[6] = { 'Z', 'F', 'W', FORTH_WIRE_VERSION, sizeof(forth_word_t), forth_wirebigendian() };
+	forth_wireputbytes(w, prelude, sizeof(prelude));
+	forth_wireputvar(w, (uint64_t)forth->header.fsize);
+
+	const forth_word_t* words = forth->data.words;
+	forth_word_t ranges[12][2];
+	int nranges = forth_wireranges(forth, ranges);
+	forth_word_t last = 0;
+	int r;
+	for (r = 0; r < nranges; r++) {
+		forth_word_t p = ranges[r][0], e = ranges[r][1];
+		while (p < e) {
+			if (words[p] == 0) {
+				p++;
+				continue;
+			}
+			forth_word_t start = p, end = p + 1;
+			while (p < e && p - start < FORTH_WIRE_CHUNK) {
+				if (words[p] != 0) {
+					end = p + 1;
+				} else if (p - end + 1 >= FORTH_WIRE_MINGAP) {
+					break;
+				}
+				p++;
+			}
+			forth_wireputrun(w, words, start, end - start, start - last);
+			last = p = end;
+		}
+	}
+	forth_wireputvar(w, 0);
+	forth_wireputvar(w, 0); // A run of no words ends the stream
+	forth_wireflush(w);
+	long bytes = w->failed ? -1 : w->bytes;
+	free(w);
+	return bytes;
+}
+
+FORTH_INLINE bool forth_wirefill(forth_wire_t* w) {
+	if (w->failed) {
+		return false;
+	}
+	long n = w->read(w->ctx, w->buf, FORTH_WIRE_BUFSIZE);
+	if (n <= 0) {
+		w->failed = true;
+		return false;
+	}
+	w->bytes += n;
+	w->pos = 0;
+	w->len = (size_t)n;
+	return true;
+}
+
+// Reads exactly len bytes, straight into data once the buffer's empty. Returns false if the stream ends first.
+FORTH_INLINE bool forth_wiregetbytes(forth_wire_t* w, void* data, size_t len) {
+	unsigned char* p = data;
+	size_t n = w->len - w->pos;
+	if (n > len) {
+		n = len;
+	}
+	memcpy(p, w->buf + w->pos, n);
+	w->pos += n;
+	p += n;
+	len -= n;
+	while (len >= FORTH_WIRE_BUFSIZE && !w->failed) {
+		long got = w->read(w->ctx, p, len);
+		if (got <= 0) {
+			w->failed = true;
+			return false;
+		}
+		w->bytes += got;
+		p += got;
+		len -= (size_t)got;
+	}
+	while (len > 0) {
+		if (w->pos == w->len && !forth_wirefill(w)) {
+			return false;
+		}
+		n = w->len - w->pos;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(p, w->buf + w->pos, n);
+		w->pos += n;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+FORTH_INLINE uint64_t forth_wiregetvar(forth_wire_t* w) {
+	uint64_t v = 0;
+	int shift;
+	for (shift = 0; shift < 64; shift += 7) {
+		if (w->pos == w->len && !forth_wirefill(w)) {
+			return 0;
+		}
+		unsigned char b = w->buf[w->pos++];
+		v |= (uint64_t)(b & 0x7F) << shift;
+		if (b < 0x80) {
+			return v;
+		}
+	}
+	w->failed = true;
+	return 0;
+}
+
+// Decodes a zigzag varint into a word, failing if it doesn't fit.
+FORTH_INLINE forth_word_t forth_wiregetword(forth_wire_t* w) {
+	uint64_t z = forth_wiregetvar(w);
+	int64_t v = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+	if ((int64_t)(forth_word_t)v != v) {
+		w->failed = true;
+	}
+	return (forth_word_t)v;
+}
+
+/* Reverses the bytes of the packed strings the importer can find (the literals in the code and the names in the
+ * index), for an image that was written on a host with the other byte order.
+ */
+FORTH_INLINE void forth_wireswapstrings(forth_t* forth) {
+	forth_header_t* h = &forth->header;
+	forth_word_t* words = forth->data.words;
+	forth_word_t i, n;
+	if (forth_isinstance(forth)) { // Its code and index belong to the shared segment
+		return;
+	}
+	for (i = h->codestart; i >= 0 && i < h->codenext && i < h->fsize; i++) {
+		forth_word_t instr = words[i];
+		if ((instr & 0xF) == FORTH_OP_PUSHSTR) {
+			i += instr >> 4;
+		} else if (forth_ispacked(instr)) {
+			n = forth_packedsize(instr >> 8);
+			if (n > h->codenext - 1 - i) {
+				break;
+			}
+			forth_wireswapwords(words + i + 1, (size_t)n);
+			i += n;
+		} else if (forth_isdense(instr) && forth_densecount(instr, &n) >= 0) {
+			i += n;
+		}
+	}
+	bool packed;
+	for (i = h->indexstart; i + 1 < h->indexnext; i += 2) {
+		forth_word_t name = words[i];
+		if ((name < h->codestart || name >= h->codenext) && forth_strheader(forth, name, &packed) >= 0 && packed) {
+			forth_wireswapwords(words + name + 1, (size_t)forth_packedsize(words[name] >> 8));
+		}
+	}
+}
+
+/* Starts reading an image from the stream. Returns its size in words (which forth_wireimport needs that much room
+ * for), or -1 if it isn't in this format or was written with a different word size.
+ */
+FORTH_INLINE forth_word_t forth_wireopen(forth_wire_t* w, forth_wireread_t read, void* ctx) {
+	unsigned char prelude[6];
+	w->write = NULL;
+	w->read = read;
+	w->ctx = ctx;
+	w->pos = w->len = 0;
+	w->failed = false;
+	w->bytes = 0;
+	if (!forth_wiregetbytes(w, prelude, sizeof(prelude)) || prelude[0] != 'Z' || prelude[1] != 'F' || prelude[2] != 'W'
+		|| prelude[3] != FORTH_WIRE_VERSION || prelude[4] != sizeof(forth_word_t) || prelude[5] > 1) {
+		return -1;
+	}
+	w->bigendian = prelude[5];
+	uint64_t size = forth_wiregetvar(w);
+	if (w->failed || size < FORTH_HEADER_MINSIZE || (uint64_t)(forth_word_t)size != size || (forth_word_t)size < 0) {
+		return -1;
+	}
+	w->fsize = (forth_word_t)size;
+	return w->fsize;
+}
+
+/* Reads the rest of an image opened with forth_wireopen into forth, which has to be size words (what that returned).
+ * Returns 0 on success, or -1 if the stream is cut short or corrupt or the result isn't a valid image.
+ */
+FORTH_INLINE int forth_wireimport(forth_wire_t* w, forth_t* forth, forth_word_t size) {
+	if (forth == NULL || w->read == NULL || size != w->fsize) {
+		return -1;
+	}
+	forth_word_t* words = forth->data.words;
+	forth_word_t next = 0;
+	while (!w->failed) {
+		uint64_t gap = forth_wiregetvar(w), tag = forth_wiregetvar(w);
+		uint64_t n = tag >> 2;
+		if (w->failed || gap > (uint64_t)(size - next) || n > (uint64_t)(size - next) - gap) {
+			return -1;
+		}
+		memset(words + next, 0, (size_t)gap * sizeof(forth_word_t));
+		next += (forth_word_t)gap;
+		if (n == 0) {
+			break;
+		}
+		forth_word_t* p = words + next, prev = 0;
+		uint64_t i;
+		switch (tag & 3) {
+		case FORTH_WIRE_VALUES:
+			for (i = 0; i < n; i++) {
+				p[i] = forth_wiregetword(w);
+			}
+			break;
+		case FORTH_WIRE_DELTAS:
+			for (i = 0; i < n; i++) {
+				p[i] = prev = (forth_word_t)((uint64_t)prev + (uint64_t)forth_wiregetword(w));
+			}
+			break;
+		case FORTH_WIRE_RAW:
+			if (forth_wiregetbytes(w, p, (size_t)n * sizeof(forth_word_t)) && forth_wirebigendian()) {
+				forth_wireswapwords(p, (size_t)n);
+			}
+			break;
+		default:
+			return -1;
+		}
+		next += (forth_word_t)n;
+	}
+	if (w->failed) {
+		return -1;
+	}
+	memset(words + next, 0, (size_t)(size - next) * sizeof(forth_word_t));
+	if (forth_checkimage(forth, size) != 0) {
+		return -1;
+	}
+	if (w->bigendian != forth_wirebigendian()) {
+		forth_wireswapstrings(forth);
+	}
+	return 0;
+}
+
+#endif
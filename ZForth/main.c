@@ -1,75 +1,26 @@
 /* A basic driver for the FORTH system.
- * Includes some code from StackExchange for making getline work on Windows, but it's all public domain.
+ * Source is read in fixed-size chunks and fed straight to the streaming assembler, so lines can be any length.
  *
  * -Zak.
  */
 //#define FORTH_16BIT
+//#define FORTH_PROFILE
 #include "forth.h"
+#include "forth_prof.h"
 #include <stdio.h>
 #include <stdlib.h>
-#include <errno.h>
-
-/* The original code is public domain -- Will Hartung 4/9/09 */
-/* Modifications, public domain as well, by Antti Haapala, 11/10/17
- ^^ This applies to the getline function I've included here. -Zak Fenton, 2020
-   - Switched to getc on 5/23/19 */
-
-   // if typedef doesn't exist (msvc, blah)
-typedef intptr_t ssize_t;
-
-ssize_t getline(char** lineptr, size_t* n, FILE* stream) {
-    size_t pos;
-    int c;
-
-    if (lineptr == NULL || stream == NULL || n == NULL) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    c = getc(stream);
-    if (c == EOF) {
-        return -1;
-    }
-
-    if (*lineptr == NULL) {
-        *lineptr = malloc(128);
-        if (*lineptr == NULL) {
-            return -1;
-        }
-        *n = 128;
-    }
-
-    pos = 0;
-    while (c != EOF) {
-        if (pos + 1 >= *n) {
-            size_t new_size = *n + (*n >> 2);
-            if (new_size < 128) {
-                new_size = 128;
-            }
-            char* new_ptr = realloc(*lineptr, new_size);
-            if (new_ptr == NULL) {
-                return -1;
-            }
-            *n = new_size;
-            *lineptr = new_ptr;
-        }
-
-        ((unsigned char*)(*lineptr))[pos++] = c;
-        if (c == '\r' || c == '\n') {
-            break;
-        }
-        c = getc(stream);
-    }
-
-    (*lineptr)[pos] = '\0';
-    return pos;
-}
-
-forth_word_t simplecallback(forth_t* forth, void* udata, int sysnum) {
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+bool simplecallback(forth_t* forth, void* udata, int sysnum) {
     fprintf(stderr, "CALLBACK\n");
     switch (sysnum) {
     case 10:
-        fprintf(stdout, "LOGNUM %d\n", forth_popdata(forth));
+        fprintf(stdout, "LOGNUM %d\n", (int)forth_popdata(forth));
         return 0;
     case 11: {
         char strbuf[100];
@@ -84,29 +35,60 @@ forth_word_t simplecallback(forth_t* forth, void* udata, int sysnum) {
         return 0;
     }
     default:
+        // Returning non-zero would just have the VM retry the same call, so only report the error.
         fprintf(stderr, "ERROR: Callback called with sysnum %d\n", sysnum);
-        return -1;
+        return 0;
     }
     
 }
 
-bool assemble(forth_t* forth, const char* src, forth_word_t len) {
-    forth_word_t i = 0;
-    forth_word_t result = 0;
-    while ((result = forth_assemble(forth, src, i, len)) > 0) {
-        //fprintf(stderr, "Token is %d len is %d\n", forth_tokentype(forth, src, i, len), forth_tokenlength(forth, src, i, len));
-        //fprintf(stderr, "Assembled %d characters from character %d\n", result, i);
-        //fprintf(stderr, "Next asm address is %d\n", forth->header.codenext);
-        i += result;
-    }
-    if (result != 0) {
-        fprintf(stderr, "Error at character %d\n", i);
+bool assemble(forth_t* forth, forth_asmstream_t* stream, const char* src, long len) {
+    if (forth_asmfeed(forth, stream, src, len) != 0) {
+        fprintf(stderr, "Error at character %ld\n", stream->errorpos);
         return false;
     } else {
         return true;
     }
 }
 
+// Blocks for about a millisecond, for a callback that asked to be called again later.
+void waitforhost(void) {
+#ifdef _WIN32
+    Sleep(1);
+#else
+    struct timespec ts = { 0, 1000000 };
+    nanosleep(&ts, NULL);
+#endif
+}
+
+// Finishes assembling a line and runs it.
+bool runline(forth_t* forth, forth_asmstream_t* stream, forth_prof_t* prof) {
+    if (forth_asmend(forth, stream) != 0) {
+        fprintf(stderr, "Error at character %ld\n", stream->errorpos);
+        return false;
+    }
+    // Begin execution, in batches of up to 1000 steps (a real host could do other work between them). Garbage is
+    // collected a slice at a time between the batches, starting again after each line if the last collection's done.
+    // Only running out of steps carries straight on: a paused callback isn't ready yet, so wait before calling it
+    // again rather than spinning on it.
+    forth_gcstart(forth);
+    forth_word_t status = FORTH_RUN_BUDGET;
+    while (status == FORTH_RUN_BUDGET || status == FORTH_RUN_PAUSED) {
+        status = forth_profrun(prof, &simplecallback, NULL, 1000, NULL);
+        forth_gcslice(forth, 256, NULL);
+        if (status == FORTH_RUN_PAUSED) {
+            waitforhost();
+        }
+    }
+    if (status == FORTH_RUN_WAITING) {
+        // Nothing here completes parked calls (a host with asynchronous calls would run its images from a readiness
+        // queue, see forth_async.h), so there's no point running it again.
+        fprintf(stderr, "Waiting on a host call that won't complete\n");
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char **argv) {
 	forth_t* forth = malloc(1024 * 24 * sizeof(forth_word_t));
 	if (forth_clear(forth, (1024 * 24), 1024, 4096) != 0) {
@@ -114,7 +96,30 @@ int main(int argc, char **argv) {
 		return -1;
 	}
 
-    fprintf(stdout, "Zak's simple FORTH-like system. You're running in %d-bit mode.\n", (sizeof(forth_word_t) * 8));
+    // Let calls to named words patch themselves into direct calls the first time they run.
+    forth_enablequicken(forth, 1024);
+    // Fuse common pairs of instructions as they're assembled, turn calls right before a return into tail calls, and
+    // pack strings several bytes to a word.
+    forth->header.asmflags |= FORTH_ASM_PEEPHOLE | FORTH_ASM_TAILCALL | FORTH_ASM_PACKED;
+    // Let scripts allocate (and free) memory with heap.alloc and heap.free.
+    if (forth_enablealloc(forth, 8192) != 0 || forth_defineheapops(forth) != 0) {
+        fprintf(stderr, "Couldn't initialise the allocator.\n");
+        return -1;
+    }
+    // Let scripts run blocks as tasks that take turns with task.spawn, task.yield and task.join.
+    if (forth_enabletasks(forth, 64, 64) != 0 || forth_definetaskops(forth) != 0) {
+        fprintf(stderr, "Couldn't initialise tasks.\n");
+        return -1;
+    }
+
+    // Everything runs through the profiler, which is just forth_run unless FORTH_PROFILE is defined.
+    forth_prof_t* prof = forth_profcreate(forth, 100);
+    if (prof == NULL) {
+        fprintf(stderr, "Couldn't initialise the profiler.\n");
+        return -1;
+    }
+
+    fprintf(stdout, "Zak's simple FORTH-like system. You're running in %d-bit mode.\n", (int)(sizeof(forth_word_t) * 8));
 
 	//fprintf(stderr, "Bootstrapping.\n");
 
@@ -166,36 +171,49 @@ int main(int argc, char **argv) {
     */
 
     /* The new implementation shows the ability to make a simple read-eval-print loop. */
-    bool vmstopped = false;
-    while (!vmstopped) {
-        fprintf(stdout, "[EXIT to quit] > "); // Display a simple prompt.
-
-        // Allocate a small buffer, enough to hopefully fit any reasonable line of code.
-        char* lbuffer = malloc(1024);
-        lbuffer[0] = 0;
-        size_t lsize = 1024;
-
-        size_t n = getline(&lbuffer, &lsize, stdin);
-
-        if (strcmp(lbuffer, "EXIT\n") == 0 || strcmp(lbuffer, "EXIT") == 0 || strcmp(lbuffer, "EXIT\r\n") == 0) {
-            vmstopped = true;
-        } else if (n > 0) {
+    forth_asmstream_t stream;
+    char buffer[1024];
+    bool linestart = true;
+    bool okay = true;
+    fprintf(stdout, "[EXIT to quit] > "); // Display a simple prompt.
+    while (fgets(buffer, sizeof(buffer), stdin) != NULL) {
+        long n = (long)strlen(buffer);
+        if (linestart) {
+            if (strcmp(buffer, "EXIT\n") == 0 || strcmp(buffer, "EXIT") == 0 || strcmp(buffer, "EXIT\r\n") == 0) {
+                break;
+            }
             // This ensures the next execution will begin where the line is assembled to.
             forth->header.pc = forth->header.codenext;
+            forth_asmbegin(&stream);
+            okay = true;
+        }
 
-            // Assemble the line (this function is just a simple loop using the built-in assembler, TODO: Better error handling)
-            bool okay = assemble(forth, (const char*)lbuffer, (forth_word_t)n);
+        // A line longer than the buffer just arrives in more than one piece.
+        okay = okay && assemble(forth, &stream, buffer, n);
 
-            // Begin execution.
-            while (okay && (!vmstopped) && forth_step(forth, &simplecallback, NULL) == 0) {
-                // System is running...
+        linestart = n > 0 && buffer[n - 1] == '\n';
+        if (linestart) {
+            if (okay) {
+                runline(forth, &stream, prof);
             }
-        } else {
-            // Just ignore empty lines.
+            fprintf(stdout, "[EXIT to quit] > ");
         }
+    }
+    if (!linestart && okay) { // The last line didn't end with a newline
+        runline(forth, &stream, prof);
+    }
 
-        free(lbuffer);
+#ifdef FORTH_PROFILE
+    // Where the time went, and the stack samples for flamegraph.pl (or similar).
+    forth_profwritereport(prof, stderr);
+    FILE* folded = fopen("zforth.folded", "w");
+    if (folded != NULL) {
+        forth_profwritefolded(prof, folded);
+        fclose(folded);
+        fprintf(stderr, "Wrote stack samples to zforth.folded\n");
     }
+#endif
+    forth_profdestroy(prof);
 
 	fprintf(stderr, "Done.\n");
 
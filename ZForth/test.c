@@ -0,0 +1,1016 @@
+/* Regression tests for the FORTH system.
+ * Each test prints "ok" or "FAIL" and its name on a line, and the program exits non-zero if any of them failed. Runs
+ * that every engine has to agree on also print a "trace" line with a hash of the states they went through, which
+ * "make test" compares between the builds of each word size. See the Makefile for building it in each configuration.
+ */
+#include "forth.h"
+#include "forth_jit.h"
+#include "forth_module.h"
+#include "forth_verify.h"
+#include "forth_wire.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(FORTH_16BIT)
+#define TEST_BITS	16
+#elif defined(FORTH_64BIT)
+#define TEST_BITS	64
+#else
+#define TEST_BITS	32
+#endif
+
+#if defined(FORTH_USE_THREADED) && defined(FORTH_TOSCACHE)
+#define TEST_ENGINE	"threaded-tos"
+#elif defined(FORTH_USE_THREADED)
+#define TEST_ENGINE	"threaded"
+#elif defined(FORTH_TOSCACHE)
+#define TEST_ENGINE	"switch-tos"
+#else
+#define TEST_ENGINE	"switch"
+#endif
+
+// Small enough for 16-bit builds, where instructions only have 12 bits for addresses.
+#define TEST_SIZE	4096
+#define TEST_INDEXSIZE	64
+#define TEST_CODESIZE	512
+
+static int test_failures = 0;
+
+static void test_check(const char* name, bool ok) {
+	printf("%s %s (%d-bit, %s)\n", ok ? "ok  " : "FAIL", name, TEST_BITS, TEST_ENGINE);
+	if (!ok) {
+		test_failures++;
+	}
+}
+
+// Host calls record the last sysnum they were called with, and these ones are stack words (see test_stackwords).
+static int test_lastsys = 0;
+// What "note" has popped, in order.
+static forth_word_t test_notes[16];
+static int test_nnotes = 0;
+
+enum {
+	TEST_SYS_DUP = 10,
+	TEST_SYS_DROP,
+	TEST_SYS_SWAP,
+	TEST_SYS_OVER,
+	TEST_SYS_ROT,
+	TEST_SYS_LT,
+	TEST_SYS_NOTE,
+	TEST_SYS_END
+};
+
+static bool test_callback(forth_t* forth, void* udata, int sysnum) {
+	forth_word_t a, b, c;
+	test_lastsys = sysnum;
+	switch (sysnum) {
+	case TEST_SYS_DUP: // a -- a a
+		a = forth_popdata(forth);
+		forth_pushdata(forth, a);
+		forth_pushdata(forth, a);
+		break;
+	case TEST_SYS_DROP: // a --
+		forth_popdata(forth);
+		break;
+	case TEST_SYS_SWAP: // a b -- b a
+		b = forth_popdata(forth);
+		a = forth_popdata(forth);
+		forth_pushdata(forth, b);
+		forth_pushdata(forth, a);
+		break;
+	case TEST_SYS_OVER: // a b -- a b a
+		b = forth_popdata(forth);
+		a = forth_popdata(forth);
+		forth_pushdata(forth, a);
+		forth_pushdata(forth, b);
+		forth_pushdata(forth, a);
+		break;
+	case TEST_SYS_ROT: // a b c -- b c a
+		c = forth_popdata(forth);
+		b = forth_popdata(forth);
+		a = forth_popdata(forth);
+		forth_pushdata(forth, b);
+		forth_pushdata(forth, c);
+		forth_pushdata(forth, a);
+		break;
+	case TEST_SYS_LT: // a b -- a<b
+		b = forth_popdata(forth);
+		a = forth_popdata(forth);
+		forth_pushdata(forth, (a < b) ? -1 : 0);
+		break;
+	case TEST_SYS_NOTE: // a --
+		a = forth_popdata(forth);
+		if (test_nnotes < (int)(sizeof(test_notes) / sizeof(test_notes[0]))) {
+			test_notes[test_nnotes++] = a;
+		}
+		break;
+	}
+	return false;
+}
+
+// Names the stack words, since the VM has none of its own.
+static void test_stackwords(forth_t* forth) {
+	static const char* const names[TEST_SYS_END - TEST_SYS_DUP] = { "dup", "drop", "swap", "over", "rot", "lt", "note" };
+	int i;
+	for (i = TEST_SYS_DUP; i < TEST_SYS_END; i++) {
+		forth_setlookupinstr(forth, names[i - TEST_SYS_DUP], forth_encode(forth, FORTH_OP_CALLSYS, i));
+	}
+}
+
+static forth_t* test_open(void) {
+	forth_t* forth = malloc(TEST_SIZE * sizeof(forth_word_t));
+	if (forth == NULL || forth_clear(forth, TEST_SIZE, TEST_INDEXSIZE, TEST_CODESIZE) != 0) {
+		fprintf(stderr, "ERROR: Couldn't initialise an image.\n");
+		exit(1);
+	}
+	return forth;
+}
+
+// Assembles src at the end of the code, returning the address it starts at.
+static forth_word_t test_code(forth_t* forth, const char* src) {
+	forth_word_t start = forth->header.codenext;
+	forth_word_t len = (forth_word_t)strlen(src);
+	forth_word_t i = 0;
+	forth_word_t result;
+	while ((result = forth_assemble(forth, src, i, len)) > 0) {
+		i += result;
+	}
+	if (result != 0) {
+		fprintf(stderr, "ERROR: Couldn't assemble \"%s\".\n", src);
+		exit(1);
+	}
+	return start;
+}
+
+static void test_define(forth_t* forth, const char* name, const char* src) {
+	forth_setlookupinstr(forth, name, forth_encode(forth, FORTH_OP_CALLADDR, test_code(forth, src)));
+}
+
+// Runs the image from pc to the end of the code, returning whether it got there.
+static bool test_run(forth_t* forth, forth_word_t pc) {
+	forth->header.pc = pc;
+	forth_word_t status;
+	do {
+		status = forth_run(forth, &test_callback, NULL, 1000, NULL);
+	} while (status == FORTH_RUN_BUDGET);
+	return status == -1 && forth->header.pc == forth->header.codenext;
+}
+
+/* A call by index through a heap cell (rather than an index entry) isn't quickened, so it sees the cell change. */
+static void test_quickencell(void) {
+	forth_t* forth = test_open();
+	forth_enablequicken(forth, 16);
+	forth_word_t cell = forth->header.heapnext++;
+	forth_poke(forth, cell, forth_encode(forth, FORTH_OP_CALLSYS, 1));
+	forth_word_t start = forth->header.codenext;
+	forth_poke(forth, forth->header.codenext++, forth_encode(forth, FORTH_OP_CALLINDEX, cell));
+	bool ok = test_run(forth, start) && test_lastsys == 1;
+	forth_poke(forth, cell, forth_encode(forth, FORTH_OP_CALLSYS, 2));
+	ok = ok && test_run(forth, start) && test_lastsys == 2;
+	test_check("quicken.heapcell", ok);
+	free(forth);
+}
+
+/* The peephole pass only fuses a pair once the second instruction has been stored, so running out of room for it
+ * leaves the first one as it was.
+ */
+static void test_peepholefull(void) {
+	forth_t* forth = test_open();
+	forth->header.asmflags |= FORTH_ASM_PEEPHOLE | FORTH_ASM_TAILCALL;
+	forth_word_t at = forth->header.fsize - 1;
+	forth->header.codenext = at;
+	bool ok = forth_assemble(forth, "5", 0, 1) == 1 && forth_assemble(forth, "+", 0, 1) == 0;
+	ok = ok && forth->header.codenext == at + 1 && forth_peek(forth, at) == forth_encode(forth, FORTH_OP_PUSHINT, 5);
+	test_check("peephole.full", ok);
+	free(forth);
+}
+
+/* A number and a simple op are fused as long as the number fits in the superinstruction, negative or not. */
+static void test_peepholepushop(void) {
+	forth_word_t big = ((forth_word_t)1 << (TEST_BITS - 5)) - 1; // The biggest number a PUSHINT holds
+	forth_word_t fused[] = { -3, 1000 % big, big };
+	size_t i;
+	bool ok = true;
+	for (i = 0; i < sizeof(fused) / sizeof(fused[0]); i++) {
+		forth_t* forth = test_open();
+		forth->header.asmflags |= FORTH_ASM_PEEPHOLE;
+		forth_word_t start = forth->header.codenext;
+		forth_asmnumber(forth, 10);
+		forth_asmnumber(forth, fused[i]); // The assembler doesn't read negative numbers
+		test_code(forth, "+");
+		bool fits = ((forth_word_t)((uintmax_t)fused[i] << 8) >> 8) == fused[i];
+		ok = ok && ((forth_peek(forth, start + 1) & 0xF) == FORTH_OP_PUSHOP) == fits;
+		ok = ok && test_run(forth, start) && forth->header.dsp == forth->header.dsstart + 1
+			&& forth->data.words[forth->header.dsstart] == (forth_word_t)(10 + fused[i]);
+		free(forth);
+	}
+	test_check("peephole.pushop", ok);
+}
+
+/* The peephole stats count each pair as it's fused, so loading the same code from a module doesn't add to them. */
+static void test_peepholestats(void) {
+	forth_t* forth = test_open();
+	forth->header.asmflags |= FORTH_ASM_PEEPHOLE | FORTH_ASM_TAILCALL;
+	forth_setlookupinstr(forth, "sys1", forth_encode(forth, FORTH_OP_CALLSYS, 1));
+	forth_modmark_t mark;
+	forth_modbegin(forth, &mark);
+	test_code(forth, "[ 0 ] ! 1 + * - [ sys1 ]"); // The + that 1 + skips over is still fused with the *
+	forth_peepholestats_t stats;
+	forth_getpeepholestats(forth, &stats);
+	bool ok = stats.pushop == 1 && stats.opop == 2 && stats.blockloop == 1 && stats.tailcalls == 1;
+	forth_word_t size = forth_modwrite(forth, &mark, NULL, 0);
+	forth_word_t* mod = malloc(size * sizeof(forth_word_t));
+	forth_modwrite(forth, &mark, mod, size);
+	free(forth);
+
+	forth = test_open();
+	forth_setlookupinstr(forth, "sys1", forth_encode(forth, FORTH_OP_CALLSYS, 1));
+	ok = ok && forth_modload(forth, mod, size) >= 0;
+	forth_getpeepholestats(forth, &stats);
+	ok = ok && stats.pushop == 0 && stats.opop == 0 && stats.blockloop == 0 && stats.tailcalls == 0;
+	test_check("peephole.stats", ok);
+	free(forth);
+	free(mod);
+}
+
+/* forth_checkimage turns down headers (e.g. from a file or the wire) whose stacks or quicken log aren't in the heap. */
+static void test_checkimage(void) {
+	forth_t* forth = test_open();
+	forth_t* copy = malloc(TEST_SIZE * sizeof(forth_word_t));
+	forth_enablequicken(forth, 16);
+	forth_setlookupinstr(forth, "sys1", forth_encode(forth, FORTH_OP_CALLSYS, 1));
+	forth_word_t start = forth->header.codenext;
+	bool ok = forth_assemble(forth, "sys1", 0, 4) == 4 && test_run(forth, start) && forth->header.qnext == forth->header.qstart + 2;
+	ok = ok && forth_checkimage(forth, TEST_SIZE) == 0;
+	test_check("checkimage.valid", ok);
+
+	// Each change is made to a fresh copy of the image.
+	static const struct {
+		const char* name;
+		size_t field;
+		forth_word_t value; // Added to the field
+	} bad[] = {
+		{ "checkimage.dsend", offsetof(forth_header_t, dsend), TEST_SIZE * 2 },
+		{ "checkimage.dsstart", offsetof(forth_header_t, dsstart), -10000 },
+		{ "checkimage.rsp", offsetof(forth_header_t, rsp), 1000 },
+		{ "checkimage.asend", offsetof(forth_header_t, asend), TEST_SIZE },
+		{ "checkimage.qnext", offsetof(forth_header_t, qnext), TEST_SIZE },
+		{ "checkimage.qend", offsetof(forth_header_t, qend), TEST_SIZE },
+		{ "checkimage.qodd", offsetof(forth_header_t, qnext), -1 },
+	};
+	size_t i;
+	for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		memcpy(copy, forth, TEST_SIZE * sizeof(forth_word_t));
+		*(forth_word_t*)((char*)&copy->header + bad[i].field) += bad[i].value;
+		test_check(bad[i].name, forth_checkimage(copy, TEST_SIZE) == -1);
+	}
+	// A logged site outside the code would have forth_requicken write there.
+	memcpy(copy, forth, TEST_SIZE * sizeof(forth_word_t));
+	copy->data.words[copy->header.qstart] = TEST_SIZE + 1000;
+	test_check("checkimage.qsite", forth_checkimage(copy, TEST_SIZE) == -1);
+	free(copy);
+	free(forth);
+}
+
+/* forth_modload turns down modules that would define a word as a call or block at an absolute address, or whose
+ * code refers to an address or index entry without a relocation.
+ */
+static void test_modload(void) {
+	forth_t* forth = test_open();
+	forth_modmark_t mark;
+	forth_modbegin(forth, &mark);
+	forth_setlookupinstr(forth, "double", forth_encode(forth, FORTH_OP_CALLADDR, test_code(forth, "2 * ;")));
+	forth_setlookupinstr(forth, "sys.x", forth_encode(forth, FORTH_OP_CALLSYS, 5));
+	test_code(forth, "[ 1 ] 4 double");
+	forth_word_t size = forth_modwrite(forth, &mark, NULL, 0);
+	forth_word_t* mod = malloc(size * sizeof(forth_word_t));
+	forth_word_t* bad = malloc(size * sizeof(forth_word_t));
+	forth_modwrite(forth, &mark, mod, size);
+	forth_word_t absolute = forth_encode(forth, FORTH_OP_CALLADDR, 3);
+	forth_word_t unrelocated = forth_encode(forth, FORTH_OP_CALLADDR, 1);
+	free(forth);
+
+	forth = test_open();
+	test_check("modload.valid", forth_modload(forth, mod, size) >= 0 && (forth_lookupinstr(forth, "sys.x") & 0xF) == FORTH_OP_CALLSYS);
+	free(forth);
+
+	const forth_modheader_t* mh = (const forth_modheader_t*)mod;
+	forth_word_t codeat = FORTH_MODULE_HEADERWORDS;
+	forth_word_t symsat = codeat + mh->codesize + mh->nrelocs;
+	forth_word_t i;
+	memcpy(bad, mod, size * sizeof(forth_word_t));
+	for (i = 0; i < mh->nsymbols; i++) {
+		forth_modsymbol_t* sym = (forth_modsymbol_t*)(bad + symsat) + i;
+		if (sym->kind == FORTH_MODULE_EXPORT) {
+			sym->instr = absolute;
+		}
+	}
+	forth = test_open();
+	test_check("modload.exportaddr", forth_modload(forth, bad, size) == -1);
+	free(forth);
+
+	// The "2" at the start of the code becomes a call within the module that isn't in the relocations.
+	memcpy(bad, mod, size * sizeof(forth_word_t));
+	bad[codeat] = unrelocated;
+	forth = test_open();
+	test_check("modload.unrelocated", forth_modload(forth, bad, size) == -1);
+	free(forth);
+	free(bad);
+	free(mod);
+}
+
+// A non-leaf native that parks the VM and then completes the call itself straight away.
+static bool test_addparked(forth_t* forth, void* udata, forth_word_t* args) {
+	forth_word_t sum = args[0] + args[1];
+	forth_complete(forth, forth_park(forth), &sum, 1);
+	return true;
+}
+
+/* A native function that completes its own call leaves just its results, like one that returns them in args. */
+static void test_nativecomplete(void) {
+	forth_t* forth = test_open();
+	forth_native_t table[4];
+	forth_natives_t natives;
+	forth_nativeinit(&natives, table, 4, NULL, NULL);
+	forth_nativebind(&natives, 1, 2, 1, &test_addparked, NULL);
+	forth_nativename(forth, "add", 1);
+	forth_word_t start = test_code(forth, "3 4 add");
+	forth->header.pc = start;
+	forth_word_t status;
+	do {
+		status = forth_run(forth, &forth_nativecallback, &natives, 1000, NULL);
+	} while (status == FORTH_RUN_BUDGET || status == FORTH_RUN_PAUSED);
+	bool ok = status == -1 && forth->header.pc == forth->header.codenext;
+	ok = ok && forth->header.dsp == forth->header.dsstart + 1 && forth->data.words[forth->header.dsstart] == 7;
+	test_check("native.selfcomplete", ok);
+	free(forth);
+}
+
+// A non-leaf native that adds, after asking to be called again the first time (udata counts the calls).
+static bool test_addretry(forth_t* forth, void* udata, forth_word_t* args) {
+	if ((*(int*)udata)++ == 0) {
+		return true;
+	}
+	args[0] += args[1];
+	return false;
+}
+
+static bool test_addonce(forth_t* forth, void* udata, forth_word_t* args) {
+	args[0] += args[1];
+	return false;
+}
+
+/* A native function that asks to be called again without parking sees the same arguments the second time, and
+ * leaves the stack as if it had only been called once. Both with enough on the stack for the fast path and without.
+ */
+static void test_nativeretry(void) {
+	static const char* progs[] = { "3 4 add", "4 add" };
+	size_t p;
+	for (p = 0; p < sizeof(progs) / sizeof(progs[0]); p++) {
+		forth_word_t dsp[2];
+		forth_word_t top[2];
+		int r;
+		for (r = 0; r < 2; r++) {
+			forth_t* forth = test_open();
+			forth_native_t table[4];
+			forth_natives_t natives;
+			int calls = 0;
+			forth_nativeinit(&natives, table, 4, NULL, NULL);
+			forth_nativebind(&natives, 1, 2, 1, r == 0 ? &test_addretry : &test_addonce, &calls);
+			forth_nativename(forth, "add", 1);
+			forth->header.pc = test_code(forth, progs[p]);
+			forth_word_t status;
+			do {
+				status = forth_run(forth, &forth_nativecallback, &natives, 1000, NULL);
+			} while (status == FORTH_RUN_BUDGET || status == FORTH_RUN_PAUSED);
+			dsp[r] = forth->header.dsp - forth->header.dsstart;
+			top[r] = forth->data.words[forth->header.dsstart];
+			free(forth);
+		}
+		test_check(p == 0 ? "native.retry" : "native.retryslow", dsp[0] == dsp[1] && top[0] == top[1] && (p != 0 || top[0] == 7));
+	}
+}
+
+/* What a run has left behind that every engine has to agree on: the status, the registers and the live parts of the
+ * stacks (the words above the top of the data stack can be different with FORTH_TOSCACHE).
+ */
+static unsigned long test_state(forth_t* forth, forth_word_t status) {
+	const forth_header_t* h = &forth->header;
+	forth_word_t regs[] = { status, h->pc, h->rsp, h->dsp, h->asp };
+	unsigned long hash = 5381;
+	forth_word_t i;
+	for (i = 0; i < (forth_word_t)(sizeof(regs) / sizeof(regs[0])); i++) {
+		hash = hash * 33 ^ (unsigned long)regs[i];
+	}
+	for (i = h->rsstart; i < h->rsp && i < h->rsend; i++) {
+		hash = hash * 33 ^ (unsigned long)forth->data.words[i];
+	}
+	for (i = h->dsstart; i < h->dsp && i < h->dsend; i++) {
+		hash = hash * 33 ^ (unsigned long)forth->data.words[i];
+	}
+	return hash;
+}
+
+#define TEST_ENGINESTEPS	20000
+
+/* forth_run goes through the same states one instruction at a time as it does with bigger budgets, and ends with the
+ * same code (which quickening changes as it runs). The trace is compared with the other engines by "make test".
+ */
+static void test_engine(const char* name, bool opt) {
+	static unsigned long states[TEST_ENGINESTEPS + 1]; // After each number of steps, until it finishes
+	memset(states, 0, sizeof(states));
+	forth_t* forth = test_open();
+	forth_t* ref = malloc(TEST_SIZE * sizeof(forth_word_t));
+	forth_t* copy = malloc(TEST_SIZE * sizeof(forth_word_t));
+	test_stackwords(forth);
+	if (opt) {
+		forth_enablequicken(forth, 32);
+		forth->header.asmflags |= FORTH_ASM_PEEPHOLE | FORTH_ASM_TAILCALL;
+	}
+	test_define(forth, "fib", "dup 2 lt [ drop ] ? drop dup 1 - fib swap 2 - fib + ;");
+	test_define(forth, "count", "[ rot rot swap over + swap 1 - rot over ] ! drop drop ;"); // ( acc n -- acc+n+...+1 )
+	forth->header.pc = test_code(forth, "9 fib 0 10 count \"abc\" drop 1 2 = 3 3 = | 100 7 % 50 3 / 1 2 3 rot swap over lt");
+	memcpy(ref, forth, TEST_SIZE * sizeof(forth_word_t));
+
+	long n = 0;
+	long done;
+	forth_word_t status;
+	do {
+		done = 0;
+		status = forth_run(ref, &test_callback, NULL, 1, &done);
+		n += done;
+		if (status == FORTH_RUN_BUDGET) {
+			states[n] = test_state(ref, status);
+		}
+	} while (status == FORTH_RUN_BUDGET && n < TEST_ENGINESTEPS);
+	bool ok = status == -1 && ref->header.pc == ref->header.codenext;
+	unsigned long final = test_state(ref, status);
+	unsigned long trace = 5381;
+	long i;
+	for (i = 1; i <= n; i++) {
+		trace = trace * 33 ^ states[i];
+	}
+	trace = trace * 33 ^ final;
+	for (i = ref->header.codestart; i < ref->header.codenext; i++) {
+		trace = trace * 33 ^ (unsigned long)ref->data.words[i];
+	}
+
+	static const long budgets[] = { 2, 3, 64, 100000 };
+	size_t b;
+	for (b = 0; b < sizeof(budgets) / sizeof(budgets[0]); b++) {
+		memcpy(copy, forth, TEST_SIZE * sizeof(forth_word_t));
+		long at = 0;
+		do {
+			done = 0;
+			status = forth_run(copy, &test_callback, NULL, budgets[b], &done);
+			at += done;
+			ok = ok && at <= n && (status == FORTH_RUN_BUDGET ? states[at] : final) == test_state(copy, status);
+		} while (ok && status == FORTH_RUN_BUDGET);
+		for (i = ref->header.codestart; i < ref->header.codenext && ok; i++) {
+			ok = copy->data.words[i] == ref->data.words[i];
+		}
+	}
+	test_check(name, ok);
+	printf("trace %s %lx %ld (%d-bit)\n", name, trace, n, TEST_BITS);
+	free(copy);
+	free(ref);
+	free(forth);
+}
+
+// Runs a bulk operation on three operands to the end, returning what the last chunk returned.
+static forth_word_t test_bulk(forth_t* forth, forth_word_t op, forth_word_t x, forth_word_t addr, forth_word_t count) {
+	forth_pushdata(forth, x);
+	forth_pushdata(forth, addr);
+	forth_pushdata(forth, count);
+	forth_word_t result;
+	while ((result = forth_bulk(forth, op)) == 1) {
+	}
+	return result;
+}
+
+/* Copies between overlapping ranges (both ways, and over more than one chunk), fills, and bounds failures, which leave
+ * the operands alone.
+ */
+static void test_bulkcopy(void) {
+	forth_t* forth = test_open();
+	forth_word_t* words = forth->data.words;
+	forth_word_t n = FORTH_BULK_CHUNK + 100;
+	forth_word_t buf = forth->header.heapnext;
+	forth->header.heapnext += n + 1;
+	forth_word_t i;
+	for (i = 0; i <= n; i++) {
+		words[buf + i] = i;
+	}
+	forth_word_t dsp = forth->header.dsp;
+	bool ok = test_bulk(forth, FORTH_BULK_COPY, buf, buf + 1, n) == 0 && forth->header.dsp == dsp; // Forwards onto itself
+	for (i = 0; i < n && ok; i++) {
+		ok = words[buf + 1 + i] == i;
+	}
+	ok = ok && words[buf] == 0 && test_bulk(forth, FORTH_BULK_COPY, buf + 1, buf, n) == 0; // And back
+	for (i = 0; i < n && ok; i++) {
+		ok = words[buf + i] == i;
+	}
+	test_check("bulk.copyoverlap", ok);
+
+	ok = test_bulk(forth, FORTH_BULK_FILL, 7, buf + 3, n - 3) == 0 && forth->header.dsp == dsp && words[buf + 2] == 2 && words[buf + n] == n - 1;
+	for (i = 3; i < n && ok; i++) {
+		ok = words[buf + i] == 7;
+	}
+	// And from a script, through FORTH_OP_BULK.
+	forth_definebulkops(forth);
+	char src[64];
+	sprintf(src, "%d %d 3 bulk.copy 9 %d 2 bulk.fill", (int)buf, (int)buf + 1, (int)buf);
+	forth_word_t start = test_code(forth, src);
+	ok = ok && test_run(forth, start) && forth->header.dsp == dsp && words[buf] == 9 && words[buf + 1] == 9 && words[buf + 2] == 1
+		&& words[buf + 3] == 2 && words[buf + 4] == 7;
+	test_check("bulk.fill", ok);
+
+	forth_word_t heapstart = forth->header.heapstart, heapend = forth->header.heapend;
+	static const struct {
+		forth_word_t op;
+		forth_word_t x, addr, count; // Relative to the start of the heap
+	} bad[] = {
+		{ FORTH_BULK_FILL, 0, -1, 2 },
+		{ FORTH_BULK_FILL, 0, 0, -1 },
+		{ FORTH_BULK_FILL, 0, 10, TEST_SIZE },
+		{ FORTH_BULK_COPY, -5, 0, 10 },
+		{ FORTH_BULK_COPY, 10, 0, TEST_SIZE },
+		{ FORTH_BULK_COPY, 0, 10, TEST_SIZE },
+	};
+	ok = true;
+	size_t b;
+	for (b = 0; b < sizeof(bad) / sizeof(bad[0]); b++) {
+		forth_word_t count = (bad[b].count == TEST_SIZE) ? heapend - heapstart - bad[b].addr - bad[b].x + 1 : bad[b].count;
+		ok = ok && test_bulk(forth, bad[b].op, heapstart + bad[b].x, heapstart + bad[b].addr, count) == -1 && forth->header.dsp == dsp + 3
+			&& words[dsp + 2] == count;
+		forth->header.dsp = dsp;
+	}
+	forth_pushdata(forth, buf);
+	forth_pushdata(forth, 3);
+	ok = ok && forth_bulk(forth, FORTH_BULK_FILL) == -1 && forth->header.dsp == dsp + 2; // Missing an operand
+	test_check("bulk.bounds", ok);
+	free(forth);
+}
+
+/* Filling over the only reference to a block while the collector is marking (after it's looked at the stacks) keeps
+ * the block alive, since the bulk operations go through the write barrier.
+ */
+static void test_bulkbarrier(void) {
+	forth_t* forth = test_open();
+	forth_enablealloc(forth, 1024);
+	forth_word_t a = forth_alloc(forth, 3);
+	forth_word_t b = forth_alloc(forth, 3);
+	forth->data.words[a] = b;
+	forth_pushdata(forth, a);
+	forth_gcstart(forth);
+	forth_gcslice(forth, 1, NULL); // Just the stacks
+	forth_pushdata(forth, b);
+	bool ok = forth_gcmarking(forth) && test_bulk(forth, FORTH_BULK_FILL, 0, a, 3) == 0 && forth->data.words[a] == 0;
+	ok = ok && forth_gccollect(forth, NULL) == 0 && forth_allocsize(forth, b) == 3;
+	test_check("bulk.barrier", ok);
+	free(forth);
+}
+
+/* Blocks come back from the free list of their size class (cleared), a bigger free block is split when there's
+ * nothing else, and allocations that don't fit and frees of anything but an allocated block fail.
+ */
+static void test_alloc(void) {
+	forth_t* forth = test_open();
+	bool ok = forth_alloc(forth, 1) == 0 && forth_enablealloc(forth, 1024) == 0; // Nothing before it's enabled
+	forth_word_t a = forth_alloc(forth, 5);
+	ok = ok && a != 0 && forth_allocsize(forth, a) == 7 && forth_allocsize(forth, a + 1) == -1;
+	forth->data.words[a] = 123;
+	ok = ok && forth_free(forth, a) == 0 && forth_free(forth, a) == -1 && forth_allocsize(forth, a) == -1;
+	forth_word_t b = forth_alloc(forth, 7);
+	ok = ok && b == a && forth->data.words[b] == 0;
+	test_check("alloc.reuse", ok);
+
+	ok = forth_free(forth, b + 1) == -1 && forth_free(forth, forth->header.heapstart) == -1 && forth_free(forth, forth->header.allocstart + 1) == -1
+		&& forth_free(forth, 0) == -1 && forth_free(forth, forth->header.allocend + 5) == -1;
+	test_check("alloc.freebad", ok);
+
+	// A block of 512 words, then small ones until the arena's full.
+	forth_word_t big = forth_alloc(forth, 511);
+	long n = 0;
+	while (forth_alloc(forth, 1) != 0) {
+		n++;
+	}
+	ok = big != 0 && forth_allocsize(forth, big) == 511 && n > 0 && forth_alloc(forth, TEST_SIZE) == 0 && forth_alloc(forth, -1) == 0;
+	test_check("alloc.full", ok);
+
+	// Splitting the big block leaves halves of each size class after the part that's used.
+	ok = forth_free(forth, big) == 0 && forth_alloc(forth, 3) == big && forth_alloc(forth, 255) == big + 256 && forth_alloc(forth, 127) == big + 128
+		&& forth_alloc(forth, 255) == 0;
+	test_check("alloc.split", ok);
+	free(forth);
+}
+
+/* A collection run a few words at a time keeps blocks reachable from the data stack (directly or through another
+ * block) and reclaims the rest, apart from one allocated while it was marking, which waits for the next collection.
+ */
+static void test_gc(void) {
+	forth_t* forth = test_open();
+	forth_enablealloc(forth, 1024);
+	forth_word_t a = forth_alloc(forth, 3);
+	forth_word_t b = forth_alloc(forth, 3);
+	forth_word_t c = forth_alloc(forth, 3);
+	forth_word_t last = forth_alloc(forth, 3); // So the sweep doesn't just give back the end of the arena
+	forth->data.words[a] = b;
+	forth->data.words[b + 1] = c + 2; // Not the start of a block, so it doesn't keep c alive
+	forth_pushdata(forth, a);
+	forth_pushdata(forth, last);
+	forth_gcstats_t stats;
+	memset(&stats, 0, sizeof(stats));
+	bool ok = forth_gcstart(forth) == 0 && forth_gcslice(forth, 2, &stats) == 1;
+	forth_word_t d = forth_alloc(forth, 3);
+	forth_word_t result;
+	while ((result = forth_gcslice(forth, 2, &stats)) == 1) {
+	}
+	ok = ok && result == 0 && stats.cycles == 1 && stats.slices > 4;
+	test_check("gc.reachable", ok && forth_allocsize(forth, a) == 3 && forth_allocsize(forth, b) == 3 && forth_allocsize(forth, last) == 3
+		&& forth_allocsize(forth, d) == 3);
+	test_check("gc.unreachable", ok && forth_allocsize(forth, c) == -1 && stats.reclaimed == 4 * (long)sizeof(forth_word_t)
+		&& forth_alloc(forth, 3) == c && forth_gccollect(forth, &stats) == 0 && forth_allocsize(forth, d) == -1 && forth_allocsize(forth, c) == -1);
+	free(forth);
+}
+
+/* An image written on a host with the other byte order, as far as that changes anything: the bytes in each word of
+ * its packed strings (the literals in the code and the names in the index) are the other way round, and the prelude
+ * says so. Importing it swaps them back.
+ */
+static void test_wireswap(void) {
+	static const char* const text = "hello, packed world";
+	forth_t* forth = test_open();
+	forth->header.asmflags |= FORTH_ASM_PACKED;
+	forth_setlookupinstr(forth, "greeting", forth_encode(forth, FORTH_OP_CALLSYS, 1));
+	char src[64];
+	sprintf(src, "\"%s\"", text);
+	forth_word_t start = test_code(forth, src);
+	forth_word_t name = forth_peek(forth, forth_lookuptableaddrl(forth, "greeting", 8));
+	bool ok = forth_ispacked(forth_peek(forth, start)) && forth_ispacked(forth_peek(forth, name));
+
+	size_t bytes = TEST_SIZE * sizeof(forth_word_t);
+	forth_t* foreign = malloc(bytes);
+	forth_t* back = malloc(bytes);
+	memcpy(foreign, forth, bytes);
+	forth_wireswapwords(foreign->data.words + start + 1, (size_t)forth_packedsize((forth_word_t)strlen(text)));
+	forth_wireswapwords(foreign->data.words + name + 1, (size_t)forth_packedsize(8));
+	forth_wiremem_t mem = { malloc(bytes * 2), bytes * 2, 0 };
+	ok = ok && forth_wireexport(foreign, &forth_wirememwrite, &mem) > 0;
+	mem.buf[5] ^= 1; // The byte order in the prelude
+	mem.size = mem.pos;
+	mem.pos = 0;
+	forth_wire_t w;
+	ok = ok && forth_wireopen(&w, &forth_wirememread, &mem) == TEST_SIZE && forth_wireimport(&w, back, TEST_SIZE) == 0;
+	ok = ok && memcmp(back, forth, bytes) == 0;
+	char out[64];
+	ok = ok && forth_lookupinstr(back, "greeting") == forth_encode(back, FORTH_OP_CALLSYS, 1) && test_run(back, start)
+		&& forth_peekstrl(back, forth_popdata(back), sizeof(out), out) == (forth_word_t)strlen(text) && strcmp(out, text) == 0;
+	test_check("wire.otherorder", ok);
+
+	// And the same image in this host's order comes back as it was.
+	mem.size = bytes * 2;
+	mem.pos = 0;
+	ok = forth_wireexport(forth, &forth_wirememwrite, &mem) > 0;
+	mem.size = mem.pos;
+	mem.pos = 0;
+	ok = ok && forth_wireopen(&w, &forth_wirememread, &mem) == TEST_SIZE && forth_wireimport(&w, back, TEST_SIZE) == 0 && memcmp(back, forth, bytes) == 0;
+	test_check("wire.sameorder", ok);
+	free(mem.buf);
+	free(back);
+	free(foreign);
+	free(forth);
+}
+
+/* A word that calls itself as the last thing it does runs in constant return stack with tail calls, ten times deeper
+ * than the return stack, both through its index entry (FORTH_EXT_TAILINDEX) and once that's been quickened
+ * (FORTH_OP_TAILCALL). Without them it runs out of return stack.
+ */
+static void test_tailcall(void) {
+	static const struct {
+		const char* name;
+		forth_word_t asmflags;
+		bool quicken;
+	} runs[] = {
+		{ "tailcall.index", FORTH_ASM_TAILCALL, false },
+		{ "tailcall.quickened", FORTH_ASM_TAILCALL, true },
+		{ "tailcall.off", 0, false },
+	};
+	size_t r;
+	for (r = 0; r < sizeof(runs) / sizeof(runs[0]); r++) {
+		forth_t* forth = test_open();
+		test_stackwords(forth);
+		forth->header.asmflags |= runs[r].asmflags;
+		if (runs[r].quicken) {
+			forth_enablequicken(forth, 16);
+		}
+		test_define(forth, "down", "1 - dup [ drop down ] ? drop ;"); // ( n -- 0 )
+		forth_word_t depth = (forth->header.rsend - forth->header.rsstart) * 10;
+		char src[32];
+		sprintf(src, "%d down", (int)depth);
+		forth->header.pc = test_code(forth, src);
+		forth_word_t rsp = forth->header.rsp, maxrsp = rsp;
+		forth_word_t status;
+		while ((status = forth_run(forth, &test_callback, NULL, 1, NULL)) == FORTH_RUN_BUDGET) {
+			maxrsp = (forth->header.rsp > maxrsp) ? forth->header.rsp : maxrsp;
+		}
+		bool ok = status == -1 && forth->header.pc == forth->header.codenext && forth->header.rsp == rsp;
+		ok = ok && forth->header.dsp == forth->header.dsstart + 1 && forth->data.words[forth->header.dsstart] == 0;
+		if (runs[r].asmflags != 0) {
+			test_check(runs[r].name, ok && maxrsp <= rsp + 1);
+		} else {
+			test_check(runs[r].name, maxrsp >= forth->header.rsend);
+		}
+		free(forth);
+	}
+}
+
+// Assembles and runs the engine test's program, densely or not, leaving its results on the data stack.
+static forth_t* test_denserun(bool dense, bool* ok) {
+	forth_t* forth = test_open();
+	test_stackwords(forth);
+	if (dense) {
+		forth->header.asmflags |= FORTH_ASM_DENSE;
+	}
+	test_define(forth, "fib", "dup 2 lt [ drop ] ? drop dup 1 - fib swap 2 - fib + ;");
+	test_define(forth, "count", "[ rot rot swap over + swap 1 - rot over ] ! drop drop ;");
+	forth_word_t start = test_code(forth, "9 fib 0 10 count \"abc\" drop 1 2 = 3 3 = | 100 7 % 50 3 / 1 2 3 rot swap over lt");
+	forth_asmnumber(forth, 1000); // Wide in an open dense instruction
+	forth_asmop(forth, '+');
+	forth_asmseal(forth);
+	test_code(forth, "15 16 * 0 -");
+	forth_asmseal(forth);
+	*ok = test_run(forth, start);
+	return forth;
+}
+
+/* Dense code does what the same program assembled normally does, in fewer words. */
+static void test_dense(void) {
+	bool ok;
+	bool denseok;
+	forth_t* plain = test_denserun(false, &ok);
+	forth_t* dense = test_denserun(true, &denseok);
+	forth_word_t n = plain->header.dsp - plain->header.dsstart;
+	ok = ok && denseok && dense->header.dsp - dense->header.dsstart == n
+		&& memcmp(plain->data.words + plain->header.dsstart, dense->data.words + dense->header.dsstart, n * sizeof(forth_word_t)) == 0;
+	forth_word_t i;
+	forth_word_t ndense = 0;
+	for (i = dense->header.codestart; i < dense->header.codenext; i++) {
+		ndense += forth_isdense(dense->data.words[i]);
+	}
+	ok = ok && ndense > 0 && dense->header.codenext - dense->header.codestart < plain->header.codenext - plain->header.codestart;
+	test_check("dense.roundtrip", ok);
+	free(dense);
+	free(plain);
+}
+
+/* Packed strings of no bytes, an odd number of them and more than a word's worth round trip through the image, with
+ * the last word padded, and the assembled ones push their address and carry on after them.
+ */
+static void test_packed(void) {
+	static const char* strs[] = { "", "abcde", "a string longer than a word or two" };
+	forth_t* forth = test_open();
+	char buf[64];
+	bool ok = true;
+	size_t s;
+	for (s = 0; s < sizeof(strs) / sizeof(strs[0]); s++) {
+		forth_word_t len = (forth_word_t)strlen(strs[s]);
+		forth_word_t addr = forth->header.heapnext;
+		forth_word_t size = forth_packedsize(len);
+		forth->data.words[addr + size] = -1;
+		ok = ok && forth_pokebytesl(forth, addr, len, strs[s]) == addr + 1 + size;
+		const char* bytes = (const char*)(forth->data.words + addr + 1);
+		forth_word_t i;
+		for (i = len; i < size * (forth_word_t)sizeof(forth_word_t); i++) {
+			ok = ok && bytes[i] == 0;
+		}
+		ok = ok && forth_peekbytesl(forth, addr, sizeof(buf), buf) == len && strcmp(buf, strs[s]) == 0;
+		ok = ok && forth_peekstrl(forth, addr, sizeof(buf), buf) == len && strcmp(buf, strs[s]) == 0;
+		ok = ok && forth_peekbytesl(forth, addr, len, buf) == -1; // No room for the zero after it
+	}
+	test_check("packed.pokepeek", ok);
+
+	forth->header.asmflags |= FORTH_ASM_PACKED;
+	forth_word_t start = test_code(forth, "\"\" \"abcde\" \"a string longer than a word or two\" 7");
+	ok = test_run(forth, start) && forth->header.dsp == forth->header.dsstart + 4 && forth->data.words[forth->header.dsstart + 3] == 7;
+	for (s = 0; s < sizeof(strs) / sizeof(strs[0]) && ok; s++) {
+		forth_word_t addr = forth->data.words[forth->header.dsstart + (forth_word_t)s];
+		ok = forth_ispacked(forth->data.words[addr]) && forth_peekstrl(forth, addr, sizeof(buf), buf) == (forth_word_t)strlen(strs[s])
+			&& strcmp(buf, strs[s]) == 0;
+	}
+	test_check("packed.run", ok);
+	free(forth);
+}
+
+/* The streaming assembler fed a byte at a time builds the same image as forth_assemble, with each of the assembler's
+ * options (the long string is too long to pack in 16-bit builds, so it gets unpacked as it's fed).
+ */
+static void test_asmstream(void) {
+	static const forth_word_t flags[] = { 0, FORTH_ASM_PACKED, FORTH_ASM_PEEPHOLE | FORTH_ASM_TAILCALL, FORTH_ASM_DENSE };
+	char src[512];
+	char longstr[200];
+	memset(longstr, 'x', sizeof(longstr) - 1);
+	longstr[sizeof(longstr) - 1] = 0;
+	snprintf(src, sizeof(src), "12345 [ dup 1 + swap ]\n\t? \"ab c\"  \"%s\" \"\" [ 3 * ; ] ! 7 + over 1000 drop", longstr);
+	bool ok = true;
+	size_t f;
+	for (f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+		forth_t* whole = test_open();
+		forth_t* fed = test_open();
+		test_stackwords(whole);
+		test_stackwords(fed);
+		whole->header.asmflags |= flags[f];
+		fed->header.asmflags |= flags[f];
+		test_code(whole, src);
+		forth_asmseal(whole);
+		forth_asmstream_t stream;
+		forth_asmbegin(&stream);
+		size_t i;
+		for (i = 0; src[i] != 0 && ok; i++) {
+			ok = forth_asmfeed(fed, &stream, src + i, 1) == 0;
+		}
+		ok = ok && forth_asmend(fed, &stream) == 0 && memcmp(whole, fed, TEST_SIZE * sizeof(forth_word_t)) == 0;
+		free(fed);
+		free(whole);
+	}
+	test_check("asmstream.bytes", ok);
+}
+
+// Runs the image with whichever of the JIT compiler and the verifier isn't NULL.
+static forth_word_t test_fastrun(forth_jit_t* jit, forth_verify_t* verify, long budget, long* done) {
+	if (jit != NULL) {
+		return forth_jitrun(jit, &test_callback, NULL, budget, done);
+	}
+	return forth_verifyrun(verify, &test_callback, NULL, budget, done);
+}
+
+/* forth_jitrun and forth_verifyrun go through the same states as forth_run on copies of the same image, with hot
+ * enough code for them to compile or verify, whatever budgets they're given (though a budget can stop them in the
+ * middle of a compiled or verified stretch, so they're only compared where they stop).
+ */
+static void test_fastpath(void) {
+	static const char* const pictures[TEST_SYS_END - TEST_SYS_DUP] = {
+		"a -- a a", "a --", "a b -- b a", "a b -- a b a", "a b c -- b c a", "a b -- c", "a --"
+	};
+	static unsigned long states[TEST_ENGINESTEPS + 1];
+	memset(states, 0, sizeof(states));
+	forth_t* forth = test_open();
+	forth_t* copy = malloc(TEST_SIZE * sizeof(forth_word_t));
+	test_stackwords(forth);
+	test_define(forth, "fib", "dup 2 lt [ drop ] ? drop dup 1 - fib swap 2 - fib + ;");
+	test_define(forth, "count", "[ rot rot swap over + swap 1 - rot over ] ! drop drop ;");
+	test_define(forth, "sq", "dup * ;");
+	forth->header.pc = test_code(forth, "11 fib 0 60 count 7 sq 3 sq + 1000 13 % 1 2 3 rot swap over lt");
+
+	memcpy(copy, forth, TEST_SIZE * sizeof(forth_word_t));
+	long n = 0;
+	long done;
+	forth_word_t status;
+	do {
+		done = 0;
+		status = forth_run(copy, &test_callback, NULL, 1, &done);
+		n += done;
+		if (status == FORTH_RUN_BUDGET) {
+			states[n] = test_state(copy, status);
+		}
+	} while (status == FORTH_RUN_BUDGET && n < TEST_ENGINESTEPS);
+	bool refok = status == -1 && copy->header.pc == copy->header.codenext;
+	unsigned long final = test_state(copy, status);
+
+	static const long budgets[] = { 1, 5, 64, 100000 };
+	int engine;
+	for (engine = 0; engine < 2; engine++) {
+		bool ok = refok;
+#ifdef FORTH_JIT_NATIVE
+		bool used = false; // Whether anything was compiled or verified, as the program's meant to make sure of
+#else
+		bool used = (engine == 0); // forth_jitrun just interprets
+#endif
+		size_t b;
+		for (b = 0; b < sizeof(budgets) / sizeof(budgets[0]) && ok; b++) {
+			memcpy(copy, forth, TEST_SIZE * sizeof(forth_word_t));
+			forth_jit_t* jit = (engine == 0) ? forth_jitcreate(copy, 2, 0) : NULL;
+			forth_verify_t* verify = (engine == 1) ? forth_verifycreate(copy) : NULL;
+			int i;
+			for (i = 0; verify != NULL && i < TEST_SYS_END - TEST_SYS_DUP; i++) {
+				ok = ok && forth_verifysys(verify, TEST_SYS_DUP + i, pictures[i]) == 0;
+			}
+			ok = ok && (jit != NULL || verify != NULL);
+			long at = 0;
+			do {
+				done = 0;
+				status = ok ? test_fastrun(jit, verify, budgets[b], &done) : -1;
+				at += done;
+				ok = ok && at <= n && (status == FORTH_RUN_BUDGET ? states[at] : final) == test_state(copy, status);
+			} while (ok && status == FORTH_RUN_BUDGET);
+			ok = ok && at == n;
+			used = used || (jit != NULL && jit->regions > 0) || (verify != NULL && verify->faststeps > 0);
+			if (jit != NULL) {
+				forth_jitdestroy(jit);
+			}
+			if (verify != NULL) {
+				forth_verifydestroy(verify);
+			}
+		}
+		test_check(engine == 0 ? "fastpath.jit" : "fastpath.verify", ok && used);
+	}
+	free(copy);
+	free(forth);
+}
+
+static forth_t* test_opentasks(void) {
+	forth_t* forth = test_open();
+	test_stackwords(forth);
+	if (forth_enablealloc(forth, 2048) != 0 || forth_enabletasks(forth, 16, 16) != 0 || forth_definetaskops(forth) != 0) {
+		fprintf(stderr, "ERROR: Couldn't enable tasks.\n");
+		exit(1);
+	}
+	return forth;
+}
+
+/* Tasks take turns at each task.yield, a task.join waits for its task to return from its block and leaves the top of
+ * its stack (straight away if it already has), and joining something that isn't a task stops the program.
+ */
+static void test_tasks(void) {
+	static const forth_word_t order[] = { 100, 1, 2, 200, 11, 12 };
+	forth_t* forth = test_opentasks();
+	test_define(forth, "worker", "[ dup note task.yield 10 + dup note ] task.spawn ;"); // ( n -- task )
+	forth_word_t start = test_code(forth, "1 worker 2 worker 100 note task.yield 200 note swap task.join swap task.join");
+	test_nnotes = 0;
+	bool ok = test_run(forth, start) && forth->header.task == forth->header.taskmain && forth->header.dsp == forth->header.dsstart + 2
+		&& forth->data.words[forth->header.dsstart] == 11 && forth->data.words[forth->header.dsstart + 1] == 12;
+	ok = ok && test_nnotes == (int)(sizeof(order) / sizeof(order[0])) && memcmp(test_notes, order, sizeof(order)) == 0;
+	test_check("tasks.join", ok);
+
+	// The task has finished by the time it's joined, and then it's freed.
+	forth->header.dsp = forth->header.dsstart;
+	start = test_code(forth, "1 [ 5 + ] task.spawn task.yield dup task.join");
+	ok = test_run(forth, start) && forth->header.dsp == forth->header.dsstart + 2 && forth->data.words[forth->header.dsstart + 1] == 6;
+	ok = ok && forth_allocsize(forth, forth->data.words[forth->header.dsstart]) == -1;
+	test_check("tasks.joinfinished", ok);
+
+	start = test_code(forth, "5 task.join");
+	forth->header.pc = start;
+	ok = forth_run(forth, &test_callback, NULL, 1000, NULL) == -1 && forth->header.pc == start + 1;
+	test_check("tasks.joinbad", ok);
+	free(forth);
+}
+
+#define TEST_INSTANCESIZE	600
+
+/* A saved instance is loaded without the pointer to its shared segment it was saved with (which was only good in
+ * the process that saved it), so it won't run until it's linked again. Checking a running one leaves it alone.
+ */
+static void test_instancelink(void) {
+	forth_t* master = malloc(TEST_SIZE * sizeof(forth_word_t));
+	forth_t* inst = malloc(TEST_INSTANCESIZE * sizeof(forth_word_t));
+	forth_t* loaded = malloc(TEST_INSTANCESIZE * sizeof(forth_word_t));
+	if (forth_clearshared(master, TEST_SIZE, TEST_INSTANCESIZE, 64, 512) != 0) {
+		fprintf(stderr, "ERROR: Couldn't initialise.\n");
+		exit(1);
+	}
+	test_stackwords(master);
+	test_define(master, "sq", "dup * ;");
+	forth_word_t start = test_code(master, "7 sq");
+	bool ok = forth_clearinstance(inst, TEST_INSTANCESIZE, master) == 0 && test_run(inst, start);
+	ok = ok && forth_checkheader(inst, TEST_INSTANCESIZE) == 0 && forth_sharedsegment(inst) != NULL;
+	memcpy(loaded, inst, TEST_INSTANCESIZE * sizeof(forth_word_t));
+	ok = ok && forth_checkimage(loaded, TEST_INSTANCESIZE) == 0 && forth_sharedsegment(loaded) == NULL;
+	loaded->header.pc = start;
+	loaded->header.dsp = loaded->header.dsstart;
+	ok = ok && forth_run(loaded, &test_callback, NULL, 1000, NULL) == -1 && loaded->header.pc == start;
+	ok = ok && forth_sharedlink(loaded, master->data.words + master->header.indexstart) == 0 && test_run(loaded, start)
+		&& loaded->header.dsp == loaded->header.dsstart + 1 && loaded->data.words[loaded->header.dsstart] == 49;
+	test_check("instance.loadlink", ok);
+	free(loaded);
+	free(inst);
+	free(master);
+}
+
+int main(int argc, char** argv) {
+	test_quickencell();
+	test_peepholefull();
+	test_peepholepushop();
+	test_peepholestats();
+	test_checkimage();
+	test_modload();
+	test_nativecomplete();
+	test_nativeretry();
+	test_engine("engine.plain", false);
+	test_engine("engine.opt", true);
+	test_bulkcopy();
+	test_bulkbarrier();
+	test_alloc();
+	test_gc();
+	test_wireswap();
+	test_tailcall();
+	test_tasks();
+	test_dense();
+	test_packed();
+	test_asmstream();
+	test_fastpath();
+	test_instancelink();
+	return test_failures != 0;
+}